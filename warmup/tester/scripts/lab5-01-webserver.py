@@ -146,7 +146,7 @@ def main():
     test.start_program('./plot-cache-experiment')
 
     # handle various programs not being killed properly
-    kill_process('./run-one-experiment')
+    kill_process('./server_bench')
     kill_process('./server')
 
 if __name__ == '__main__':
@@ -0,0 +1,387 @@
+/*
+ * bench_cache.c: A microbenchmark for the file cache (see cache.h).
+ *
+ * To run:
+ *  bench_cache [options]
+ *
+ * Each thread runs the same loop as a server worker, without the sockets and
+ * the disk: it looks up a file, and on a miss it makes up the file contents
+ * and inserts them. Files are picked from a set of nr_keys files with a
+ * workload distribution (see workload.h), so -d controls the key skew. A
+ * fraction (1 - hit_ratio) of the lookups instead go to files that have never
+ * been requested, and so are guaranteed misses that also push the other
+ * files out of the cache. The cache is filled with the whole file set first,
+ * and by default it is just large enough to hold it, including the memory
+ * the cache charges for names and metadata, so a hit ratio of 1 with no
+ * eviction is the best case.
+ *
+ * With -l, each thread looks files up through an L1 cache of its own, as the
+ * server workers do.
+ *
+ * The -t option takes a comma-separated list of thread counts, and every
+ * count is run with a fresh cache.
+ */
+
+#include <limits.h>
+#include "common.h"
+#include "cache.h"
+#include "histogram.h"
+#include "stats.h"
+#include "workload.h"
+
+#define MAX_LIST 32		/* max values of a list option */
+#define MAX_SIZE (64 << 20)	/* cuts off the tail of pareto sizes */
+
+enum size_type {
+	SIZE_FIXED,		/* fixed:n, every file has n bytes */
+	SIZE_UNIFORM,		/* uniform:min:max */
+	SIZE_PARETO,		/* pareto:min:alpha, heavy tailed above min */
+};
+
+struct bench {
+	struct fileinfo *files;	/* the file set, with names and sizes */
+	int nr_keys;
+	struct workload workload;
+	double hit_ratio;	/* fraction of lookups of the file set */
+	struct cache_config config;	/* of the cache under test */
+	long nr_ops;		/* per thread */
+	int l1_slots;		/* of the L1 cache of each thread, or 0 */
+	long seed;
+	enum size_type size_type;
+	double size_a, size_b;	/* parameters of the size distribution */
+	struct cache *cache;
+	long next_cold;		/* names the files that miss on purpose */
+};
+
+struct worker {
+	struct bench *b;
+	int index;
+	pthread_t thread;
+	unsigned short xsubi[3];	/* random state for erand48 */
+	struct histogram latency;	/* ns per operation */
+};
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bench_size(struct bench *b, unsigned short xsubi[3])
+{
+	double u = erand48(xsubi);
+
+	switch (b->size_type) {
+	case SIZE_FIXED:
+		return b->size_a;
+	case SIZE_UNIFORM:
+		return b->size_a + u * (b->size_b - b->size_a + 1);
+	case SIZE_PARETO:
+		return fmin(b->size_a / pow(1 - u, 1 / b->size_b), MAX_SIZE);
+	}
+	return 0;
+}
+
+/* insert a file into the cache, as the server does after reading it. the
+ * contents are allocated but never touched, so that only the cache is
+ * measured. */
+static void
+bench_insert(struct bench *b, char *name, int size)
+{
+	struct file_data *data = file_data_init();
+
+	data->file_name = strdup(name);
+	data->file_buf = Malloc(size > 0 ? size : 1);
+	data->file_size = size;
+	if (cache_insert(b->cache, data) < 0)
+		file_data_free(data);
+}
+
+static void *
+bench_worker(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+	struct bench *b = w->b;
+	struct cache_l1 *l1 = NULL;
+	struct cache_entry *e;
+	char cold[MAXLINE];
+	char *name;
+	int size;
+	uint64_t start;
+	long i;
+
+	if (b->l1_slots > 0)
+		l1 = cache_l1_init(b->cache, b->l1_slots);
+	for (i = 0; i < b->nr_ops; i++) {
+		start = bench_now();
+		if (erand48(w->xsubi) < b->hit_ratio) {
+			struct fileinfo *fi = &b->files[workload_next(
+				&b->workload, w->xsubi)];
+
+			name = fi->name;
+			size = fi->len;
+		} else {
+			snprintf(cold, MAXLINE, "cold/%ld",
+				 __sync_fetch_and_add(&b->next_cold, 1));
+			name = cold;
+			size = bench_size(b, w->xsubi);
+		}
+		if (l1) {
+			e = cache_l1_lookup(l1, name);
+			if (e)
+				cache_l1_release(l1, e);
+		} else {
+			e = cache_lookup(b->cache, name);
+			if (e)
+				cache_release(b->cache, e);
+		}
+		if (!e) {
+			bench_insert(b, name, size);
+		}
+		histogram_record(&w->latency, bench_now() - start);
+	}
+	if (l1)
+		cache_l1_destroy(l1);
+	return NULL;
+}
+
+/* fill the cache with the file set */
+static void
+bench_fill(struct bench *b)
+{
+	int i;
+
+	for (i = 0; i < b->nr_keys; i++) {
+		bench_insert(b, b->files[i].name, b->files[i].len);
+	}
+}
+
+/* run nr_threads threads against a fresh cache, and print one line */
+static void
+bench_run(struct bench *b, int nr_threads)
+{
+	struct worker *workers;
+	struct histogram latency;
+	struct cache_stats *s;
+	long lookups, hits, evictions;
+	uint64_t start, end;
+	double seconds;
+	int i;
+
+	b->cache = cache_init(&b->config);
+	bench_fill(b);
+	b->workload.next = 0;
+	/* only count what the threads do. the lock times include the inserts
+	 * above, which are a small fraction of the operations. */
+	s = Malloc(sizeof(struct cache_stats));
+	cache_get_stats(b->cache, s);
+	lookups = s->lookups;
+	hits = s->hits;
+	evictions = s->evictions;
+	workers = Malloc(sizeof(struct worker) * nr_threads);
+	start = bench_now();
+	for (i = 0; i < nr_threads; i++) {
+		struct worker *w = &workers[i];
+
+		w->b = b;
+		w->index = i;
+		workload_seed(w->xsubi, b->seed, i);
+		histogram_init(&w->latency);
+		SYS(pthread_create(&w->thread, NULL, bench_worker, w));
+	}
+	histogram_init(&latency);
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		histogram_merge(&latency, &workers[i].latency);
+	}
+	end = bench_now();
+	free(workers);
+
+	cache_get_stats(b->cache, s);
+	lookups = s->lookups - lookups;
+	hits = s->hits - hits;
+	if (s->l1_lookups > 0) {
+		/* the cache only saw the misses of the L1 caches */
+		lookups = s->l1_lookups;
+		hits += s->l1_hits;
+	}
+	evictions = s->evictions - evictions;
+	seconds = (end - start) / 1e9;
+	printf("%7d %10.0f %9.3f %9ld %9.2f %9.2f %9.2f %9.2f %9.2f\n",
+	       nr_threads, latency.count / seconds,
+	       lookups ? (double)hits / lookups : 0, evictions,
+	       histogram_percentile(&latency, 50) / 1000.0,
+	       histogram_percentile(&latency, 99) / 1000.0,
+	       histogram_percentile(&s->lock_hold, 50) / 1000.0,
+	       histogram_percentile(&s->lock_hold, 99) / 1000.0,
+	       histogram_percentile(&s->lock_wait, 99) / 1000.0);
+	fflush(stdout);
+	free(s);
+	cache_destroy(b->cache);
+}
+
+/* parse a comma-separated list of integers >= 1 into values */
+static int
+parse_list(char *arg, int *values)
+{
+	int n = 0;
+	char *tok, *save;
+
+	for (tok = strtok_r(arg, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (n == MAX_LIST)
+			return -1;
+		values[n] = atoi(tok);
+		if (values[n] < 1)
+			return -1;
+		n++;
+	}
+	return n > 0 ? n : -1;
+}
+
+/* parse a size distribution. returns 0 on success, and -1 otherwise. */
+static int
+parse_sizes(struct bench *b, char *spec)
+{
+	if (sscanf(spec, "fixed:%lf", &b->size_a) == 1) {
+		b->size_type = SIZE_FIXED;
+		return b->size_a >= 0 ? 0 : -1;
+	}
+	if (sscanf(spec, "uniform:%lf:%lf", &b->size_a, &b->size_b) == 2) {
+		b->size_type = SIZE_UNIFORM;
+		return b->size_a >= 0 && b->size_b >= b->size_a ? 0 : -1;
+	}
+	if (sscanf(spec, "pareto:%lf:%lf", &b->size_a, &b->size_b) == 2) {
+		b->size_type = SIZE_PARETO;
+		return b->size_a > 0 && b->size_b > 0 ? 0 : -1;
+	}
+	return -1;
+}
+
+static void
+usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-t nr_threads,...] [-n nr_ops] "
+		"[-k nr_keys] [-h hit_ratio] [-d workload] [-z sizes] "
+		"[-c cache_size] [-l l1_slots] [-S seed]\n"
+		"  -t  threads using the cache (default: 1,2,4,8)\n"
+		"  -n  operations per thread (default: 1000000)\n"
+		"  -k  files in the file set (default: 10000)\n"
+		"  -h  fraction of lookups of the file set, the rest are of\n"
+		"      new files (default: 1)\n"
+		"  -d  key skew, as a workload of the file set (default:\n"
+		"      zipf:1, see workload.h)\n"
+		"  -z  file sizes: fixed:n, uniform:min:max or\n"
+		"      pareto:min:alpha (default: pareto:1024:1.2)\n"
+		"  -c  cache size in bytes (default: fits the file set)\n"
+		"  -l  files in the L1 cache of each thread, 0 for none\n"
+		"      (default: 0)\n"
+		"  -S  random seed (default: 1)\n", program);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int threads[MAX_LIST] = { 1, 2, 4, 8 }, nr_threads = 4;
+	char *workload = "zipf:1", *sizes = "pareto:1024:1.2";
+	unsigned short xsubi[3];
+	char name[MAXLINE];
+	long total = 0;
+	struct bench b;
+	int c, i;
+
+	b.nr_ops = 1000000;
+	b.l1_slots = 0;
+	b.nr_keys = 10000;
+	b.hit_ratio = 1;
+	b.config.name = NULL;
+	b.config.max_size = -1;
+	b.config.max_rss = 0;
+	b.config.gzip_ratio = 0;
+	b.config.high_watermark = 0;
+	b.config.low_watermark = 0;
+	b.config.spill = NULL;
+	b.seed = 1;
+	b.next_cold = 0;
+	while ((c = getopt(argc, argv, "t:n:k:h:d:z:c:l:S:")) != -1) {
+		switch (c) {
+		case 't':
+			if ((nr_threads = parse_list(optarg, threads)) < 0)
+				usage(argv[0]);
+			break;
+		case 'n':
+			b.nr_ops = atol(optarg);
+			break;
+		case 'k':
+			b.nr_keys = atoi(optarg);
+			break;
+		case 'h':
+			b.hit_ratio = atof(optarg);
+			break;
+		case 'd':
+			workload = optarg;
+			break;
+		case 'z':
+			sizes = optarg;
+			break;
+		case 'c':
+			b.config.max_size = atol(optarg);
+			break;
+		case 'l':
+			b.l1_slots = atoi(optarg);
+			break;
+		case 'S':
+			b.seed = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || b.nr_ops <= 0 || b.nr_keys <= 0 ||
+	    b.l1_slots < 0 || b.hit_ratio < 0 || b.hit_ratio > 1 ||
+	    parse_sizes(&b, sizes) < 0) {
+		usage(argv[0]);
+	}
+	/* make up the file set */
+	b.files = Malloc(sizeof(struct fileinfo) * b.nr_keys);
+	workload_seed(xsubi, b.seed, -1);
+	for (i = 0; i < b.nr_keys; i++) {
+		snprintf(name, MAXLINE, "file/%d", i);
+		b.files[i].name = strdup(name);
+		b.files[i].len = bench_size(&b, xsubi);
+		b.files[i].csum = 0;
+		total += b.files[i].len;
+	}
+	if (b.config.max_size < 0) {
+		struct cache_stats *s = Malloc(sizeof(struct cache_stats));
+
+		/* find out how much the cache charges for the file set */
+		b.config.max_size = LONG_MAX;
+		b.cache = cache_init(&b.config);
+		bench_fill(&b);
+		cache_get_stats(b.cache, s);
+		b.config.max_size = s->size;
+		cache_destroy(b.cache);
+		free(s);
+	}
+	if (workload_init(&b.workload, workload, b.files, b.nr_keys) < 0) {
+		usage(argv[0]);
+	}
+
+	printf("%d files, %ld bytes, cache size %ld\n", b.nr_keys, total,
+	       b.config.max_size);
+	printf("%7s %10s %9s %9s %9s %9s %9s %9s %9s\n", "threads", "ops/s",
+	       "hit_ratio", "evictions", "p50_us", "p99_us", "hold_p50",
+	       "hold_p99", "wait_p99");
+	for (i = 0; i < nr_threads; i++) {
+		bench_run(&b, threads[i]);
+	}
+	workload_destroy(&b.workload);
+	stats_exit();
+	exit(0);
+}
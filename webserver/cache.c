@@ -0,0 +1,1130 @@
+/*
+ * cache.c: an LRU cache of file contents (see cache.h).
+ *
+ * Entries are kept in a chained hash table, for lookups, and in a doubly
+ * linked LRU list, so that a hit moves its entry to the front of the list and
+ * eviction takes entries from the back, both in constant time. The table
+ * doubles in size when it has more entries than buckets. A chunk of a file is
+ * keyed by the file name and the chunk number, and whole files by the name
+ * alone, with chunk number -1.
+ *
+ * The cache charges itself for every byte it owns, as the allocator sees it:
+ * each entry is a single allocation holding the file name and its metadata,
+ * plus the file contents, both rounded up by malloc_usable_size() and with
+ * malloc's per-chunk header added, plus the hash table.
+ *
+ * Eviction unlinks entries under the lock, and collects the ones that nobody
+ * is using on a list, whose memory is freed once the lock is dropped. The
+ * reclaimer thread, when there is one, evicts a batch of entries at a time,
+ * so that requests can take the lock in between.
+ *
+ * With a spill tier, the entries that are evicted for space are written to it
+ * as they are freed, outside the lock, along with the generation of the tier
+ * when they were evicted, so that an invalidation that comes in between
+ * keeps them out of it.
+ *
+ * An L1 cache is an array of a few slots, each of which pins an entry of the
+ * shared cache, and is only used by one thread, so it is looked up without
+ * any lock. A pinned entry stays valid, but evicting it bumps its generation,
+ * which tells the slot to drop it. Hits in an L1 cache set a flag in the
+ * entry instead of moving it in the LRU list, and eviction gives the entries
+ * that have the flag set another round, like the clock algorithm.
+ *
+ * Files are compressed by a single background thread, so that inserts don't
+ * wait for zlib. The thread holds a reference to each entry it works on, and
+ * only attaches the gzip copy while nobody else is using the entry, so that
+ * the file_data of an entry never changes under a reader. When the entry is
+ * in use, the copy is left with it, and the last user attaches it as it
+ * releases the entry. For the same
+ * reason, uncompressed copies are only dropped from entries that are not in
+ * use.
+ */
+
+#include <limits.h>
+#include <malloc.h>
+#include <zlib.h>
+#include "common.h"
+#include "cache.h"
+#include "spill.h"
+#include "stats.h"
+
+#define CACHE_MIN_BUCKETS 64
+/* malloc's header in front of each chunk, which malloc_usable_size() does not
+ * count */
+#define CHUNK_OVERHEAD sizeof(size_t)
+/* entries that an insert may evict when the reclaimer is behind */
+#define CACHE_INSERT_EVICTIONS 4
+/* entries the reclaimer evicts each time it takes the lock */
+#define CACHE_RECLAIM_BATCH 32
+/* groups of paths with a generation of their own, see cache_generation */
+#define CACHE_GENERATIONS 1024
+
+struct cache_entry {
+	struct file_data data;	/* data.file_name points to name below */
+	long charge;		/* bytes charged to the cache for the entry */
+	long chunk;		/* number of the chunk, or -1 for a whole file */
+	unsigned long hash;
+	int users;		/* callers of cache_lookup that hold the entry */
+	int pinned;		/* L1 caches that hold the entry */
+	int evicted;		/* removed from the table and the LRU list */
+	/* bumped when the entry is evicted, which the L1 caches that hold it
+	 * check without the lock */
+	unsigned long generation;
+	int referenced;		/* hit in an L1 cache since eviction looked */
+	int compressing;	/* has a gzip job */
+	/* the finished job, whose copy the last user attaches */
+	struct gzip_job *gzip_job;
+	int spill;		/* write it to the spill tier when freed */
+	unsigned long spill_generation;	/* of the tier, when evicted */
+	struct cache_entry *hash_next;
+	struct cache_entry *lru_prev;
+	struct cache_entry *lru_next;
+	char name[];
+};
+
+/* a slot of an L1 cache, which pins its entry */
+struct l1_slot {
+	struct cache_entry *e;	/* NULL if the slot is empty */
+	unsigned long hash;
+	unsigned long generation;	/* of e, when it was pinned */
+	long hits;		/* halved each time a slot is replaced */
+};
+
+struct cache_l1 {
+	struct cache *c;
+	long lookups;
+	long hits;
+	int nr_slots;
+	struct l1_slot slots[];
+};
+
+/* an entry waiting for the compression thread */
+struct gzip_job {
+	struct cache_entry *e;	/* holds a reference */
+	char *gzip_buf;		/* result, when it could not be attached yet */
+	long gzip_size;
+	struct gzip_job *next;
+};
+
+struct cache {
+	pthread_mutex_t lock;
+	struct cache_entry **table;
+	unsigned long nr_buckets;	/* a power of two */
+	/* lru.lru_next is the most recently used entry, and lru.lru_prev the
+	 * least recently used one */
+	struct cache_entry lru;
+	uint64_t locked;	/* stats_now() when the lock was taken */
+	long table_charge;	/* bytes charged for the table */
+	int statm_fd;		/* /proc/self/statm, when max_rss is set */
+	double gzip_ratio;
+	pthread_t gzip_thread;
+	pthread_cond_t gzip_cond;	/* signaled when a job is queued */
+	struct gzip_job *gzip_head;	/* queue of compression jobs */
+	struct gzip_job *gzip_tail;
+	int exiting;
+	int reclaimer;		/* the reclaimer thread is running */
+	pthread_t reclaim_thread;
+	pthread_cond_t reclaim_cond;	/* signaled when space is needed */
+	long high_size;		/* bytes above which the reclaimer starts */
+	long low_size;		/* bytes at which it stops */
+	long reclaim_size;	/* the target of its next pass */
+	/* bumped by the invalidations of the paths in each group, and of
+	 * directories, see cache_generation */
+	unsigned long generations[CACHE_GENERATIONS];
+	unsigned long dir_generation;
+	struct spill *spill;	/* the tier below, or NULL */
+	const char *name;
+	struct cache_stats stats;
+};
+
+static unsigned long
+cache_hash(const char *str, long chunk)
+{
+	unsigned long hash = 5381;
+	int c;
+
+	while ((c = *str++))
+		hash = hash * 33 ^ c;
+	/* spread the chunks of a file over the table */
+	return hash ^ (chunk + 1) * 0x9e3779b97f4a7c15UL;
+}
+
+/* the generation of the file path. the lock must be held. */
+static unsigned long
+cache_path_generation(struct cache *c, const char *path)
+{
+	return c->dir_generation +
+		c->generations[cache_hash(path, -1) % CACHE_GENERATIONS];
+}
+
+/* lock the cache, charging the time spent waiting to PHASE_LOCK */
+static void
+cache_lock(struct cache *c)
+{
+	uint64_t start = stats_now();
+
+	pthread_mutex_lock(&c->lock);
+	c->locked = stats_now();
+	histogram_record(&c->stats.lock_wait, c->locked - start);
+	stats_record(PHASE_LOCK, c->locked - start);
+}
+
+static void
+cache_unlock(struct cache *c)
+{
+	histogram_record(&c->stats.lock_hold, stats_now() - c->locked);
+	pthread_mutex_unlock(&c->lock);
+}
+
+static void
+lru_remove(struct cache_entry *e)
+{
+	e->lru_prev->lru_next = e->lru_next;
+	e->lru_next->lru_prev = e->lru_prev;
+}
+
+static void
+lru_push(struct cache *c, struct cache_entry *e)
+{
+	e->lru_prev = &c->lru;
+	e->lru_next = c->lru.lru_next;
+	c->lru.lru_next->lru_prev = e;
+	c->lru.lru_next = e;
+}
+
+/* bytes charged for an allocation of ptr */
+static long
+charge(void *ptr)
+{
+	return ptr ? malloc_usable_size(ptr) + CHUNK_OVERHEAD : 0;
+}
+
+/* resident set size of the process, in bytes */
+static long
+cache_rss(struct cache *c)
+{
+	char buf[64];
+	long size, resident;
+	ssize_t n;
+
+	SYS(n = pread(c->statm_fd, buf, sizeof(buf) - 1, 0));
+	buf[n] = 0;
+	if (sscanf(buf, "%ld %ld", &size, &resident) != 2)
+		return 0;
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* the entry for chunk of the file called name, or NULL. the lock must be
+ * held. */
+static struct cache_entry *
+cache_find(struct cache *c, const char *name, long chunk, unsigned long hash)
+{
+	struct cache_entry *e;
+
+	for (e = c->table[hash & (c->nr_buckets - 1)]; e; e = e->hash_next) {
+		if (e->hash == hash && e->chunk == chunk &&
+		    strcmp(e->name, name) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+static void
+cache_resize(struct cache *c, unsigned long nr_buckets)
+{
+	struct cache_entry **table, *e, *next;
+	unsigned long i;
+
+	table = Malloc(sizeof(struct cache_entry *) * nr_buckets);
+	for (i = 0; i < nr_buckets; i++) {
+		table[i] = NULL;
+	}
+	for (i = 0; i < c->nr_buckets; i++) {
+		for (e = c->table[i]; e; e = next) {
+			next = e->hash_next;
+			e->hash_next = table[e->hash & (nr_buckets - 1)];
+			table[e->hash & (nr_buckets - 1)] = e;
+		}
+	}
+	free(c->table);
+	c->table = table;
+	c->nr_buckets = nr_buckets;
+	c->stats.size -= c->table_charge;
+	c->table_charge = charge(table);
+	c->stats.size += c->table_charge;
+}
+
+/* stop charging the cache for e, and add it to the dead list, whose
+ * entries are freed by cache_free_dead. the lock must be held. */
+static void
+cache_entry_bury(struct cache *c, struct cache_entry *e,
+		 struct cache_entry **dead)
+{
+	c->stats.size -= e->charge;
+	if (e->data.file_buf)
+		c->stats.data_size -= e->data.file_size;
+	c->stats.data_size -= e->data.gzip_size;
+	/* e is no longer in the table */
+	e->hash_next = *dead;
+	*dead = e;
+}
+
+/* free the entries on a dead list, without holding the lock */
+static void
+cache_free_dead(struct cache *c, struct cache_entry *dead)
+{
+	struct cache_entry *next;
+
+	for (; dead; dead = next) {
+		next = dead->hash_next;
+		if (dead->spill) {
+			spill_put(c->spill, &dead->data,
+				  dead->spill_generation);
+		}
+		free(dead->data.file_buf);
+		free(dead->data.gzip_buf);
+		free(dead);
+	}
+}
+
+/* remove e from the cache. it goes on the dead list if nobody is using it,
+ * and is freed by the last cache_release, or by the last L1 cache to drop
+ * it, otherwise. */
+static void
+cache_evict(struct cache *c, struct cache_entry *e, struct cache_entry **dead)
+{
+	struct cache_entry **p;
+
+	lru_remove(e);
+	p = &c->table[e->hash & (c->nr_buckets - 1)];
+	while (*p != e) {
+		p = &(*p)->hash_next;
+	}
+	*p = e->hash_next;
+	c->stats.nr_entries--;
+	c->stats.evictions++;
+	e->evicted = 1;
+	__atomic_store_n(&e->generation, e->generation + 1, __ATOMIC_RELEASE);
+	if (e->users == 0 && e->pinned == 0)
+		cache_entry_bury(c, e, dead);
+}
+
+/* keep only the gzip copy of e, which nobody may be using */
+static void
+cache_demote(struct cache *c, struct cache_entry *e)
+{
+	long freed = charge(e->data.file_buf);
+
+	free(e->data.file_buf);
+	e->data.file_buf = NULL;
+	e->charge -= freed;
+	c->stats.size -= freed;
+	c->stats.data_size -= e->data.file_size;
+	c->stats.demotions++;
+}
+
+/* demote or evict entries, least recently used first, until at most size
+ * bytes are charged, limit entries were freed, or there is nothing left to
+ * free. returns the number of entries demoted or evicted. */
+static long
+cache_shrink(struct cache *c, long size, long limit, struct cache_entry **dead)
+{
+	struct cache_entry *e = c->lru.lru_prev, *prev;
+	long n = 0;
+
+	while (c->stats.size > size && e != &c->lru && n < limit) {
+		prev = e->lru_prev;
+		if (__atomic_load_n(&e->referenced, __ATOMIC_RELAXED)) {
+			/* it was hit in an L1 cache, which does not move it
+			 * to the front, so give it another round, which is
+			 * not counted in limit */
+			e->referenced = 0;
+			lru_remove(e);
+			lru_push(c, e);
+			e = prev;
+			continue;
+		} else if (e->data.file_buf && e->data.gzip_buf &&
+			   e->users == 0 && e->pinned == 0) {
+			cache_demote(c, e);
+		} else {
+			/* only whole files are spilled, and only the ones
+			 * that still have their uncompressed copy */
+			if (c->spill && e->chunk < 0 && e->data.file_buf) {
+				e->spill = 1;
+				e->spill_generation =
+					spill_generation(c->spill);
+			}
+			cache_evict(c, e, dead);
+		}
+		e = prev;
+		n++;
+	}
+	return n;
+}
+
+/* attach the gzip copy of the finished job to e, which only the caller may
+ * be using, or drop it if the file did not compress or e was evicted. frees
+ * the job. the lock must be held. */
+static void
+cache_gzip_attach(struct cache *c, struct cache_entry *e,
+		  struct gzip_job *job, struct cache_entry **dead)
+{
+	long added;
+
+	e->compressing = 0;
+	if (job->gzip_buf && !e->evicted) {
+		added = charge(job->gzip_buf);
+		e->data.gzip_buf = job->gzip_buf;
+		e->data.gzip_size = job->gzip_size;
+		e->charge += added;
+		c->stats.size += added;
+		c->stats.data_size += job->gzip_size;
+		c->stats.compressed++;
+		cache_shrink(c, c->stats.max_size, LONG_MAX, dead);
+	} else {
+		free(job->gzip_buf);
+	}
+	free(job);
+}
+
+/* drop a reference to e, adding it to the dead list if it was the last one
+ * of an evicted entry. the lock must be held. */
+static void
+cache_entry_put(struct cache *c, struct cache_entry *e,
+		struct cache_entry **dead)
+{
+	struct gzip_job *job;
+
+	assert(e->users > 0);
+	if (e->users == 1 && e->gzip_job) {
+		/* the gzip thread finished while e was in use. e is still
+		 * held while the cache shrinks, so it is not buried twice. */
+		job = e->gzip_job;
+		e->gzip_job = NULL;
+		cache_gzip_attach(c, e, job, dead);
+	}
+	e->users--;
+	if (e->evicted && e->users == 0 && e->pinned == 0)
+		cache_entry_bury(c, e, dead);
+}
+
+/* ask the reclaimer to shrink the cache to at most size bytes, or to the low
+ * watermark if that is less. the lock must be held, and the caller wakes the
+ * reclaimer up once it dropped the lock, so that the reclaimer does not wait
+ * for it. */
+static void
+cache_reclaim(struct cache *c, long size)
+{
+	if (size < c->reclaim_size)
+		c->reclaim_size = size;
+}
+
+static void *
+cache_reclaim_thread(void *arg)
+{
+	struct cache *c = (struct cache *)arg;
+	struct cache_entry *dead;
+	long n;
+
+	cache_lock(c);
+	while (1) {
+		while (!c->exiting && c->stats.size <= c->high_size &&
+		       c->stats.size <= c->reclaim_size) {
+			pthread_cond_wait(&c->reclaim_cond, &c->lock);
+			c->locked = stats_now();
+		}
+		if (c->exiting)
+			break;
+		c->stats.reclaims++;
+		do {
+			dead = NULL;
+			n = cache_shrink(c, c->reclaim_size, CACHE_RECLAIM_BATCH,
+					 &dead);
+			c->stats.reclaimed += n;
+			cache_unlock(c);
+			cache_free_dead(c, dead);
+			cache_lock(c);
+		} while (n > 0 && c->stats.size > c->reclaim_size &&
+			 !c->exiting);
+		c->reclaim_size = c->low_size;
+		if (n == 0 && !c->exiting) {
+			/* the rest is held by evicted entries that are in use,
+			 * wait for more to be freed */
+			pthread_cond_wait(&c->reclaim_cond, &c->lock);
+			c->locked = stats_now();
+		}
+	}
+	cache_unlock(c);
+	return NULL;
+}
+
+/* compress size bytes of buf with gzip. returns the compressed copy, and its
+ * size in gzip_size, or NULL if it would be larger than ratio * size. */
+static char *
+gzip_compress(char *buf, long size, double ratio, long *gzip_size)
+{
+	z_stream z;
+	char *out;
+	int ret;
+
+	memset(&z, 0, sizeof(z));
+	/* 16 + MAX_WBITS asks for a gzip header and trailer */
+	if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS,
+			 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return NULL;
+	}
+	out = Malloc(deflateBound(&z, size));
+	z.next_in = (unsigned char *)buf;
+	z.avail_in = size;
+	z.next_out = (unsigned char *)out;
+	z.avail_out = deflateBound(&z, size);
+	ret = deflate(&z, Z_FINISH);
+	deflateEnd(&z);
+	if (ret != Z_STREAM_END || z.total_out > ratio * size) {
+		free(out);
+		return NULL;
+	}
+	/* don't keep, and charge for, the slack of deflateBound */
+	*gzip_size = z.total_out;
+	return realloc(out, z.total_out);
+}
+
+static void *
+cache_gzip_thread(void *arg)
+{
+	struct cache *c = (struct cache *)arg;
+	struct gzip_job *job;
+	struct cache_entry *e, *dead;
+
+	while (1) {
+		cache_lock(c);
+		while (!c->gzip_head && !c->exiting) {
+			pthread_cond_wait(&c->gzip_cond, &c->lock);
+			c->locked = stats_now();
+		}
+		if (c->exiting) {
+			cache_unlock(c);
+			return NULL;
+		}
+		job = c->gzip_head;
+		c->gzip_head = job->next;
+		cache_unlock(c);
+
+		e = job->e;
+		job->gzip_buf = gzip_compress(e->data.file_buf,
+					      e->data.file_size, c->gzip_ratio,
+					      &job->gzip_size);
+		dead = NULL;
+		cache_lock(c);
+		/* gzip_buf is NULL if the file did not compress well enough,
+		 * and cache_gzip_attach then drops the job */
+		if (job->gzip_buf && !e->evicted && e->users > 1) {
+			/* a worker is sending the file, so the last one to
+			 * release it attaches the copy */
+			e->gzip_job = job;
+		} else {
+			cache_gzip_attach(c, e, job, &dead);
+		}
+		cache_entry_put(c, e, &dead);
+		cache_unlock(c);
+		cache_free_dead(c, dead);
+	}
+}
+
+struct cache *
+cache_init(const struct cache_config *config)
+{
+	struct cache *c;
+
+	c = Malloc(sizeof(struct cache));
+	pthread_mutex_init(&c->lock, NULL);
+	c->table = NULL;
+	c->nr_buckets = 0;
+	c->table_charge = 0;
+	c->stats.size = 0;
+	cache_resize(c, CACHE_MIN_BUCKETS);
+	c->lru.lru_next = &c->lru;
+	c->lru.lru_prev = &c->lru;
+	c->stats.lookups = 0;
+	c->stats.hits = 0;
+	c->stats.inserts = 0;
+	c->stats.evictions = 0;
+	c->stats.nr_entries = 0;
+	c->stats.data_size = 0;
+	c->stats.max_size = config->max_size;
+	c->stats.rss = 0;
+	c->stats.max_rss = config->max_rss;
+	c->stats.rss_rejects = 0;
+	c->stats.compressed = 0;
+	c->stats.demotions = 0;
+	c->stats.chunk_inserts = 0;
+	c->stats.invalidations = 0;
+	c->stats.stale_rejects = 0;
+	c->stats.space_rejects = 0;
+	c->stats.reclaims = 0;
+	c->stats.reclaimed = 0;
+	c->stats.l1_lookups = 0;
+	c->stats.l1_hits = 0;
+	memset(c->generations, 0, sizeof(c->generations));
+	c->dir_generation = 0;
+	c->spill = config->spill;
+	c->name = config->name ? config->name : "cache";
+	c->statm_fd = -1;
+	if (config->max_rss > 0) {
+		SYS(c->statm_fd = open("/proc/self/statm", O_RDONLY));
+	}
+	c->gzip_ratio = config->gzip_ratio;
+	c->gzip_head = NULL;
+	c->gzip_tail = NULL;
+	c->exiting = 0;
+	pthread_cond_init(&c->gzip_cond, NULL);
+	if (c->gzip_ratio > 0) {
+		SYS(pthread_create(&c->gzip_thread, NULL, cache_gzip_thread, c));
+	}
+	c->high_size = config->high_watermark * config->max_size;
+	c->low_size = config->low_watermark * config->max_size;
+	c->reclaim_size = c->low_size;
+	c->reclaimer = config->high_watermark > 0;
+	pthread_cond_init(&c->reclaim_cond, NULL);
+	if (c->reclaimer) {
+		SYS(pthread_create(&c->reclaim_thread, NULL,
+				   cache_reclaim_thread, c));
+	}
+	histogram_init(&c->stats.lock_wait);
+	histogram_init(&c->stats.lock_hold);
+	return c;
+}
+
+void
+cache_destroy(struct cache *c)
+{
+	struct cache_entry *e, *next, *dead = NULL;
+	struct gzip_job *job;
+
+	pthread_mutex_lock(&c->lock);
+	c->exiting = 1;
+	pthread_cond_signal(&c->gzip_cond);
+	pthread_cond_signal(&c->reclaim_cond);
+	pthread_mutex_unlock(&c->lock);
+	if (c->gzip_ratio > 0) {
+		pthread_join(c->gzip_thread, NULL);
+	}
+	if (c->reclaimer) {
+		pthread_join(c->reclaim_thread, NULL);
+	}
+	while ((job = c->gzip_head) != NULL) {
+		c->gzip_head = job->next;
+		free(job->gzip_buf);
+		cache_entry_put(c, job->e, &dead);
+		free(job);
+	}
+	for (e = c->lru.lru_next; e != &c->lru; e = next) {
+		next = e->lru_next;
+		assert(e->users == 0 && e->pinned == 0);
+		cache_entry_bury(c, e, &dead);
+	}
+	cache_free_dead(c, dead);
+	if (c->statm_fd >= 0) {
+		SYS(close(c->statm_fd));
+	}
+	pthread_cond_destroy(&c->reclaim_cond);
+	pthread_cond_destroy(&c->gzip_cond);
+	pthread_mutex_destroy(&c->lock);
+	free(c->table);
+	free(c);
+}
+
+/* look up chunk of the file called name, counting the lookup and moving a hit
+ * to the front of the LRU list. the lock must be held. */
+static struct cache_entry *
+cache_get(struct cache *c, const char *name, long chunk, unsigned long hash)
+{
+	struct cache_entry *e;
+	uint64_t start = stats_now();
+
+	c->stats.lookups++;
+	e = cache_find(c, name, chunk, hash);
+	if (e) {
+		c->stats.hits++;
+		lru_remove(e);
+		lru_push(c, e);
+	}
+	stats_record(PHASE_LOOKUP, stats_now() - start);
+	return e;
+}
+
+struct cache_entry *
+cache_lookup_chunk(struct cache *c, const char *name, long chunk)
+{
+	struct cache_entry *e;
+
+	cache_lock(c);
+	e = cache_get(c, name, chunk, cache_hash(name, chunk));
+	if (e)
+		e->users++;
+	cache_unlock(c);
+	return e;
+}
+
+struct cache_entry *
+cache_lookup(struct cache *c, const char *name)
+{
+	return cache_lookup_chunk(c, name, -1);
+}
+
+int
+cache_contains(struct cache *c, const char *name)
+{
+	struct cache_entry *e;
+
+	cache_lock(c);
+	e = cache_find(c, name, -1, cache_hash(name, -1));
+	cache_unlock(c);
+	return e != NULL;
+}
+
+struct file_data *
+cache_entry_data(struct cache_entry *e)
+{
+	return &e->data;
+}
+
+struct file_data *
+cache_entry_inflate(struct cache_entry *e)
+{
+	struct file_data *data = file_data_init();
+	z_stream z;
+	int ret;
+
+	assert(e->data.gzip_buf);
+	data->file_name = strdup(e->name);
+	data->file_size = e->data.file_size;
+	data->file_csum = e->data.file_csum;
+	data->file_mtime = e->data.file_mtime;
+	data->file_buf = Malloc(data->file_size);
+	memset(&z, 0, sizeof(z));
+	ret = inflateInit2(&z, 16 + MAX_WBITS);
+	assert(ret == Z_OK);
+	z.next_in = (unsigned char *)e->data.gzip_buf;
+	z.avail_in = e->data.gzip_size;
+	z.next_out = (unsigned char *)data->file_buf;
+	z.avail_out = data->file_size;
+	ret = inflate(&z, Z_FINISH);
+	assert(ret == Z_STREAM_END && z.total_out == data->file_size);
+	inflateEnd(&z);
+	return data;
+}
+
+void
+cache_release(struct cache *c, struct cache_entry *e)
+{
+	struct cache_entry *dead = NULL;
+
+	cache_lock(c);
+	cache_entry_put(c, e, &dead);
+	cache_unlock(c);
+	if (c->reclaimer && dead) {
+		/* the reclaimer may be waiting for this space */
+		pthread_cond_signal(&c->reclaim_cond);
+	}
+	cache_free_dead(c, dead);
+}
+
+struct cache_l1 *
+cache_l1_init(struct cache *c, int nr_slots)
+{
+	struct cache_l1 *l1;
+	int i;
+
+	l1 = Malloc(sizeof(struct cache_l1) +
+		    sizeof(struct l1_slot) * nr_slots);
+	l1->c = c;
+	l1->lookups = 0;
+	l1->hits = 0;
+	l1->nr_slots = nr_slots;
+	for (i = 0; i < nr_slots; i++) {
+		l1->slots[i].e = NULL;
+	}
+	return l1;
+}
+
+/* empty slot s, dropping its entry. the lock must be held. */
+static void
+cache_l1_unpin(struct cache *c, struct l1_slot *s, struct cache_entry **dead)
+{
+	struct cache_entry *e = s->e;
+
+	s->e = NULL;
+	e->pinned--;
+	if (e->evicted && e->users == 0 && e->pinned == 0)
+		cache_entry_bury(c, e, dead);
+}
+
+void
+cache_l1_destroy(struct cache_l1 *l1)
+{
+	struct cache *c = l1->c;
+	struct cache_entry *dead = NULL;
+	int i;
+
+	cache_lock(c);
+	for (i = 0; i < l1->nr_slots; i++) {
+		if (l1->slots[i].e)
+			cache_l1_unpin(c, &l1->slots[i], &dead);
+	}
+	c->stats.l1_lookups += l1->lookups;
+	c->stats.l1_hits += l1->hits;
+	cache_unlock(c);
+	cache_free_dead(c, dead);
+	free(l1);
+}
+
+/* is the entry in slot s still in the cache? this is called without the
+ * lock. */
+static int
+cache_l1_valid(struct l1_slot *s)
+{
+	return __atomic_load_n(&s->e->generation, __ATOMIC_ACQUIRE) ==
+		s->generation;
+}
+
+/* pin e in a slot of l1, in place of the slot that was hit the least. the
+ * lock must be held. */
+static void
+cache_l1_pin(struct cache_l1 *l1, struct cache_entry *e, unsigned long hash,
+	     struct cache_entry **dead)
+{
+	struct l1_slot *s, *victim = NULL;
+	int i;
+
+	for (i = 0; i < l1->nr_slots; i++) {
+		s = &l1->slots[i];
+		if (!s->e) {
+			victim = s;
+			break;
+		}
+		if (!victim || s->hits < victim->hits)
+			victim = s;
+	}
+	/* age the slots, so that files that were hot once don't stay */
+	for (i = 0; i < l1->nr_slots; i++) {
+		l1->slots[i].hits /= 2;
+	}
+	if (victim->e)
+		cache_l1_unpin(l1->c, victim, dead);
+	victim->e = e;
+	victim->hash = hash;
+	victim->generation = e->generation;
+	victim->hits = 0;
+	e->pinned++;
+}
+
+struct cache_entry *
+cache_l1_lookup(struct cache_l1 *l1, const char *name)
+{
+	struct cache *c = l1->c;
+	unsigned long hash = cache_hash(name, -1);
+	struct cache_entry *e, *dead = NULL;
+	struct l1_slot *s;
+	uint64_t start = stats_now();
+	int i, stale = 0;
+
+	l1->lookups++;
+	for (i = 0; i < l1->nr_slots; i++) {
+		s = &l1->slots[i];
+		if (!s->e)
+			continue;
+		if (!cache_l1_valid(s)) {
+			stale = 1;
+		} else if (s->hash == hash && strcmp(s->e->name, name) == 0) {
+			l1->hits++;
+			s->hits++;
+			e = s->e;
+			if (!__atomic_load_n(&e->referenced, __ATOMIC_RELAXED))
+				__atomic_store_n(&e->referenced, 1,
+						 __ATOMIC_RELAXED);
+			stats_record(PHASE_LOOKUP, stats_now() - start);
+			return e;
+		}
+	}
+
+	/* a miss, which takes the lock anyway, so drop the entries that were
+	 * evicted on the way */
+	cache_lock(c);
+	for (i = 0; stale && i < l1->nr_slots; i++) {
+		s = &l1->slots[i];
+		if (s->e && s->e->generation != s->generation)
+			cache_l1_unpin(c, s, &dead);
+	}
+	e = cache_get(c, name, -1, hash);
+	/* the data of a pinned entry must not change, so it is pinned once it
+	 * was compressed. large files are not pinned, since a slot holds on to
+	 * its entry after it is evicted, until the slot is looked at again. */
+	if (e && !e->compressing &&
+	    e->charge <= c->stats.max_size / l1->nr_slots) {
+		cache_l1_pin(l1, e, hash, &dead);
+	} else if (e) {
+		e->users++;
+	}
+	cache_unlock(c);
+	if (c->reclaimer && dead) {
+		/* the reclaimer may be waiting for this space */
+		pthread_cond_signal(&c->reclaim_cond);
+	}
+	cache_free_dead(c, dead);
+	return e;
+}
+
+void
+cache_l1_release(struct cache_l1 *l1, struct cache_entry *e)
+{
+	int i;
+
+	for (i = 0; i < l1->nr_slots; i++) {
+		if (l1->slots[i].e == e)
+			return;
+	}
+	cache_release(l1->c, e);
+}
+
+int
+cache_insert_chunk(struct cache *c, struct file_data *data, long chunk)
+{
+	unsigned long hash = cache_hash(data->file_name, chunk);
+	size_t len = strlen(data->file_name);
+	struct cache_entry *e, *dead = NULL;
+	struct gzip_job *job = NULL;
+	long rss = 0, shed;
+	int wake = 0;		/* the reclaimer */
+
+	/* set the entry up before taking the lock */
+	e = Malloc(sizeof(struct cache_entry) + len + 1);
+	memcpy(e->name, data->file_name, len + 1);
+	e->data = *data;
+	e->data.file_name = e->name;
+	e->charge = charge(e) + charge(data->file_buf);
+	e->chunk = chunk;
+	e->hash = hash;
+	e->users = 0;
+	e->pinned = 0;
+	e->evicted = 0;
+	e->generation = 0;
+	e->referenced = 0;
+	e->compressing = 0;
+	e->gzip_job = NULL;
+	e->spill = 0;
+	if (e->charge > c->stats.max_size - c->table_charge)
+		goto fail;
+	if (c->stats.max_rss > 0)
+		rss = cache_rss(c);
+
+	cache_lock(c);
+	if (cache_find(c, e->name, chunk, hash)) {
+		/* another thread read and inserted the file meanwhile */
+		goto fail_unlock;
+	}
+	if (data->file_generation != cache_path_generation(c, e->name)) {
+		c->stats.stale_rejects++;
+		goto fail_unlock;
+	}
+	if (c->stats.max_rss > 0) {
+		c->stats.rss = rss;
+		if (rss + e->charge > c->stats.max_rss) {
+			/* the process is over its cap, so shed the excess
+			 * from the cache instead of growing it */
+			shed = c->stats.size - (rss + e->charge -
+						c->stats.max_rss);
+			if (c->reclaimer) {
+				cache_reclaim(c, shed);
+				wake = 1;
+			} else {
+				cache_shrink(c, shed, LONG_MAX, &dead);
+			}
+			c->stats.rss_rejects++;
+			goto fail_unlock;
+		}
+	}
+	/* with a reclaimer, only make a little space here */
+	cache_shrink(c, c->stats.max_size - e->charge,
+		     c->reclaimer ? CACHE_INSERT_EVICTIONS : LONG_MAX, &dead);
+	if (c->stats.size + e->charge > c->stats.max_size) {
+		/* the reclaimer is behind, or the space is held by evicted
+		 * entries that are in use */
+		if (c->reclaimer) {
+			cache_reclaim(c, c->stats.max_size - e->charge);
+			wake = 1;
+		}
+		c->stats.space_rejects++;
+		goto fail_unlock;
+	}
+	e->hash_next = c->table[hash & (c->nr_buckets - 1)];
+	c->table[hash & (c->nr_buckets - 1)] = e;
+	lru_push(c, e);
+	c->stats.size += e->charge;
+	c->stats.data_size += e->data.file_size;
+	c->stats.nr_entries++;
+	c->stats.inserts++;
+	if (chunk >= 0)
+		c->stats.chunk_inserts++;
+	if (c->stats.nr_entries > c->nr_buckets)
+		cache_resize(c, c->nr_buckets * 2);
+	/* chunks are sent in ranges, which are never compressed */
+	if (c->gzip_ratio > 0 && chunk < 0 && e->data.file_size > 0 &&
+	    !e->data.gzip_buf) {
+		/* the job keeps a reference until the file is compressed */
+		job = Malloc(sizeof(struct gzip_job));
+		job->e = e;
+		job->gzip_buf = NULL;
+		job->next = NULL;
+		e->users++;
+		e->compressing = 1;
+		if (c->gzip_head)
+			c->gzip_tail->next = job;
+		else
+			c->gzip_head = job;
+		c->gzip_tail = job;
+		pthread_cond_signal(&c->gzip_cond);
+	}
+	wake = c->reclaimer && c->stats.size > c->high_size;
+	cache_unlock(c);
+	if (wake)
+		pthread_cond_signal(&c->reclaim_cond);
+	cache_free_dead(c, dead);
+	/* the entry has its own copy of the name, and owns the contents */
+	free(data->file_name);
+	free(data);
+	return 0;
+
+fail_unlock:
+	cache_unlock(c);
+	if (wake)
+		pthread_cond_signal(&c->reclaim_cond);
+	cache_free_dead(c, dead);
+fail:
+	free(e);
+	return -1;
+}
+
+int
+cache_insert(struct cache *c, struct file_data *data)
+{
+	return cache_insert_chunk(c, data, -1);
+}
+
+/* is name the file path, or under the directory path of length len? */
+static int
+cache_path_matches(const char *name, const char *path, size_t len, int is_dir)
+{
+	if (!is_dir)
+		return strcmp(name, path) == 0;
+	return strncmp(name, path, len) == 0 &&
+		(name[len] == 0 || name[len] == '/');
+}
+
+void
+cache_invalidate(struct cache *c, const char *path, int is_dir)
+{
+	size_t len = strlen(path);
+	struct cache_entry *e, *next, *dead = NULL;
+
+	cache_lock(c);
+	if (is_dir)
+		c->dir_generation++;
+	else
+		c->generations[cache_hash(path, -1) % CACHE_GENERATIONS]++;
+	/* under the lock, so that files evicted before it are not spilled
+	 * after it */
+	if (c->spill)
+		spill_invalidate(c->spill, path, is_dir);
+	if (!is_dir && c->stats.chunk_inserts == 0) {
+		/* there is at most one entry for the file */
+		e = cache_find(c, path, -1, cache_hash(path, -1));
+		if (e) {
+			cache_evict(c, e, &dead);
+			c->stats.invalidations++;
+		}
+	} else {
+		for (e = c->lru.lru_next; e != &c->lru; e = next) {
+			next = e->lru_next;
+			if (cache_path_matches(e->name, path, len, is_dir)) {
+				cache_evict(c, e, &dead);
+				c->stats.invalidations++;
+			}
+		}
+	}
+	cache_unlock(c);
+	cache_free_dead(c, dead);
+}
+
+unsigned long
+cache_generation(struct cache *c, const char *path)
+{
+	unsigned long generation;
+
+	pthread_mutex_lock(&c->lock);
+	generation = cache_path_generation(c, path);
+	pthread_mutex_unlock(&c->lock);
+	return generation;
+}
+
+void
+cache_get_stats(struct cache *c, struct cache_stats *stats)
+{
+	pthread_mutex_lock(&c->lock);
+	*stats = c->stats;
+	pthread_mutex_unlock(&c->lock);
+}
+
+void
+cache_dump(struct cache *c, FILE *out)
+{
+	struct cache_stats *s;
+
+	s = Malloc(sizeof(struct cache_stats));
+	cache_get_stats(c, s);
+	fprintf(out, "%s: %ld lookups, %.1f%% hits, %ld inserts, "
+		"%ld evictions, %ld files\n", c->name, s->lookups,
+		s->lookups ? 100.0 * s->hits / s->lookups : 0, s->inserts,
+		s->evictions, s->nr_entries);
+	fprintf(out, "%s memory: %ld of %ld bytes charged, %ld of them "
+		"file data\n", c->name, s->size, s->max_size, s->data_size);
+	if (s->max_rss > 0) {
+		fprintf(out, "%s rss: %ld of %ld bytes, %ld inserts "
+			"refused\n", c->name, s->rss, s->max_rss,
+			s->rss_rejects);
+	}
+	if (s->compressed > 0) {
+		fprintf(out, "%s gzip: %ld files compressed, %ld "
+			"uncompressed copies dropped\n", c->name,
+			s->compressed, s->demotions);
+	}
+	if (s->invalidations > 0 || s->stale_rejects > 0) {
+		fprintf(out, "%s invalidations: %ld files removed, %ld "
+			"inserts of stale files refused\n", c->name,
+			s->invalidations, s->stale_rejects);
+	}
+	if (s->reclaims > 0 || s->space_rejects > 0) {
+		fprintf(out, "%s reclaim: %ld passes, %ld files evicted or "
+			"demoted, %ld inserts refused for space\n", c->name,
+			s->reclaims, s->reclaimed, s->space_rejects);
+	}
+	if (s->l1_lookups > 0) {
+		fprintf(out, "%s l1: %ld lookups, %.1f%% hits in the caches of "
+			"the threads\n", c->name, s->l1_lookups,
+			100.0 * s->l1_hits / s->l1_lookups);
+	}
+	if (s->chunk_inserts > 0) {
+		fprintf(out, "%s chunks: %ld chunks of files added\n",
+			c->name, s->chunk_inserts);
+	}
+	fprintf(out, "%s lock: wait p50 %.1f p99 %.1f max %.1f, "
+		"hold p50 %.1f p99 %.1f max %.1f (usec)\n", c->name,
+		histogram_percentile(&s->lock_wait, 50) / 1000.0,
+		histogram_percentile(&s->lock_wait, 99) / 1000.0,
+		s->lock_wait.max / 1000.0,
+		histogram_percentile(&s->lock_hold, 50) / 1000.0,
+		histogram_percentile(&s->lock_hold, 99) / 1000.0,
+		s->lock_hold.max / 1000.0);
+	fflush(out);
+	free(s);
+}
@@ -0,0 +1,158 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdio.h>
+#include "histogram.h"
+#include "request.h"
+
+/*
+ * A thread-safe cache of file contents, keyed by file name, that evicts the
+ * least recently used files when it runs out of space.
+ *
+ * Entries are reference counted. cache_lookup returns an entry that stays
+ * valid until the caller passes it to cache_release, even if the entry is
+ * evicted in the meantime, so files are never read from the cache under the
+ * cache lock. An evicted entry that is still in use is freed, and stops being
+ * charged to the cache, when its last user releases it.
+ *
+ * The size of the cache counts all the memory it uses, including names,
+ * metadata and allocator overhead, not just the file contents. In addition,
+ * the cache can be capped by the resident set size (RSS) of the whole
+ * process: while the process is over the cap, inserts are refused and evict
+ * enough of the cache to make up the difference.
+ *
+ * Optionally, a background thread compresses each file after it is inserted,
+ * and keeps a gzip copy next to the file when it is small enough. The gzip
+ * copy is sent to clients that accept it. When the cache needs space, the
+ * least recently used files that have a gzip copy first lose their
+ * uncompressed copy, and are only evicted the next time they come up, so
+ * more files fit in the cache. A client that does not accept gzip gets such
+ * a file decompressed with cache_entry_inflate.
+ *
+ * Besides whole files, the cache can hold fixed-size chunks of files, each
+ * an entry of its own, so that the parts of a large file that are requested
+ * often are cached without the rest of it.
+ *
+ * With watermarks, eviction is moved off the path of the requests, to a
+ * reclaimer thread that wakes up when the cache is fuller than the high
+ * watermark and evicts files until it is down to the low watermark. An insert
+ * into a cache that is full evicts at most a few files itself, and is refused
+ * if that does not make enough space, leaving the rest to the reclaimer.
+ * Either way, the memory of evicted files is freed after the lock is dropped.
+ *
+ * Each thread can put a small L1 cache in front of the cache, which keeps
+ * the files that the thread hits most pinned, and looks them up without
+ * taking the lock of the cache. Only misses in the L1 cache go to the cache,
+ * where the files to pin are found. A file evicted from the cache is dropped
+ * by the L1 caches the next time they look it up.
+ *
+ * The cache can have a spill tier on disk beneath it, which gets the files
+ * that are evicted for space. The cache only writes to the tier, and the
+ * caller reads the files back with spill_get after a miss.
+ */
+
+struct cache;
+struct cache_entry;
+struct cache_l1;
+struct spill;
+
+struct cache_config {
+	const char *name;	/* in cache_dump, "cache" if NULL */
+	long max_size;		/* bytes */
+	long max_rss;		/* cap on the RSS of the process, if > 0 */
+	/* keep a gzip copy of files that compress to at most this fraction
+	 * of their size. 0 disables compression. */
+	double gzip_ratio;
+	/* fractions of max_size between which the reclaimer keeps the cache.
+	 * a high_watermark of 0 evicts in cache_insert instead. */
+	double high_watermark;
+	double low_watermark;
+	/* files evicted for space are written to this tier, and invalidations
+	 * are passed on to it. NULL if there is none (see spill.h). */
+	struct spill *spill;
+};
+
+struct cache_stats {
+	long lookups;
+	long hits;
+	long inserts;
+	long evictions;
+	long nr_entries;
+	long size;		/* bytes charged to the cache */
+	long data_size;		/* bytes of file contents in the cache */
+	long max_size;
+	long rss;		/* RSS of the process at the last insert */
+	long max_rss;		/* 0 if the RSS is not capped */
+	long rss_rejects;	/* inserts refused because of max_rss */
+	long compressed;	/* files given a gzip copy */
+	long demotions;		/* uncompressed copies dropped for space */
+	long chunk_inserts;	/* chunks of files added */
+	long invalidations;	/* entries removed by cache_invalidate */
+	long stale_rejects;	/* inserts of files read before a change */
+	long space_rejects;	/* inserts refused because the cache was full */
+	long reclaims;		/* times the reclaimer woke up */
+	long reclaimed;		/* entries evicted or demoted by it */
+	long l1_lookups;	/* by L1 caches that were destroyed */
+	long l1_hits;
+	/* ns spent waiting for the lock, and holding it. these are only
+	 * measured when STATS is defined (see stats.h). */
+	struct histogram lock_wait;
+	struct histogram lock_hold;
+};
+
+struct cache *cache_init(const struct cache_config *config);
+/* free the cache and all its entries. no entry may be in use. */
+void cache_destroy(struct cache *c);
+
+/* look up the file called name. returns the entry, which the caller must
+ * release, or NULL if the file is not cached. */
+struct cache_entry *cache_lookup(struct cache *c, const char *name);
+/* is the file called name cached? unlike cache_lookup, this is not counted
+ * as a lookup, and does not make the file recently used. */
+int cache_contains(struct cache *c, const char *name);
+/* the file of an entry returned by cache_lookup. file_buf is NULL if only
+ * the gzip copy is cached. */
+struct file_data *cache_entry_data(struct cache_entry *e);
+/* a new, uncompressed copy of the file of an entry that has a gzip copy,
+ * which the caller frees with file_data_free */
+struct file_data *cache_entry_inflate(struct cache_entry *e);
+void cache_release(struct cache *c, struct cache_entry *e);
+/* look up chunk number chunk of the file called name. its data holds the
+ * bytes of the chunk, and file_size is the length of the chunk. */
+struct cache_entry *cache_lookup_chunk(struct cache *c, const char *name,
+				       long chunk);
+
+/* create an L1 cache of nr_slots files in front of c, for the calling
+ * thread only. it must be destroyed before c. */
+struct cache_l1 *cache_l1_init(struct cache *c, int nr_slots);
+void cache_l1_destroy(struct cache_l1 *l1);
+/* look up the file called name, like cache_lookup, in l1 and then in the
+ * cache. the entry is released with cache_l1_release. */
+struct cache_entry *cache_l1_lookup(struct cache_l1 *l1, const char *name);
+void cache_l1_release(struct cache_l1 *l1, struct cache_entry *e);
+
+/* add data to the cache, evicting other files to make space for it. returns
+ * 0 if data was added, in which case the cache owns and may free it, and -1
+ * if it was not, because the file is cached already or it does not fit. */
+int cache_insert(struct cache *c, struct file_data *data);
+/* add chunk number chunk of the file data->file_name, like cache_insert */
+int cache_insert_chunk(struct cache *c, struct file_data *data, long chunk);
+
+/* remove the file path, and its chunks, from the cache. if is_dir is set,
+ * remove every file under the directory path instead. */
+void cache_invalidate(struct cache *c, const char *path, int is_dir);
+/* the number of cache_invalidate calls so far that may have covered the
+ * file path. a file that was read when its generation was g has
+ * file_generation set to g, and is not inserted if the file may have been
+ * invalidated since, because it may have been read before a change. the
+ * paths are hashed into groups that share a generation, so a change to
+ * another file only refuses the insert when the two are in the same group,
+ * and a change to a directory refuses every insert. */
+unsigned long cache_generation(struct cache *c, const char *path);
+
+/* copy the statistics of the cache into stats */
+void cache_get_stats(struct cache *c, struct cache_stats *stats);
+/* print the statistics of the cache */
+void cache_dump(struct cache *c, FILE *out);
+
+#endif /* __CACHE_H__ */
@@ -0,0 +1,966 @@
+/*
+ * cache_sim.c: replays a trace of the requests recorded by the server (see
+ * rtrace.h) against cache policies, at many cache sizes at once, and prints
+ * the hit ratio and the byte hit ratio of each policy at each size.
+ *
+ * To run:
+ *  cache_sim [options] trace
+ *
+ * The policies are LRU, FIFO, LFU, ARC, GDSF and TinyLFU. All of them cache
+ * files of different sizes in a cache of a number of bytes, and never cache
+ * a file that is larger than the cache.
+ *
+ * LRU is a stack algorithm: a cache of any size holds the most recently used
+ * files that fit, so a request hits in a cache of C bytes if the file and the
+ * distinct files requested since it was last requested add up to at most C
+ * bytes, its stack distance. The stack distances of all the requests are
+ * found in a single pass, with a Fenwick tree over the positions in the trace
+ * that holds the size of each file at the position of its last request, and
+ * give the LRU hit ratio at every size. Files larger than a cache take up
+ * space in the stack, where the other policies skip them, which makes LRU
+ * look slightly worse than it is at sizes close to the sizes of the files.
+ *
+ * The other policies are simulated, one cache per policy and size, and each
+ * request of the trace is given to every cache in turn, so that the trace is
+ * still read once. The sizes of files are the sizes that were recorded, so
+ * the simulated caches do not count the names and the metadata that the
+ * cache of the server charges for (see cache.h), and a simulated size
+ * corresponds to a somewhat larger max_cache_size.
+ */
+
+#include <limits.h>
+#include "common.h"
+#include "rtrace.h"
+
+#define MAX_LIST 64		/* max values of a list option */
+#define NR_SIZES 12		/* default number of cache sizes */
+#define SIM_MIN_BUCKETS 64
+/* TinyLFU: the window takes this fraction of the cache, and the protected
+ * segment this fraction of the rest */
+#define TINYLFU_WINDOW 0.01
+#define TINYLFU_PROTECTED 0.8
+/* TinyLFU: counters of each row of the sketch, a power of two */
+#define SKETCH_WIDTH (1 << 18)
+#define SKETCH_DEPTH 4
+#define SKETCH_MAX 15		/* counters saturate at this count */
+
+enum policy {
+	POLICY_LRU,
+	POLICY_FIFO,
+	POLICY_LFU,
+	POLICY_ARC,
+	POLICY_GDSF,
+	POLICY_TINYLFU,
+	NR_POLICIES,
+};
+
+static const char *policy_names[NR_POLICIES] = {
+	"lru", "fifo", "lfu", "arc", "gdsf", "tinylfu",
+};
+
+/* the lists of the policies that have several */
+enum {
+	ARC_T1, ARC_T2, ARC_B1, ARC_B2,		/* B1 and B2 are ghosts */
+	TINY_WINDOW = 0, TINY_PROBATION, TINY_PROTECTED,
+	NR_LISTS = 4,
+};
+
+/* a file that a simulated cache holds, or remembers */
+struct object {
+	int id;			/* of the file, see struct trace */
+	long size;
+	struct object *hash_next;
+	struct object *prev;	/* in its list */
+	struct object *next;
+	int list;
+	long freq;		/* LFU and GDSF */
+	double priority;	/* LFU and GDSF, lowest is evicted first */
+	long last;		/* position of the last request, for ties */
+	long heap_index;
+};
+
+/* a doubly linked list, most recently used first */
+struct list {
+	struct object head;
+	long bytes;
+};
+
+/* a simulated cache */
+struct sim {
+	enum policy policy;
+	long capacity;		/* bytes */
+	long used;		/* bytes of the files in the cache */
+	struct object **table;	/* the files held or remembered, by id */
+	unsigned long nr_buckets;	/* a power of two */
+	long nr_objects;
+	struct list lists[NR_LISTS];
+	struct object **heap;	/* LFU and GDSF, a min-heap by priority */
+	long heap_size;
+	long heap_max;
+	double inflation;	/* GDSF: priority of the last eviction */
+	double target;		/* ARC: bytes of T1 it aims for */
+	long hits;
+	long bytes_hit;
+};
+
+/* the trace, with the files numbered in the order they first appear */
+struct trace {
+	struct rtrace_record *records;
+	int *ids;		/* of the file of each record */
+	long nr_records;
+	int nr_files;
+	long file_bytes;	/* of the files, at their first request */
+	long bytes;		/* requested */
+	long recorded_hits;	/* of the server */
+};
+
+/* a count-min sketch of the frequencies of the files, for TinyLFU. it is
+ * the same for every cache size, so all the TinyLFU caches share it. */
+static struct {
+	unsigned char *counters;
+	long additions;		/* since the counters were last halved */
+} sketch;
+
+static uint64_t
+mix(uint64_t x)
+{
+	/* the finalizer of splitmix64 */
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static unsigned char *
+sketch_counter(int id, int row)
+{
+	uint64_t h = mix((uint64_t)id * SKETCH_DEPTH + row);
+
+	return &sketch.counters[row * SKETCH_WIDTH + (h & (SKETCH_WIDTH - 1))];
+}
+
+static int
+sketch_estimate(int id)
+{
+	int row, min = SKETCH_MAX;
+
+	for (row = 0; row < SKETCH_DEPTH; row++) {
+		if (*sketch_counter(id, row) < min)
+			min = *sketch_counter(id, row);
+	}
+	return min;
+}
+
+static void
+sketch_add(int id)
+{
+	unsigned char *c;
+	long i;
+	int row;
+
+	for (row = 0; row < SKETCH_DEPTH; row++) {
+		c = sketch_counter(id, row);
+		if (*c < SKETCH_MAX)
+			(*c)++;
+	}
+	/* age the counts, so that files that were popular once fade */
+	if (++sketch.additions == 10L * SKETCH_WIDTH) {
+		for (i = 0; i < (long)SKETCH_DEPTH * SKETCH_WIDTH; i++) {
+			sketch.counters[i] /= 2;
+		}
+		sketch.additions = 0;
+	}
+}
+
+static void
+list_init(struct list *l)
+{
+	l->head.next = &l->head;
+	l->head.prev = &l->head;
+	l->bytes = 0;
+}
+
+static void
+list_push(struct sim *s, int list, struct object *o)
+{
+	struct list *l = &s->lists[list];
+
+	o->list = list;
+	o->prev = &l->head;
+	o->next = l->head.next;
+	l->head.next->prev = o;
+	l->head.next = o;
+	l->bytes += o->size;
+}
+
+static void
+list_remove(struct sim *s, struct object *o)
+{
+	o->prev->next = o->next;
+	o->next->prev = o->prev;
+	s->lists[o->list].bytes -= o->size;
+}
+
+/* the least recently used object of a list, or NULL */
+static struct object *
+list_lru(struct sim *s, int list)
+{
+	struct list *l = &s->lists[list];
+
+	return l->head.prev != &l->head ? l->head.prev : NULL;
+}
+
+static int
+heap_less(struct object *a, struct object *b)
+{
+	return a->priority < b->priority ||
+		(a->priority == b->priority && a->last < b->last);
+}
+
+static void
+heap_swap(struct sim *s, long i, long j)
+{
+	struct object *o = s->heap[i];
+
+	s->heap[i] = s->heap[j];
+	s->heap[j] = o;
+	s->heap[i]->heap_index = i;
+	s->heap[j]->heap_index = j;
+}
+
+/* restore the heap after the priority of the object at i changed */
+static void
+heap_fix(struct sim *s, long i)
+{
+	long child;
+
+	while (i > 0 && heap_less(s->heap[i], s->heap[(i - 1) / 2])) {
+		heap_swap(s, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	while ((child = 2 * i + 1) < s->heap_size) {
+		if (child + 1 < s->heap_size &&
+		    heap_less(s->heap[child + 1], s->heap[child]))
+			child++;
+		if (!heap_less(s->heap[child], s->heap[i]))
+			break;
+		heap_swap(s, i, child);
+		i = child;
+	}
+}
+
+static void
+heap_push(struct sim *s, struct object *o)
+{
+	if (s->heap_size == s->heap_max) {
+		s->heap_max = s->heap_max ? 2 * s->heap_max : 64;
+		s->heap = realloc(s->heap, sizeof(struct object *) *
+				  s->heap_max);
+		assert(s->heap);
+	}
+	o->heap_index = s->heap_size;
+	s->heap[s->heap_size++] = o;
+	heap_fix(s, o->heap_index);
+}
+
+static void
+heap_remove(struct sim *s, struct object *o)
+{
+	long i = o->heap_index;
+
+	heap_swap(s, i, --s->heap_size);
+	if (i < s->heap_size)
+		heap_fix(s, i);
+}
+
+static void
+sim_resize(struct sim *s, unsigned long nr_buckets)
+{
+	struct object **table, *o, *next;
+	unsigned long i;
+
+	table = Malloc(sizeof(struct object *) * nr_buckets);
+	for (i = 0; i < nr_buckets; i++) {
+		table[i] = NULL;
+	}
+	for (i = 0; i < s->nr_buckets; i++) {
+		for (o = s->table[i]; o; o = next) {
+			next = o->hash_next;
+			o->hash_next = table[mix(o->id) & (nr_buckets - 1)];
+			table[mix(o->id) & (nr_buckets - 1)] = o;
+		}
+	}
+	free(s->table);
+	s->table = table;
+	s->nr_buckets = nr_buckets;
+}
+
+static struct object *
+sim_find(struct sim *s, int id)
+{
+	struct object *o;
+
+	for (o = s->table[mix(id) & (s->nr_buckets - 1)]; o; o = o->hash_next) {
+		if (o->id == id)
+			return o;
+	}
+	return NULL;
+}
+
+/* a new object for the file id, in the table but not in a list yet */
+static struct object *
+sim_add(struct sim *s, int id, long size, long pos)
+{
+	struct object *o = Malloc(sizeof(struct object));
+
+	o->id = id;
+	o->size = size;
+	o->freq = 1;
+	o->priority = 0;
+	o->last = pos;
+	o->hash_next = s->table[mix(id) & (s->nr_buckets - 1)];
+	s->table[mix(id) & (s->nr_buckets - 1)] = o;
+	if (++s->nr_objects > s->nr_buckets)
+		sim_resize(s, s->nr_buckets * 2);
+	return o;
+}
+
+/* forget o, which is in no list or heap any more */
+static void
+sim_drop(struct sim *s, struct object *o)
+{
+	struct object **p = &s->table[mix(o->id) & (s->nr_buckets - 1)];
+
+	while (*p != o) {
+		p = &(*p)->hash_next;
+	}
+	*p = o->hash_next;
+	s->nr_objects--;
+	free(o);
+}
+
+/* evict o, the file leaves the cache */
+static void
+sim_evict_list(struct sim *s, struct object *o)
+{
+	list_remove(s, o);
+	s->used -= o->size;
+	sim_drop(s, o);
+}
+
+static int
+fifo_access(struct sim *s, int id, long size, long pos)
+{
+	struct object *o;
+
+	if (sim_find(s, id))
+		return 1;
+	while (s->used + size > s->capacity) {
+		sim_evict_list(s, list_lru(s, 0));
+	}
+	o = sim_add(s, id, size, pos);
+	list_push(s, 0, o);
+	s->used += size;
+	return 0;
+}
+
+/* LFU and GDSF, which only differ in the priorities */
+static int
+heap_access(struct sim *s, int id, long size, long pos)
+{
+	struct object *o, *victim;
+
+	if ((o = sim_find(s, id)) != NULL) {
+		o->freq++;
+		o->last = pos;
+		if (s->policy == POLICY_LFU)
+			o->priority = o->freq;
+		else
+			o->priority = s->inflation + (double)o->freq / o->size;
+		heap_fix(s, o->heap_index);
+		return 1;
+	}
+	while (s->used + size > s->capacity) {
+		victim = s->heap[0];
+		/* GDSF ages the files that stay by raising the priority of
+		 * the ones that come in */
+		s->inflation = victim->priority;
+		heap_remove(s, victim);
+		s->used -= victim->size;
+		sim_drop(s, victim);
+	}
+	o = sim_add(s, id, size, pos);
+	if (s->policy == POLICY_LFU)
+		o->priority = 1;
+	else
+		o->priority = s->inflation + 1.0 / (size > 0 ? size : 1);
+	heap_push(s, o);
+	s->used += size;
+	return 0;
+}
+
+/* make room for size bytes in T1 and T2, by moving their least recently used
+ * files to the ghost lists. in_b2 is set if the file came from B2. */
+static void
+arc_replace(struct sim *s, long size, int in_b2)
+{
+	struct object *o;
+	long t1;
+
+	while (s->used + size > s->capacity) {
+		t1 = s->lists[ARC_T1].bytes;
+		o = list_lru(s, ARC_T1);
+		if (o && (t1 > s->target || (in_b2 && t1 == s->target) ||
+			  !list_lru(s, ARC_T2))) {
+			list_remove(s, o);
+			list_push(s, ARC_B1, o);
+		} else {
+			o = list_lru(s, ARC_T2);
+			list_remove(s, o);
+			list_push(s, ARC_B2, o);
+		}
+		s->used -= o->size;
+	}
+}
+
+/* keep T1 and B1 within the cache size, and all four lists within twice the
+ * cache size, as ARC does with a number of pages */
+static void
+arc_trim(struct sim *s)
+{
+	struct list *l = s->lists;
+	struct object *o;
+
+	while (l[ARC_T1].bytes + l[ARC_B1].bytes > s->capacity &&
+	       (o = list_lru(s, ARC_B1)) != NULL) {
+		list_remove(s, o);
+		sim_drop(s, o);
+	}
+	while (l[ARC_T1].bytes + l[ARC_T2].bytes + l[ARC_B1].bytes +
+	       l[ARC_B2].bytes > 2 * s->capacity) {
+		if ((o = list_lru(s, ARC_B2)) == NULL &&
+		    (o = list_lru(s, ARC_B1)) == NULL)
+			break;
+		list_remove(s, o);
+		sim_drop(s, o);
+	}
+}
+
+static int
+arc_access(struct sim *s, int id, long size, long pos)
+{
+	struct list *l = s->lists;
+	struct object *o;
+	double ratio;
+
+	o = sim_find(s, id);
+	if (o && (o->list == ARC_T1 || o->list == ARC_T2)) {
+		list_remove(s, o);
+		list_push(s, ARC_T2, o);
+		return 1;
+	}
+	if (o && o->list == ARC_B1) {
+		/* T1 was too small for this file */
+		ratio = l[ARC_B1].bytes ? (double)l[ARC_B2].bytes /
+			l[ARC_B1].bytes : 1;
+		s->target = fmin(s->capacity,
+				 s->target + fmax(ratio, 1) * size);
+	} else if (o) {
+		/* T2 was too small for this file */
+		ratio = l[ARC_B2].bytes ? (double)l[ARC_B1].bytes /
+			l[ARC_B2].bytes : 1;
+		s->target = fmax(0, s->target - fmax(ratio, 1) * size);
+	}
+	if (o) {
+		/* a ghost comes back, to T2 */
+		list_remove(s, o);
+		o->size = size;
+		arc_replace(s, size, o->list == ARC_B2);
+		list_push(s, ARC_T2, o);
+	} else {
+		arc_replace(s, size, 0);
+		o = sim_add(s, id, size, pos);
+		list_push(s, ARC_T1, o);
+	}
+	s->used += size;
+	arc_trim(s);
+	return 0;
+}
+
+/* evict from the main segments of TinyLFU to make room for cand, which just
+ * left the window, if cand is more popular than the files it evicts */
+static void
+tinylfu_admit(struct sim *s, struct object *cand)
+{
+	struct object *victim;
+
+	while (s->used > s->capacity) {
+		victim = list_lru(s, TINY_PROBATION);
+		if (!victim)
+			victim = list_lru(s, TINY_PROTECTED);
+		if (!victim || sketch_estimate(victim->id) >=
+		    sketch_estimate(cand->id)) {
+			s->used -= cand->size;
+			sim_drop(s, cand);
+			return;
+		}
+		sim_evict_list(s, victim);
+	}
+	list_push(s, TINY_PROBATION, cand);
+}
+
+static int
+tinylfu_access(struct sim *s, int id, long size, long pos)
+{
+	long window = TINYLFU_WINDOW * s->capacity;
+	long protected = TINYLFU_PROTECTED * (s->capacity - window);
+	struct object *o;
+
+	if ((o = sim_find(s, id)) != NULL) {
+		list_remove(s, o);
+		if (o->list == TINY_WINDOW) {
+			list_push(s, TINY_WINDOW, o);
+			return 1;
+		}
+		list_push(s, TINY_PROTECTED, o);
+		while (s->lists[TINY_PROTECTED].bytes > protected) {
+			o = list_lru(s, TINY_PROTECTED);
+			list_remove(s, o);
+			list_push(s, TINY_PROBATION, o);
+		}
+		return 1;
+	}
+	o = sim_add(s, id, size, pos);
+	list_push(s, TINY_WINDOW, o);
+	s->used += size;
+	while (s->lists[TINY_WINDOW].bytes > window) {
+		o = list_lru(s, TINY_WINDOW);
+		list_remove(s, o);
+		tinylfu_admit(s, o);
+	}
+	return 0;
+}
+
+static struct sim *
+sim_init(enum policy policy, long capacity)
+{
+	struct sim *s = Malloc(sizeof(struct sim));
+	int i;
+
+	s->policy = policy;
+	s->capacity = capacity;
+	s->used = 0;
+	s->table = NULL;
+	s->nr_buckets = 0;
+	s->nr_objects = 0;
+	sim_resize(s, SIM_MIN_BUCKETS);
+	for (i = 0; i < NR_LISTS; i++) {
+		list_init(&s->lists[i]);
+	}
+	s->heap = NULL;
+	s->heap_size = 0;
+	s->heap_max = 0;
+	s->inflation = 0;
+	s->target = 0;
+	s->hits = 0;
+	s->bytes_hit = 0;
+	return s;
+}
+
+static void
+sim_destroy(struct sim *s)
+{
+	struct object *o, *next;
+	unsigned long i;
+
+	for (i = 0; i < s->nr_buckets; i++) {
+		for (o = s->table[i]; o; o = next) {
+			next = o->hash_next;
+			free(o);
+		}
+	}
+	free(s->table);
+	free(s->heap);
+	free(s);
+}
+
+/* give the request at pos of the trace to s */
+static void
+sim_access(struct sim *s, struct trace *t, long pos)
+{
+	long size = t->records[pos].size;
+	int id = t->ids[pos], hit;
+
+	if (size > s->capacity) {
+		/* too large to cache, it only changes the frequencies */
+		return;
+	}
+	switch (s->policy) {
+	case POLICY_FIFO:
+		hit = fifo_access(s, id, size, pos);
+		break;
+	case POLICY_LFU:
+	case POLICY_GDSF:
+		hit = heap_access(s, id, size, pos);
+		break;
+	case POLICY_ARC:
+		hit = arc_access(s, id, size, pos);
+		break;
+	case POLICY_TINYLFU:
+		hit = tinylfu_access(s, id, size, pos);
+		break;
+	default:
+		assert(0);
+	}
+	if (hit) {
+		s->hits++;
+		s->bytes_hit += size;
+	}
+}
+
+/* the LRU sizes that requests need to hit, by stack distance */
+struct distance {
+	long need;		/* bytes, LONG_MAX for the first request */
+	long size;
+};
+
+static int
+distance_cmp(const void *a, const void *b)
+{
+	const struct distance *x = a, *y = b;
+
+	return x->need < y->need ? -1 : x->need > y->need;
+}
+
+/* the stack distances of all the requests, sorted by need */
+static struct distance *
+lru_distances(struct trace *t)
+{
+	struct distance *d = Malloc(sizeof(struct distance) *
+				    (t->nr_records + 1));
+	long *tree = Malloc(sizeof(long) * (t->nr_records + 1));
+	long *last = Malloc(sizeof(long) * t->nr_files);
+	long *sizes = Malloc(sizeof(long) * t->nr_files);
+	long pos, i, above;
+	int id;
+
+	for (i = 0; i <= t->nr_records; i++) {
+		tree[i] = 0;
+	}
+	for (i = 0; i < t->nr_files; i++) {
+		last[i] = -1;
+	}
+	for (pos = 0; pos < t->nr_records; pos++) {
+		id = t->ids[pos];
+		d[pos].size = t->records[pos].size;
+		d[pos].need = LONG_MAX;
+		if (last[id] >= 0) {
+			/* the bytes of the files requested since, which are
+			 * at the positions after last[id] */
+			above = 0;
+			for (i = pos; i > 0; i -= i & -i) {
+				above += tree[i];
+			}
+			for (i = last[id] + 1; i > 0; i -= i & -i) {
+				above -= tree[i];
+			}
+			d[pos].need = above + d[pos].size;
+			for (i = last[id] + 1; i <= t->nr_records;
+			     i += i & -i) {
+				tree[i] -= sizes[id];
+			}
+		}
+		for (i = pos + 1; i <= t->nr_records; i += i & -i) {
+			tree[i] += d[pos].size;
+		}
+		last[id] = pos;
+		sizes[id] = d[pos].size;
+	}
+	qsort(d, t->nr_records, sizeof(struct distance), distance_cmp);
+	free(sizes);
+	free(last);
+	free(tree);
+	return d;
+}
+
+/* the LRU hits and byte hits at capacity, from the sorted distances d, and
+ * bytes, the sums of the sizes of the first i of them */
+static void
+lru_hits(struct trace *t, struct distance *d, long *bytes, long capacity,
+	 long *hits, long *bytes_hit)
+{
+	long lo = 0, hi = t->nr_records, mid;
+
+	/* the number of requests that need at most capacity bytes */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (d[mid].need <= capacity)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*hits = lo;
+	*bytes_hit = bytes[lo];
+}
+
+/* read the whole trace, numbering the files */
+static int
+trace_load(struct trace *t, const char *path)
+{
+	struct rtrace_record *r;
+	unsigned long nr_slots = 1, slot;
+	long max = 1 << 16, i;
+	uint64_t *keys;
+	int *slots;
+	FILE *f;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		perror(path);
+		return -1;
+	}
+	if (rtrace_check(f) < 0) {
+		fprintf(stderr, "%s: not a trace recorded by the server\n",
+			path);
+		fclose(f);
+		return -1;
+	}
+	t->records = Malloc(sizeof(struct rtrace_record) * max);
+	t->nr_records = 0;
+	while (fread(&t->records[t->nr_records], sizeof(struct rtrace_record),
+		     1, f) == 1) {
+		if (++t->nr_records == max) {
+			max *= 2;
+			t->records = realloc(t->records,
+					     sizeof(struct rtrace_record) * max);
+			assert(t->records);
+		}
+	}
+	fclose(f);
+
+	/* number the files with an open addressing table from hashes to
+	 * numbers, which is at most half full */
+	while (nr_slots < 2 * (unsigned long)t->nr_records) {
+		nr_slots *= 2;
+	}
+	keys = Malloc(sizeof(uint64_t) * nr_slots);
+	slots = Malloc(sizeof(int) * nr_slots);
+	for (slot = 0; slot < nr_slots; slot++) {
+		slots[slot] = -1;
+	}
+	t->ids = Malloc(sizeof(int) * (t->nr_records + 1));
+	t->nr_files = 0;
+	t->file_bytes = 0;
+	t->bytes = 0;
+	t->recorded_hits = 0;
+	for (i = 0; i < t->nr_records; i++) {
+		r = &t->records[i];
+		slot = mix(r->hash) & (nr_slots - 1);
+		while (slots[slot] >= 0 && keys[slot] != r->hash) {
+			slot = (slot + 1) & (nr_slots - 1);
+		}
+		if (slots[slot] < 0) {
+			keys[slot] = r->hash;
+			slots[slot] = t->nr_files++;
+			t->file_bytes += r->size;
+		}
+		t->ids[i] = slots[slot];
+		t->bytes += r->size;
+		if (r->flags & RTRACE_HIT)
+			t->recorded_hits++;
+	}
+	free(slots);
+	free(keys);
+	return 0;
+}
+
+/* parse a size, with an optional k, m or g suffix. returns -1 if it is not
+ * a size. */
+static long
+parse_size(const char *arg)
+{
+	char *end;
+	long size = strtol(arg, &end, 10);
+
+	switch (tolower(*end)) {
+	case 'k':
+		size <<= 10, end++;
+		break;
+	case 'm':
+		size <<= 20, end++;
+		break;
+	case 'g':
+		size <<= 30, end++;
+		break;
+	}
+	return *end || end == arg || size <= 0 ? -1 : size;
+}
+
+/* parse a comma-separated list of sizes into values */
+static int
+parse_sizes(char *arg, long *values)
+{
+	char *tok, *save;
+	int n = 0;
+
+	for (tok = strtok_r(arg, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (n == MAX_LIST || (values[n] = parse_size(tok)) < 0)
+			return -1;
+		n++;
+	}
+	return n > 0 ? n : -1;
+}
+
+/* parse a comma-separated list of policy names into enabled */
+static int
+parse_policies(char *arg, int *enabled)
+{
+	char *tok, *save;
+	int i;
+
+	for (i = 0; i < NR_POLICIES; i++) {
+		enabled[i] = 0;
+	}
+	for (tok = strtok_r(arg, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < NR_POLICIES; i++) {
+			if (strcmp(tok, policy_names[i]) == 0)
+				break;
+		}
+		if (i == NR_POLICIES)
+			return -1;
+		enabled[i] = 1;
+	}
+	return 0;
+}
+
+static void
+usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-p policies] [-c sizes] [-f text|csv] "
+		"trace\n"
+		"  -p  comma-separated policies to simulate, of lru, fifo,\n"
+		"      lfu, arc, gdsf and tinylfu (default: all of them)\n"
+		"  -c  comma-separated cache sizes in bytes, with an optional\n"
+		"      k, m or g suffix (default: %d sizes from 1/256 of the\n"
+		"      bytes of the files in the trace to all of them)\n"
+		"  -f  print a table (default), or csv for plotting\n",
+		program, NR_SIZES);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	long sizes[MAX_LIST], *bytes, hits, bytes_hit;
+	struct sim *sims[NR_POLICIES][MAX_LIST];
+	int enabled[NR_POLICIES] = { 1, 1, 1, 1, 1, 1 };
+	int nr_sizes = 0, csv = 0, c, i, k;
+	struct distance *d;
+	struct trace t;
+	long pos;
+
+	while ((c = getopt(argc, argv, "p:c:f:")) != -1) {
+		switch (c) {
+		case 'p':
+			if (parse_policies(optarg, enabled) < 0)
+				usage(argv[0]);
+			break;
+		case 'c':
+			if ((nr_sizes = parse_sizes(optarg, sizes)) < 0)
+				usage(argv[0]);
+			break;
+		case 'f':
+			if (strcmp(optarg, "csv") == 0)
+				csv = 1;
+			else if (strcmp(optarg, "text") != 0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1)
+		usage(argv[0]);
+	if (trace_load(&t, argv[optind]) < 0)
+		exit(1);
+	if (t.nr_records == 0) {
+		fprintf(stderr, "%s: the trace is empty\n", argv[optind]);
+		exit(1);
+	}
+	if (nr_sizes == 0) {
+		/* evenly spaced on a log scale */
+		for (nr_sizes = 0; nr_sizes < NR_SIZES; nr_sizes++) {
+			sizes[nr_sizes] = fmax(1, t.file_bytes * pow(256,
+				(double)(nr_sizes + 1) / NR_SIZES - 1));
+		}
+	}
+
+	/* one pass over the trace for the simulated policies */
+	if (enabled[POLICY_TINYLFU]) {
+		sketch.counters = Malloc((long)SKETCH_DEPTH * SKETCH_WIDTH);
+		memset(sketch.counters, 0, (long)SKETCH_DEPTH * SKETCH_WIDTH);
+		sketch.additions = 0;
+	}
+	for (i = 0; i < NR_POLICIES; i++) {
+		for (k = 0; enabled[i] && i != POLICY_LRU && k < nr_sizes;
+		     k++) {
+			sims[i][k] = sim_init(i, sizes[k]);
+		}
+	}
+	for (pos = 0; pos < t.nr_records; pos++) {
+		if (enabled[POLICY_TINYLFU])
+			sketch_add(t.ids[pos]);
+		for (i = 0; i < NR_POLICIES; i++) {
+			for (k = 0; enabled[i] && i != POLICY_LRU &&
+			     k < nr_sizes; k++) {
+				sim_access(sims[i][k], &t, pos);
+			}
+		}
+	}
+	/* and LRU at every size at once */
+	d = NULL;
+	bytes = NULL;
+	if (enabled[POLICY_LRU]) {
+		d = lru_distances(&t);
+		bytes = Malloc(sizeof(long) * (t.nr_records + 1));
+		bytes[0] = 0;
+		for (pos = 0; pos < t.nr_records; pos++) {
+			bytes[pos + 1] = bytes[pos] + d[pos].size;
+		}
+	}
+
+	if (csv) {
+		printf("policy,cache_size,hit_ratio,byte_hit_ratio\n");
+	} else {
+		printf("%ld requests of %d files, %ld bytes in the files, "
+		       "%.1f%% hits in the server\n", t.nr_records,
+		       t.nr_files, t.file_bytes,
+		       100.0 * t.recorded_hits / t.nr_records);
+		printf("%-8s %12s %9s %14s\n", "policy", "cache_size",
+		       "hit_ratio", "byte_hit_ratio");
+	}
+	for (i = 0; i < NR_POLICIES; i++) {
+		for (k = 0; enabled[i] && k < nr_sizes; k++) {
+			if (i == POLICY_LRU) {
+				lru_hits(&t, d, bytes, sizes[k], &hits,
+					 &bytes_hit);
+			} else {
+				hits = sims[i][k]->hits;
+				bytes_hit = sims[i][k]->bytes_hit;
+				sim_destroy(sims[i][k]);
+			}
+			printf(csv ? "%s,%ld,%.4f,%.4f\n" :
+			       "%-8s %12ld %9.4f %14.4f\n", policy_names[i],
+			       sizes[k], (double)hits / t.nr_records,
+			       t.bytes ? (double)bytes_hit / t.bytes : 0);
+		}
+	}
+	free(bytes);
+	free(d);
+	free(sketch.counters);
+	free(t.ids);
+	free(t.records);
+	exit(0);
+}
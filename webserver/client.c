@@ -1,40 +1,266 @@
 /*
  * client.c: A multi-threaded client for testing the HTTP server.
  * 
+ * Every request is timed from the start of its connect until the connection
+ * is established (connect), until the first byte of the response arrives
+ * (first_byte), and until the last byte arrives (latency). Each thread keeps
+ * its own histograms, which are merged at the end of the run. With -f, the
+ * client prints the throughput, the latency percentiles and the error counts
+ * in text, csv or json format.
+ *
+ * By default, the client is closed-loop: each thread sends its next request
+ * only after it has received the response to the previous one. With -c, the
+ * threads run event loops (see client_event.c) instead, which together keep
+ * the given number of non-blocking connections busy, so that many more
+ * concurrent clients can be simulated than with a thread each. With -r, the
+ * client is open-loop: the event loops start requests at the given rate no
+ * matter how many responses are outstanding.
+ *
+ * With -z, requests say that the client accepts gzip, and compressed
+ * responses are decompressed before they are checked. With -b, each request
+ * asks for a random byte range of the file instead of the whole file. With
+ * -e, each thread remembers the ETag of the files it got, and asks for them
+ * again with If-None-Match, so that the server can answer 304 Not Modified.
  */
 
-#include "common.h"
+#include "client.h"
+
+int
+client_format_request(struct client_thread *ct, struct fileinfo *fi,
+		      struct client_body *b, char *buf, int size)
+{
+	struct client *cl = ct->cl;
+	char range[MAXLINE] = "", match[MAXLINE] = "";
+	long len;
+
+	if (cl->range_size > 0 && fi->len > 0) {
+		b->range_start = erand48(ct->xsubi) * fi->len;
+		len = fi->len - b->range_start;
+		if (len > cl->range_size)
+			len = cl->range_size;
+		b->range_end = b->range_start + erand48(ct->xsubi) * len;
+		snprintf(range, MAXLINE, "Range: bytes=%ld-%ld\r\n",
+			 b->range_start, b->range_end);
+	}
+	if (ct->etags) {
+		b->etag_slot = &ct->etags[fi - cl->fileset];
+		if (*b->etag_slot) {
+			snprintf(match, MAXLINE, "If-None-Match: %s\r\n",
+				 *b->etag_slot);
+		}
+	}
+	/* create the request line, one request header line for the server
+	 * host, the optional headers, and then the empty line */
+	return snprintf(buf, size, "GET %s HTTP/1.0\r\nhost: %s\r\n%s%s%s"
+			"\r\n", fi->name, cl->host,
+			cl->gzip ? "Accept-Encoding: gzip\r\n" : "", range,
+			match);
+}
 
 /* send an HTTP request for the specified file */
 static void
-client_send(int fd, char *host, char *filename)
+client_send(int fd, struct client_thread *ct, struct fileinfo *fi,
+	    struct client_body *b)
 {
 	char buf[MAXLINE];
+	int n;
+
+	n = client_format_request(ct, fi, b, buf, MAXLINE);
+	Rio_write(fd, buf, n);
+}
+
+uint64_t
+client_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+client_body_init(struct client_body *b)
+{
+	b->status = 0;
+	b->etag[0] = 0;
+	b->etag_slot = NULL;
+	b->length = 0;
+	b->csum = 0;
+	b->has_csum = 0;
+	b->gzip = 0;
+	b->error = 0;
+	b->length_received = 0;
+	b->length_decoded = 0;
+	b->csum_received = 0;
+	b->range_start = -1;
+	b->range_end = -1;
+	b->content_start = -1;
+	b->content_end = -1;
+	b->content_size = -1;
+}
 
-	/* create the request line */
-	sprintf(buf, "GET %s HTTP/1.0\r\n", filename);
-	/* create one request header line for the server host, 
-	   and then the empty line */
-	sprintf(buf, "%shost: %s\r\n\r\n", buf, host);
-	Rio_write(fd, buf, strlen(buf));
+void
+client_body_header(struct client_body *b, char *line)
+{
+	if (sscanf(line, "HTTP/%*d.%*d %d", &b->status) == 1) {
+		/* found the status line */
+	}
+	if (sscanf(line, "ETag: %63s", b->etag) == 1) {
+		/* found etag tag */
+	}
+	if (sscanf(line, "Content-Length: %ld ", &b->length) == 1) {
+		/* found length tag */
+	}
+	if (sscanf(line, "Content-Csum: %u ", &b->csum) == 1) {
+		/* found csum tag */
+		b->has_csum = 1;
+	}
+	if (sscanf(line, "Content-Range: bytes %ld-%ld/%ld ", &b->content_start,
+		   &b->content_end, &b->content_size) == 3) {
+		/* found range tag */
+	}
+	if (strncasecmp(line, "Content-Encoding: gzip", 22) == 0 && !b->gzip) {
+		memset(&b->z, 0, sizeof(b->z));
+		/* 16 + MAX_WBITS expects a gzip header and trailer */
+		if (inflateInit2(&b->z, 16 + MAX_WBITS) != Z_OK)
+			b->error = 1;
+		b->gzip = 1;
+	}
 }
 
-/* read the HTTP response and print it out */
 static void
-client_print(int fd, unsigned int orig_csum, int orig_length, int print)
+client_body_decoded(struct client_body *b, unsigned char *buf, int n)
+{
+	int i;
+
+	b->length_decoded += n;
+	for (i = 0; i < n; i++) {
+		b->csum_received += buf[i];
+	}
+}
+
+void
+client_body_data(struct client_body *b, char *buf, int n)
+{
+	unsigned char out[16384];
+	int ret;
+
+	b->length_received += n;
+	if (!b->gzip) {
+		client_body_decoded(b, (unsigned char *)buf, n);
+		return;
+	}
+	if (b->error)
+		return;
+	b->z.next_in = (unsigned char *)buf;
+	b->z.avail_in = n;
+	do {
+		b->z.next_out = out;
+		b->z.avail_out = sizeof(out);
+		ret = inflate(&b->z, Z_NO_FLUSH);
+		if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+			b->error = 1;
+			return;
+		}
+		client_body_decoded(b, out, sizeof(out) - b->z.avail_out);
+	} while (b->z.avail_out == 0);
+}
+
+/* remember the ETag of a good response, for the next request of the file */
+static int
+client_body_done(struct client_body *b)
+{
+	if (b->etag_slot && b->etag[0] && b->status != 304) {
+		free(*b->etag_slot);
+		*b->etag_slot = strdup(b->etag);
+	}
+	return 0;
+}
+
+void
+client_body_free(struct client_body *b)
+{
+	/* inflateEnd does nothing on a stream that was ended already, or
+	 * that failed to start */
+	if (b->gzip)
+		inflateEnd(&b->z);
+}
+
+int
+client_body_verify(struct client_body *b, struct fileinfo *fi)
+{
+	int ok;
+
+	client_body_free(b);
+	if (b->status == 304) {
+		if (!b->etag_slot || !*b->etag_slot ||
+		    b->length_received != 0) {
+			fprintf(stderr, "bad response: %s: unexpected 304 Not "
+				"Modified\n", fi->name);
+			return -1;
+		}
+		return 0;
+	}
+	if (b->range_start >= 0) {
+		ok = !b->gzip && b->length == b->length_received &&
+			b->csum == b->csum_received &&
+			b->content_start == b->range_start &&
+			b->content_end == b->range_end &&
+			b->content_size == fi->len &&
+			b->length == b->range_end - b->range_start + 1;
+		if (!ok) {
+			fprintf(stderr, "bad response: %s: expected bytes "
+				"%ld-%ld/%ld, got bytes %ld-%ld/%ld, "
+				"length = %ld (%ld received), "
+				"csum = %u (%u received)\n",
+				fi->name, b->range_start, b->range_end, fi->len,
+				b->content_start, b->content_end,
+				b->content_size, b->length, b->length_received,
+				b->csum, b->csum_received);
+			return -1;
+		}
+		return client_body_done(b);
+	}
+	/* a file that the server streams may come without a checksum, and
+	 * is then only checked against the file set */
+	ok = fi->csum == b->csum_received && fi->len == b->length_decoded &&
+		b->length == b->length_received &&
+		(!b->has_csum || b->csum == b->csum_received);
+	if (b->gzip) {
+		ok = ok && !b->error;
+	} else {
+		ok = ok && fi->len == b->length;
+	}
+	if (!ok) {
+		fprintf(stderr, "bad response: %s: expected length = %ld, "
+			"csum = %u, got length = %ld (%ld received, %ld after "
+			"decompression%s), csum = %u (%u received)\n",
+			fi->name, fi->len, fi->csum, b->length,
+			b->length_received, b->length_decoded,
+			b->error ? ", corrupt" : "", b->csum,
+			b->csum_received);
+		return -1;
+	}
+	return client_body_done(b);
+}
+
+/* read the HTTP response and print it out. first_byte is set to the time at
+ * which the first line of the response was received. returns 0 if the
+ * response matches the file set, and -1 otherwise. */
+static int
+client_print(int fd, struct fileinfo *fi, struct client_body *b, int print,
+	     uint64_t *first_byte)
 {
 	struct rio *rio;
 	char buf[MAXBUF];
-	int i, n;
-	int length = 0;
-	int length_received = 0;
-	unsigned int csum = 0;
-	unsigned int csum_received = 0;
+	int n;
 	
 	rio = Rio_init(fd);
 
 	/* read and display the HTTP header */
 	n = Rio_readlineb(rio, buf, MAXBUF);
+	*first_byte = client_now();
+	client_body_header(b, buf);
 	while (strcmp(buf, "\r\n") && (n > 0)) {
 		if (print) {
 			printf("Header: %s", buf);
@@ -42,12 +268,7 @@ client_print(int fd, unsigned int orig_csum, int orig_length, int print)
 		n = Rio_readlineb(rio, buf, MAXBUF);
 
 		/* look for certain HTTP tags... */
-		if (sscanf(buf, "Content-Length: %d ", &length) == 1) {
-			/* found length tag */
-		}
-		if (sscanf(buf, "Content-Csum: %u ", &csum) == 1) {
-			/* found csum tag */
-		}
+		client_body_header(b, buf);
 	}
 
 	fflush(stdout);
@@ -57,135 +278,303 @@ client_print(int fd, unsigned int orig_csum, int orig_length, int print)
 		if (print) {
 			Rio_write(STDOUT_FILENO, buf, n);
 		}
-		length_received += n;
-		for (i = 0; i < n; i++) {
-			csum_received += (unsigned char)buf[i];
-		}
+		client_body_data(b, buf, n);
 	} while (n > 0);
+	Rio_destroy(rio);
+	return client_body_verify(b, fi);
+}
+
+static void
+client_stats_init(struct client_stats *st)
+{
+	histogram_init(&st->connect);
+	histogram_init(&st->first_byte);
+	histogram_init(&st->latency);
+	st->nr_requests = 0;
+	st->nr_errors = 0;
+	st->nr_connect_errors = 0;
+	st->bytes = 0;
+}
 
-	assert(orig_csum == csum);
-	assert(orig_length == length);
+/* record a correct response with body b that was started at start */
+void
+client_stats_record(struct client_stats *st, struct client_body *b,
+		    uint64_t start, uint64_t connected, uint64_t first_byte,
+		    uint64_t last_byte)
+{
+	histogram_record(&st->connect, connected - start);
+	histogram_record(&st->first_byte, first_byte - start);
+	histogram_record(&st->latency, last_byte - start);
+	st->nr_requests++;
+	st->bytes += b->length_decoded;
+}
 
-	assert(length == length_received);
-	assert(csum == csum_received);
-	Rio_destroy(rio);
+static void
+client_stats_merge(struct client_stats *dst, const struct client_stats *src)
+{
+	histogram_merge(&dst->connect, &src->connect);
+	histogram_merge(&dst->first_byte, &src->first_byte);
+	histogram_merge(&dst->latency, &src->latency);
+	dst->nr_requests += src->nr_requests;
+	dst->nr_errors += src->nr_errors;
+	dst->nr_connect_errors += src->nr_connect_errors;
+	dst->bytes += src->bytes;
 }
 
-struct fileinfo {
-	char *name;
-	unsigned int csum;
-	int len;
-};
+/* get a random file from the file set */
+struct fileinfo *
+client_pick_file(struct client_thread *ct)
+{
+	struct client *cl = ct->cl;
 
-struct client {
-	char *host;
-	int port;
-	int nr_times;
-	int nr_threads;
-	struct fileinfo *fileset;
-	int nr_files;
-	int timing_mode;
-};
+	/* we used to use a self similar distribution but that allowed
+	 * using simplistic caching policies. Now we use a uniform
+	 * distribution by default, and the others are selected with -d. */
+	return &cl->fileset[workload_next(&cl->workload, ct->xsubi)];
+}
 
 /* open a single connection to the specified host and port */
 static void *
 client_request(void *arg)
 {
-	struct client *cl = (struct client *)arg;
+	struct client_thread *ct = (struct client_thread *)arg;
+	struct client *cl = ct->cl;
+	struct client_stats *st = &ct->stats;
 	int clientfd;
 	int i;
 
 	for (i = 0; i < cl->nr_times; i++) {
-		int fnr;
-
-		clientfd = open_clientfd(cl->host, cl->port);
-		/* get a random file from the file set */
-		/* we used to use a self similar distribution but that allowed
-		 * using simplistic caching policies. Now we use a uniform
-		 * distribution. */
-		/* fnr = rand_self_similar_int(0.2, cl->nr_files); */
-		fnr = rand_int(cl->nr_files);		
-		fnr--;
+		struct fileinfo *fi;
+		struct client_body body;
+		uint64_t start, connected, first_byte, last_byte;
+
+		fi = client_pick_file(ct);
+		start = client_now();
+		clientfd = connect_clientfd(&cl->serveraddr);
+		if (clientfd < 0) {
+			st->nr_connect_errors++;
+			continue;
+		}
+		connected = client_now();
 		/* for debugging */
-		// fprintf(stderr, "requesting file: %s\n", 
-		// cl->fileset[fnr].name);
-		client_send(clientfd, cl->host, cl->fileset[fnr].name);
+		// fprintf(stderr, "requesting file: %s\n", fi->name);
+		client_body_init(&body);
+		client_send(clientfd, ct, fi, &body);
 		/* when timing_mode is 1, then don't print anything */
-		client_print(clientfd, cl->fileset[fnr].csum, 
-			     cl->fileset[fnr].len, (cl->timing_mode == 0));
+		if (client_print(clientfd, fi, &body, (cl->timing_mode == 0),
+				 &first_byte) < 0) {
+			st->nr_errors++;
+			SYS(close(clientfd));
+			continue;
+		}
+		last_byte = client_now();
 		SYS(close(clientfd));
+		client_stats_record(st, &body, start, connected, first_byte,
+				    last_byte);
 	}
 	return NULL;
 }
 
-static void
-usage(char *program)
-{
-	fprintf(stderr, "Usage: %s [-t] host port nr_times nr_threads fileset\n",
-		program);
-	exit(1);
-}
+static const char *metric_names[] = { "connect", "first_byte", "latency" };
+#define NR_METRICS 3
 
-/* filename should have a list of files to be requested, one per line */
+/* print the statistics of a run that took seconds, in format fmt */
 static void
-init_fileset(char *filename, struct client *cl)
+client_stats_print(FILE *out, const char *fmt, struct client_stats *st,
+		   double seconds)
 {
-	int i, n;
-	int fd;
-	struct rio *rio;
-	char buf[MAXLINE];
+	struct histogram *metrics[NR_METRICS] = {
+		&st->connect, &st->first_byte, &st->latency
+	};
+	long errors = st->nr_errors + st->nr_connect_errors;
+	double throughput = st->nr_requests / seconds;
+	int i;
 
-	/* read the index file for the fileset */
-	SYS(fd = open(filename, O_RDONLY, 0));
-	rio = Rio_init(fd);
-	i = 0;
-	while (1) {
-		struct fileinfo *fi;
-		n = Rio_readlineb(rio, buf, MAXLINE);
-		if (n == 0) {
-			assert(cl->nr_files > 0);
-			assert(i == cl->nr_files);
-			break;
+	if (strcmp(fmt, "csv") == 0) {
+		/* only write the header to an empty file, so that the results
+		 * of several runs can be appended to the same file */
+		if (ftell(out) <= 0) {
+			fprintf(out, "requests,errors,connect_errors,seconds,"
+				"throughput");
+			for (i = 0; i < NR_METRICS; i++) {
+				fprintf(out, ",%s_mean,%s_p50,%s_p90,%s_p99,"
+					"%s_p999,%s_max", metric_names[i],
+					metric_names[i], metric_names[i],
+					metric_names[i], metric_names[i],
+					metric_names[i]);
+			}
+			fprintf(out, "\n");
 		}
-		if (buf[n - 1] == '\n') {
-			n--;
+		fprintf(out, "%ld,%ld,%ld,%.6f,%.2f", st->nr_requests, errors,
+			st->nr_connect_errors, seconds, throughput);
+		for (i = 0; i < NR_METRICS; i++) {
+			struct histogram *h = metrics[i];
+			fprintf(out, ",%.1f,%.1f,%.1f,%.1f,%.1f,%.1f",
+				histogram_mean(h) / 1000,
+				histogram_percentile(h, 50) / 1000.0,
+				histogram_percentile(h, 90) / 1000.0,
+				histogram_percentile(h, 99) / 1000.0,
+				histogram_percentile(h, 99.9) / 1000.0,
+				h->max / 1000.0);
 		}
-		if (cl->nr_files == 0) {
-			cl->nr_files = atoi(buf);
-			assert(cl->nr_files > 0);
-			cl->fileset = Malloc(sizeof(struct fileinfo) * 
-					     cl->nr_files);
-			continue;
+		fprintf(out, "\n");
+	} else if (strcmp(fmt, "json") == 0) {
+		fprintf(out, "{\"requests\": %ld, \"errors\": %ld, "
+			"\"connect_errors\": %ld, \"seconds\": %.6f, "
+			"\"throughput\": %.2f", st->nr_requests, errors,
+			st->nr_connect_errors, seconds, throughput);
+		for (i = 0; i < NR_METRICS; i++) {
+			struct histogram *h = metrics[i];
+			fprintf(out, ", \"%s\": {\"mean\": %.1f, "
+				"\"p50\": %.1f, \"p90\": %.1f, "
+				"\"p99\": %.1f, \"p999\": %.1f, "
+				"\"max\": %.1f}", metric_names[i],
+				histogram_mean(h) / 1000,
+				histogram_percentile(h, 50) / 1000.0,
+				histogram_percentile(h, 90) / 1000.0,
+				histogram_percentile(h, 99) / 1000.0,
+				histogram_percentile(h, 99.9) / 1000.0,
+				h->max / 1000.0);
+		}
+		fprintf(out, "}\n");
+	} else {
+		fprintf(out, "requests = %ld, errors = %ld "
+			"(connect errors = %ld)\n", st->nr_requests, errors,
+			st->nr_connect_errors);
+		fprintf(out, "throughput = %.2f requests/second, "
+			"%.2f MB/second\n", throughput,
+			st->bytes / seconds / (1024 * 1024));
+		fprintf(out, "%-10s %10s %10s %10s %10s %10s %10s  (usec)\n",
+			"", "mean", "p50", "p90", "p99", "p99.9", "max");
+		for (i = 0; i < NR_METRICS; i++) {
+			struct histogram *h = metrics[i];
+			fprintf(out, "%-10s %10.1f %10.1f %10.1f %10.1f "
+				"%10.1f %10.1f\n", metric_names[i],
+				histogram_mean(h) / 1000,
+				histogram_percentile(h, 50) / 1000.0,
+				histogram_percentile(h, 90) / 1000.0,
+				histogram_percentile(h, 99) / 1000.0,
+				histogram_percentile(h, 99.9) / 1000.0,
+				h->max / 1000.0);
 		}
-		assert(i < cl->nr_files);
-		fi = &cl->fileset[i];
-		fi->name = Malloc(n + 1);
-		sscanf(buf, "%s %u %d", fi->name, &fi->csum, &fi->len);
-		i++;
 	}
-	Rio_destroy(rio);
-	SYS(close(fd));
+}
+
+static void
+usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-t] [-f text|csv|json] [-o file] "
+		"[-d workload] [-S seed] [-c concurrency] [-r rate] "
+		"[-a poisson|fixed|trace] [-z] [-b range_size] [-e] "
+		"host port nr_times nr_threads fileset\n"
+		"  -t  timing mode, only print the run time\n"
+		"  -f  print request statistics in this format\n"
+		"  -o  append the statistics to file instead of stdout\n"
+		"  -d  files to request: uniform (default), zipf:s,\n"
+		"      selfsimilar:a, hotset:f:p or trace:file (see workload.h)\n"
+		"  -S  random seed (default: 1), 0 for a random seed\n"
+		"  -c  closed-loop with concurrency connections, each sending\n"
+		"      nr_times requests, from nr_threads event loops\n"
+		"  -r  open-loop: start rate requests/second in total, from\n"
+		"      nr_threads event loops sending nr_times requests each\n"
+		"  -a  open-loop arrival process (default: poisson). trace\n"
+		"      sends requests at the times of a trace workload\n"
+		"  -z  accept gzip responses, and decompress them\n"
+		"  -b  ask for a random byte range of each file, of at most\n"
+		"      range_size bytes\n"
+		"  -e  ask for files again only if they changed, with the\n"
+		"      ETag of the last response (If-None-Match)\n",
+		program);
+	exit(1);
 }
 
 int
 main(int argc, char *argv[])
 {
-	int i;
+	int i, c;
 	char *filename;
-	pthread_t *threads;
+	char *stats_format = NULL;
+	char *stats_file = NULL;
+	char *workload = "uniform";
+	struct client_thread *threads;
+	struct client_stats stats;
 	struct client cl;
 	struct timeval start, end, diff;
+	double seconds;
 
-	if (argc != 6 && argc != 7) {
+	cl.timing_mode = 0;
+	cl.seed = 1;
+	cl.concurrency = 0;
+	cl.open_loop = 0;
+	cl.rate = 0;
+	cl.arrival = ARRIVAL_POISSON;
+	cl.gzip = 0;
+	cl.range_size = 0;
+	cl.revalidate = 0;
+	while ((c = getopt(argc, argv, "tf:o:d:S:c:r:a:zb:e")) != -1) {
+		switch (c) {
+		case 't':
+			cl.timing_mode = 1;
+			break;
+		case 'f':
+			stats_format = optarg;
+			break;
+		case 'o':
+			stats_file = optarg;
+			break;
+		case 'd':
+			workload = optarg;
+			break;
+		case 'S':
+			cl.seed = atol(optarg);
+			break;
+		case 'c':
+			cl.concurrency = atoi(optarg);
+			if (cl.concurrency <= 0)
+				usage(argv[0]);
+			break;
+		case 'r':
+			cl.rate = atof(optarg);
+			if (cl.rate <= 0)
+				usage(argv[0]);
+			cl.open_loop = 1;
+			break;
+		case 'a':
+			if (strcmp(optarg, "poisson") == 0)
+				cl.arrival = ARRIVAL_POISSON;
+			else if (strcmp(optarg, "fixed") == 0)
+				cl.arrival = ARRIVAL_FIXED;
+			else if (strcmp(optarg, "trace") == 0)
+				cl.arrival = ARRIVAL_TRACE;
+			else
+				usage(argv[0]);
+			break;
+		case 'z':
+			cl.gzip = 1;
+			break;
+		case 'b':
+			cl.range_size = atol(optarg);
+			if (cl.range_size <= 0)
+				usage(argv[0]);
+			break;
+		case 'e':
+			cl.revalidate = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 5) {
 		usage(argv[0]);
 	}
-	i = 1;
-	if (strcmp(argv[i], "-t") == 0) {
-		cl.timing_mode = 1;
-		i++;
-	} else {
-		cl.timing_mode = 0;
+	if (stats_file && !stats_format) {
+		stats_format = "text";
+	}
+	if (stats_format && strcmp(stats_format, "text") &&
+	    strcmp(stats_format, "csv") && strcmp(stats_format, "json")) {
+		usage(argv[0]);
 	}
+	i = optind;
 	cl.host = argv[i++];
 	cl.port = atoi(argv[i++]);
 	cl.nr_times = atoi(argv[i++]);
@@ -196,27 +585,99 @@ main(int argc, char *argv[])
 		usage(argv[0]);
 	}
 
-	init_fileset(filename, &cl);
+	cl.fileset = fileset_load(filename, &cl.nr_files);
+	if (workload_init(&cl.workload, workload, cl.fileset,
+			  cl.nr_files) < 0) {
+		usage(argv[0]);
+	}
+	if (cl.arrival == ARRIVAL_TRACE) {
+		if (cl.workload.type != WORKLOAD_TRACE) {
+			fprintf(stderr, "-a trace needs a trace workload\n");
+			usage(argv[0]);
+		}
+		cl.open_loop = 1;
+	} else if (!cl.open_loop && cl.arrival != ARRIVAL_POISSON) {
+		fprintf(stderr, "-a needs -r\n");
+		usage(argv[0]);
+	}
+	if (cl.open_loop && cl.concurrency > 0) {
+		fprintf(stderr, "-c is closed-loop, it can't be used with "
+			"-r or -a\n");
+		usage(argv[0]);
+	}
+	/* resolve the host once, rather than for every request */
+	resolve_host(cl.host, cl.port, &cl.serveraddr);
 
-	if (cl.timing_mode)
-		gettimeofday(&start, NULL);
+	gettimeofday(&start, NULL);
 
-	init_random();
+	if (cl.seed == 0) {
+		init_random();
+		cl.seed = random();
+	}
+	if (cl.open_loop || cl.concurrency > 0) {
+		client_event_init(&cl);
+	}
 
-	threads = Malloc(sizeof(pthread_t) * cl.nr_threads);
+	threads = Malloc(sizeof(struct client_thread) * cl.nr_threads);
 	for (i = 0; i < cl.nr_threads; i++) {
-		SYS(pthread_create(&threads[i], NULL, client_request,
-				   (void *)&cl));
+		threads[i].cl = &cl;
+		threads[i].index = i;
+		workload_seed(threads[i].xsubi, cl.seed, i);
+		threads[i].etags = NULL;
+		if (cl.revalidate) {
+			threads[i].etags = calloc(cl.nr_files, sizeof(char *));
+			assert(threads[i].etags);
+		}
+		client_stats_init(&threads[i].stats);
+		SYS(pthread_create(&threads[i].thread, NULL,
+				   (cl.open_loop || cl.concurrency > 0) ?
+				   client_event_loop : client_request,
+				   (void *)&threads[i]));
 	}
+	client_stats_init(&stats);
 	for (i = 0; i < cl.nr_threads; i++) {
-		pthread_join(threads[i], NULL);
+		pthread_join(threads[i].thread, NULL);
+		client_stats_merge(&stats, &threads[i].stats);
 	}
 
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &diff);
+	seconds = (double)diff.tv_sec + (double)diff.tv_usec / 1000000;
 	if (cl.timing_mode) {
-		gettimeofday(&end, NULL);
-		timersub(&end, &start, &diff);
-		printf("client runtime = %.6f seconds\n",
-			(float)diff.tv_sec + (float)diff.tv_usec / 1000000);
+		printf("client runtime = %.6f seconds\n", seconds);
+	}
+	if (stats_format) {
+		FILE *out = stdout;
+
+		if (stats_file) {
+			out = fopen(stats_file, "a");
+			if (!out) {
+				fprintf(stderr, "%s: %s\n", stats_file,
+					strerror(errno));
+				exit(1);
+			}
+		}
+		client_stats_print(out, stats_format, &stats, seconds);
+		if (stats_file) {
+			fclose(out);
+		}
+	}
+	for (i = 0; i < cl.nr_threads && cl.revalidate; i++) {
+		int j;
+
+		for (j = 0; j < cl.nr_files; j++) {
+			free(threads[i].etags[j]);
+		}
+		free(threads[i].etags);
+	}
+	free(threads);
+	workload_destroy(&cl.workload);
+	if (stats.nr_errors + stats.nr_connect_errors > 0) {
+		fprintf(stderr, "%ld of %ld requests failed\n",
+			stats.nr_errors + stats.nr_connect_errors,
+			stats.nr_requests + stats.nr_errors +
+			stats.nr_connect_errors);
+		exit(1);
 	}
 	exit(0);
 }
@@ -0,0 +1,107 @@
+#ifndef __CLIENT_H__
+#define __CLIENT_H__
+
+#include <zlib.h>
+#include "common.h"
+#include "histogram.h"
+#include "workload.h"
+
+/* how an open-loop client schedules its requests */
+enum arrival {
+	ARRIVAL_POISSON,	/* exponential gaps with mean 1/rate */
+	ARRIVAL_FIXED,		/* a request every 1/rate seconds */
+	ARRIVAL_TRACE,		/* at the times in the trace workload */
+};
+
+struct client {
+	char *host;
+	int port;
+	struct sockaddr_in serveraddr;
+	int nr_times;
+	int nr_threads;
+	struct fileinfo *fileset;
+	int nr_files;
+	int timing_mode;
+	struct workload workload;	/* which files are requested */
+	long seed;	/* random seed, the same seed gives the same requests */
+	int concurrency;	/* closed-loop connections of the event loops (-c) */
+	int open_loop;	/* requests are started by event loops (-r, -a) */
+	double rate;	/* open-loop requests/second */
+	enum arrival arrival;
+	int gzip;	/* send Accept-Encoding: gzip (-z) */
+	long range_size;	/* ask for random ranges of up to this (-b) */
+	int revalidate;	/* send the ETag of files seen before (-e) */
+};
+
+/* the body of a response, checked as it arrives. gzip bodies are
+ * decompressed, and the file set is checked against the decompressed
+ * bytes. */
+struct client_body {
+	int status;		/* of the response */
+	char etag[64];		/* ETag of the response, or "" */
+	/* with -e, the ETag the thread has for the file. it was sent in
+	 * If-None-Match if it is not NULL, and is replaced by a new one. */
+	char **etag_slot;
+	long length;		/* Content-Length of the response */
+	unsigned int csum;	/* Content-Csum of the response */
+	int has_csum;		/* it was sent, streamed files may have none */
+	int gzip;		/* Content-Encoding: gzip */
+	z_stream z;		/* decompresses gzip bodies */
+	int error;		/* the gzip data is corrupt */
+	long length_received;	/* bytes received */
+	long length_decoded;	/* bytes after decompression */
+	unsigned int csum_received;	/* of the decompressed bytes */
+	long range_start;	/* the range that was asked for, or -1 */
+	long range_end;
+	long content_start;	/* Content-Range of the response, or -1 */
+	long content_end;
+	long content_size;
+};
+
+/* request statistics, kept per thread and merged at the end of the run */
+struct client_stats {
+	struct histogram connect;	/* time to establish the connection */
+	struct histogram first_byte;	/* time to the first response byte */
+	struct histogram latency;	/* time to the last response byte */
+	long nr_requests;	/* requests that completed correctly */
+	long nr_errors;		/* bad or truncated responses */
+	long nr_connect_errors;	/* connections that could not be opened */
+	long bytes;		/* body bytes of correct responses */
+};
+
+struct client_thread {
+	struct client *cl;
+	int index;	/* thread number */
+	pthread_t thread;
+	unsigned short xsubi[3];	/* random state for erand48 */
+	char **etags;	/* with -e, the last ETag of each file */
+	struct client_stats stats;
+};
+
+/* client.c */
+uint64_t client_now(void);
+struct fileinfo *client_pick_file(struct client_thread *ct);
+void client_body_init(struct client_body *b);
+/* write the request of thread ct for fi into buf, and tell b what it asks
+ * for. returns the length of the request. */
+int client_format_request(struct client_thread *ct, struct fileinfo *fi,
+			  struct client_body *b, char *buf, int size);
+/* look for the headers of the body in a response header line */
+void client_body_header(struct client_body *b, char *line);
+void client_body_data(struct client_body *b, char *buf, int n);
+/* free what b holds, once the response is done with, whether or not it was
+ * verified */
+void client_body_free(struct client_body *b);
+/* check a complete body against fi, or against the range it asked for. the
+ * bytes of a range are only checked against its Content-Csum, and a 304 must
+ * answer an If-None-Match. returns 0 if it matches, and -1 otherwise. */
+int client_body_verify(struct client_body *b, struct fileinfo *fi);
+void client_stats_record(struct client_stats *st, struct client_body *b,
+			 uint64_t start, uint64_t connected,
+			 uint64_t first_byte, uint64_t last_byte);
+
+/* client_event.c */
+void client_event_init(struct client *cl);
+void *client_event_loop(void *arg);
+
+#endif /* __CLIENT_H__ */
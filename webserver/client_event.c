@@ -0,0 +1,422 @@
+/*
+ * client_event.c: An event-driven engine for the client.
+ *
+ * Each event loop thread drives many non-blocking connections with epoll, so
+ * that a few threads can keep thousands of requests outstanding. Every
+ * connection goes through the states below, and the response body is
+ * checksummed as it arrives, so no response is ever buffered whole.
+ *
+ * In closed-loop mode (-c), each event loop keeps a fixed number of requests
+ * outstanding, starting a new request as soon as one finishes, just like a
+ * fixed number of client threads would, but without a thread per connection.
+ *
+ * In open-loop mode, requests are started on a fixed or poisson schedule, or
+ * at the times recorded in a trace, whether or not earlier responses have
+ * arrived. All times are measured from the time at which a request was
+ * scheduled to be sent, not from when the loop got around to sending it, so a
+ * server that falls behind shows up as higher latency rather than as a lower
+ * request rate.
+ */
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include "client.h"
+
+#define MAX_EVENTS 256
+#define HEADER_SIZE 1024	/* max size of a response header */
+#define BODY_SIZE 65536		/* read size for response bodies */
+
+enum conn_state {
+	CONN_CONNECTING,	/* waiting for a non-blocking connect */
+	CONN_SENDING,		/* writing the request */
+	CONN_HEADER,		/* reading the response header */
+	CONN_BODY,		/* reading the response body */
+};
+
+struct conn {
+	int fd;
+	enum conn_state state;
+	struct fileinfo *fi;	/* file being requested */
+	uint64_t start;		/* time at which the request was scheduled */
+	uint64_t connected;
+	uint64_t first_byte;
+	char buf[HEADER_SIZE];	/* request, and then response header */
+	int len;		/* bytes in buf */
+	int sent;		/* bytes of the request sent so far */
+	struct client_body body;
+	struct conn *next;	/* free list */
+};
+
+struct event_loop {
+	struct client *cl;
+	struct client_thread *ct;
+	struct client_stats *st;
+	int epfd;
+	int timerfd;		/* fires when the next request is due */
+	int nr_clients;		/* closed-loop requests kept outstanding */
+	long nr_requests;	/* requests to start in total */
+	long nr_started;	/* requests started so far */
+	int nr_outstanding;	/* requests started but not finished */
+	uint64_t first_start;	/* time at which the loop started */
+	uint64_t next_start;	/* time at which the next request is due */
+	double interval;	/* mean time between requests, in ns */
+	struct conn *free_conns;
+	char body[BODY_SIZE];
+};
+
+/* allow as many connections as the hard limit on descriptors allows */
+void
+client_event_init(struct client *cl)
+{
+	struct rlimit rl;
+
+	SYS(getrlimit(RLIMIT_NOFILE, &rl));
+	rl.rlim_cur = rl.rlim_max;
+	SYS(setrlimit(RLIMIT_NOFILE, &rl));
+}
+
+static struct conn *
+conn_alloc(struct event_loop *el)
+{
+	struct conn *c = el->free_conns;
+
+	if (c) {
+		el->free_conns = c->next;
+	} else {
+		c = Malloc(sizeof(struct conn));
+	}
+	return c;
+}
+
+static void
+conn_free(struct event_loop *el, struct conn *c)
+{
+	c->next = el->free_conns;
+	el->free_conns = c;
+}
+
+/* closing the descriptor also removes it from the epoll set */
+static void
+conn_finish(struct event_loop *el, struct conn *c)
+{
+	client_body_free(&c->body);
+	SYS(close(c->fd));
+	el->nr_outstanding--;
+	conn_free(el, c);
+}
+
+static void
+conn_wait(struct event_loop *el, struct conn *c, int op, uint32_t events)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = c;
+	SYS(epoll_ctl(el->epfd, op, c->fd, &ev));
+}
+
+/* the trace entry of the n'th request of this loop. the loops take turns
+ * taking the entries of the trace. */
+static struct trace_entry
+event_loop_trace(struct event_loop *el, long n)
+{
+	return workload_trace(&el->cl->workload,
+			      el->ct->index + n * el->cl->nr_threads);
+}
+
+/* time at which the request after the current one is due */
+static uint64_t
+event_loop_next(struct event_loop *el)
+{
+	switch (el->cl->arrival) {
+	case ARRIVAL_FIXED:
+		return el->next_start + el->interval;
+	case ARRIVAL_POISSON:
+		/* exponentially distributed inter-arrival times */
+		return el->next_start +
+			-log(1 - erand48(el->ct->xsubi)) * el->interval;
+	case ARRIVAL_TRACE:
+		return el->first_start +
+			event_loop_trace(el, el->nr_started).time;
+	}
+	assert(0);
+	return 0;
+}
+
+static void
+event_loop_arm_timer(struct event_loop *el)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = el->next_start / 1000000000;
+	its.it_value.tv_nsec = el->next_start % 1000000000;
+	SYS(timerfd_settime(el->timerfd, TFD_TIMER_ABSTIME, &its, NULL));
+}
+
+static void conn_send(struct event_loop *el, struct conn *c);
+
+/* start a request for fi that was due at start */
+static void
+conn_start(struct event_loop *el, uint64_t start, struct fileinfo *fi)
+{
+	struct client *cl = el->cl;
+	struct conn *c;
+	int ret;
+
+	el->nr_started++;
+	c = conn_alloc(el);
+	c->fi = fi;
+	c->start = start;
+	client_body_init(&c->body);
+	c->len = client_format_request(el->ct, fi, &c->body, c->buf,
+				       HEADER_SIZE);
+	c->sent = 0;
+	SYS(c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0));
+	ret = connect(c->fd, (struct sockaddr *)&cl->serveraddr,
+		      sizeof(cl->serveraddr));
+	if (ret < 0 && errno != EINPROGRESS) {
+		el->st->nr_connect_errors++;
+		SYS(close(c->fd));
+		conn_free(el, c);
+		return;
+	}
+	el->nr_outstanding++;
+	if (ret == 0) {	/* loopback connects can complete right away */
+		c->connected = client_now();
+		c->state = CONN_SENDING;
+		conn_wait(el, c, EPOLL_CTL_ADD, EPOLLOUT);
+		conn_send(el, c);
+		return;
+	}
+	c->state = CONN_CONNECTING;
+	conn_wait(el, c, EPOLL_CTL_ADD, EPOLLOUT);
+}
+
+static void
+conn_connected(struct event_loop *el, struct conn *c)
+{
+	int err;
+	socklen_t len = sizeof(err);
+
+	SYS(getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len));
+	if (err) {
+		el->st->nr_connect_errors++;
+		conn_finish(el, c);
+		return;
+	}
+	c->connected = client_now();
+	c->state = CONN_SENDING;
+	conn_send(el, c);
+}
+
+static void
+conn_send(struct event_loop *el, struct conn *c)
+{
+	ssize_t n;
+
+	n = write(c->fd, c->buf + c->sent, c->len - c->sent);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		el->st->nr_errors++;
+		conn_finish(el, c);
+		return;
+	}
+	c->sent += n;
+	if (c->sent < c->len)
+		return;
+	c->state = CONN_HEADER;
+	c->len = 0;
+	conn_wait(el, c, EPOLL_CTL_MOD, EPOLLIN);
+}
+
+/* parse the header in c->buf, which ends at end, and checksum the part of
+ * the body that arrived with it */
+static void
+conn_header(struct conn *c, char *end)
+{
+	char *line, *eol;
+
+	for (line = c->buf; line < end; line = eol + 2) {
+		eol = strstr(line, "\r\n");
+		client_body_header(&c->body, line);
+	}
+	client_body_data(&c->body, end + 4, c->buf + c->len - (end + 4));
+	c->state = CONN_BODY;
+}
+
+static void
+conn_recv(struct event_loop *el, struct conn *c)
+{
+	ssize_t n;
+	char *end;
+
+	if (c->state == CONN_HEADER) {
+		n = read(c->fd, c->buf + c->len, HEADER_SIZE - 1 - c->len);
+	} else {
+		n = read(c->fd, el->body, BODY_SIZE);
+	}
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		el->st->nr_errors++;
+		conn_finish(el, c);
+		return;
+	}
+	if (n == 0) { /* the server closes the connection after the body */
+		uint64_t last_byte = client_now();
+
+		if (c->state != CONN_BODY ||
+		    client_body_verify(&c->body, c->fi) < 0) {
+			el->st->nr_errors++;
+		} else {
+			client_stats_record(el->st, &c->body, c->start,
+					    c->connected, c->first_byte,
+					    last_byte);
+		}
+		conn_finish(el, c);
+		return;
+	}
+	if (c->state == CONN_BODY) {
+		client_body_data(&c->body, el->body, n);
+		return;
+	}
+	if (c->len == 0) {
+		c->first_byte = client_now();
+	}
+	c->len += n;
+	c->buf[c->len] = 0;
+	end = strstr(c->buf, "\r\n\r\n");
+	if (end) {
+		conn_header(c, end);
+	} else if (c->len == HEADER_SIZE - 1) {
+		fprintf(stderr, "response header too long: %s\n", c->fi->name);
+		el->st->nr_errors++;
+		conn_finish(el, c);
+	}
+}
+
+/* start all the requests that are due, and arm the timer for the next one */
+static void
+event_loop_start_due(struct event_loop *el)
+{
+	struct client *cl = el->cl;
+	struct fileinfo *fi;
+	uint64_t now = client_now();
+
+	while (el->nr_started < el->nr_requests && el->next_start <= now) {
+		if (cl->arrival == ARRIVAL_TRACE) {
+			fi = &cl->fileset[event_loop_trace(el,
+					el->nr_started).file];
+		} else {
+			fi = client_pick_file(el->ct);
+		}
+		conn_start(el, el->next_start, fi);
+		el->next_start = event_loop_next(el);
+	}
+	if (el->nr_started < el->nr_requests) {
+		event_loop_arm_timer(el);
+	}
+}
+
+/* closed-loop: replace the requests that have finished */
+static void
+event_loop_refill(struct event_loop *el)
+{
+	while (el->nr_started < el->nr_requests &&
+	       el->nr_outstanding < el->nr_clients) {
+		conn_start(el, client_now(), client_pick_file(el->ct));
+	}
+}
+
+void *
+client_event_loop(void *arg)
+{
+	struct client_thread *ct = (struct client_thread *)arg;
+	struct client *cl = ct->cl;
+	struct epoll_event events[MAX_EVENTS];
+	struct epoll_event ev;
+	struct event_loop *el;
+	struct conn *c;
+	int i, n;
+
+	el = Malloc(sizeof(struct event_loop));
+	el->cl = cl;
+	el->ct = ct;
+	el->st = &ct->stats;
+	el->nr_started = 0;
+	el->nr_outstanding = 0;
+	el->free_conns = NULL;
+	/* the rate, or the connections, are split evenly between the event
+	 * loops */
+	if (cl->rate > 0) {
+		el->interval = 1e9 * cl->nr_threads / cl->rate;
+	}
+	if (cl->open_loop) {
+		el->nr_clients = 0;
+		el->nr_requests = cl->nr_times;
+	} else {
+		el->nr_clients = cl->concurrency / cl->nr_threads +
+			(ct->index < cl->concurrency % cl->nr_threads);
+		el->nr_requests = (long)el->nr_clients * cl->nr_times;
+	}
+	SYS(el->epfd = epoll_create1(0));
+	SYS(el->timerfd = timerfd_create(CLOCK_MONOTONIC, 0));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;	/* the timer is the only event without a conn */
+	SYS(epoll_ctl(el->epfd, EPOLL_CTL_ADD, el->timerfd, &ev));
+
+	el->first_start = client_now();
+	el->next_start = el->first_start;
+	if (!cl->open_loop) {
+		event_loop_refill(el);
+	} else {
+		if (cl->arrival == ARRIVAL_TRACE) {
+			el->next_start += event_loop_trace(el, 0).time;
+		}
+		event_loop_start_due(el);
+	}
+	while (el->nr_started < el->nr_requests || el->nr_outstanding > 0) {
+		n = epoll_wait(el->epfd, events, MAX_EVENTS, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		SYS(n);
+		for (i = 0; i < n; i++) {
+			c = events[i].data.ptr;
+			if (!c) {
+				uint64_t expirations;
+
+				SYS(read(el->timerfd, &expirations,
+					 sizeof(expirations)));
+				event_loop_start_due(el);
+				continue;
+			}
+			switch (c->state) {
+			case CONN_CONNECTING:
+				conn_connected(el, c);
+				break;
+			case CONN_SENDING:
+				conn_send(el, c);
+				break;
+			case CONN_HEADER:
+			case CONN_BODY:
+				conn_recv(el, c);
+				break;
+			}
+		}
+		if (!cl->open_loop) {
+			event_loop_refill(el);
+		}
+	}
+
+	SYS(close(el->timerfd));
+	SYS(close(el->epfd));
+	while ((c = el->free_conns) != NULL) {
+		el->free_conns = c->next;
+		free(c);
+	}
+	free(el);
+	return NULL;
+}
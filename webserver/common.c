@@ -32,6 +32,16 @@ Malloc(size_t size)
 
 #define RIO_BUFSIZE 8192
 
+static void
+rio_poll(int fd, int events)
+{
+	struct pollfd pfd = { fd, events, 0 };
+
+	poll(&pfd, 1, -1);
+}
+
+void (*rio_wait)(int fd, int events) = rio_poll;
+
 struct rio {
 	int rio_fd;	/* descriptor for this internal buf */
 	int rio_cnt;	/* unread bytes in internal buf */
@@ -72,7 +82,10 @@ rio_read(int fd, void *usrbuf, size_t n)
 		if ((nread = read(fd, bufp, nleft)) < 0) {
 			if (errno == EINTR)	/* interrupted by sig handler return */
 				nread = 0;	/* and call read() again */
-			else
+			else if (errno == EAGAIN) {	/* non-blocking fd */
+				rio_wait(fd, POLLIN);
+				nread = 0;
+			} else
 				return -1;	/* errno set by read() */
 		} else if (nread == 0)
 			break;	/* EOF */
@@ -94,7 +107,10 @@ rio_write(int fd, void *usrbuf, size_t n)
 		if ((nwritten = write(fd, bufp, nleft)) <= 0) {
 			if (errno == EINTR)	/* interrupted by sig handler return */
 				nwritten = 0;	/* and call write() again */
-			else
+			else if (errno == EAGAIN) {	/* non-blocking fd */
+				rio_wait(fd, POLLOUT);
+				nwritten = 0;
+			} else
 				return -1;	/* errorno set by write() */
 		}
 		nleft -= nwritten;
@@ -120,7 +136,9 @@ rio_readb(struct rio *rp, char *usrbuf, size_t n)
 		rp->rio_cnt = read(rp->rio_fd, rp->rio_buf,
 				   sizeof(rp->rio_buf));
 		if (rp->rio_cnt < 0) {
-			if (errno != EINTR)	/* interrupted by sig handler return */
+			if (errno == EAGAIN)	/* non-blocking fd */
+				rio_wait(rp->rio_fd, POLLIN);
+			else if (errno != EINTR)	/* interrupted by sig handler return */
 				return -1;
 		} else if (rp->rio_cnt == 0)	/* EOF */
 			return 0;
@@ -145,7 +163,8 @@ rio_readlineb(struct rio *rp, void *usrbuf, size_t maxlen)
 	int n, rc;
 	char c, *bufp = usrbuf;
 
-	for (n = 0; n < maxlen; n++) {
+	/* leave room for the terminating 0 */
+	for (n = 0; n < maxlen - 1; n++) {
 		if ((rc = rio_readb(rp, &c, 1)) == 1) {
 			*bufp++ = c;
 			if (c == '\n') {
@@ -212,20 +231,15 @@ Rio_readlineb(struct rio * rp, void *usrbuf, size_t maxlen)
 /******************************** 
  * Client/server helper functions
  ********************************/
-/* open connection to server at <hostname, port> and return a socket descriptor
- * ready for reading and writing. */
-int
-open_clientfd(char *hostname, int port)
+/* fill serveraddr with the address of <hostname, port> */
+void
+resolve_host(char *hostname, int port, struct sockaddr_in *serveraddr)
 {
-	int clientfd;
 	struct hostent *hp;
 	struct hostent hent;
 	size_t buf_len;
 	char* buf;
 	int rc, h_errno_local;
-	struct sockaddr_in serveraddr;
-
-	SYS(clientfd = socket(AF_INET, SOCK_STREAM, 0));
 
 	/* Fill in the server's IP address and port */
 	/* Loop is necessary to grow buffer if it's currently not big enough for
@@ -252,16 +266,45 @@ open_clientfd(char *hostname, int port)
 		exit(1);
 	}
 
-	bzero((char *)&serveraddr, sizeof(serveraddr));
-	serveraddr.sin_family = AF_INET;
+	bzero((char *)serveraddr, sizeof(*serveraddr));
+	serveraddr->sin_family = AF_INET;
 	bcopy((char *)hp->h_addr,
-	      (char *)&serveraddr.sin_addr.s_addr, hp->h_length);
+	      (char *)&serveraddr->sin_addr.s_addr, hp->h_length);
 	/* Documentation makes no mention of when buf is safe to be freed,
 	 * but it should be safe to free now since we're done with hp. */
 	free(buf);
-	serveraddr.sin_port = htons(port);
+	serveraddr->sin_port = htons(port);
+}
+
+/* open a connection to an address filled by resolve_host. unlike
+ * open_clientfd, returns -1 if the connection fails, so that callers can
+ * count failures instead of exiting. */
+int
+connect_clientfd(struct sockaddr_in *serveraddr)
+{
+	int clientfd;
+
+	SYS(clientfd = socket(AF_INET, SOCK_STREAM, 0));
+	if (connect(clientfd, (struct sockaddr *)serveraddr,
+		    sizeof(*serveraddr)) < 0) {
+		close(clientfd);
+		return -1;
+	}
+	return clientfd;
+}
+
+/* open connection to server at <hostname, port> and return a socket descriptor
+ * ready for reading and writing. */
+int
+open_clientfd(char *hostname, int port)
+{
+	int clientfd;
+	struct sockaddr_in serveraddr;
+
+	resolve_host(hostname, port, &serveraddr);
 
 	/* Establish a connection with the server */
+	SYS(clientfd = socket(AF_INET, SOCK_STREAM, 0));
 	SYS(connect(clientfd, (struct sockaddr *)&serveraddr,
 		    sizeof(serveraddr)));
 	return clientfd;
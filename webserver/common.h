@@ -68,6 +68,11 @@ void *Malloc(size_t size);
 /* Persistent state for the robust I/O (Rio) package */
 struct rio;
 
+/* wait until the non-blocking fd is ready for events (POLLIN or POLLOUT),
+ * when a Rio function would block on it. poll(2) by default, which a server
+ * with user-level threads replaces (see uthread.h). */
+extern void (*rio_wait)(int fd, int events);
+
 struct rio *Rio_init(int fd);
 void Rio_destroy(struct rio *rp);
 ssize_t Rio_read(int fd, void *usrbuf, size_t n);
@@ -76,6 +81,8 @@ ssize_t Rio_readlineb(struct rio *rp, void *usrbuf, size_t maxlen);
 
 /* Wrappers for client/server helper functions */
 int open_clientfd(char *hostname, int port);
+void resolve_host(char *hostname, int port, struct sockaddr_in *serveraddr);
+int connect_clientfd(struct sockaddr_in *serveraddr);
 int open_listenfd(int port);
 
 /* Random functions */
@@ -0,0 +1,103 @@
+/*
+ * histogram.c: log-linear latency histograms (see histogram.h).
+ */
+
+#include <string.h>
+#include "histogram.h"
+
+/* bucket index of value. values below HIST_SUB_BUCKETS are stored exactly,
+ * larger values are stored by exponent and the HIST_SUB_BITS bits below the
+ * most significant one. */
+static int
+histogram_index(uint64_t value)
+{
+	int exp;
+
+	if (value < HIST_SUB_BUCKETS)
+		return value;
+	exp = 63 - __builtin_clzll(value);
+	return (exp - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS +
+		((value >> (exp - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/* largest value that maps to bucket index */
+static uint64_t
+histogram_value(int index)
+{
+	int shift;
+	uint64_t low;
+
+	if (index < HIST_SUB_BUCKETS)
+		return index;
+	shift = index / HIST_SUB_BUCKETS - 1;
+	low = (uint64_t)(HIST_SUB_BUCKETS + index % HIST_SUB_BUCKETS) << shift;
+	return low + ((uint64_t)1 << shift) - 1;
+}
+
+void
+histogram_init(struct histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+void
+histogram_record(struct histogram *h, uint64_t value)
+{
+	h->buckets[histogram_index(value)]++;
+	h->count++;
+	h->sum += value;
+	if (value < h->min)
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+}
+
+void
+histogram_merge(struct histogram *dst, const struct histogram *src)
+{
+	int i;
+
+	for (i = 0; i < HIST_NR_BUCKETS; i++) {
+		dst->buckets[i] += src->buckets[i];
+	}
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+uint64_t
+histogram_percentile(const struct histogram *h, double p)
+{
+	uint64_t rank, seen = 0;
+	int i;
+
+	if (h->count == 0)
+		return 0;
+	/* rank of the value we are looking for, between 1 and count */
+	rank = (uint64_t)(p / 100 * h->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank > h->count)
+		rank = h->count;
+	for (i = 0; i < HIST_NR_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+	/* the bucket bound can overshoot the largest value recorded */
+	if (histogram_value(i) > h->max)
+		return h->max;
+	return histogram_value(i);
+}
+
+double
+histogram_mean(const struct histogram *h)
+{
+	if (h->count == 0)
+		return 0;
+	return (double)h->sum / h->count;
+}
@@ -0,0 +1,32 @@
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stdint.h>
+
+/*
+ * A log-linear (HDR-style) histogram of 64-bit values. Values are grouped by
+ * their power of two, and each power of two is split into HIST_SUB_BUCKETS
+ * linear sub-buckets, so any recorded value is reported with a relative error
+ * of at most 1 / HIST_SUB_BUCKETS, no matter how large it is. Recording is a
+ * few arithmetic instructions and never allocates.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_NR_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+struct histogram {
+	uint64_t count;	/* number of values recorded */
+	uint64_t sum;	/* sum of all values, for the mean */
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[HIST_NR_BUCKETS];
+};
+
+void histogram_init(struct histogram *h);
+void histogram_record(struct histogram *h, uint64_t value);
+void histogram_merge(struct histogram *dst, const struct histogram *src);
+/* p is a percentile between 0 and 100 */
+uint64_t histogram_percentile(const struct histogram *h, double p);
+double histogram_mean(const struct histogram *h);
+
+#endif /* __HISTOGRAM_H__ */
@@ -0,0 +1,361 @@
+/*
+ * logger.c: an asynchronous logger (see logger.h).
+ *
+ * Each thread has a ring buffer per stream, which it allocates the first time
+ * it logs to the stream. A ring has a single producer, its thread, and a
+ * single consumer, the logger thread, so it needs no lock: head and tail
+ * count the bytes ever appended and written, the thread only moves head and
+ * the logger thread only moves tail, and each publishes its moves with a
+ * release store. The buffer is empty when they are equal, and full when they
+ * are LOGGER_RING_SIZE apart.
+ *
+ * The logger thread sleeps while all the rings are empty. Otherwise it writes
+ * what the rings hold with one writev per stream, and then waits for up to
+ * LOGGER_INTERVAL for the rings to fill up some more, so that the batches are
+ * large when there is a lot to log. A thread wakes it up early when its ring
+ * gets half full. The lock only protects the list of rings and the sleeping
+ * of the logger thread, so a thread takes it once to add its ring, and then
+ * only to wake the logger thread up.
+ */
+
+#include <stdarg.h>
+#include <sys/uio.h>
+#include "common.h"
+#include "logger.h"
+
+#define LOGGER_RING_SIZE (128 * 1024)	/* bytes per thread and stream */
+#define LOGGER_INTERVAL 10000000	/* ns to let the rings fill up */
+#define LOGGER_IOVS 256	/* per writev, two per ring since rings wrap */
+
+struct logger_ring {
+	char *buf;
+	unsigned long head;	/* bytes appended, moved by the thread */
+	unsigned long tail;	/* bytes written, moved by the logger thread */
+	long dropped;		/* lines, only changed by the thread */
+	struct logger_ring *next;	/* rings of the stream */
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* signaled to wake the logger thread up */
+	struct logger_ring *rings[NR_LOGGER_STREAMS];
+	int fds[NR_LOGGER_STREAMS];
+	long dropped[NR_LOGGER_STREAMS];	/* by the rings freed so far */
+	unsigned long generation;	/* of logger_init calls */
+	int running;		/* the thread was started */
+	int idle;		/* the thread is waiting for lines */
+	int exiting;
+	pthread_t thread;
+} logger = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.fds = { STDOUT_FILENO, -1 },
+};
+
+/* the rings of the calling thread, valid while my_generation is the
+ * generation of the logger */
+static __thread struct logger_ring *my_rings[NR_LOGGER_STREAMS];
+static __thread unsigned long my_generation;
+
+/* write all of buf, giving up on errors since there is nowhere to report
+ * them */
+static void
+logger_write(int fd, const char *buf, size_t n)
+{
+	ssize_t ret;
+
+	while (n > 0) {
+		ret = write(fd, buf, n);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return;
+		buf += ret;
+		n -= ret;
+	}
+}
+
+/* write all of the nr buffers of iov, which it changes, as logger_write */
+static void
+logger_writev(int fd, struct iovec *iov, int nr)
+{
+	ssize_t ret;
+
+	while (nr > 0) {
+		ret = writev(fd, iov, nr);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return;
+		while (nr > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			nr--;
+		}
+		if (nr > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+}
+
+/* write the nr_iov buffers of the batch of nr rings of stream, which hold
+ * lines up to heads, and make the space free */
+static void
+logger_write_batch(enum logger_stream stream, struct iovec *iov, int nr_iov,
+		   struct logger_ring **batch, unsigned long *heads, int nr)
+{
+	int i;
+
+	if (logger.fds[stream] >= 0)
+		logger_writev(logger.fds[stream], iov, nr_iov);
+	for (i = 0; i < nr; i++) {
+		__atomic_store_n(&batch[i]->tail, heads[i], __ATOMIC_RELEASE);
+	}
+}
+
+/* write out what the rings of stream hold. returns the number of bytes. */
+static long
+logger_flush(enum logger_stream stream)
+{
+	struct iovec iov[LOGGER_IOVS];
+	struct logger_ring *batch[LOGGER_IOVS / 2], *r;
+	unsigned long heads[LOGGER_IOVS / 2], head, start, n;
+	long total = 0;
+	int nr_iov = 0, nr = 0;
+
+	/* rings are only added at the front of the list, and freed by
+	 * logger_exit, so the list can be walked without the lock */
+	pthread_mutex_lock(&logger.lock);
+	r = logger.rings[stream];
+	pthread_mutex_unlock(&logger.lock);
+	for (; r; r = r->next) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (head == r->tail)
+			continue;
+		/* write up to the end of the buffer, then from its start */
+		start = r->tail % LOGGER_RING_SIZE;
+		n = head - r->tail;
+		if (n > LOGGER_RING_SIZE - start) {
+			iov[nr_iov].iov_base = r->buf + start;
+			iov[nr_iov++].iov_len = LOGGER_RING_SIZE - start;
+			n -= LOGGER_RING_SIZE - start;
+			start = 0;
+		}
+		iov[nr_iov].iov_base = r->buf + start;
+		iov[nr_iov++].iov_len = n;
+		total += head - r->tail;
+		batch[nr] = r;
+		heads[nr++] = head;
+		if (nr == LOGGER_IOVS / 2) {
+			logger_write_batch(stream, iov, nr_iov, batch, heads,
+					   nr);
+			nr_iov = nr = 0;
+		}
+	}
+	if (nr > 0)
+		logger_write_batch(stream, iov, nr_iov, batch, heads, nr);
+	return total;
+}
+
+/* whether any ring has lines to write, with the lock held */
+static int
+logger_pending(void)
+{
+	struct logger_ring *r;
+	int s;
+
+	for (s = 0; s < NR_LOGGER_STREAMS; s++) {
+		for (r = logger.rings[s]; r; r = r->next) {
+			if (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) !=
+			    r->tail)
+				return 1;
+		}
+	}
+	return 0;
+}
+
+static void *
+logger_thread(void *arg)
+{
+	struct timespec deadline;
+	long n;
+	int s;
+
+	pthread_mutex_lock(&logger.lock);
+	while (1) {
+		pthread_mutex_unlock(&logger.lock);
+		for (n = 0, s = 0; s < NR_LOGGER_STREAMS; s++) {
+			n += logger_flush(s);
+		}
+		pthread_mutex_lock(&logger.lock);
+		if (n > 0 && !logger.exiting) {
+			/* let the next batch grow, unless a ring fills up */
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += LOGGER_INTERVAL;
+			if (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&logger.cond, &logger.lock,
+					       &deadline);
+			continue;
+		}
+		if (n > 0)
+			continue;
+		if (logger.exiting)
+			break;
+		/* the threads that append after this see idle, and the ones
+		 * that appended before it are seen by logger_pending */
+		__atomic_store_n(&logger.idle, 1, __ATOMIC_SEQ_CST);
+		if (!logger_pending())
+			pthread_cond_wait(&logger.cond, &logger.lock);
+		__atomic_store_n(&logger.idle, 0, __ATOMIC_SEQ_CST);
+	}
+	pthread_mutex_unlock(&logger.lock);
+	return NULL;
+}
+
+void
+logger_init(int fd, int access_fd)
+{
+	pthread_mutex_lock(&logger.lock);
+	assert(!logger.running);
+	logger.fds[LOGGER_MESSAGES] = fd;
+	logger.fds[LOGGER_ACCESS] = access_fd;
+	logger.generation++;
+	logger.idle = 0;
+	logger.exiting = 0;
+	__atomic_store_n(&logger.running, 1, __ATOMIC_RELEASE);
+	SYS(pthread_create(&logger.thread, NULL, logger_thread, NULL));
+	pthread_mutex_unlock(&logger.lock);
+}
+
+void
+logger_exit(void)
+{
+	struct logger_ring *r, *next;
+	int s;
+
+	pthread_mutex_lock(&logger.lock);
+	if (!logger.running) {
+		pthread_mutex_unlock(&logger.lock);
+		return;
+	}
+	logger.exiting = 1;
+	pthread_cond_signal(&logger.cond);
+	pthread_mutex_unlock(&logger.lock);
+	pthread_join(logger.thread, NULL);
+	pthread_mutex_lock(&logger.lock);
+	__atomic_store_n(&logger.running, 0, __ATOMIC_RELEASE);
+	for (s = 0; s < NR_LOGGER_STREAMS; s++) {
+		for (r = logger.rings[s]; r; r = next) {
+			next = r->next;
+			logger.dropped[s] += r->dropped;
+			free(r->buf);
+			free(r);
+		}
+		logger.rings[s] = NULL;
+	}
+	logger.fds[LOGGER_ACCESS] = -1;
+	pthread_mutex_unlock(&logger.lock);
+}
+
+/* the ring of the calling thread for stream */
+static struct logger_ring *
+logger_ring(enum logger_stream stream)
+{
+	struct logger_ring *r;
+	int s;
+
+	if (my_generation != logger.generation) {
+		/* the rings of an earlier logger_init were freed */
+		for (s = 0; s < NR_LOGGER_STREAMS; s++) {
+			my_rings[s] = NULL;
+		}
+		my_generation = logger.generation;
+	}
+	if ((r = my_rings[stream]) != NULL)
+		return r;
+	r = Malloc(sizeof(struct logger_ring));
+	r->buf = Malloc(LOGGER_RING_SIZE);
+	r->head = 0;
+	r->tail = 0;
+	r->dropped = 0;
+	pthread_mutex_lock(&logger.lock);
+	r->next = logger.rings[stream];
+	logger.rings[stream] = r;
+	pthread_mutex_unlock(&logger.lock);
+	return my_rings[stream] = r;
+}
+
+void
+logger_append(enum logger_stream stream, const char *line, int len)
+{
+	struct logger_ring *r;
+	unsigned long head, used, start, n;
+
+	if (!__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE)) {
+		if (stream == LOGGER_MESSAGES)
+			logger_write(logger.fds[stream], line, len);
+		return;
+	}
+	r = logger_ring(stream);
+	head = r->head;
+	used = head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	if (used + len > LOGGER_RING_SIZE) {
+		r->dropped++;
+		return;
+	}
+	start = head % LOGGER_RING_SIZE;
+	n = len < LOGGER_RING_SIZE - start ? len : LOGGER_RING_SIZE - start;
+	memcpy(r->buf + start, line, n);
+	memcpy(r->buf, line + n, len - n);
+	__atomic_store_n(&r->head, head + len, __ATOMIC_SEQ_CST);
+	/* wake the logger thread up if it sleeps, or if the ring got half
+	 * full */
+	if (__atomic_load_n(&logger.idle, __ATOMIC_SEQ_CST) ||
+	    (used <= LOGGER_RING_SIZE / 2 &&
+	     used + len > LOGGER_RING_SIZE / 2)) {
+		pthread_mutex_lock(&logger.lock);
+		pthread_cond_signal(&logger.cond);
+		pthread_mutex_unlock(&logger.lock);
+	}
+}
+
+void
+logger_printf(const char *fmt, ...)
+{
+	char msg[MAXLINE];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(msg, MAXLINE, fmt, ap);
+	va_end(ap);
+	if (len >= MAXLINE)
+		len = MAXLINE - 1;
+	logger_append(LOGGER_MESSAGES, msg, len);
+}
+
+int
+logger_enabled(enum logger_stream stream)
+{
+	return __atomic_load_n(&logger.running, __ATOMIC_ACQUIRE) ?
+		logger.fds[stream] >= 0 : stream == LOGGER_MESSAGES;
+}
+
+long
+logger_dropped(enum logger_stream stream)
+{
+	struct logger_ring *r;
+	long dropped;
+
+	pthread_mutex_lock(&logger.lock);
+	dropped = logger.dropped[stream];
+	for (r = logger.rings[stream]; r; r = r->next) {
+		dropped += r->dropped;
+	}
+	pthread_mutex_unlock(&logger.lock);
+	return dropped;
+}
@@ -0,0 +1,41 @@
+#ifndef __LOGGER_H__
+#define __LOGGER_H__
+
+/*
+ * An asynchronous logger. Each thread appends its lines to buffers of its
+ * own, without taking a lock, and a background thread writes the lines of
+ * all the threads out in large batches, so that the threads serving requests
+ * never wait for the output or for each other. When the buffer of a thread is
+ * full, its lines are dropped and counted rather than waited for. The lines
+ * of one thread are written in order, but the lines of different threads may
+ * be interleaved in any order.
+ *
+ * There are two streams: messages, such as the errors sent to clients, and
+ * the access log, which has a line for every response.
+ *
+ * Until logger_init is called, and after logger_exit, messages are written
+ * out right away, and access log lines are dropped without being counted.
+ */
+
+enum logger_stream {
+	LOGGER_MESSAGES,	/* logger_printf */
+	LOGGER_ACCESS,		/* see request_log */
+	NR_LOGGER_STREAMS
+};
+
+/* start writing messages to fd, and the access log to access_fd, or nowhere
+ * if access_fd is -1 */
+void logger_init(int fd, int access_fd);
+/* write out the lines that are left, and stop the logger thread. no other
+ * thread may log during this call. */
+void logger_exit(void);
+void logger_printf(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+/* append the line of len bytes to stream */
+void logger_append(enum logger_stream stream, const char *line, int len);
+/* whether lines appended to stream are written anywhere */
+int logger_enabled(enum logger_stream stream);
+/* the number of lines of stream dropped so far */
+long logger_dropped(enum logger_stream stream);
+
+#endif /* __LOGGER_H__ */
@@ -0,0 +1,480 @@
+/*
+ * prefetch.c: prefetching of likely-next files (see prefetch.h).
+ *
+ * Each file that was requested has a node in a hash table, which counts the
+ * files that were requested right after it. Only PREFETCH_SUCCESSORS of them
+ * are counted, with the Misra-Gries summary: a successor that is not counted
+ * takes a free slot, or, if there is none, every count is decremented, and
+ * the slots that drop to zero are freed. The successors that follow a file
+ * more than a fraction 1 / (PREFETCH_SUCCESSORS + 1) of the time are always
+ * counted, and their counts are within that fraction of the total.
+ *
+ * Requests come from many connections at once, so the successor of a file is
+ * simply the next file requested from the server. Successors that are just
+ * noise don't reach PREFETCH_MIN_SHARE of the requests after a file.
+ *
+ * The queue of files to read is a ring, and files that don't fit are
+ * dropped. The background thread polls while the disk is busy, like the
+ * compression thread of the cache polls while an entry is in use.
+ */
+
+#include "common.h"
+#include "prefetch.h"
+#include "request.h"
+
+#define PREFETCH_MIN_BUCKETS 64
+/* files kept in the table, whose successors are learned */
+#define PREFETCH_MAX_FILES 65536
+/* successors counted for each file */
+#define PREFETCH_SUCCESSORS 4
+/* hints kept for each file */
+#define PREFETCH_HINTS 8
+/* prefetch a successor only if it followed the file this often, and at
+ * least twice */
+#define PREFETCH_MIN_SHARE 0.25
+/* files queued for the background thread */
+#define PREFETCH_QUEUE 64
+/* a queued file that waited longer than this, in ns, is not read */
+#define PREFETCH_MAX_WAIT 100000000
+/* how long the background thread waits for the disk, in us */
+#define PREFETCH_POLL 1000
+
+struct node;
+
+struct successor {
+	struct node *node;	/* NULL if the slot is free */
+	long count;
+};
+
+/* a file that was requested, or named in the hints */
+struct node {
+	unsigned long hash;
+	struct node *next;	/* in its bucket */
+	long total;		/* requests that followed this file */
+	struct successor successors[PREFETCH_SUCCESSORS];
+	struct node *hints[PREFETCH_HINTS];
+	int nr_hints;
+	int queued;		/* waiting for the background thread */
+	long pending;		/* bytes prefetched and not requested since */
+	char name[];
+};
+
+struct prefetch {
+	struct cache *cache;
+	int depth;
+	int max_reads;
+	int reads;		/* requests reading from disk */
+	pthread_mutex_t lock;	/* protects everything below */
+	pthread_cond_t cond;	/* signaled when a file is queued */
+	struct node **table;
+	unsigned long nr_buckets;	/* a power of two */
+	long nr_nodes;
+	struct node *last;	/* the file requested last */
+	struct node *queue[PREFETCH_QUEUE];
+	uint64_t queued[PREFETCH_QUEUE];	/* prefetch_now() of each */
+	unsigned long head;	/* files queued */
+	unsigned long tail;	/* files taken off the queue */
+	int exiting;
+	pthread_t thread;
+	long issued;		/* files queued */
+	long dropped;		/* files that did not fit in the queue */
+	long late;		/* files that waited too long */
+	long cached;		/* files that were in the cache already */
+	long prefetched;	/* files read and inserted */
+	long prefetched_bytes;
+	long failed;		/* files that could not be read */
+	long used;		/* prefetched files that were then hit */
+	long evicted;		/* prefetched files that then missed */
+	long evicted_bytes;
+};
+
+static uint64_t
+prefetch_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned long
+prefetch_hash(const char *str)
+{
+	unsigned long hash = 5381;
+	int c;
+
+	while ((c = *str++))
+		hash = hash * 33 ^ c;
+	return hash;
+}
+
+static void
+prefetch_resize(struct prefetch *p, unsigned long nr_buckets)
+{
+	struct node **table, *n, *next;
+	unsigned long i;
+
+	table = Malloc(sizeof(struct node *) * nr_buckets);
+	for (i = 0; i < nr_buckets; i++) {
+		table[i] = NULL;
+	}
+	for (i = 0; i < p->nr_buckets; i++) {
+		for (n = p->table[i]; n; n = next) {
+			next = n->next;
+			n->next = table[n->hash & (nr_buckets - 1)];
+			table[n->hash & (nr_buckets - 1)] = n;
+		}
+	}
+	free(p->table);
+	p->table = table;
+	p->nr_buckets = nr_buckets;
+}
+
+/* the node of the file called name, which is added if it is new and create
+ * is set, or NULL. the lock must be held. */
+static struct node *
+prefetch_node(struct prefetch *p, const char *name, int create)
+{
+	unsigned long hash = prefetch_hash(name);
+	size_t len = strlen(name);
+	struct node *n;
+	int i;
+
+	for (n = p->table[hash & (p->nr_buckets - 1)]; n; n = n->next) {
+		if (n->hash == hash && strcmp(n->name, name) == 0)
+			return n;
+	}
+	if (!create || p->nr_nodes >= PREFETCH_MAX_FILES)
+		return NULL;
+	n = Malloc(sizeof(struct node) + len + 1);
+	n->hash = hash;
+	n->total = 0;
+	for (i = 0; i < PREFETCH_SUCCESSORS; i++) {
+		n->successors[i].node = NULL;
+		n->successors[i].count = 0;
+	}
+	n->nr_hints = 0;
+	n->queued = 0;
+	n->pending = 0;
+	memcpy(n->name, name, len + 1);
+	n->next = p->table[hash & (p->nr_buckets - 1)];
+	p->table[hash & (p->nr_buckets - 1)] = n;
+	p->nr_nodes++;
+	if (p->nr_nodes > p->nr_buckets)
+		prefetch_resize(p, p->nr_buckets * 2);
+	return n;
+}
+
+/* count next as a successor of n. the lock must be held. */
+static void
+prefetch_learn(struct node *n, struct node *next)
+{
+	struct successor *free = NULL;
+	int i;
+
+	n->total++;
+	for (i = 0; i < PREFETCH_SUCCESSORS; i++) {
+		if (n->successors[i].node == next) {
+			n->successors[i].count++;
+			return;
+		}
+		if (!n->successors[i].node && !free)
+			free = &n->successors[i];
+	}
+	if (free) {
+		free->node = next;
+		free->count = 1;
+		return;
+	}
+	for (i = 0; i < PREFETCH_SUCCESSORS; i++) {
+		if (--n->successors[i].count == 0)
+			n->successors[i].node = NULL;
+	}
+}
+
+/* queue n for the background thread. the lock must be held. */
+static void
+prefetch_queue(struct prefetch *p, struct node *n)
+{
+	/* it is queued, or was prefetched and not requested since */
+	if (n->queued || n->pending)
+		return;
+	p->issued++;
+	if (p->head - p->tail == PREFETCH_QUEUE) {
+		p->dropped++;
+		return;
+	}
+	p->queue[p->head % PREFETCH_QUEUE] = n;
+	p->queued[p->head % PREFETCH_QUEUE] = prefetch_now();
+	p->head++;
+	n->queued = 1;
+	pthread_cond_signal(&p->cond);
+}
+
+/* the successor that follows n most often, if it does often enough, or
+ * NULL. the lock must be held. */
+static struct node *
+prefetch_successor(struct node *n)
+{
+	struct successor *s, *best = NULL;
+	int i;
+
+	for (i = 0; i < PREFETCH_SUCCESSORS; i++) {
+		s = &n->successors[i];
+		if (s->node && (!best || s->count > best->count))
+			best = s;
+	}
+	if (!best || best->count < 2 ||
+	    best->count < PREFETCH_MIN_SHARE * n->total)
+		return NULL;
+	return best->node;
+}
+
+/* queue the files that are likely to be requested after n: its hints, and
+ * the chain of its most likely successors, up to depth files ahead, so that
+ * the files further ahead are read before they are needed. the lock must be
+ * held. */
+static void
+prefetch_predict(struct prefetch *p, struct node *n)
+{
+	struct node *next = n;
+	int i;
+
+	for (i = 0; i < n->nr_hints; i++) {
+		prefetch_queue(p, n->hints[i]);
+	}
+	for (i = 0; i < p->depth; i++) {
+		if ((next = prefetch_successor(next)) == NULL || next == n)
+			break;
+		prefetch_queue(p, next);
+	}
+}
+
+static void *
+prefetch_thread(void *arg)
+{
+	struct prefetch *p = (struct prefetch *)arg;
+	struct file_data *data;
+	struct node *n;
+	uint64_t queued;
+	long size;
+	int inserted;
+
+	pthread_mutex_lock(&p->lock);
+	while (1) {
+		while (p->head == p->tail && !p->exiting) {
+			pthread_cond_wait(&p->cond, &p->lock);
+		}
+		if (p->exiting)
+			break;
+		if (__atomic_load_n(&p->reads, __ATOMIC_RELAXED) >=
+		    p->max_reads) {
+			/* the disk is busy with requests */
+			pthread_mutex_unlock(&p->lock);
+			usleep(PREFETCH_POLL);
+			pthread_mutex_lock(&p->lock);
+			continue;
+		}
+		n = p->queue[p->tail % PREFETCH_QUEUE];
+		queued = p->queued[p->tail % PREFETCH_QUEUE];
+		p->tail++;
+		n->queued = 0;
+		if (prefetch_now() - queued > PREFETCH_MAX_WAIT) {
+			/* the request it was queued for is long gone */
+			p->late++;
+			continue;
+		}
+		pthread_mutex_unlock(&p->lock);
+
+		/* nodes are never freed while the thread runs */
+		if (cache_contains(p->cache, n->name)) {
+			pthread_mutex_lock(&p->lock);
+			p->cached++;
+			continue;
+		}
+		data = file_data_init();
+		data->file_name = strdup(n->name);
+		/* the file may change while it is read */
+		data->file_generation = cache_generation(p->cache, n->name);
+		if (!request_loadfile(data)) {
+			file_data_free(data);
+			pthread_mutex_lock(&p->lock);
+			p->failed++;
+			continue;
+		}
+		/* mark the file before it can be hit. the cache owns data
+		 * once it is inserted. */
+		size = data->file_size > 0 ? data->file_size : 1;
+		pthread_mutex_lock(&p->lock);
+		n->pending = size;
+		pthread_mutex_unlock(&p->lock);
+		inserted = cache_insert(p->cache, data) == 0;
+		pthread_mutex_lock(&p->lock);
+		if (!inserted) {
+			/* it was inserted by a request meanwhile, or did not
+			 * fit */
+			file_data_free(data);
+			n->pending = 0;
+			p->cached++;
+			continue;
+		}
+		p->prefetched++;
+		p->prefetched_bytes += size;
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/* the node of a file named in the hints file. the lock must be held. */
+static struct node *
+prefetch_hint_node(struct prefetch *p, const char *name)
+{
+	char path[MAXLINE];
+
+	/* as the server names the files it is asked for */
+	if (strncmp(name, "./", 2) == 0)
+		return prefetch_node(p, name, 1);
+	snprintf(path, MAXLINE, "./%s", name + strspn(name, "/"));
+	return prefetch_node(p, path, 1);
+}
+
+/* read the hints file. returns -1 if it can't be read. */
+static int
+prefetch_load_hints(struct prefetch *p, const char *hints)
+{
+	char line[MAXLINE], *name, *save;
+	struct node *n, *next;
+	FILE *f;
+
+	if ((f = fopen(hints, "r")) == NULL)
+		return -1;
+	while (fgets(line, MAXLINE, f)) {
+		if ((name = strtok_r(line, " \t\r\n", &save)) == NULL)
+			continue;
+		if ((n = prefetch_hint_node(p, name)) == NULL)
+			break;
+		while ((name = strtok_r(NULL, " \t\r\n", &save)) != NULL &&
+		       n->nr_hints < PREFETCH_HINTS) {
+			if ((next = prefetch_hint_node(p, name)) == NULL)
+				break;
+			n->hints[n->nr_hints++] = next;
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+struct prefetch *
+prefetch_init(struct cache *cache, const struct prefetch_config *config)
+{
+	struct prefetch *p;
+
+	p = Malloc(sizeof(struct prefetch));
+	memset(p, 0, sizeof(struct prefetch));
+	p->cache = cache;
+	p->depth = config->depth;
+	p->max_reads = config->max_reads > 0 ? config->max_reads : 1;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	prefetch_resize(p, PREFETCH_MIN_BUCKETS);
+	if (config->hints && prefetch_load_hints(p, config->hints) < 0) {
+		perror(config->hints);
+		p->exiting = 1;
+		prefetch_destroy(p);
+		return NULL;
+	}
+	SYS(pthread_create(&p->thread, NULL, prefetch_thread, p));
+	return p;
+}
+
+void
+prefetch_destroy(struct prefetch *p)
+{
+	struct node *n, *next;
+	unsigned long i;
+
+	pthread_mutex_lock(&p->lock);
+	if (!p->exiting) {
+		p->exiting = 1;
+		pthread_cond_signal(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+		pthread_join(p->thread, NULL);
+	} else {
+		pthread_mutex_unlock(&p->lock);
+	}
+	for (i = 0; i < p->nr_buckets; i++) {
+		for (n = p->table[i]; n; n = next) {
+			next = n->next;
+			free(n);
+		}
+	}
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+	free(p->table);
+	free(p);
+}
+
+void
+prefetch_access(struct prefetch *p, const char *name, int hit)
+{
+	struct node *n;
+
+	pthread_mutex_lock(&p->lock);
+	n = prefetch_node(p, name, 1);
+	if (n && n->pending) {
+		/* it was prefetched */
+		if (hit) {
+			p->used++;
+		} else {
+			p->evicted++;
+			p->evicted_bytes += n->pending;
+		}
+		n->pending = 0;
+	}
+	if (n && p->last)
+		prefetch_learn(p->last, n);
+	p->last = n;
+	if (n)
+		prefetch_predict(p, n);
+	pthread_mutex_unlock(&p->lock);
+}
+
+void
+prefetch_read_begin(struct prefetch *p)
+{
+	__atomic_add_fetch(&p->reads, 1, __ATOMIC_RELAXED);
+}
+
+void
+prefetch_read_end(struct prefetch *p)
+{
+	__atomic_sub_fetch(&p->reads, 1, __ATOMIC_RELAXED);
+}
+
+void
+prefetch_dump(struct prefetch *p, FILE *out)
+{
+	long unused = 0, unused_bytes = 0;
+	struct node *n;
+	unsigned long i;
+
+	pthread_mutex_lock(&p->lock);
+	for (i = 0; i < p->nr_buckets; i++) {
+		for (n = p->table[i]; n; n = n->next) {
+			if (n->pending) {
+				unused++;
+				unused_bytes += n->pending;
+			}
+		}
+	}
+	fprintf(out, "prefetch: %ld files queued, %ld dropped, %ld late, "
+		"%ld cached already, %ld not found, %ld prefetched in %ld "
+		"bytes\n", p->issued, p->dropped, p->late, p->cached,
+		p->failed, p->prefetched, p->prefetched_bytes);
+	fprintf(out, "prefetch accuracy: %.1f%% of the files used, %ld bytes "
+		"wasted (%ld files evicted before use, %ld not requested "
+		"yet)\n", p->prefetched ? 100.0 * p->used / p->prefetched : 0,
+		p->evicted_bytes + unused_bytes, p->evicted, unused);
+	pthread_mutex_unlock(&p->lock);
+	fflush(out);
+}
@@ -0,0 +1,56 @@
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include <stdio.h>
+#include "cache.h"
+
+/*
+ * A prefetcher, which loads the files that are likely to be requested next
+ * into a cache before they are requested.
+ *
+ * It learns which files follow each file in the stream of requests, and
+ * keeps the few most frequent successors of each file. When a file is
+ * requested, the files that are likely to follow it are queued, along with
+ * the files given for it in a hints file, and a background thread
+ * reads them from disk and inserts them into the cache. The thread only
+ * reads while few requests are reading from disk themselves, so that it uses
+ * the disk when it would be idle, and queued files that don't get their turn
+ * soon enough are dropped.
+ *
+ * A prefetched file is used if it is still in the cache when it is
+ * requested, and wasted if it is not, or if it was never requested. The
+ * dump reports both, so that the prefetcher can be tuned or disabled.
+ */
+
+struct prefetch;
+
+struct prefetch_config {
+	/* files to prefetch ahead of each requested file, following its most
+	 * likely successor, then the successor of that file, and so on, as
+	 * learned from the requests. 0 only prefetches the hints. */
+	int depth;
+	/* a file of lines "name next...", giving the files to prefetch after
+	 * name, or NULL. names are paths under the directory of the server,
+	 * as in the requests. */
+	const char *hints;
+	/* only read while fewer requests than this are reading from disk */
+	int max_reads;
+};
+
+/* prefetch into cache. returns NULL, after printing an error, if the hints
+ * file could not be read. */
+struct prefetch *prefetch_init(struct cache *cache,
+			       const struct prefetch_config *config);
+/* stop the background thread. files still queued are not read. */
+void prefetch_destroy(struct prefetch *p);
+
+/* the file called name was requested, and hit is set if it was cached */
+void prefetch_access(struct prefetch *p, const char *name, int hit);
+/* a request starts or stops reading a file from disk */
+void prefetch_read_begin(struct prefetch *p);
+void prefetch_read_end(struct prefetch *p);
+
+/* print the statistics of the prefetcher */
+void prefetch_dump(struct prefetch *p, FILE *out);
+
+#endif /* __PREFETCH_H__ */
@@ -1,67 +1,283 @@
 /*
  * request.c: Does the bulk of the work for the web server.
+ *
+ * Responses carry a strong ETag, made of the size, the checksum and the
+ * modification time of the file, and a Last-Modified header, so that clients
+ * can ask for a file only if it changed since they got it.
+ *
+ * Files that are too large to read into memory are streamed instead (see
+ * request_streamfile), so their size is only limited by the 64-bit sizes.
  */
 
+#define _GNU_SOURCE	/* for strptime and timegm */
+#include <aio.h>
 #include "common.h"
 #include "request.h"
+#include "stats.h"
+#include "logger.h"
+
+#define MAX_RANGES 16	/* more ranges than this get the whole file */
+/* separates the parts of a response with several ranges */
+#define BOUNDARY "OS_WEB_SERVER_BYTERANGES"
+#define ETAG_SIZE 64
+#define HTTP_DATE "%a, %d %b %Y %H:%M:%S GMT"
+#define STREAM_CHUNK (256 * 1024)	/* see request_streamfile */
+/* the time in the access log, as in the Common Log Format */
+#define LOG_DATE "[%d/%b/%Y:%H:%M:%S +0000]"
+
+/* a byte range, end included. before it is resolved, start is -1 for a
+ * suffix range of the last end bytes, and end is -1 for a range to the end
+ * of the file */
+struct range {
+	long start;
+	long end;
+};
+
+/* a piece of the body of a range response */
+struct slice {
+	int range;	/* index of the range */
+	char *buf;
+	long len;
+	int owned;	/* buf is freed by request_destroy */
+};
 
 struct request {
 	int fd;		 /* descriptor for client connection */
 	struct file_data *data;
+	int accept_gzip; /* the client takes Content-Encoding: gzip */
+	char *if_none_match;	/* the If-None-Match header, or NULL */
+	time_t if_modified_since;	/* If-Modified-Since, or -1 */
+	char *error_buf; /* the error response that was sent, or NULL */
+	int error_size;
+	int srcfd;	 /* the file, while chunks are read from it, or -1 */
+	int stat_done;	 /* request_statfile succeeded */
+	int disk_waited; /* request_disk_delay was added to the request */
+	int csum_done;	 /* data->file_csum is known, without data->file_buf */
+	int nr_ranges;	 /* ranges in the Range header, or 0 */
+	int resolved;	 /* ranges are resolved, nr_ranges may now be -1 */
+	struct range ranges[MAX_RANGES];
+	struct slice *slices;
+	int nr_slices;
+	int max_slices;
+	uint64_t started; /* when the request was read, in ns, for the access
+			   * log */
 };
 
-/* requestError(fd, filename, "404", "Not found", 
+int request_disk_delay = 10000;
+int (*request_stat)(const char *path, struct stat *sbuf) = stat;
+int (*request_usleep)(useconds_t usec) = usleep;
+int (*request_csum_lookup)(const char *path, long size, time_t mtime,
+			   unsigned int *csum) = NULL;
+void (*request_csum_store)(const char *path, long size, time_t mtime,
+			   unsigned int csum) = NULL;
+
+/* the date of the access log lines of the thread, formatted once a second */
+static __thread time_t log_time;
+static __thread char log_date[32];
+static __thread int log_date_len;
+
+/* append the decimal n to p, and return the end */
+static char *
+request_log_number(char *p, long n)
+{
+	char digits[24];
+	int i = 0;
+
+	if (n < 0) {
+		*p++ = '-';
+		n = -n;
+	}
+	do {
+		digits[i++] = '0' + n % 10;
+		n /= 10;
+	} while (n > 0);
+	while (i > 0)
+		*p++ = digits[--i];
+	return p;
+}
+
+/* add a line for the response to rq, with status and size bytes in all, to
+ * the access log. the line is in the Common Log Format, followed by the
+ * microseconds that the request took:
+ *
+ *	127.0.0.1 - - [19/Oct/2026:12:00:00 +0000] "GET /a HTTP/1.0" 200 5951 92
+ *
+ * it is put together by hand, without stdio, since it is done for every
+ * request. */
+static void
+request_log(struct request *rq, int status, long size)
+{
+	char line[MAXLINE], *p = line;
+	const char *name = rq->data->file_name;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	struct timespec ts;
+	struct tm tm;
+	long n;
+
+	if (!logger_enabled(LOGGER_ACCESS))
+		return;
+	if (getpeername(rq->fd, (struct sockaddr *)&addr, &addrlen) < 0 ||
+	    addr.sin_family != AF_INET ||
+	    !inet_ntop(AF_INET, &addr.sin_addr, p, INET_ADDRSTRLEN)) {
+		strcpy(p, "-");
+	}
+	p += strlen(p);
+	memcpy(p, " - - ", 5);
+	p += 5;
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	if (ts.tv_sec != log_time) {
+		log_time = ts.tv_sec;
+		gmtime_r(&log_time, &tm);
+		log_date_len = strftime(log_date, sizeof(log_date), LOG_DATE,
+					&tm);
+	}
+	memcpy(p, log_date, log_date_len);
+	p += log_date_len;
+	if (name) {	/* skip the . of the path */
+		memcpy(p, " \"GET ", 6);
+		p += 6;
+		n = strlen(name + 1);
+		if (n > MAXLINE - 128)
+			n = MAXLINE - 128;
+		memcpy(p, name + 1, n);
+		p += n;
+		memcpy(p, " HTTP/1.0\" ", 11);
+		p += 11;
+	} else {	/* the request was not understood */
+		memcpy(p, " \"-\" ", 5);
+		p += 5;
+	}
+	p = request_log_number(p, status);
+	*p++ = ' ';
+	p = request_log_number(p, size);
+	*p++ = ' ';
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	p = request_log_number(p, ((uint64_t)ts.tv_sec * 1000000000 +
+				   ts.tv_nsec - rq->started) / 1000);
+	*p++ = '\n';
+	logger_append(LOGGER_ACCESS, line, p - line);
+}
+
+/* request_error(rq, filename, "404", "Not found", 
  *		"OS server could not find this file");
+ *
+ * the whole response is put together first, and sent with a single write.
+ * rq keeps it, so that it can be cached (see request_error_data).
  */
 static void
-request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
+request_error(struct request *rq, char *cause, char *errnum, char *shortmsg,
+	      char *longmsg)
 {
-	char buf[MAXLINE], body[MAXBUF];
-	int i;
+	char body[MAXBUF], *buf;
+	int body_size, size, i;
 	unsigned int csum = 0;
 
 	/* create the body of the error message */
-	sprintf(body, "<html><title>OS Web Server Error</title>");
-	sprintf(body, "%s<body bgcolor=" "fffff" ">\r\n", body);
-	sprintf(body, "%s<p>%s: %s</p>\r\n", body, errnum, shortmsg);
-	sprintf(body, "%s<p>%s: %s</p>\r\n", body, longmsg, cause);
-	sprintf(body, "%s</body></html>\r\n", body);
-
-	/* write out the header information for this response */
-	sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
-
-	sprintf(buf, "Content-Type: text/html\r\n");
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
-
-	sprintf(buf, "Content-Length: %ld\r\n", strlen(body));
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+	body_size = snprintf(body, MAXBUF,
+			     "<html><title>OS Web Server Error</title>"
+			     "<body bgcolor=" "fffff" ">\r\n"
+			     "<p>%s: %s</p>\r\n"
+			     "<p>%s: %s</p>\r\n"
+			     "</body></html>\r\n",
+			     errnum, shortmsg, longmsg, cause);
+	if (body_size >= MAXBUF)
+		body_size = MAXBUF - 1;
 
 	/* generate a very trivial checksum */
-	for (i = 0; i < strlen(body); i++) {
+	for (i = 0; i < body_size; i++) {
 		csum += (unsigned char)(body[i]);
 	}
-	sprintf(buf, "Content-Csum: %u\r\n\r\n", csum);
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
 
-	/* write out the content */
-	Rio_write(fd, body, strlen(body));
-	printf("%s", body);
+	/* the header information, followed by the content */
+	buf = Malloc(MAXLINE + body_size);
+	size = snprintf(buf, MAXLINE, "HTTP/1.0 %s %s\r\n"
+			"Content-Type: text/html\r\n"
+			"Content-Length: %d\r\n"
+			"Content-Csum: %u\r\n\r\n",
+			errnum, shortmsg, body_size, csum);
+	memcpy(buf + size, body, body_size);
+	size += body_size;
+	Rio_write(rq->fd, buf, size);
+	logger_printf("%s %s: %s\n", errnum, shortmsg, cause);
+	request_log(rq, atoi(errnum), size);
+
+	free(rq->error_buf);
+	rq->error_buf = realloc(buf, size);
+	rq->error_size = size;
+}
 
+/* parse the value of a Range header, "bytes=" followed by a comma-separated
+ * list of ranges "first-last", "first-" or "-suffix_length". a header that is
+ * not valid is ignored, as if the client asked for the whole file. */
+static void
+request_parse_ranges(struct request *rq, char *spec)
+{
+	char *tok, *save, *p;
+	struct range *r;
+	int n = 0;
+
+	while (isspace(*spec))
+		spec++;
+	if (strncasecmp(spec, "bytes=", 6))
+		return;
+	for (tok = strtok_r(spec + 6, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (n == MAX_RANGES)
+			return;
+		r = &rq->ranges[n++];
+		p = tok;
+		while (isspace(*p))
+			p++;
+		r->start = -1;
+		r->end = -1;
+		if (isdigit(*p)) {
+			r->start = strtol(p, &p, 10);
+		}
+		if (*p++ != '-')
+			return;
+		if (isdigit(*p)) {
+			r->end = strtol(p, &p, 10);
+		}
+		while (isspace(*p))
+			p++;
+		if (*p || (r->start < 0 && r->end < 0) ||
+		    (r->start >= 0 && r->end >= 0 && r->end < r->start))
+			return;
+	}
+	rq->nr_ranges = n;
 }
 
-/* reads and discards everything up to an empty text line */
+/* reads everything up to an empty text line, and remembers the headers we
+ * care about in rq */
 static void
-request_read_headers(struct rio *rp)
+request_read_headers(struct rio *rp, struct request *rq)
 {
 	char buf[MAXLINE];
 
 	Rio_readlineb(rp, buf, MAXLINE);
 	while (strcmp(buf, "\r\n")) {
+		if (strncasecmp(buf, "Accept-Encoding:", 16) == 0 &&
+		    strstr(buf + 16, "gzip")) {
+			rq->accept_gzip = 1;
+		}
+		if (strncasecmp(buf, "Range:", 6) == 0) {
+			request_parse_ranges(rq, buf + 6);
+		}
+		if (strncasecmp(buf, "If-None-Match:", 14) == 0 &&
+		    !rq->if_none_match) {
+			rq->if_none_match = strdup(buf + 14);
+		}
+		if (strncasecmp(buf, "If-Modified-Since:", 18) == 0) {
+			struct tm tm;
+			char *p = buf + 18;
+
+			while (isspace(*p))
+				p++;
+			memset(&tm, 0, sizeof(tm));
+			if (strptime(p, HTTP_DATE, &tm))
+				rq->if_modified_since = timegm(&tm);
+		}
 		Rio_readlineb(rp, buf, MAXLINE);
 	}
 	return;
@@ -74,11 +290,33 @@ request_read_headers(struct rio *rp)
  * Adding the "./" means that files will only be served from the directory in
  * which the webserver is running.
  *
- * Also, we don't serve files with a .. in the path (see request_readfile). */
+ * Also, we don't serve files with a .. in the path (see request_readfile).
+ *
+ * The name is canonical: empty and "." components of the uri are dropped, so
+ * that "/a//./b" and "a/b" are both "./a/b". Each file then has a single name
+ * in the cache, which is also the name the watcher (see watch.h) uses. */
 static void
 request_parse_URI(char *uri, char *filename, size_t max)
 {
-	snprintf(filename, max, "./%s", uri);
+	char *p = uri, *out = filename, *end = filename + max - 1;
+
+	*out++ = '.';
+	while (*p) {
+		while (*p == '/')
+			p++;
+		if (p[0] == '.' && (p[1] == '/' || p[1] == 0)) {
+			p++;
+			continue;
+		}
+		if (*p && out < end)
+			*out++ = '/';
+		while (*p && *p != '/') {
+			if (out < end)
+				*out++ = *p;
+			p++;
+		}
+	}
+	*out = 0;
 }
 
 /* Fills in the filetype given the filename */
@@ -95,6 +333,33 @@ request_get_file_type(char *filename, char *filetype)
 		strcpy(filetype, "text/plain");
 }
 
+/* initialize file data */
+struct file_data *
+file_data_init(void)
+{
+	struct file_data *data;
+
+	data = Malloc(sizeof(struct file_data));
+	data->file_name = NULL;
+	data->file_buf = NULL;
+	data->file_size = 0;
+	data->file_csum = 0;
+	data->file_mtime = 0;
+	data->file_generation = 0;
+	data->gzip_buf = NULL;
+	data->gzip_size = 0;
+	return data;
+}
+
+void
+file_data_free(struct file_data *data)
+{
+	free(data->file_name);
+	free(data->file_buf);
+	free(data->gzip_buf);
+	free(data);
+}
+
 /* entry point to this file */
 /* returns a pointer to a request struct, filling rq->fd with connfd,
  * and rq->file_name with the file that is being requested.
@@ -111,23 +376,49 @@ request_init(int connfd, struct file_data *data)
 	rq = Malloc(sizeof(struct request));
 	rq->fd = connfd;
 	rq->data = data;
-	data->file_name = Malloc(MAXLINE);
+	rq->accept_gzip = 0;
+	rq->if_none_match = NULL;
+	rq->if_modified_since = -1;
+	rq->error_buf = NULL;
+	rq->error_size = 0;
+	rq->srcfd = -1;
+	rq->stat_done = 0;
+	rq->disk_waited = 0;
+	rq->csum_done = 0;
+	rq->nr_ranges = 0;
+	rq->resolved = 0;
+	rq->slices = NULL;
+	rq->nr_slices = 0;
+	rq->max_slices = 0;
+	rq->started = 0;
+	if (logger_enabled(LOGGER_ACCESS)) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		rq->started = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	}
+	data->file_name = NULL;
 	data->file_buf = NULL;
 	data->file_size = 0;
+	data->file_csum = 0;
+	data->file_mtime = 0;
 	rio = Rio_init(rq->fd);
 	Rio_readlineb(rio, buf, MAXLINE);
 	sscanf(buf, "%s %s %s", method, uri, version);
 
 	// printf("%s %s %s, fd = %d\n", method, uri, version, connfd);
 	if (strcasecmp(method, "GET")) {
-		request_error(rq->fd, method, "501", "Not Implemented",
+		request_error(rq, method, "501", "Not Implemented",
 			     "OS Web Server does not implement this method");
 		Rio_destroy(rio);
 		request_destroy(rq);
 		return NULL;
 	}
-	request_read_headers(rio);
-	request_parse_URI(uri, data->file_name, MAXLINE);
+	request_read_headers(rio, rq);
+	/* the name is kept as long as the file is cached, so don't waste a
+	 * MAXLINE buffer on it */
+	request_parse_URI(uri, buf, MAXLINE);
+	data->file_name = strdup(buf);
 	Rio_destroy(rio);
 	return rq;
 }
@@ -135,78 +426,262 @@ request_init(int connfd, struct file_data *data)
 void
 request_destroy(struct request *rq)
 {
+	int i;
+
 	assert(rq);
 	/* close the connection fd */
 	SYS(close(rq->fd));
+	if (rq->srcfd >= 0) {
+		SYS(close(rq->srcfd));
+	}
+	for (i = 0; i < rq->nr_slices; i++) {
+		if (rq->slices[i].owned)
+			free(rq->slices[i].buf);
+	}
+	free(rq->slices);
+	free(rq->if_none_match);
+	free(rq->error_buf);
 	free(rq);
 }
 
-/* read in filename corresponding to request. 
- * Returns 1 on success, and fills rq->file_buf, and rq->file_size.
- * Returns 0 on failure, sends error to client. */
-int
-request_readfile(struct request *rq)
+struct file_data *
+request_error_data(struct request *rq)
 {
-	int srcfd;
-	struct stat sbuf;
 	struct file_data *data;
-	char *ext;
 
-	data = rq->data;
-	assert(data);
+	if (!rq->error_buf)
+		return NULL;
+	data = file_data_init();
+	data->file_name = strdup(rq->data->file_name);
+	data->file_buf = rq->error_buf;
+	data->file_size = rq->error_size;
+	rq->error_buf = NULL;
+	return data;
+}
+
+void
+request_send_error(struct request *rq, struct file_data *error)
+{
+	char status[64];
+
+	Rio_write(rq->fd, error->file_buf, error->file_size);
+	/* log the status line, as request_error does */
+	if (sscanf(error->file_buf, "HTTP/%*d.%*d %63[^\r]", status) == 1) {
+		logger_printf("%s: %s\n", status, rq->data->file_name);
+		request_log(rq, atoi(status), error->file_size);
+	}
+}
+
+/* why the file called name is not served, or NULL if it is */
+static char *
+request_refused(const char *name)
+{
+	char *ext;
 
 	/* don't serve files that start with /, or .., or end in .c */
-	if (data->file_name[0] == '/') {
+	if (name[0] == '/') {
 		/* this shouldn't really happen because we add a "./" at the
 		 * beginning of the file path */
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server doesn't serve files "
-			      "with absolute paths");
-		return 0;
-	}
-	if (strstr(data->file_name, "..") != NULL) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server doesn't serve files "
-			      "with .. in the path");
-		return 0;
+		return "OS Web Server doesn't serve files with absolute paths";
 	}
-	if (((ext = strrchr(data->file_name, '.')) != NULL) && 
+	if (strstr(name, "..") != NULL)
+		return "OS Web Server doesn't serve files with .. in the path";
+	if (((ext = strrchr(name, '.')) != NULL) &&
 	    ((strcmp(ext, ".c") == 0) || (strcmp(ext, ".h") == 0))) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server doesn't serve C or header files ");
+		return "OS Web Server doesn't serve C or header files ";
+	}
+	return NULL;
+}
+
+/* check the file name, and fill in data->file_size.
+ * Returns 1 on success.
+ * Returns 0 on failure, sends error to client. */
+int
+request_statfile(struct request *rq)
+{
+	struct stat sbuf;
+	struct file_data *data;
+	char *refused;
+
+	data = rq->data;
+	assert(data);
+
+	if ((refused = request_refused(data->file_name)) != NULL) {
+		request_error(rq, data->file_name, "404", "Not found",
+			      refused);
 		return 0;
 	}
 
-	if (stat(data->file_name, &sbuf) < 0) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
+	if (request_stat(data->file_name, &sbuf) < 0) {
+		request_error(rq, data->file_name, "404", "Not found",
 			      "OS Web Server could not find this file");
 		return 0;
 	}
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-		request_error(rq->fd, data->file_name, "403", "Forbidden",
+		request_error(rq, data->file_name, "403", "Forbidden",
 			      "OS Web Server could not read this file");
 		return 0;
 	}
 
 	data->file_size = sbuf.st_size;
+	data->file_mtime = sbuf.st_mtime;
+	rq->stat_done = 1;
+	return 1;
+}
+
+/* we do this to simulate a slow disk, once per request that reads the file.
+ * otherwise, file caching doesn't have much benefit because a lot of the time
+ * is spent in processing (see request_processfile below) and so
+ * request_readfile does not have much impact. */
+static void
+request_disk_wait(struct request *rq)
+{
+	if (request_disk_delay > 0 && !rq->disk_waited)
+		request_usleep(request_disk_delay);
+	rq->disk_waited = 1;
+}
 
+/* read the data->file_size bytes of the file into data->file_buf */
+static void
+request_readdata(struct file_data *data)
+{
+	int srcfd;
+	long i;
+
+	SYS(srcfd = open(data->file_name, O_RDONLY, 0));
+	data->file_buf = Malloc(data->file_size);
+	Rio_read(srcfd, data->file_buf, data->file_size);
+	/* ask the kernel to stop caching the file */
+	SYS(posix_fadvise(srcfd, 0, data->file_size, POSIX_FADV_DONTNEED));
+	SYS(close(srcfd));
+	/* generate a very trivial checksum, once per file read, so that it is
+	 * cached along with the file */
+	for (i = 0; i < data->file_size; i++) {
+		data->file_csum += (unsigned char)(data->file_buf[i]);
+	}
+}
+
+/* read in filename corresponding to request. 
+ * Returns 1 on success, and fills rq->file_buf, rq->file_size and
+ * rq->file_csum.
+ * Returns 0 on failure, sends error to client. */
+int
+request_readfile(struct request *rq)
+{
+	struct file_data *data;
+
+	data = rq->data;
+	if (!rq->stat_done && !request_statfile(rq))
+		return 0;
 	if (data->file_size) {
-		SYS(srcfd = open(data->file_name, O_RDONLY, 0));
-		data->file_buf = Malloc(data->file_size);
-		Rio_read(srcfd, data->file_buf, data->file_size);
-		/* ask the kernel to stop caching the file */
-		SYS(posix_fadvise(srcfd, 0, data->file_size, 
-				  POSIX_FADV_DONTNEED));
-		SYS(close(srcfd));
-		/* we do this to simulate a slow disk. otherwise, file caching
-		 * doesn't have much benefit because a lot of the time is spent
-		 * in processing (see request_processfile below) and so
-		 * request_readfile does not have much impact. */
-		usleep(10000);
+		request_readdata(data);
+		request_disk_wait(rq);
+	}
+	return 1;
+}
+
+int
+request_loadfile(struct file_data *data)
+{
+	struct stat sbuf;
+
+	if (request_refused(data->file_name) ||
+	    request_stat(data->file_name, &sbuf) < 0 ||
+	    !S_ISREG(sbuf.st_mode) || !(S_IRUSR & sbuf.st_mode)) {
+		return 0;
+	}
+	data->file_size = sbuf.st_size;
+	data->file_mtime = sbuf.st_mtime;
+	if (data->file_size) {
+		request_readdata(data);
+		/* the same disk, without a request */
+		if (request_disk_delay > 0)
+			request_usleep(request_disk_delay);
 	}
 	return 1;
 }
 
+/* read len bytes at offset of the file into a new buffer */
+static char *
+request_pread(struct request *rq, long offset, long len)
+{
+	char *buf = Malloc(len > 0 ? len : 1);
+	ssize_t n;
+	long done;
+
+	if (rq->srcfd < 0) {
+		SYS(rq->srcfd = open(rq->data->file_name, O_RDONLY, 0));
+	}
+	for (done = 0; done < len; done += n) {
+		SYS(n = pread(rq->srcfd, buf + done, len - done,
+			      offset + done));
+		if (n == 0) {
+			/* the file shrank since it was stat'ed */
+			memset(buf + done, 0, len - done);
+			break;
+		}
+	}
+	SYS(posix_fadvise(rq->srcfd, offset, len, POSIX_FADV_DONTNEED));
+	request_disk_wait(rq);
+	return buf;
+}
+
+static void
+request_slice(struct request *rq, int i, char *buf, long len, int owned)
+{
+	struct slice *sl;
+
+	assert(i >= 0 && i < rq->nr_ranges);
+	if (rq->nr_slices == rq->max_slices) {
+		rq->max_slices = rq->max_slices ? rq->max_slices * 2 : 4;
+		rq->slices = realloc(rq->slices,
+				     sizeof(struct slice) * rq->max_slices);
+		assert(rq->slices);
+	}
+	sl = &rq->slices[rq->nr_slices++];
+	sl->range = i;
+	sl->buf = buf;
+	sl->len = len;
+	sl->owned = owned;
+}
+
+void
+request_add_slice(struct request *rq, int i, char *buf, long len)
+{
+	request_slice(rq, i, buf, len, 0);
+}
+
+/* read in only the ranges of the file that the client asked for.
+ * Returns 1 on success, and adds a slice for each range.
+ * Returns 0 on failure, sends error to client. */
+int
+request_readranges(struct request *rq)
+{
+	long start, len;
+	int i, nr_ranges;
+
+	if (!request_statfile(rq))
+		return 0;
+	/* a 304 needs only the metadata */
+	nr_ranges = request_not_modified(rq) ? 0 : request_nr_ranges(rq);
+	for (i = 0; i < nr_ranges; i++) {
+		request_range(rq, i, &start, &len);
+		request_slice(rq, i, request_pread(rq, start, len), len, 1);
+	}
+	return 1;
+}
+
+struct file_data *
+request_readchunk(struct request *rq, long offset, long len)
+{
+	struct file_data *data = file_data_init();
+
+	data->file_name = strdup(rq->data->file_name);
+	data->file_buf = request_pread(rq, offset, len);
+	data->file_size = len;
+	return data;
+}
+
 /* if you have previous file data, you can reuse it */
 void
 request_set_data(struct request *rq, struct file_data *data)
@@ -214,24 +689,275 @@ request_set_data(struct request *rq, struct file_data *data)
 	rq->data = data;
 }
 
+int
+request_accepts_gzip(struct request *rq)
+{
+	/* ranges are of the uncompressed file */
+	return rq->accept_gzip && rq->nr_ranges == 0;
+}
+
+/* the ETag of the response to rq in buf. returns 0 if there is none, because
+ * the checksum of the file is only known once the whole file was read. the
+ * gzip encoding of a file is a different representation, with its own ETag. */
+static int
+request_etag(struct request *rq, char *buf, size_t size)
+{
+	struct file_data *data = rq->data;
+
+	if (!data->file_buf && !data->gzip_buf && data->file_size > 0 &&
+	    !rq->csum_done)
+		return 0;
+	snprintf(buf, size, "\"%lx-%x-%lx%s\"", data->file_size,
+		 data->file_csum, (long)data->file_mtime,
+		 request_accepts_gzip(rq) && data->gzip_buf ? "-gz" : "");
+	return 1;
+}
+
+/* does the If-None-Match list contain etag? a list of "*" matches any file.
+ * weak tags (W/"...") match their strong counterparts, as they should for a
+ * GET. */
+static int
+request_etag_matches(char *list, char *etag)
+{
+	size_t len = strlen(etag);
+	char *p = list;
+
+	while (*p) {
+		while (isspace(*p) || *p == ',')
+			p++;
+		if (*p == '*')
+			return 1;
+		if (strncmp(p, "W/", 2) == 0)
+			p += 2;
+		if (strncmp(p, etag, len) == 0 &&
+		    (p[len] == 0 || p[len] == ',' || isspace(p[len])))
+			return 1;
+		while (*p && *p != ',')
+			p++;
+	}
+	return 0;
+}
+
+int
+request_not_modified(struct request *rq)
+{
+	char etag[ETAG_SIZE];
+
+	/* If-Modified-Since is ignored when If-None-Match is sent */
+	if (rq->if_none_match) {
+		return request_etag(rq, etag, ETAG_SIZE) &&
+			request_etag_matches(rq->if_none_match, etag);
+	}
+	return rq->if_modified_since >= 0 &&
+		rq->data->file_mtime <= rq->if_modified_since;
+}
+
+/* the ETag and Last-Modified lines of the response to rq */
+static size_t
+request_validators(struct request *rq, char *buf, size_t size)
+{
+	char etag[ETAG_SIZE], date[ETAG_SIZE];
+	struct tm tm;
+	size_t n = 0;
+
+	if (request_etag(rq, etag, ETAG_SIZE)) {
+		n += snprintf(buf + n, size - n, "ETag: %s\r\n", etag);
+	}
+	gmtime_r(&rq->data->file_mtime, &tm);
+	strftime(date, ETAG_SIZE, HTTP_DATE, &tm);
+	n += snprintf(buf + n, size - n, "Last-Modified: %s\r\n", date);
+	return n;
+}
+
+/* tell the client that its copy of the file is still good */
+static void
+request_send_not_modified(struct request *rq)
+{
+	char buf[MAXLINE];
+	size_t size = 0;
+
+	size += snprintf(buf + size, MAXLINE - size,
+			 "HTTP/1.0 304 Not Modified\r\n"
+			 "Server: OS Web Server\r\n");
+	size += request_validators(rq, buf + size, MAXLINE - size);
+	snprintf(buf + size, MAXLINE - size, "\r\n");
+	Rio_write(rq->fd, buf, strlen(buf));
+	request_log(rq, 304, strlen(buf));
+}
+
+int
+request_has_ranges(struct request *rq)
+{
+	return rq->nr_ranges != 0;
+}
+
+int
+request_nr_ranges(struct request *rq)
+{
+	long size = rq->data->file_size;
+	struct range *r;
+	int i, n = 0;
+
+	if (rq->resolved || rq->nr_ranges == 0)
+		return rq->nr_ranges;
+	rq->resolved = 1;
+	/* clamp the ranges to the file, and drop the ones outside it */
+	for (i = 0; i < rq->nr_ranges; i++) {
+		r = &rq->ranges[i];
+		if (r->start < 0) {
+			/* no suffix is in an empty file */
+			if (r->end == 0 || size == 0)
+				continue;
+			r->start = r->end < size ? size - r->end : 0;
+			r->end = size - 1;
+		} else if (r->start >= size) {
+			continue;
+		} else if (r->end < 0 || r->end >= size) {
+			r->end = size - 1;
+		}
+		rq->ranges[n++] = *r;
+	}
+	rq->nr_ranges = n > 0 ? n : -1;
+	return rq->nr_ranges;
+}
+
+void
+request_range(struct request *rq, int i, long *start, long *len)
+{
+	assert(rq->resolved && i >= 0 && i < rq->nr_ranges);
+	*start = rq->ranges[i].start;
+	*len = rq->ranges[i].end - rq->ranges[i].start + 1;
+}
+
 /* process file, the main reason for this function is that if we don't do enough
  * processing on the file, the network becomes the bottleneck, and then the
  * various server parameters have no affect on server performance. this is a
  * problem because we have 100 Mb/s network. With faster networks, we wouldn't
- * have to do this artificial work. */
+ * have to do this artificial work. the work is done on the body that is
+ * sent, which is the compressed file for gzip responses. */
 static void
-request_processfile(struct request *rq)
+request_processfile(char *body, long size)
 {
-	struct file_data *data;
-	int i, j, dummy;
-	data = rq->data;
-	assert(data);
+	long i, j;
+	int dummy;
 
 	for (i = 0; i < 128; i++) {
-		for (j = 0; j < data->file_size; j++) {
-			dummy += (unsigned char)(data->file_buf[j]);
+		for (j = 0; j < size; j++) {
+			dummy += (unsigned char)(body[j]);
+		}
+	}
+}
+
+/* tell the client that none of its ranges are in the file */
+static void
+request_send_unsatisfiable(struct request *rq)
+{
+	char buf[MAXLINE];
+
+	snprintf(buf, MAXLINE, "HTTP/1.0 416 Range Not Satisfiable\r\n"
+		 "Server: OS Web Server\r\n"
+		 "Content-Range: bytes */%ld\r\n"
+		 "Content-Length: 0\r\n"
+		 "Content-Csum: 0\r\n\r\n", rq->data->file_size);
+	Rio_write(rq->fd, buf, strlen(buf));
+	request_log(rq, 416, strlen(buf));
+}
+
+static unsigned int
+request_csum(char *buf, long len)
+{
+	unsigned int csum = 0;
+	long i;
+
+	for (i = 0; i < len; i++) {
+		csum += (unsigned char)buf[i];
+	}
+	return csum;
+}
+
+/* send the ranges of the file in a 206 response. a single range is sent as
+ * is, and several ranges as the parts of a multipart/byteranges body, each
+ * with its own headers. the checksum is that of the body as sent. */
+static void
+request_sendranges(struct request *rq, char *filetype)
+{
+	struct file_data *data = rq->data;
+	int nr_ranges = rq->nr_ranges;
+	char buf[MAXBUF], *parts = NULL, *part;
+	char *tail = "\r\n--" BOUNDARY "--\r\n";
+	long start, len, body_size = 0;
+	unsigned int csum = 0;
+	size_t size = 0;
+	uint64_t now;
+	int i, prev;
+
+	now = stats_now();
+	if (rq->nr_slices == 0) {
+		/* the whole file is in memory */
+		assert(data->file_buf);
+		for (i = 0; i < nr_ranges; i++) {
+			request_range(rq, i, &start, &len);
+			request_add_slice(rq, i, data->file_buf + start, len);
 		}
 	}
+	for (i = 0; i < rq->nr_slices; i++) {
+		request_processfile(rq->slices[i].buf, rq->slices[i].len);
+		csum += request_csum(rq->slices[i].buf, rq->slices[i].len);
+		body_size += rq->slices[i].len;
+	}
+	if (nr_ranges > 1) {
+		parts = Malloc(MAXLINE * nr_ranges);
+		for (i = 0; i < nr_ranges; i++) {
+			part = parts + i * MAXLINE;
+			request_range(rq, i, &start, &len);
+			snprintf(part, MAXLINE, "\r\n--" BOUNDARY "\r\n"
+				 "Content-Type: %s\r\n"
+				 "Content-Range: bytes %ld-%ld/%ld\r\n\r\n",
+				 filetype, start, start + len - 1,
+				 data->file_size);
+			csum += request_csum(part, strlen(part));
+			body_size += strlen(part);
+		}
+		csum += request_csum(tail, strlen(tail));
+		body_size += strlen(tail);
+	}
+	stats_record(PHASE_PROCESS, stats_now() - now);
+
+	size += snprintf(buf + size, MAXBUF - size,
+			 "HTTP/1.0 206 Partial Content\r\n"
+			 "Server: OS Web Server\r\n");
+	if (nr_ranges > 1) {
+		size += snprintf(buf + size, MAXBUF - size, "Content-Type: "
+				 "multipart/byteranges; boundary=" BOUNDARY
+				 "\r\n");
+	} else {
+		request_range(rq, 0, &start, &len);
+		size += snprintf(buf + size, MAXBUF - size,
+				 "Content-Type: %s\r\n"
+				 "Content-Range: bytes %ld-%ld/%ld\r\n",
+				 filetype, start, start + len - 1,
+				 data->file_size);
+	}
+	size += request_validators(rq, buf + size, MAXBUF - size);
+	size += snprintf(buf + size, MAXBUF - size, "Content-Length: %ld\r\n"
+			 "Content-Csum: %u\r\n\r\n", body_size, csum);
+
+	now = stats_now();
+	Rio_write(rq->fd, buf, strlen(buf));
+	for (i = 0, prev = -1; i < rq->nr_slices; i++) {
+		if (nr_ranges > 1 && rq->slices[i].range != prev) {
+			part = parts + rq->slices[i].range * MAXLINE;
+			Rio_write(rq->fd, part, strlen(part));
+			prev = rq->slices[i].range;
+		}
+		Rio_write(rq->fd, rq->slices[i].buf, rq->slices[i].len);
+	}
+	if (nr_ranges > 1) {
+		Rio_write(rq->fd, tail, strlen(tail));
+	}
+	stats_record(PHASE_WRITE, stats_now() - now);
+	request_log(rq, 206, size + body_size);
+	free(parts);
 }
 
 /* send filename to the fd connection */
@@ -239,32 +965,213 @@ void
 request_sendfile(struct request *rq)
 {
 	char filetype[MAXLINE], buf[MAXBUF];
-	int i;
-	unsigned int csum = 0;
 	struct file_data *data;
+	char *body, *encoding = "";
+	long body_size;
 	long size = 0;
+	uint64_t start;
 
 	data = rq->data;
 	assert(data);
 
+	/* conditions are checked before ranges, and need only metadata */
+	if (request_not_modified(rq)) {
+		request_send_not_modified(rq);
+		return;
+	}
 	request_get_file_type(data->file_name, filetype);
-	/* generate a very trivial checksum */
-	for (i = 0; i < data->file_size; i++) {
-		csum += (unsigned char)(data->file_buf[i]);
+	switch (request_nr_ranges(rq)) {
+	case -1:
+		request_send_unsatisfiable(rq);
+		return;
+	case 0:
+		break;
+	default:
+		request_sendranges(rq, filetype);
+		return;
+	}
+	start = stats_now();
+	/* the cache may have a compressed copy of the file */
+	if (request_accepts_gzip(rq) && data->gzip_buf) {
+		body = data->gzip_buf;
+		body_size = data->gzip_size;
+		encoding = "Content-Encoding: gzip\r\n";
+	} else {
+		assert(data->file_buf || data->file_size == 0);
+		body = data->file_buf;
+		body_size = data->file_size;
 	}
 	/* do some processing */
-	request_processfile(rq);
-	/* put together response */
+	request_processfile(body, body_size);
+	stats_record(PHASE_PROCESS, stats_now() - start);
+	/* put together response. the checksum is always that of the file, so
+	 * clients check it after decompressing. */
 	size += sprintf(buf + size, "HTTP/1.0 200 OK\r\n");
 	size += sprintf(buf + size, "Server: OS Web Server\r\n");
 	size += sprintf(buf + size, "Content-Type: %s\r\n", filetype);
-	size += sprintf(buf + size, "Content-Length: %d\r\n", data->file_size);
-	size += sprintf(buf + size, "Content-Csum: %u\r\n\r\n", csum);
+	size += sprintf(buf + size, "%s", encoding);
+	size += request_validators(rq, buf + size, MAXBUF - size);
+	size += sprintf(buf + size, "Content-Length: %ld\r\n", body_size);
+	size += sprintf(buf + size, "Content-Csum: %u\r\n\r\n",
+			data->file_csum);
 
+	start = stats_now();
+	Rio_write(rq->fd, buf, strlen(buf));
+
+	/* writes the body to the client socket */
+	if (body_size > 0) {
+		Rio_write(rq->fd, body, body_size);
+	}
+	stats_record(PHASE_WRITE, stats_now() - start);
+	request_log(rq, 200, size + body_size);
+}
+
+/* start reading len bytes at offset of the file into buf, in the
+ * background */
+static void
+request_aio_start(struct request *rq, struct aiocb *cb, char *buf,
+		  long offset, long len)
+{
+	memset(cb, 0, sizeof(*cb));
+	cb->aio_fildes = rq->srcfd;
+	cb->aio_buf = buf;
+	cb->aio_nbytes = len;
+	cb->aio_offset = offset;
+	cb->aio_sigevent.sigev_notify = SIGEV_NONE;
+	SYS(aio_read(cb));
+}
+
+/* wait for the read started by request_aio_start to fill its buffer */
+static void
+request_aio_wait(struct request *rq, struct aiocb *cb)
+{
+	const struct aiocb *list[1] = { cb };
+	char *buf = (char *)cb->aio_buf;
+	long len = cb->aio_nbytes;
+	ssize_t n, ret;
+
+	while ((ret = aio_error(cb)) == EINPROGRESS) {
+		aio_suspend(list, 1, NULL);
+	}
+	errno = ret;
+	SYS(n = ret ? -1 : aio_return(cb));
+	/* a short read is finished synchronously */
+	for (; n < len; n += ret) {
+		SYS(ret = pread(rq->srcfd, buf + n, len - n,
+				cb->aio_offset + n));
+		if (ret == 0) {
+			/* the file shrank since it was stat'ed */
+			memset(buf + n, 0, len - n);
+			break;
+		}
+	}
+}
+
+/* send the file of rq from two buffers of STREAM_CHUNK bytes. while one
+ * chunk is processed and written to the client, the next one is read into
+ * the other buffer with aio_read. the chunks are added up into *csum, and the
+ * time spent in each phase is added to times. */
+static void
+request_stream_chunks(struct request *rq, char **bufs, unsigned int *csum,
+		      uint64_t times[NR_PHASES])
+{
+	struct file_data *data = rq->data;
+	long offset, len, next, k;
+	struct aiocb cb;
+	uint64_t start;
+	int i;
+
+	len = data->file_size < STREAM_CHUNK ? data->file_size : STREAM_CHUNK;
+	if (len > 0) {
+		request_aio_start(rq, &cb, bufs[0], 0, len);
+	}
+	for (offset = 0, i = 0; offset < data->file_size;
+	     offset += len, i = !i) {
+		len = data->file_size - offset < STREAM_CHUNK ?
+			data->file_size - offset : STREAM_CHUNK;
+		start = stats_now();
+		request_aio_wait(rq, &cb);
+		request_disk_wait(rq);
+		next = offset + len;
+		if (next < data->file_size) {
+			request_aio_start(rq, &cb, bufs[!i], next,
+					  data->file_size - next < STREAM_CHUNK ?
+					  data->file_size - next : STREAM_CHUNK);
+		}
+		times[PHASE_READ] += stats_now() - start;
+
+		start = stats_now();
+		for (k = 0; k < len; k++) {
+			*csum += (unsigned char)bufs[i][k];
+		}
+		request_processfile(bufs[i], len);
+		times[PHASE_PROCESS] += stats_now() - start;
+
+		start = stats_now();
+		Rio_write(rq->fd, bufs[i], len);
+		/* as request_readfile, keep the file out of the page cache */
+		SYS(posix_fadvise(rq->srcfd, offset, len,
+				  POSIX_FADV_DONTNEED));
+		times[PHASE_WRITE] += stats_now() - start;
+	}
+}
+
+/* the headers go out before the file is read, so the checksum, for the
+ * Content-Csum and ETag headers, is only known if request_csum_lookup
+ * remembers it from an earlier response. otherwise the response has neither
+ * header, and the checksum is added up while the file is sent, for the next
+ * response. */
+void
+request_streamfile(struct request *rq)
+{
+	struct file_data *data = rq->data;
+	char filetype[MAXLINE], buf[MAXBUF], *bufs[2];
+	uint64_t times[NR_PHASES] = { 0 }, start;
+	unsigned int csum = 0;
+	size_t size = 0;
+
+	assert(rq->stat_done && rq->nr_ranges == 0);
+	if (request_csum_lookup &&
+	    request_csum_lookup(data->file_name, data->file_size,
+				data->file_mtime, &data->file_csum)) {
+		rq->csum_done = 1;
+	}
+	if (request_not_modified(rq)) {
+		request_send_not_modified(rq);
+		return;
+	}
+	if (rq->srcfd < 0) {
+		SYS(rq->srcfd = open(data->file_name, O_RDONLY, 0));
+	}
+	SYS(posix_fadvise(rq->srcfd, 0, 0, POSIX_FADV_SEQUENTIAL));
+
+	request_get_file_type(data->file_name, filetype);
+	size += snprintf(buf + size, MAXBUF - size, "HTTP/1.0 200 OK\r\n"
+			 "Server: OS Web Server\r\n"
+			 "Content-Type: %s\r\n", filetype);
+	size += request_validators(rq, buf + size, MAXBUF - size);
+	size += snprintf(buf + size, MAXBUF - size, "Content-Length: %ld\r\n",
+			 data->file_size);
+	if (rq->csum_done) {
+		size += snprintf(buf + size, MAXBUF - size,
+				 "Content-Csum: %u\r\n", data->file_csum);
+	}
+	snprintf(buf + size, MAXBUF - size, "\r\n");
+	start = stats_now();
 	Rio_write(rq->fd, buf, strlen(buf));
+	times[PHASE_WRITE] += stats_now() - start;
 
-	/* writes data->file_buf to the client socket */
-	if (data->file_size > 0) {
-		Rio_write(rq->fd, data->file_buf, data->file_size);
+	bufs[0] = Malloc(STREAM_CHUNK);
+	bufs[1] = Malloc(STREAM_CHUNK);
+	request_stream_chunks(rq, bufs, &csum, times);
+	if (!rq->csum_done && request_csum_store) {
+		request_csum_store(data->file_name, data->file_size,
+				   data->file_mtime, csum);
 	}
+	request_log(rq, 200, strlen(buf) + data->file_size);
+	stats_record(PHASE_READ, times[PHASE_READ]);
+	stats_record(PHASE_PROCESS, times[PHASE_PROCESS]);
+	stats_record(PHASE_WRITE, times[PHASE_WRITE]);
+	free(bufs[1]);
+	free(bufs[0]);
 }
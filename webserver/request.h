@@ -1,16 +1,96 @@
 #ifndef __REQUEST_H__
 #define __REQUEST_H__
 
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
 struct file_data {
 	char *file_name; /* name of file being requested */
 	char *file_buf;	 /* file is read into this buffer in memory */
-	int file_size;	 /* file size */
+	long file_size;	 /* file size */
+	unsigned int file_csum;	/* checksum of file_buf */
+	time_t file_mtime;	/* last modification time of the file */
+	unsigned long file_generation;	/* see cache_generation */
+	char *gzip_buf;	 /* gzip-compressed file, or NULL (see cache.c) */
+	long gzip_size;
 };
 
+struct file_data *file_data_init(void);
+/* free data, its name and its contents */
+void file_data_free(struct file_data *data);
+
+/* stat(2), or a replacement that caches the metadata of files (see
+ * watch.h) */
+extern int (*request_stat)(const char *path, struct stat *sbuf);
+
+/* simulated disk latency added to every request that reads its file, in
+ * microseconds */
+extern int request_disk_delay;
+/* usleep(3), for request_disk_delay, or a replacement that only puts the
+ * calling user-level thread to sleep (see uthread.h) */
+extern int (*request_usleep)(useconds_t usec);
+/* the checksum of the file path with size and mtime, remembered by
+ * request_csum_store when the file was last streamed, for
+ * request_streamfile. returns 0 if it is not known. both are NULL, and
+ * streamed files have no checksum, unless they are set (see watch.h). */
+extern int (*request_csum_lookup)(const char *path, long size, time_t mtime,
+				  unsigned int *csum);
+extern void (*request_csum_store)(const char *path, long size, time_t mtime,
+				  unsigned int csum);
+
 struct request *request_init(int connfd, struct file_data *data);
+/* check that the file can be served, and fill in its size */
+int request_statfile(struct request *rq);
 int request_readfile(struct request *rq);
+/* read only the requested ranges of the file, see request_add_slice */
+int request_readranges(struct request *rq);
+/* read the file data->file_name into data, as request_readfile does, but
+ * outside of a request, for prefetching. returns 0 if the file is not
+ * served. */
+int request_loadfile(struct file_data *data);
+/* read len bytes at offset of the file, once request_statfile succeeded */
+struct file_data *request_readchunk(struct request *rq, long offset, long len);
+/* send the whole file while reading it, a chunk at a time, once
+ * request_statfile succeeded. the headers are sent first, with Content-Csum
+ * and ETag only if request_csum_lookup knows the checksum. memory use does
+ * not depend on the size of the file, but the file is not left in
+ * data->file_buf. */
+void request_streamfile(struct request *rq);
 void request_set_data(struct request *rq, struct file_data *data);
+/* does the client already have the file, according to its If-None-Match or
+ * If-Modified-Since header? if so, request_sendfile sends a 304 without a
+ * body, and the contents of the file are not needed. */
+int request_not_modified(struct request *rq);
+/* will the response be gzip compressed? only if the client sent
+ * "Accept-Encoding: gzip", and did not ask for byte ranges */
+int request_accepts_gzip(struct request *rq);
+
+/*
+ * Range requests. A client that sends "Range: bytes=..." gets only those
+ * byte ranges of the file, in a 206 response. The ranges are resolved against
+ * data->file_size, so request_nr_ranges may only be called once the size is
+ * known.
+ */
+/* did the client send a valid Range header? */
+int request_has_ranges(struct request *rq);
+/* the number of ranges to send, 0 to send the whole file, or -1 if none of
+ * the ranges are in the file */
+int request_nr_ranges(struct request *rq);
+/* the first byte and the length of range i */
+void request_range(struct request *rq, int i, long *start, long *len);
+/* send len bytes at buf as the next part of range i. slices are added in
+ * order, and buf must stay valid until request_sendfile returns. without
+ * slices, the ranges are sent from data->file_buf. */
+void request_add_slice(struct request *rq, int i, char *buf, long len);
+
 void request_sendfile(struct request *rq);
+/* the 404 or 403 response that was sent because the file could not be read,
+ * for a negative cache, or NULL. the response is in file_buf, and the caller
+ * owns the new file_data. */
+struct file_data *request_error_data(struct request *rq);
+/* send an error response returned by request_error_data */
+void request_send_error(struct request *rq, struct file_data *error);
 void request_destroy(struct request *rq);
 
 #endif
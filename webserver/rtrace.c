@@ -0,0 +1,103 @@
+/*
+ * rtrace.c: a binary trace of the requests (see rtrace.h).
+ *
+ * Records are appended to a stdio stream with a large buffer, whose lock
+ * keeps the records of different threads apart, so a request only waits for
+ * the disk once every RTRACE_BUFFER bytes of records.
+ */
+
+#include "common.h"
+#include "rtrace.h"
+
+#define RTRACE_BUFFER (1 << 20)
+
+struct rtrace {
+	FILE *f;
+	char *buf;		/* of f */
+	uint64_t start;		/* rtrace_now() when the trace was opened */
+	long records;
+};
+
+static uint64_t
+rtrace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t
+rtrace_hash(const char *name)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;	/* FNV-1a */
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+struct rtrace *
+rtrace_open(const char *path)
+{
+	struct rtrace *t;
+	FILE *f;
+
+	if ((f = fopen(path, "w")) == NULL)
+		return NULL;
+	t = Malloc(sizeof(struct rtrace));
+	t->f = f;
+	t->buf = Malloc(RTRACE_BUFFER);
+	setvbuf(f, t->buf, _IOFBF, RTRACE_BUFFER);
+	fwrite(RTRACE_MAGIC, RTRACE_MAGIC_SIZE, 1, f);
+	t->start = rtrace_now();
+	t->records = 0;
+	return t;
+}
+
+void
+rtrace_close(struct rtrace *t)
+{
+	fclose(t->f);
+	free(t->buf);
+	free(t);
+}
+
+void
+rtrace_write(struct rtrace *t, const char *name, long size, int flags)
+{
+	struct rtrace_record r;
+
+	r.time = rtrace_now() - t->start;
+	r.hash = rtrace_hash(name);
+	r.size = size < UINT32_MAX ? size : UINT32_MAX;
+	r.flags = flags;
+	flockfile(t->f);
+	fwrite_unlocked(&r, sizeof(r), 1, t->f);
+	t->records++;
+	funlockfile(t->f);
+}
+
+long
+rtrace_records(struct rtrace *t)
+{
+	long records;
+
+	flockfile(t->f);
+	records = t->records;
+	funlockfile(t->f);
+	return records;
+}
+
+int
+rtrace_check(FILE *f)
+{
+	char magic[RTRACE_MAGIC_SIZE];
+
+	if (fread(magic, RTRACE_MAGIC_SIZE, 1, f) != 1 ||
+	    memcmp(magic, RTRACE_MAGIC, RTRACE_MAGIC_SIZE) != 0)
+		return -1;
+	return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef __RTRACE_H__
+#define __RTRACE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * A compact binary trace of the requests for files, which the server records
+ * with -T, and cache_sim replays against cache policies. The trace starts
+ * with RTRACE_MAGIC, followed by one record per request, in the byte order
+ * of the machine that recorded it.
+ *
+ * Files are identified by a hash of their name, so the trace does not reveal
+ * the names, and every record has the same size.
+ */
+
+#define RTRACE_MAGIC "WSRT0001"
+#define RTRACE_MAGIC_SIZE 8
+
+#define RTRACE_HIT 0x1	/* the file was in the cache of the server */
+
+struct rtrace_record {
+	uint64_t time;		/* ns since the trace was opened */
+	uint64_t hash;		/* of the file name, see rtrace_hash */
+	uint32_t size;		/* of the file, at most UINT32_MAX */
+	uint32_t flags;
+};
+
+struct rtrace;
+
+/* create the trace file path. returns NULL if it can't be created. */
+struct rtrace *rtrace_open(const char *path);
+/* write out the records that are left, and close the trace */
+void rtrace_close(struct rtrace *t);
+/* record a request for the file called name, which may be called by many
+ * threads at once */
+void rtrace_write(struct rtrace *t, const char *name, long size, int flags);
+/* the records written so far */
+long rtrace_records(struct rtrace *t);
+
+/* the hash of a file name in the trace */
+uint64_t rtrace_hash(const char *name);
+/* check the magic at the start of a trace being read. returns -1 if f is not
+ * a trace. */
+int rtrace_check(FILE *f);
+
+#endif /* __RTRACE_H__ */
@@ -1,23 +1,114 @@
+#define _GNU_SOURCE	/* for ppoll */
 #include <malloc.h>
 #include "common.h"
 #include "request.h"
 #include "server_thread.h"
+#include "shcache.h"
+#include "tracer.h"
 
 /* 
  * server.c: A very, very simple web server
  *
  * To run:
- *  server portnum nr_threads max_requests max_cache_size
+ *  server [-R max_rss] [-z gzip_ratio] [-k chunk_size] [-s stream_size]
+ *         [-e low:high] [-D spill_size] [-L l1_slots] [-P depth] [-H hints]
+ *         [-T trace] [-F nr_workers] [-U] [-J aging] [-A access_log]
+ *         [-C chrome_trace] [-c sample] [-W]
+ *         portnum nr_threads max_requests max_cache_size
+ *
+ * The options, which usage() describes in full, are:
+ *  -R  stop caching while the resident memory is above max_rss bytes
+ *  -z  cache gzip copies of the files that compress to gzip_ratio
+ *  -k  cache the ranges of files larger than the cache in chunks
+ *  -s  stream the files larger than stream_size bytes from disk
+ *  -e  evict in a background thread between the low and high marks
+ *  -D  spill evicted files to a file of spill_size bytes
+ *  -L  give each worker a cache of the l1_slots files it hits most
+ *  -P  prefetch up to depth files that followed each requested file
+ *  -H  also prefetch the files that the hints file lists
+ *  -T  record the requests in a trace for cache_sim
+ *  -F  serve from nr_workers processes with a shared cache (see below)
+ *  -U  serve each connection in a user-level thread
+ *  -J  serve the requests for the smallest files first, with aging
+ *  -A  write an access log
+ *  -C  write a Chrome trace of some of the requests
+ *  -c  trace one in every sample requests for -C
+ *  -W  watch the files for changes, and cache the not-found errors
  *
  * Repeatedly handles HTTP requests sent to this port number. Most of the work
  * is done within routines written in server_thread.c and request.c
+ *
+ * With -F, the server forks nr_workers worker processes, each of which
+ * accepts connections on the same listening socket and serves them with
+ * nr_threads threads of its own. The workers share one cache, in shared
+ * memory (see shcache.h). The parent process only restarts the workers that
+ * crash, and the cache keeps its files across the restarts.
+ *
+ * Sending SIGUSR1 to the server prints the statistics collected so far.
  */
 
 static void
 usage(char *program)
 {
-	fprintf(stderr, "Usage: %s port nr_threads max_requests "
-		"max_cache_size\n", program);
+	fprintf(stderr, "Usage: %s [-R max_rss] [-z gzip_ratio] "
+		"[-k chunk_size] [-s stream_size] [-e low:high] "
+		"[-D spill_size] [-L l1_slots] [-P depth] [-H hints] "
+		"[-T trace] [-F nr_workers] [-U] [-J aging] [-A access_log] "
+		"[-C chrome_trace] [-c sample] [-W] port nr_threads "
+		"max_requests max_cache_size\n"
+		"  -R  stop caching files while the server's resident memory\n"
+		"      is above max_rss bytes\n"
+		"  -z  cache a gzip copy of files that compress to at most\n"
+		"      gzip_ratio of their size, for clients that accept it\n"
+		"  -k  cache the byte ranges requested from files larger than\n"
+		"      the cache in chunks of chunk_size bytes, instead of\n"
+		"      reading them from disk every time\n"
+		"  -s  send files larger than stream_size bytes while they\n"
+		"      are read, instead of reading them into memory first.\n"
+		"      their responses have a checksum only with -W, once\n"
+		"      the file was sent\n"
+		"  -e  evict files in a background thread, which starts when\n"
+		"      the cache is fuller than the high fraction of its size\n"
+		"      and stops at the low one, e.g., 0.85:0.95, instead of\n"
+		"      evicting while inserting\n"
+		"  -D  write the files evicted from the cache to a spill file\n"
+		"      of spill_size bytes in $TMPDIR, and read them back from\n"
+		"      there on a miss\n"
+		"  -L  keep the l1_slots files each worker hits most in a\n"
+		"      cache of its own, e.g., 8, instead of looking every\n"
+		"      file up in the shared cache\n"
+		"  -P  prefetch up to depth of the files that most often\n"
+		"      followed each requested file into the cache, while the\n"
+		"      disk is idle\n"
+		"  -H  also prefetch the files listed after each file on the\n"
+		"      lines of the hints file\n"
+		"  -T  record the requests in a binary trace file, to try\n"
+		"      other cache sizes and policies with cache_sim. in the\n"
+		"      prefork mode, each worker adds .slot to the name\n"
+		"  -F  serve from nr_workers processes, which share a cache\n"
+		"      in shared memory, and restart the ones that crash.\n"
+		"      -R, -z, -k, -e, -D, -L, -P and -H don't apply to the\n"
+		"      shared cache\n"
+		"  -U  serve each connection in a user-level thread of its\n"
+		"      own, on nr_threads kernel threads, so that up to\n"
+		"      max_requests connections can wait for their clients at\n"
+		"      once. -L doesn't apply\n"
+		"  -J  serve the queued requests for the smallest files first.\n"
+		"      a request waits at most a millisecond for every aging\n"
+		"      bytes of its file longer than one for a smaller file\n"
+		"  -A  append a line in the Common Log Format, followed by\n"
+		"      the microseconds taken, for every response to the\n"
+		"      access_log file. lines are dropped, and counted, when\n"
+		"      the file falls behind\n"
+		"  -C  trace what the threads do for some of the requests, and\n"
+		"      write the trace to the chrome_trace file, for Perfetto\n"
+		"      or chrome://tracing, on SIGUSR1 and on exit. in the\n"
+		"      prefork mode, each worker adds .slot to the name\n"
+		"  -c  trace one in every sample requests (default: 16)\n"
+		"  -W  watch the files for changes, so that the cache never\n"
+		"      serves stale files and a miss needs no stat, and cache\n"
+		"      the error responses for files that were not found\n",
+		program);
 	exit(1);
 }
 
@@ -52,34 +143,46 @@ close_fifo(void)
 	unlink(fifo);
 }
 
-int
-main(int argc, char *argv[])
+static volatile sig_atomic_t dump_requested = 0;
+
+/* only sets a flag, the main loop does the actual (non async-signal-safe)
+ * printing */
+static void
+dump_handler(int sig)
 {
-	int port, nr_threads, max_requests, max_cache_size;
-	int listenfd, connfd, clientlen;
-	int exitfd;
-	struct sockaddr_in clientaddr;
-	struct server *sv;
+	dump_requested = 1;
+}
 
-	if (argc != 5)
-		usage(argv[0]);
-	port = atoi(argv[1]);
-	nr_threads = atoi(argv[2]);
-	max_requests = atoi(argv[3]);
-	max_cache_size = atoi(argv[4]);
-	if (port < 1024) {
-		fprintf(stderr, "port = %d, should be >= 1024\n", port);
-		usage(argv[0]);
-	}
-	if (nr_threads < 0 || max_requests < 0 || max_cache_size < 0) {
-		fprintf(stderr, "arguments should be > 0\n");
-		usage(argv[0]);
-	}
+/* SIGUSR1 asks the server to dump its statistics. the signal is blocked
+ * before the worker threads are created, so that they inherit a mask that
+ * blocks it. the main thread only unblocks it while it sleeps in ppoll, so
+ * a dump request can't be missed while a request is being served. returns
+ * the mask to use with ppoll in wait_mask. */
+static void
+init_dump_signal(sigset_t *wait_mask)
+{
+	struct sigaction sa;
+	sigset_t mask;
 
-	sv = server_init(nr_threads, max_requests, max_cache_size);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = dump_handler;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	SYS(sigaction(SIGUSR1, &sa, NULL));
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &mask, wait_mask);
+	sigdelset(wait_mask, SIGUSR1);
+}
 
-	listenfd = open_listenfd(port);
-	exitfd = open_fifo();
+/* accept connections and serve them until an exit is requested */
+static void
+serve(struct server *sv, int listenfd, int exitfd, sigset_t *wait_mask)
+{
+	struct sockaddr_in clientaddr;
+	int connfd, clientlen;
+	uint64_t start;
+	int ret;
 
 	struct pollfd fds[] = {
 		{exitfd, POLLIN},
@@ -87,22 +190,320 @@ main(int argc, char *argv[])
 	};
 	while (1) {
 		/* wait for either a client to connect or an exit event */
-		SYS(poll(fds, 2, -1));
-		
+		ret = ppoll(fds, 2, NULL, wait_mask);
+		if (dump_requested) {
+			dump_requested = 0;
+			server_dump(sv);
+		}
+		if (ret < 0 && errno == EINTR) { /* interrupted by a signal */
+			continue;
+		}
+		SYS(ret);
+
 		if(fds[0].revents & POLLIN) { /* exit requested */
 			break;
 		}
 
 		assert(fds[1].revents & POLLIN); /* connect request arrived */
 		clientlen = sizeof(clientaddr);
+		start = stats_now();
 		/* connfd is the socket descriptor the server will use to send
 		 * data to the client */
-		SYS(connfd = accept(listenfd, (struct sockaddr *)&clientaddr,
-				    (socklen_t *) & clientlen));
+		connfd = accept(listenfd, (struct sockaddr *)&clientaddr,
+				(socklen_t *) & clientlen);
+		/* in the prefork mode, another worker may have accepted the
+		 * connection first */
+		if (connfd < 0 && errno == EAGAIN) {
+			continue;
+		}
+		SYS(connfd);
+		tracer_start();
+		tracer_record(TRACE_ACCEPT, stats_now() - start);
 
 		/* serve the request */
 		server_request(sv, connfd);
 	}
+}
+
+/* the worker processes of the prefork mode */
+struct prefork {
+	int nr_workers;
+	pid_t *pids;		/* of the workers, 0 once they exited */
+	struct shcache *shared;	/* NULL when max_cache_size is 0 */
+	int listenfd;
+	int exitfd;
+	sigset_t *wait_mask;
+	int nr_threads;
+	int max_requests;
+	int max_cache_size;
+};
+
+static volatile sig_atomic_t child_exited = 0;
+
+static void
+child_handler(int sig)
+{
+	child_exited = 1;
+}
+
+/* the path of the file of the worker in slot, for the file path of the
+ * server */
+static char *
+prefork_path(const char *path, int slot)
+{
+	char *p = Malloc(strlen(path) + 16);
+
+	sprintf(p, "%s.%d", path, slot);
+	return p;
+}
+
+/* fork the worker of slot. the worker serves requests until an exit is
+ * requested, and then exits. */
+static pid_t
+prefork_start(struct prefork *p, int slot)
+{
+	struct server *sv;
+	pid_t pid;
+
+	/* or the output buffered so far would be printed twice */
+	fflush(stdout);
+	fflush(stderr);
+	SYS(pid = fork());
+	if (pid > 0)
+		return pid;
+	if (p->shared) {
+		shcache_attach(p->shared, slot);
+		server_config.shared = p->shared;
+	}
+	/* traces of its own */
+	if (server_config.rtrace)
+		server_config.rtrace = prefork_path(server_config.rtrace, slot);
+	if (server_config.chrome_trace) {
+		server_config.chrome_trace =
+			prefork_path(server_config.chrome_trace, slot);
+	}
+	sv = server_init(p->nr_threads, p->max_requests, p->max_cache_size);
+	serve(sv, p->listenfd, p->exitfd, p->wait_mask);
+	server_exit(sv);
+	exit(0);
+}
+
+/* wait for the workers that exited, blocking until all of them did if block
+ * is set. the entries that a worker held are released, and a worker that was
+ * killed by a signal is restarted if restart is set. a worker that exited
+ * with an error failed to start, and is not restarted. */
+static void
+prefork_wait(struct prefork *p, int block, int restart)
+{
+	pid_t pid;
+	int status, i;
+
+	while ((pid = waitpid(-1, &status, block ? 0 : WNOHANG)) > 0) {
+		for (i = 0; i < p->nr_workers && p->pids[i] != pid; i++)
+			;
+		if (i == p->nr_workers)
+			continue;
+		p->pids[i] = 0;
+		if (p->shared)
+			shcache_reap(p->shared, i);
+		if (!WIFSIGNALED(status))
+			continue;
+		fprintf(stderr, "worker %d (pid %d) killed by signal %d%s\n",
+			i, pid, WTERMSIG(status),
+			restart ? ", restarting" : "");
+		if (restart)
+			p->pids[i] = prefork_start(p, i);
+	}
+}
+
+/* run the server as nr_workers processes, and wait for an exit request */
+static void
+prefork(struct prefork *p, sigset_t *wait_mask)
+{
+	struct sigaction sa;
+	sigset_t mask;
+	int ret, i;
+
+	if (p->max_cache_size > 0) {
+		p->shared = shcache_init(p->max_cache_size, p->nr_workers);
+		if (!p->shared) {
+			perror("shcache_init");
+			exit(1);
+		}
+	}
+	/* all the workers are woken up by each connection, and only one of
+	 * them gets it */
+	SYS(fcntl(p->listenfd, F_SETFL,
+		  fcntl(p->listenfd, F_GETFL) | O_NONBLOCK));
+	/* like SIGUSR1, SIGCHLD is only delivered while the parent waits in
+	 * ppoll. the workers inherit the mask, and don't fork. */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = child_handler;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	SYS(sigaction(SIGCHLD, &sa, NULL));
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	p->pids = Malloc(sizeof(pid_t) * p->nr_workers);
+	for (i = 0; i < p->nr_workers; i++) {
+		p->pids[i] = prefork_start(p, i);
+	}
+
+	struct pollfd fds[] = {
+		{p->exitfd, POLLIN},
+	};
+	while (1) {
+		ret = ppoll(fds, 1, NULL, wait_mask);
+		if (dump_requested) {
+			/* each worker prints its own statistics */
+			dump_requested = 0;
+			for (i = 0; i < p->nr_workers; i++) {
+				if (p->pids[i] > 0)
+					kill(p->pids[i], SIGUSR1);
+			}
+			if (p->shared)
+				shcache_dump(p->shared, stdout);
+		}
+		if (child_exited) {
+			child_exited = 0;
+			prefork_wait(p, 0, 1);
+		}
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		SYS(ret);
+		if (fds[0].revents & POLLIN) {
+			break;
+		}
+	}
+	/* the workers see the exit request too */
+	prefork_wait(p, 1, 0);
+	if (p->shared) {
+		if (!server_config.quiet)
+			shcache_dump(p->shared, stdout);
+		shcache_destroy(p->shared);
+	}
+	free(p->pids);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int port, nr_threads, max_requests, max_cache_size;
+	int listenfd, exitfd, nr_workers = 0;
+	struct server *sv;
+	sigset_t wait_mask;
+	char extra;
+	int c;
+
+	while ((c = getopt(argc, argv, "R:z:k:s:e:D:L:P:H:T:F:UJ:A:C:c:W")) != -1) {
+		switch (c) {
+		case 'R':
+			server_config.max_rss = atol(optarg);
+			break;
+		case 'z':
+			server_config.gzip_ratio = atof(optarg);
+			break;
+		case 'k':
+			server_config.chunk_size = atol(optarg);
+			break;
+		case 's':
+			server_config.stream_size = atol(optarg);
+			break;
+		case 'e':
+			if (sscanf(optarg, "%lf:%lf%c",
+				   &server_config.low_watermark,
+				   &server_config.high_watermark, &extra) != 2)
+				usage(argv[0]);
+			break;
+		case 'D':
+			server_config.spill_size = atol(optarg);
+			break;
+		case 'L':
+			server_config.l1_slots = atoi(optarg);
+			break;
+		case 'P':
+			server_config.prefetch_depth = atoi(optarg);
+			break;
+		case 'H':
+			server_config.prefetch_hints = optarg;
+			break;
+		case 'T':
+			server_config.rtrace = optarg;
+			break;
+		case 'F':
+			nr_workers = atoi(optarg);
+			break;
+		case 'U':
+			server_config.uthreads = 1;
+			break;
+		case 'J':
+			server_config.sjf_aging = atol(optarg);
+			break;
+		case 'A':
+			server_config.access_log = optarg;
+			break;
+		case 'C':
+			server_config.chrome_trace = optarg;
+			break;
+		case 'c':
+			server_config.trace_sample = atoi(optarg);
+			break;
+		case 'W':
+			server_config.watch = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 4)
+		usage(argv[0]);
+	port = atoi(argv[optind]);
+	nr_threads = atoi(argv[optind + 1]);
+	max_requests = atoi(argv[optind + 2]);
+	max_cache_size = atoi(argv[optind + 3]);
+	if (port < 1024) {
+		fprintf(stderr, "port = %d, should be >= 1024\n", port);
+		usage(argv[0]);
+	}
+	if (nr_threads < 0 || max_requests < 0 || max_cache_size < 0 ||
+	    server_config.max_rss < 0 || server_config.gzip_ratio < 0 ||
+	    server_config.chunk_size < 0 || server_config.stream_size < 0 ||
+	    server_config.spill_size < 0 || server_config.l1_slots < 0 ||
+	    server_config.prefetch_depth < 0 || nr_workers < 0 ||
+	    server_config.sjf_aging < 0 || server_config.trace_sample < 1) {
+		fprintf(stderr, "arguments should be > 0\n");
+		usage(argv[0]);
+	}
+	if (server_config.low_watermark < 0 ||
+	    server_config.low_watermark > server_config.high_watermark ||
+	    server_config.high_watermark > 1) {
+		fprintf(stderr, "watermarks should be 0 <= low <= high <= 1\n");
+		usage(argv[0]);
+	}
+
+	init_dump_signal(&wait_mask);
+	if (nr_workers > 0) {
+		struct prefork p = {
+			.nr_workers = nr_workers,
+			.listenfd = open_listenfd(port),
+			.exitfd = open_fifo(),
+			.wait_mask = &wait_mask,
+			.nr_threads = nr_threads,
+			.max_requests = max_requests,
+			.max_cache_size = max_cache_size,
+		};
+
+		prefork(&p, &wait_mask);
+		close_fifo();
+		exit(0);
+	}
+	sv = server_init(nr_threads, max_requests, max_cache_size);
+
+	listenfd = open_listenfd(port);
+	exitfd = open_fifo();
+	serve(sv, listenfd, exitfd, &wait_mask);
 
 	close_fifo();
 	server_exit(sv);
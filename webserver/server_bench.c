@@ -0,0 +1,792 @@
+/*
+ * server_bench.c: An in-process benchmark for the web server.
+ *
+ * To run:
+ *  server_bench [options] fileset_dir.idx
+ * from the directory that contains the file set.
+ *
+ * The server code (server_thread.c and request.c) is linked in directly, and
+ * requests are fed to server_request over socketpairs, so there is no server
+ * process to start, no TCP and no sleeping. Each driver thread sends a
+ * request, hands the server its end of the socketpair, and waits until its
+ * reader thread has received and checked the whole response, so the drivers
+ * behave like the closed-loop client threads of client.c. The reader is a
+ * separate thread because with no worker threads, server_request serves the
+ * request in the driver thread itself.
+ *
+ * The -t, -q, -c, -d and -n options take comma-separated lists, and every
+ * combination of them is run as a separate configuration. A configuration
+ * starts a server, runs a few warm-up rounds of requests, whose results are
+ * thrown away, and then a number of trials. The mean and the 95% confidence
+ * interval of each metric over the trials are printed, and written to a csv
+ * results file with -o. With -b, the results are compared with a results file
+ * saved earlier, and metrics that got worse by more than the noise between
+ * trials (Welch's t-test at 95%) are reported as regressions.
+ *
+ * With -p, the requests go over TCP to a real server process instead, as the
+ * lab testers expect: each configuration starts ./server on the port, with
+ * its output in server.log, and shuts it down through its server_exit fifo
+ * once the trials are done.
+ */
+
+#include "common.h"
+#include "histogram.h"
+#include "request.h"
+#include "server_thread.h"
+#include "workload.h"
+
+#define HEADER_SIZE 1024	/* max size of a response header */
+#define BODY_SIZE 65536		/* read size for response bodies */
+#define MAX_LIST 32		/* max values of a list option */
+
+struct bench {
+	struct fileinfo *fileset;
+	int nr_files;
+	struct workload workload;
+	long seed;
+	int nr_drivers;
+	int nr_times;		/* requests sent by each driver */
+	int nr_warmup;		/* rounds run before the trials */
+	int nr_trials;		/* rounds whose results are kept */
+	long nr_errors;		/* errors in the current configuration */
+	int serialize;		/* the server has no worker threads */
+	pthread_mutex_t serve_lock;	/* taken around server_request then */
+	int port;		/* of the ./server processes, 0 to link it in */
+	struct sockaddr_in addr;	/* where they listen */
+};
+
+/* what is measured in each trial */
+enum metric {
+	METRIC_SECONDS,
+	METRIC_THROUGHPUT,
+	METRIC_MEAN,
+	METRIC_P50,
+	METRIC_P99,
+	METRIC_P999,
+	NR_METRICS,
+};
+
+static const struct {
+	char *name;		/* column name in the results file */
+	int higher_is_better;
+} metrics[NR_METRICS] = {
+	{ "seconds", 0 },
+	{ "throughput", 1 },
+	{ "mean_us", 0 },
+	{ "p50_us", 0 },
+	{ "p99_us", 0 },
+	{ "p999_us", 0 },
+};
+
+struct trial {
+	double metric[NR_METRICS];
+};
+
+/* a configuration, and the mean, standard deviation and 95% confidence
+ * interval of each metric over its trials */
+struct result {
+	int nr_threads;
+	int max_requests;
+	int max_cache_size;
+	char *workload;
+	int nr_drivers;
+	int nr_trials;
+	long nr_errors;
+	double mean[NR_METRICS];
+	double std[NR_METRICS];
+	double ci[NR_METRICS];
+};
+
+struct driver {
+	struct bench *b;
+	struct server *sv;
+	int index;
+	pthread_t thread;
+	pthread_t reader;
+	unsigned short xsubi[3];	/* random state for erand48 */
+	sem_t sent;		/* a request has been sent */
+	sem_t received;		/* its response has been received */
+	int fd;			/* our end of the socketpair of the request */
+	struct fileinfo *fi;	/* file being requested */
+	uint64_t start;		/* time at which the request was sent */
+	int exiting;
+	struct histogram latency;
+	long nr_errors;
+};
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* read a response from fd and check it against fi. returns 0 if it is
+ * correct, and -1 otherwise. */
+static int
+bench_response(int fd, struct fileinfo *fi)
+{
+	char header[HEADER_SIZE], body[BODY_SIZE];
+	char *end = NULL, *line, *eol;
+	int len = 0, length = 0, length_received = 0;
+	unsigned int csum = 0, csum_received = 0;
+	int i, has_csum = 0;
+	ssize_t n;
+
+	/* read until the end of the header */
+	while (!end) {
+		n = read(fd, header + len, HEADER_SIZE - 1 - len);
+		if (n <= 0)
+			return -1;
+		len += n;
+		header[len] = 0;
+		end = strstr(header, "\r\n\r\n");
+		if (!end && len == HEADER_SIZE - 1)
+			return -1;
+	}
+	for (line = header; line < end; line = eol + 2) {
+		eol = strstr(line, "\r\n");
+		sscanf(line, "Content-Length: %d ", &length);
+		if (sscanf(line, "Content-Csum: %u ", &csum) == 1)
+			has_csum = 1;
+	}
+	/* the part of the body that arrived with the header */
+	for (line = end + 4; line < header + len; line++) {
+		csum_received += (unsigned char)*line;
+		length_received++;
+	}
+	while ((n = read(fd, body, BODY_SIZE)) > 0) {
+		for (i = 0; i < n; i++) {
+			csum_received += (unsigned char)body[i];
+		}
+		length_received += n;
+	}
+	/* streamed files may come without a checksum */
+	if (n < 0 || fi->csum != csum_received || fi->len != length ||
+	    length != length_received || (has_csum && csum != csum_received)) {
+		fprintf(stderr, "bad response: %s: expected length = %ld, "
+			"csum = %u, got length = %d (%d received), "
+			"csum = %u (%u received)\n", fi->name, fi->len,
+			fi->csum, length, length_received, csum,
+			csum_received);
+		return -1;
+	}
+	return 0;
+}
+
+static void *
+bench_reader(void *arg)
+{
+	struct driver *d = (struct driver *)arg;
+
+	while (1) {
+		sem_wait(&d->sent);
+		if (d->exiting)
+			break;
+		if (bench_response(d->fd, d->fi) < 0) {
+			d->nr_errors++;
+		} else {
+			histogram_record(&d->latency,
+					 bench_now() - d->start);
+		}
+		SYS(close(d->fd));
+		sem_post(&d->received);
+	}
+	return NULL;
+}
+
+static void *
+bench_driver(void *arg)
+{
+	struct driver *d = (struct driver *)arg;
+	struct bench *b = d->b;
+	char buf[MAXLINE];
+	int fds[2];
+	int i;
+
+	SYS(pthread_create(&d->reader, NULL, bench_reader, d));
+	for (i = 0; i < b->nr_times; i++) {
+		d->fi = &b->fileset[workload_next(&b->workload, d->xsubi)];
+		snprintf(buf, MAXLINE,
+			 "GET %s HTTP/1.0\r\nhost: bench\r\n\r\n",
+			 d->fi->name);
+		d->start = bench_now();
+		if (!b->port) {
+			SYS(socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+		} else if ((fds[0] = connect_clientfd(&b->addr)) < 0) {
+			d->nr_errors++;
+			continue;
+		}
+		Rio_write(fds[0], buf, strlen(buf));
+		d->fd = fds[0];
+		sem_post(&d->sent);
+		/* the server closes fds[1] when it is done with it. with no
+		 * worker threads, the server serves one request at a time, in
+		 * the thread that calls server_request, like the accept loop
+		 * of server.c does. */
+		if (!b->port) {
+			if (b->serialize)
+				pthread_mutex_lock(&b->serve_lock);
+			server_request(d->sv, fds[1]);
+			if (b->serialize)
+				pthread_mutex_unlock(&b->serve_lock);
+		}
+		sem_wait(&d->received);
+	}
+	d->exiting = 1;
+	sem_post(&d->sent);
+	pthread_join(d->reader, NULL);
+	return NULL;
+}
+
+/* run one round of requests on sv, and return its results in t */
+static void
+bench_round(struct bench *b, struct server *sv, int round, struct trial *t)
+{
+	struct driver *drivers;
+	struct histogram latency;
+	uint64_t start, end;
+	int i;
+
+	drivers = Malloc(sizeof(struct driver) * b->nr_drivers);
+	start = bench_now();
+	for (i = 0; i < b->nr_drivers; i++) {
+		struct driver *d = &drivers[i];
+
+		d->b = b;
+		d->sv = sv;
+		d->index = i;
+		d->exiting = 0;
+		d->nr_errors = 0;
+		/* every round requests a different sequence of files */
+		workload_seed(d->xsubi, b->seed, round * b->nr_drivers + i);
+		histogram_init(&d->latency);
+		sem_init(&d->sent, 0, 0);
+		sem_init(&d->received, 0, 0);
+		SYS(pthread_create(&d->thread, NULL, bench_driver, d));
+	}
+	histogram_init(&latency);
+	for (i = 0; i < b->nr_drivers; i++) {
+		pthread_join(drivers[i].thread, NULL);
+		histogram_merge(&latency, &drivers[i].latency);
+		b->nr_errors += drivers[i].nr_errors;
+		sem_destroy(&drivers[i].sent);
+		sem_destroy(&drivers[i].received);
+	}
+	end = bench_now();
+	free(drivers);
+
+	t->metric[METRIC_SECONDS] = (end - start) / 1e9;
+	t->metric[METRIC_THROUGHPUT] = latency.count /
+		t->metric[METRIC_SECONDS];
+	t->metric[METRIC_MEAN] = histogram_mean(&latency) / 1000;
+	t->metric[METRIC_P50] = histogram_percentile(&latency, 50) / 1000.0;
+	t->metric[METRIC_P99] = histogram_percentile(&latency, 99) / 1000.0;
+	t->metric[METRIC_P999] = histogram_percentile(&latency, 99.9) / 1000.0;
+}
+
+/* two-sided 95% critical value of Student's t distribution */
+static double
+t_critical(int df)
+{
+	static const double table[] = {
+		12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306,
+		2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120,
+		2.110, 2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064,
+		2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+	};
+
+	if (df < 1)
+		df = 1;
+	if (df <= sizeof(table) / sizeof(table[0]))
+		return table[df - 1];
+	return 1.960;
+}
+
+/* summarize the trials of a configuration into r */
+static void
+bench_summarize(struct trial *trials, int nr_trials, struct result *r)
+{
+	int i, m;
+
+	r->nr_trials = nr_trials;
+	for (m = 0; m < NR_METRICS; m++) {
+		double sum = 0, dev = 0;
+
+		for (i = 0; i < nr_trials; i++) {
+			sum += trials[i].metric[m];
+		}
+		r->mean[m] = sum / nr_trials;
+		for (i = 0; i < nr_trials; i++) {
+			double d = trials[i].metric[m] - r->mean[m];
+
+			dev += d * d;
+		}
+		/* sample standard deviation, and the half-width of the 95%
+		 * confidence interval of the mean */
+		r->std[m] = nr_trials > 1 ? sqrt(dev / (nr_trials - 1)) : 0;
+		r->ci[m] = nr_trials > 1 ? t_critical(nr_trials - 1) *
+			r->std[m] / sqrt(nr_trials) : 0;
+	}
+}
+
+/* start ./server for the configuration r, and wait until it answers a
+ * request. returns its pid. */
+static pid_t
+bench_server_start(struct bench *b, struct result *r)
+{
+	char port[16], threads[16], requests[16], cache_size[16];
+	char buf[MAXLINE];
+	pid_t pid;
+	int fd, i;
+
+	snprintf(port, sizeof(port), "%d", b->port);
+	snprintf(threads, sizeof(threads), "%d", r->nr_threads);
+	snprintf(requests, sizeof(requests), "%d", r->max_requests);
+	snprintf(cache_size, sizeof(cache_size), "%d", r->max_cache_size);
+	SYS(pid = fork());
+	if (pid == 0) {
+		SYS(fd = open("server.log", O_WRONLY | O_CREAT | O_TRUNC,
+			      0644));
+		SYS(dup2(fd, STDOUT_FILENO));
+		SYS(dup2(fd, STDERR_FILENO));
+		execl("./server", "./server", port, threads, requests,
+		      cache_size, (char *)NULL);
+		perror("./server");
+		_exit(1);
+	}
+	/* give it up to 10 seconds to listen */
+	snprintf(buf, MAXLINE, "GET %s HTTP/1.0\r\nhost: bench\r\n\r\n",
+		 b->fileset[0].name);
+	for (i = 0; i < 1000; i++) {
+		if (waitpid(pid, NULL, WNOHANG) == pid)
+			break;
+		if ((fd = connect_clientfd(&b->addr)) >= 0) {
+			Rio_write(fd, buf, strlen(buf));
+			bench_response(fd, &b->fileset[0]);
+			SYS(close(fd));
+			return pid;
+		}
+		usleep(10000);
+	}
+	fprintf(stderr, "./server %s %s %s %s did not start, see server.log\n",
+		port, threads, requests, cache_size);
+	kill(pid, SIGKILL);
+	exit(1);
+}
+
+/* shut the server down as server_shutdown does, and wait for it to exit */
+static void
+bench_server_stop(pid_t pid)
+{
+	int fd, status;
+
+	/* the server has the fifo open for reading until it exits */
+	if ((fd = open("./server_exit", O_WRONLY | O_NONBLOCK)) >= 0) {
+		Rio_write(fd, "shutdown\n", 9);
+		SYS(close(fd));
+	} else {
+		kill(pid, SIGTERM);
+	}
+	SYS(waitpid(pid, &status, 0));
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "./server did not shut down cleanly, see "
+			"server.log\n");
+	}
+}
+
+/* run one configuration: warm-up rounds, whose results are thrown away, and
+ * then the trials, all against the same server so that the warm-up rounds
+ * fill its cache */
+static void
+bench_config(struct bench *b, struct result *r)
+{
+	struct trial *trials;
+	struct server *sv = NULL;
+	pid_t pid = 0;
+	int i;
+
+	/* each configuration sees the same sequence of requests */
+	b->workload.next = 0;
+	b->nr_errors = 0;
+	b->serialize = r->nr_threads == 0;
+	trials = Malloc(sizeof(struct trial) * b->nr_trials);
+	if (b->port)
+		pid = bench_server_start(b, r);
+	else
+		sv = server_init(r->nr_threads, r->max_requests,
+				 r->max_cache_size);
+	for (i = 0; i < b->nr_warmup; i++) {
+		bench_round(b, sv, i, &trials[0]);
+	}
+	/* only the errors of the trials are reported */
+	b->nr_errors = 0;
+	for (i = 0; i < b->nr_trials; i++) {
+		bench_round(b, sv, b->nr_warmup + i, &trials[i]);
+	}
+	if (b->port)
+		bench_server_stop(pid);
+	else
+		server_exit(sv);
+	bench_summarize(trials, b->nr_trials, r);
+	r->nr_errors = b->nr_errors;
+	free(trials);
+}
+
+/* does a differ significantly from b, using Welch's t-test at 95%? */
+static int
+significant(struct result *a, struct result *b, int m)
+{
+	double va, vb, t, df;
+
+	if (a->nr_trials < 2 || b->nr_trials < 2)
+		return 0;
+	va = a->std[m] * a->std[m] / a->nr_trials;
+	vb = b->std[m] * b->std[m] / b->nr_trials;
+	if (va + vb == 0)
+		return a->mean[m] != b->mean[m];
+	t = fabs(a->mean[m] - b->mean[m]) / sqrt(va + vb);
+	df = (va + vb) * (va + vb) / (va * va / (a->nr_trials - 1) +
+				      vb * vb / (b->nr_trials - 1));
+	return t > t_critical((int)df);
+}
+
+/* compare r against the same configuration in the baseline. returns the
+ * number of metrics that got significantly worse. */
+static int
+bench_compare(struct result *baseline, int nr_baseline, struct result *r)
+{
+	struct result *base = NULL;
+	int i, m, nr_regressions = 0;
+
+	for (i = 0; i < nr_baseline; i++) {
+		if (baseline[i].nr_threads == r->nr_threads &&
+		    baseline[i].max_requests == r->max_requests &&
+		    baseline[i].max_cache_size == r->max_cache_size &&
+		    baseline[i].nr_drivers == r->nr_drivers &&
+		    strcmp(baseline[i].workload, r->workload) == 0) {
+			base = &baseline[i];
+			break;
+		}
+	}
+	if (!base)
+		return 0;
+	/* the run time is the inverse of the throughput, so skip it */
+	for (m = METRIC_THROUGHPUT; m < NR_METRICS; m++) {
+		int worse = metrics[m].higher_is_better ?
+			r->mean[m] < base->mean[m] : r->mean[m] > base->mean[m];
+
+		if (worse && significant(r, base, m)) {
+			printf("  regression: %s %.1f -> %.1f (%+.1f%%)\n",
+			       metrics[m].name, base->mean[m], r->mean[m],
+			       100 * (r->mean[m] - base->mean[m]) /
+			       base->mean[m]);
+			nr_regressions++;
+		}
+	}
+	return nr_regressions;
+}
+
+static void
+result_write_header(FILE *f)
+{
+	int m;
+
+	fprintf(f, "threads,requests,cache_size,workload,drivers,trials,"
+		"errors");
+	for (m = 0; m < NR_METRICS; m++) {
+		fprintf(f, ",%s,%s_std,%s_ci", metrics[m].name,
+			metrics[m].name, metrics[m].name);
+	}
+	fprintf(f, "\n");
+}
+
+static void
+result_write(FILE *f, struct result *r)
+{
+	int m;
+
+	fprintf(f, "%d,%d,%d,%s,%d,%d,%ld", r->nr_threads, r->max_requests,
+		r->max_cache_size, r->workload, r->nr_drivers, r->nr_trials,
+		r->nr_errors);
+	for (m = 0; m < NR_METRICS; m++) {
+		fprintf(f, ",%.6g,%.6g,%.6g", r->mean[m], r->std[m], r->ci[m]);
+	}
+	fprintf(f, "\n");
+	fflush(f);
+}
+
+/* next comma-separated field of a line, or "" if there are no more */
+static char *
+next_field(char **save)
+{
+	char *tok = strtok_r(NULL, ",\n", save);
+
+	return tok ? tok : "";
+}
+
+/* read a results file written with -o. returns the results, and their
+ * number in nr. */
+static struct result *
+result_load(char *filename, int *nr)
+{
+	struct result *results = NULL;
+	char line[MAXLINE], *save;
+	int n = 0, size = 0, m;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (!f) {
+		perror(filename);
+		exit(1);
+	}
+	while (fgets(line, MAXLINE, f)) {
+		struct result *r;
+
+		/* skip the header */
+		if (!isdigit(line[0]))
+			continue;
+		if (n == size) {
+			size = size ? size * 2 : 16;
+			results = realloc(results, sizeof(struct result) * size);
+			assert(results);
+		}
+		r = &results[n];
+		r->nr_threads = atoi(strtok_r(line, ",", &save));
+		r->max_requests = atoi(next_field(&save));
+		r->max_cache_size = atoi(next_field(&save));
+		r->workload = strdup(next_field(&save));
+		r->nr_drivers = atoi(next_field(&save));
+		r->nr_trials = atoi(next_field(&save));
+		r->nr_errors = atol(next_field(&save));
+		for (m = 0; m < NR_METRICS; m++) {
+			r->mean[m] = atof(next_field(&save));
+			r->std[m] = atof(next_field(&save));
+			r->ci[m] = atof(next_field(&save));
+		}
+		n++;
+	}
+	fclose(f);
+	*nr = n;
+	return results;
+}
+
+/* parse a comma-separated list of integers >= min into values */
+static int
+parse_list(char *arg, int *values, int min)
+{
+	int n = 0;
+	char *tok, *save;
+
+	for (tok = strtok_r(arg, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (n == MAX_LIST)
+			return -1;
+		values[n] = atoi(tok);
+		if (values[n] < min)
+			return -1;
+		n++;
+	}
+	return n > 0 ? n : -1;
+}
+
+/* split a comma-separated list of names into names */
+static int
+parse_names(char *arg, char **names)
+{
+	int n = 0;
+	char *tok, *save;
+
+	for (tok = strtok_r(arg, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (n == MAX_LIST)
+			return -1;
+		names[n++] = tok;
+	}
+	return n > 0 ? n : -1;
+}
+
+static void
+usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-t nr_threads,...] [-q max_requests,...] "
+		"[-c max_cache_size,...] [-d workload,...] [-n nr_drivers,...] "
+		"[-r nr_times] [-w nr_warmup] [-N nr_trials] [-D disk_delay] "
+		"[-S seed] [-p port] [-o results] [-b baseline] fileset\n"
+		"  -t  server worker threads (default: 8)\n"
+		"  -q  server request queue size (default: 8)\n"
+		"  -c  server cache size in bytes (default: 0)\n"
+		"  -d  files to request (default: uniform, see workload.h)\n"
+		"  -n  driver threads sending requests (default: 10)\n"
+		"  -r  requests sent by each driver per round (default: 100)\n"
+		"  -w  warm-up rounds per configuration (default: 1)\n"
+		"  -N  measured rounds (trials) per configuration (default: 5)\n"
+		"  -D  simulated disk latency in usec (default: 10000)\n"
+		"  -S  random seed (default: 1)\n"
+		"  -p  send the requests to ./server processes on this port,\n"
+		"      started for each configuration, instead of linking the\n"
+		"      server in. -D does not apply\n"
+		"  -o  write the results to this csv file\n"
+		"  -b  compare with the results in this csv file, and exit with\n"
+		"      status 2 if any metric got significantly worse\n",
+		program);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int threads[MAX_LIST] = { 8 }, nr_threads = 1;
+	int requests[MAX_LIST] = { 8 }, nr_requests = 1;
+	int cache_sizes[MAX_LIST] = { 0 }, nr_cache_sizes = 1;
+	int drivers[MAX_LIST] = { 10 }, nr_drivers = 1;
+	char *workload_names[MAX_LIST] = { "uniform" };
+	struct workload workloads[MAX_LIST];
+	int nr_workloads = 1;
+	char *results_file = NULL, *baseline_file = NULL;
+	struct result *baseline = NULL;
+	int nr_baseline = 0, nr_regressions = 0;
+	FILE *results = NULL;
+	struct bench b;
+	int c, i, nr_configs, disk_delay = 0;
+
+	b.nr_times = 100;
+	b.nr_warmup = 1;
+	b.nr_trials = 5;
+	b.seed = 1;
+	b.port = 0;
+	pthread_mutex_init(&b.serve_lock, NULL);
+	while ((c = getopt(argc, argv, "t:q:c:d:n:r:w:N:D:S:p:o:b:")) != -1) {
+		switch (c) {
+		case 't':
+			if ((nr_threads = parse_list(optarg, threads, 0)) < 0)
+				usage(argv[0]);
+			break;
+		case 'q':
+			if ((nr_requests = parse_list(optarg, requests, 1)) < 0)
+				usage(argv[0]);
+			break;
+		case 'c':
+			if ((nr_cache_sizes = parse_list(optarg, cache_sizes,
+							 0)) < 0)
+				usage(argv[0]);
+			break;
+		case 'd':
+			if ((nr_workloads = parse_names(optarg,
+							workload_names)) < 0)
+				usage(argv[0]);
+			break;
+		case 'n':
+			if ((nr_drivers = parse_list(optarg, drivers, 1)) < 0)
+				usage(argv[0]);
+			break;
+		case 'r':
+			b.nr_times = atoi(optarg);
+			break;
+		case 'w':
+			b.nr_warmup = atoi(optarg);
+			break;
+		case 'N':
+			b.nr_trials = atoi(optarg);
+			break;
+		case 'D':
+			request_disk_delay = atoi(optarg);
+			disk_delay = 1;
+			break;
+		case 'S':
+			b.seed = atol(optarg);
+			break;
+		case 'p':
+			b.port = atoi(optarg);
+			if (b.port <= 0 || b.port > 65535)
+				usage(argv[0]);
+			break;
+		case 'o':
+			results_file = optarg;
+			break;
+		case 'b':
+			baseline_file = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1 || b.nr_times <= 0 || b.nr_warmup < 0 ||
+	    b.nr_trials <= 0 || request_disk_delay < 0 ||
+	    (b.port && disk_delay)) {
+		usage(argv[0]);
+	}
+	if (b.port)
+		resolve_host("127.0.0.1", b.port, &b.addr);
+	b.fileset = fileset_load(argv[optind], &b.nr_files);
+	for (i = 0; i < nr_workloads; i++) {
+		if (workload_init(&workloads[i], workload_names[i], b.fileset,
+				  b.nr_files) < 0) {
+			usage(argv[0]);
+		}
+	}
+	if (baseline_file) {
+		baseline = result_load(baseline_file, &nr_baseline);
+	}
+	if (results_file) {
+		results = fopen(results_file, "w");
+		if (!results) {
+			perror(results_file);
+			exit(1);
+		}
+		result_write_header(results);
+	}
+	/* the server prints its request statistics on exit otherwise */
+	server_config.quiet = 1;
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%7s %8s %10s %7s %9s %8s %9s %8s %9s %8s %6s %s\n", "threads",
+	       "requests", "cache_size", "drivers", "req/s", "+-", "p50_us",
+	       "+-", "p99_us", "+-", "errors", "workload");
+	/* run every combination of the lists, the last list varying fastest */
+	nr_configs = nr_threads * nr_requests * nr_cache_sizes * nr_workloads *
+		nr_drivers;
+	for (i = 0; i < nr_configs; i++) {
+		struct result r;
+		int config = i;
+
+		r.nr_drivers = drivers[config % nr_drivers];
+		config /= nr_drivers;
+		b.workload = workloads[config % nr_workloads];
+		r.workload = workload_names[config % nr_workloads];
+		config /= nr_workloads;
+		r.max_cache_size = cache_sizes[config % nr_cache_sizes];
+		config /= nr_cache_sizes;
+		r.max_requests = requests[config % nr_requests];
+		config /= nr_requests;
+		r.nr_threads = threads[config];
+		b.nr_drivers = r.nr_drivers;
+		bench_config(&b, &r);
+		printf("%7d %8d %10d %7d %9.1f %8.1f %9.1f %8.1f %9.1f %8.1f "
+		       "%6ld %s\n", r.nr_threads, r.max_requests,
+		       r.max_cache_size, r.nr_drivers,
+		       r.mean[METRIC_THROUGHPUT], r.ci[METRIC_THROUGHPUT],
+		       r.mean[METRIC_P50], r.ci[METRIC_P50],
+		       r.mean[METRIC_P99], r.ci[METRIC_P99], r.nr_errors,
+		       r.workload);
+		if (baseline) {
+			nr_regressions += bench_compare(baseline, nr_baseline,
+							&r);
+		}
+		fflush(stdout);
+		if (results)
+			result_write(results, &r);
+	}
+	if (results)
+		fclose(results);
+	for (i = 0; i < nr_workloads; i++) {
+		workload_destroy(&workloads[i]);
+	}
+	if (nr_regressions > 0) {
+		printf("%d significant regressions\n", nr_regressions);
+		exit(2);
+	}
+	exit(0);
+}
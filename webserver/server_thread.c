@@ -1,141 +1,479 @@
 #include "request.h"
 #include "server_thread.h"
 #include "common.h"
+#include "cache.h"
+#include "shcache.h"
+#include "watch.h"
+#include "spill.h"
+#include "prefetch.h"
+#include "rtrace.h"
+#include "stats.h"
+#include "logger.h"
+#include "uthread.h"
+#include "tracer.h"
+
+//bytes of error responses kept by the negative cache
+#define NEGATIVE_CACHE_SIZE (1 << 20)
+
+//an accepted connection waiting for a worker thread
+struct conn {
+	int connfd;	//socket descriptor of the client connection
+	uint64_t accepted;	//stats_now() when the connection was queued
+	uint64_t trace;	//the request in the tracer, 0 if it is not traced
+	struct server * sv;	//the server, for a user-level thread
+};
+
+//a parsed request waiting for a worker thread, see server_config.sjf_aging
+struct job {
+	struct request * rq;
+	struct file_data * data;
+	uint64_t accepted;	//stats_now() when the connection was queued
+	uint64_t queued;	//nanoseconds the connection waited in sv->buffer
+	uint64_t parsed;	//stats_now() when the request was parsed
+	uint64_t due;	//server_now() when parsed, plus the time its file is worth
+	uint64_t trace;	//the request in the tracer, 0 if it is not traced
+};
 
 struct server {
 	int nr_threads;	//number of threads
 	int max_requests;	//number of requests
 	int max_cache_size;	//max cache size
 	int exiting;	//determines whether program should exit or not
-	int * buffer;	
+	struct conn * buffer;	//queue of accepted connections
 	int in;	//read value location
 	int out;	//send value location
 	pthread_mutex_t * lock;	//lock for the server
 	pthread_cond_t * empty;	//when full, the threads that are waiting queue
 	pthread_cond_t * full;	//when empty, ^     ^     ^    ^     ^      ^
 	pthread_t * tid;	//holds a pointer to the thread ids
+	struct cache * cache;	//file cache, NULL when max_cache_size is 0
+	struct shcache * shared;	//file cache of the prefork mode, or NULL
+	struct spill * spill;	//files evicted from the cache, or NULL
+	struct prefetch * prefetch;	//loads likely-next files into the cache, or NULL
+	struct rtrace * rtrace;	//trace of the requests, or NULL
+	struct cache * negative;	//error responses by path, NULL when not watching
+	struct watch * watch;	//invalidates the caches, NULL when not watching
+	struct uthreads * uthreads;	//runs the connections, NULL without user-level threads
+	int active;	//connections running in user-level threads
+	struct job * jobs;	//a min-heap of parsed requests by due time, NULL when FIFO
+	int nr_jobs;	//number of parsed requests
+	int access_fd;	//the access log, or -1
 	/* add any other parameters you need */
 };
 
-//main cache structure
-struct cash { 
-	struct node ** cashTable; //cache table, holds head of the hash linked list for hash values (array of linked lists)
-	int size;	//total size of cache table
-	int cashAvailable;	//available memory in cache
-	pthread_mutex_t * safe;	//lock for accessing the cache table
-	struct node * counterfeitCash;	//pointer to head of linked list which holds all of inserted files
+//globals
+//optional settings, see server_thread.h. server and server_bench both start
+//from these defaults
+struct server_config server_config = {
+	.trace_sample = 16,
 };
 
-//data entry for the linked list
-typedef struct node {
-	struct file_data * file;	//holds the actual file
-	struct node * nextNode;	//holds the pointer to the next item in linked list
-	int users;	//number of threads currently using the data (this variable is only updated within the cache, not the LRU even though both the LRU and cache use this struct)
-}Node;
-
-//globals
-struct cash * Cash;	//main cache table
+//the watcher used by server_stat, there is one per process
+static struct watch * server_watch;
 
 /* static functions */
 void server_response(struct server *sv);	//threads all reading the passed files
-unsigned long hash(char *str);	//hash function
-Node * lookup_cash(struct file_data * file);	//lookups in the cache for a specific file
-void insert_cash_table(struct file_data * file); 	//inserts a file into the cache table
-void insert_cash(struct file_data *file);	//determines whether to evict prior to inserting into cache table
-void evict_cash(int amount_to_evict);	//evicts the largest node that takes up the most memory in the cache table
-void spend_cash(struct file_data *file);	//removes and frees nodes from the cache table
-void insert_latest_cash_use(struct file_data * file);	//inserts file into linked list lru at tail, if exists, return
-void go_bankrupt();	//deletes and frees cache table
-void burn_cash_trace();	//deletes and frees LRU linked list
-void printcash();	//prints the cache and the LRU (mostly for debugging)
-
-/* initialize file data */
-static struct file_data *
-file_data_init(void)
+static void server_uthread(void *arg);	//a user-level thread serving one connection
+
+//request_stat, answered by the watcher
+static int
+server_stat(const char *path, struct stat *sbuf)
+{
+	return watch_stat(server_watch, path, sbuf);
+}
+
+//request_csum_lookup and request_csum_store, kept by the watcher
+static int
+server_csum_lookup(const char *path, long size, time_t mtime,
+		   unsigned int *csum)
+{
+	return watch_csum(server_watch, path, size, mtime, csum);
+}
+
+static void
+server_csum_store(const char *path, long size, time_t mtime,
+		  unsigned int csum)
+{
+	watch_set_csum(server_watch, path, size, mtime, csum);
+}
+
+//CLOCK_MONOTONIC in nanoseconds, unlike stats_now() also without STATS
+static uint64_t
+server_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//record a request for the file of data in the trace, if there is one
+static void
+server_trace(struct server *sv, struct file_data *data, int flags)
+{
+	if (sv->rtrace){
+		rtrace_write(sv->rtrace, data->file_name, data->file_size, flags);
+	}
+}
+
+/* serve the ranges of a file that is larger than the cache from chunks of
+ * the file, reading the chunks that are not cached from disk and caching
+ * them. returns 0, without sending anything, if the file is not served this
+ * way. */
+static int
+server_send_chunks(struct server *sv, struct request *rq,
+		   struct file_data *data)
+{
+	long chunk_size = server_config.chunk_size;
+	long start, len, first, offset, n, i;
+	struct cache_entry **entries;
+	struct file_data **chunks;
+	long *index;
+	int nr_ranges, nr_chunks = 0, r, k;
+	unsigned long generation;
+	uint64_t now;
+
+	if (chunk_size <= 0 || data->file_size <= sv->max_cache_size)
+		return 0;
+	if ((nr_ranges = request_nr_ranges(rq)) <= 0)
+		return 0;
+	for (r = 0; r < nr_ranges; r++) {
+		request_range(rq, r, &start, &len);
+		nr_chunks += (start + len - 1) / chunk_size -
+			start / chunk_size + 1;
+	}
+	entries = Malloc(sizeof(struct cache_entry *) * nr_chunks);
+	chunks = Malloc(sizeof(struct file_data *) * nr_chunks);
+	index = Malloc(sizeof(long) * nr_chunks);
+	generation = cache_generation(sv->cache, data->file_name);
+	for (r = 0, k = 0; r < nr_ranges; r++) {
+		request_range(rq, r, &start, &len);
+		for (i = start / chunk_size;
+		     i <= (start + len - 1) / chunk_size; i++, k++) {
+			first = i * chunk_size;
+			index[k] = i;
+			entries[k] = cache_lookup_chunk(sv->cache,
+							data->file_name, i);
+			if (entries[k]) {
+				chunks[k] = cache_entry_data(entries[k]);
+			} else {
+				now = stats_now();
+				n = data->file_size - first;
+				chunks[k] = request_readchunk(rq, first,
+					n < chunk_size ? n : chunk_size);
+				chunks[k]->file_generation = generation;
+				stats_record(PHASE_READ, stats_now() - now);
+			}
+			/* the part of the chunk that is in the range */
+			offset = start > first ? start - first : 0;
+			n = start + len < first + chunk_size ?
+				start + len - first - offset :
+				chunk_size - offset;
+			request_add_slice(rq, r, chunks[k]->file_buf + offset,
+					  n);
+		}
+	}
+	request_sendfile(rq);
+	for (k = 0; k < nr_chunks; k++) {
+		if (entries[k]) {
+			cache_release(sv->cache, entries[k]);
+		} else if (cache_insert_chunk(sv->cache, chunks[k],
+					      index[k]) < 0) {
+			file_data_free(chunks[k]);
+		}
+	}
+	free(index);
+	free(chunks);
+	free(entries);
+	return 1;
+}
+
+/* send a file that is larger than stream_size while it is read. returns 0,
+ * without sending anything, if the file is not served this way. */
+static int
+server_stream_file(struct server *sv, struct request *rq,
+		   struct file_data *data)
 {
-	struct file_data *data;
+	long stream_size = server_config.stream_size;
+
+	if (stream_size <= 0 || request_has_ranges(rq))
+		return 0;
+	if (!request_statfile(rq))
+		return 1;	//the error was sent
+	if (data->file_size <= stream_size)
+		return 0;
+	request_streamfile(rq);
+	server_trace(sv, data, 0);
+	return 1;
+}
 
-	data = Malloc(sizeof(struct file_data));
-	data->file_name = NULL;
-	data->file_buf = NULL;
-	data->file_size = 0;
-	return data;
+/* send a file that the cache evicted to the spill tier, and put it back in
+ * the cache. returns 0, without sending anything, if the file is not in the
+ * spill tier. */
+static int
+server_send_spilled(struct server *sv, struct request *rq,
+		    struct file_data *data)
+{
+	struct file_data *spilled;
+	uint64_t start;
+
+	if (!sv->spill)
+		return 0;
+	start = stats_now();
+	spilled = spill_get(sv->spill, data->file_name);
+	stats_record(PHASE_READ, stats_now() - start);
+	if (!spilled)
+		return 0;
+	spilled->file_generation = data->file_generation;
+	request_set_data(rq, spilled);
+	request_sendfile(rq);
+	server_trace(sv, spilled, 0);
+	if (cache_insert(sv->cache, spilled) < 0){
+		file_data_free(spilled);
+	}
+	return 1;
 }
 
-/* free all file data */
+/* send the error response cached for the requested file, if there is one.
+ * returns 0, without sending anything, if there is none. */
+static int
+server_send_negative(struct server *sv, struct request *rq,
+		     struct file_data *data)
+{
+	struct cache_entry *entry;
+
+	if (!sv->negative)
+		return 0;
+	entry = cache_lookup(sv->negative, data->file_name);
+	if (!entry)
+		return 0;
+	request_send_error(rq, cache_entry_data(entry));
+	cache_release(sv->negative, entry);
+	return 1;
+}
+
+/* cache the error response that was sent for the requested file. generation
+ * is that of the negative cache before the file was looked up. */
 static void
-file_data_free(struct file_data *data)
+server_insert_negative(struct server *sv, struct request *rq,
+		       unsigned long generation)
 {
-	free(data->file_name);
-	free(data->file_buf);
-	free(data);
+	struct file_data *error;
+
+	if (!sv->negative || !(error = request_error_data(rq)))
+		return;
+	error->file_generation = generation;
+	if (cache_insert(sv->negative, error) < 0) {
+		file_data_free(error);
+	}
 }
 
+/* serve the requested file from the cache shared by the worker processes,
+ * reading it from disk and adding it to the cache on a miss */
 static void
-do_server_request(struct server *sv, int connfd)
+server_shared_request(struct server *sv, struct request *rq,
+		      struct file_data *data)
 {
+	struct shcache_entry *entry;
+	struct file_data cached;
+	uint64_t start;
 	int ret;
-	struct request *rq;
-	struct file_data *data;
 
-	data = file_data_init();
+	memset(&cached, 0, sizeof(cached));
+	entry = shcache_lookup(sv->shared, data->file_name, &cached);
+	if (entry){	//cached points into the shared memory until the release
+		request_set_data(rq, &cached);
+		request_sendfile(rq);
+		server_trace(sv, &cached, RTRACE_HIT);
+		shcache_release(sv->shared, entry);
+		return;
+	}
+	data->file_generation = shcache_generation(sv->shared, data->file_name);	//the file may change while it is read
+	if (server_stream_file(sv, rq, data)){
+		return;
+	}
+	start = stats_now();
+	if (request_has_ranges(rq)){	//only read what is sent
+		ret = request_readranges(rq);
+	} else {
+		ret = request_readfile(rq);
+	}
+	stats_record(PHASE_READ, stats_now() - start);
+	if (ret == 0) { /* couldn't read file */
+		return;
+	}
+	request_sendfile(rq);
+	server_trace(sv, data, 0);
+	if (!request_has_ranges(rq)){	//the other processes can use it too
+		shcache_insert(sv->shared, data);
+	}
+}
+
+/* look up the requested file in the L1 cache of the thread, if it has one,
+ * and in the cache */
+static struct cache_entry *
+server_lookup(struct server *sv, struct cache_l1 *l1, struct file_data *data)
+{
+	if (l1)
+		return cache_l1_lookup(l1, data->file_name);
+	return cache_lookup(sv->cache, data->file_name);
+}
+
+static void
+server_release(struct server *sv, struct cache_l1 *l1,
+	       struct cache_entry *entry)
+{
+	if (l1)
+		cache_l1_release(l1, entry);
+	else
+		cache_release(sv->cache, entry);
+}
+
+/* read the request on connfd, and fill data->file_name with the name of the
+ * file being requested. returns NULL, and frees data, if there is no valid
+ * request. */
+static struct request *
+server_parse(int connfd, struct file_data *data)
+{
+	struct request *rq;
+	uint64_t start;
 
-	/* fill data->file_name with name of the file being requested */
+	start = stats_now();
 	rq = request_init(connfd, data);
+	stats_record(PHASE_PARSE, stats_now() - start);
 	if (!rq) {
 		file_data_free(data);
-		return;
+	}
+	return rq;
+}
+
+//send the response to the parsed request rq, l1 is the L1 cache of the calling thread, or NULL
+static void
+server_serve(struct server *sv, struct cache_l1 *l1, struct request *rq,
+	     struct file_data *data, uint64_t accepted)
+{
+	int ret;
+	uint64_t start;
+	unsigned long negative_generation = 0;
+
+	if (sv->negative){	//files that were not found are not looked up again
+		negative_generation = cache_generation(sv->negative,
+						      data->file_name);
+		if (server_send_negative(sv, rq, data)){
+			goto out;
+		}
+	}
+	if (sv->shared){	//the prefork mode
+		server_shared_request(sv, rq, data);
+		goto out;
 	}
 	/* read file, 
 	 * fills data->file_buf with the file contents,
 	 * data->file_size with file size. */
-	Node * cacheData = NULL;
-	if (sv->max_cache_size > 0){	//checks if size of the cache greater than 0
-		pthread_mutex_lock(Cash->safe);	//since reading through cache, lock the data
-		cacheData = lookup_cash(data);	//check if the data exists or not
-		if (cacheData != NULL){	//if it does, update the data of the request and send the data
-			cacheData->users++;	//since someone is reading through the data in the cache, increment users
-			request_set_data(rq, cacheData->file);	//update data
-			pthread_mutex_unlock(Cash->safe);
-
+	if (sv->cache){	//checks if there is a cache
+		struct cache_entry * entry = server_lookup(sv, l1, data);	//check if the data exists or not
+		if (entry != NULL){	//if it does, send the cached data
+			struct file_data * cached = cache_entry_data(entry);
+			struct file_data * inflated = NULL;
+			if (sv->prefetch){
+				prefetch_access(sv->prefetch, data->file_name, 1);
+			}
+			request_set_data(rq, cached);	//update data
+			if (cached->file_buf == NULL && !request_accepts_gzip(rq) &&
+			    !request_not_modified(rq)){	//only the gzip copy is cached, and it is needed
+				inflated = cache_entry_inflate(entry);
+				request_set_data(rq, inflated);
+			}
 			request_sendfile(rq);
-
-			pthread_mutex_lock(Cash->safe);
-			cacheData->users--;	//decrement users since we are no longer reading the data, decrement
+			server_trace(sv, cached, RTRACE_HIT);
+			server_release(sv, l1, entry);	//we are no longer reading the data
 			request_destroy(rq);
-			pthread_mutex_unlock(Cash->safe);
-
+			file_data_free(data);
+			if (inflated != NULL){
+				file_data_free(inflated);
+			}
+			stats_record(PHASE_TOTAL, stats_now() - accepted);
 			return;
 		}
-		pthread_mutex_unlock(Cash->safe);
 		//if the data does not yet exist:
-		request_readfile(rq);	//read
-		request_sendfile(rq);	//send
-
-		pthread_mutex_lock(Cash->safe);
-		cacheData = lookup_cash(data);	//check again
-		if (cacheData == NULL){
-			insert_cash(data);	//insert into the cache
-			insert_latest_cash_use(data);	//as well as into the lru
+		data->file_generation = cache_generation(sv->cache, data->file_name);	//the file may change while it is read
+		if (sv->prefetch){
+			prefetch_access(sv->prefetch, data->file_name, 0);
 		}
-		else {
-			file_data_free(data);
+		if (server_send_spilled(sv, rq, data)){	//the second tier
+			goto out;
+		}
+		if (request_has_ranges(rq)){	//large files are served in chunks
+			if (!request_statfile(rq)){
+				goto out;
+			}
+			if (request_not_modified(rq)){	//a 304 needs only the metadata
+				request_sendfile(rq);
+				goto out;
+			}
+			if (server_send_chunks(sv, rq, data)){
+				goto out;
+			}
+		}
+		if (server_stream_file(sv, rq, data)){	//too large to read into memory
+			goto out;
+		}
+		start = stats_now();
+		if (sv->prefetch){	//the prefetcher waits while the disk is busy
+			prefetch_read_begin(sv->prefetch);
+		}
+		ret = request_readfile(rq);	//read
+		if (sv->prefetch){
+			prefetch_read_end(sv->prefetch);
+		}
+		stats_record(PHASE_READ, stats_now() - start);
+		if (ret == 0) { /* couldn't read file */
+			goto out;
 		}
+		request_sendfile(rq);	//send
+		server_trace(sv, data, 0);
 		request_destroy(rq);
-		pthread_mutex_unlock(Cash->safe);
+		if (cache_insert(sv->cache, data) < 0){	//insert into the cache, unless another thread did
+			file_data_free(data);
+		}
+		stats_record(PHASE_TOTAL, stats_now() - accepted);
 		return;
 	}
 
 	else {	//if cache size = 0, use given function 
-		ret = request_readfile(rq);
+		if (server_stream_file(sv, rq, data)){
+			goto out;
+		}
+		start = stats_now();
+		if (request_has_ranges(rq)){	//only read what is sent
+			ret = request_readranges(rq);
+		} else {
+			ret = request_readfile(rq);
+		}
+		stats_record(PHASE_READ, stats_now() - start);
 		if (ret == 0) { /* couldn't read file */
 			goto out;
 		}
 		/* send file to client */
 		request_sendfile(rq);
+		server_trace(sv, data, 0);
 	out:
+		server_insert_negative(sv, rq, negative_generation);	//if an error was sent
 		request_destroy(rq);
 		file_data_free(data);
+		stats_record(PHASE_TOTAL, stats_now() - accepted);
+	}
+}
+
+static void
+do_server_request(struct server *sv, struct cache_l1 *l1, int connfd,
+		  uint64_t accepted)
+{
+	struct file_data *data = file_data_init();
+	struct request *rq = server_parse(connfd, data);
+
+	if (rq){
+		server_serve(sv, l1, rq, data, accepted);
 	}
 }
 
@@ -151,6 +489,18 @@ server_init(int nr_threads, int max_requests, int max_cache_size)
 	sv->max_requests = max_requests + 1;
 	sv->max_cache_size = max_cache_size;
 	sv->exiting = 0;
+	sv->cache = NULL;
+	sv->shared = server_config.shared;
+	sv->spill = NULL;
+	sv->prefetch = NULL;
+	sv->rtrace = NULL;
+	sv->negative = NULL;
+	sv->watch = NULL;
+	sv->uthreads = NULL;
+	sv->active = 0;
+	sv->jobs = NULL;
+	sv->nr_jobs = 0;
+	sv->access_fd = -1;
 	sv->in = 0;
 	sv->out = 0;
 	sv->lock = Malloc(sizeof(pthread_mutex_t));
@@ -159,26 +509,99 @@ server_init(int nr_threads, int max_requests, int max_cache_size)
 	pthread_mutex_init(sv->lock, NULL);
 	pthread_cond_init(sv->empty, NULL);
 	pthread_cond_init(sv->full, NULL);
+	if (server_config.access_log){
+		sv->access_fd = open(server_config.access_log,
+				     O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (sv->access_fd < 0){
+			perror(server_config.access_log);
+		}
+	}
+	if (server_config.chrome_trace){
+		tracer_init(server_config.trace_sample);
+	}
+	logger_init(STDOUT_FILENO, sv->access_fd);	//requests do not wait for stdout or the access log
+	if (server_config.rtrace){
+		sv->rtrace = rtrace_open(server_config.rtrace);
+		if (!sv->rtrace){
+			perror(server_config.rtrace);
+		}
+	}
 	
 	if (nr_threads > 0 || max_requests > 0 || max_cache_size > 0) {
 		/* Lab 4: create queue of max_request size when max_requests > 0 */
-		sv->buffer = Malloc(sizeof(int) * max_requests);
+		sv->buffer = Malloc(sizeof(struct conn) * sv->max_requests);
 		/* Lab 5: init server cache and limit its size to max_cache_size */
-		if (max_cache_size > 0){
-			Cash = Malloc (sizeof(struct cash));
-			Cash->safe = Malloc(sizeof(pthread_mutex_t));
-			pthread_mutex_init(Cash->safe, NULL);
-			Cash->size = max_cache_size + 1;
-			Cash->cashAvailable = max_cache_size;
-			Cash->cashTable = (Node **)Malloc(Cash->size * sizeof(Node * ));
-			Cash->counterfeitCash = NULL;
-			for (int i = 0; i < Cash->size; i++){
-				Cash->cashTable[i] = NULL;
+		if (max_cache_size > 0 && server_config.spill_size > 0 &&
+		    !sv->shared){
+			char * dir = getenv("TMPDIR");
+
+			sv->spill = spill_init(dir ? dir : "/tmp",
+					       server_config.spill_size);
+			if (!sv->spill){
+				perror("spill_init");
+			}
+		}
+		if (max_cache_size > 0 && !sv->shared){
+			struct cache_config config = {
+				.max_size = max_cache_size,
+				.max_rss = server_config.max_rss,
+				.gzip_ratio = server_config.gzip_ratio,
+				.high_watermark = server_config.high_watermark,
+				.low_watermark = server_config.low_watermark,
+				.spill = sv->spill,
+			};
+
+			sv->cache = cache_init(&config);
+		}
+		if (sv->cache && (server_config.prefetch_depth > 0 ||
+				  server_config.prefetch_hints)){
+			struct prefetch_config config = {
+				.depth = server_config.prefetch_depth,
+				.hints = server_config.prefetch_hints,
+				//leave half of the workers the disk to themselves
+				.max_reads = nr_threads / 2,
+			};
+
+			sv->prefetch = prefetch_init(sv->cache, &config);
+		}
+		if (server_config.watch){
+			//errors can only be cached while files are watched
+			struct cache_config config = {
+				.name = "negative cache",
+				.max_size = NEGATIVE_CACHE_SIZE,
+			};
+			struct cache * caches[2];
+
+			sv->negative = cache_init(&config);
+			caches[0] = sv->cache;
+			caches[1] = sv->negative;
+			sv->watch = watch_init(".", caches, 2, sv->shared);
+			if (sv->watch){
+				server_watch = sv->watch;
+				request_stat = server_stat;
+				request_csum_lookup = server_csum_lookup;
+				request_csum_store = server_csum_store;
+			} else {
+				cache_destroy(sv->negative);
+				sv->negative = NULL;
 			}
 		}
 		
 		/* Lab 4: create worker threads when nr_threads > 0 */
 		sv->tid = Malloc(sizeof(pthread_t) * nr_threads);
+		if (server_config.uthreads && nr_threads > 0){
+			//the threads run the connections instead of taking them from the queue
+			sv->uthreads = uthreads_init(nr_threads);
+			rio_wait = uthread_wait_fd;	//sockets park their thread
+			request_usleep = uthread_usleep;
+			nr_threads = 0;
+		}
+		if (server_config.sjf_aging > 0 && nr_threads > 0){
+			//the workers parse the requests, and then serve the smallest first
+			//each worker may queue one more while it parses
+			sv->jobs = Malloc(sizeof(struct job) *
+					  (sv->max_requests + nr_threads));
+		}
 		for (int i = 0; i < nr_threads; i++){
 			pthread_create(&sv->tid[i], NULL, (void *)&server_response, sv);
 		}
@@ -187,43 +610,200 @@ server_init(int nr_threads, int max_requests, int max_cache_size)
 	return sv;
 }
 
+//connections in sv->buffer, and parsed requests, with sv->lock held
+static int
+server_nr_queued(struct server *sv)
+{
+	return (sv->in - sv->out + sv->max_requests) % sv->max_requests +
+		sv->nr_jobs;
+}
+
+static void
+server_job_swap(struct server *sv, int i, int j)
+{
+	struct job job = sv->jobs[i];
+
+	sv->jobs[i] = sv->jobs[j];
+	sv->jobs[j] = job;
+}
+
+//add a parsed request to the heap, with sv->lock held
+static void
+server_push_job(struct server *sv, struct job *job)
+{
+	int i = sv->nr_jobs++;
+
+	sv->jobs[i] = *job;
+	while (i > 0 && sv->jobs[i].due < sv->jobs[(i - 1) / 2].due){
+		server_job_swap(sv, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+//remove the parsed request that is due first, with sv->lock held
+static struct job
+server_pop_job(struct server *sv)
+{
+	struct job job = sv->jobs[0];
+	int i = 0, child;
+
+	sv->jobs[0] = sv->jobs[--sv->nr_jobs];
+	while ((child = 2 * i + 1) < sv->nr_jobs){
+		if (child + 1 < sv->nr_jobs &&
+		    sv->jobs[child + 1].due < sv->jobs[child].due){
+			child++;
+		}
+		if (sv->jobs[i].due <= sv->jobs[child].due){
+			break;
+		}
+		server_job_swap(sv, i, child);
+		i = child;
+	}
+	return job;
+}
+
+/* parse the request on the connection, and queue it to be served when it is
+ * due. the response to a request for a file of size bytes is due size /
+ * sjf_aging milliseconds after the request was parsed, so the smallest
+ * responses are sent first, but a large file is sent before the small files
+ * requested long enough after it. */
+static void
+server_parse_job(struct server *sv, struct conn *conn)
+{
+	struct job job;
+	struct stat sbuf;
+	long size = 0;	//an error response is small
+
+	job.accepted = conn->accepted;
+	job.trace = conn->trace;
+	job.queued = stats_now() - conn->accepted;
+	job.data = file_data_init();
+	job.rq = server_parse(conn->connfd, job.data);
+	if (!job.rq){
+		pthread_mutex_lock(sv->lock);
+		pthread_cond_broadcast(sv->full);
+		pthread_mutex_unlock(sv->lock);
+		return;
+	}
+	//the watcher usually answers this from memory
+	if (request_stat(job.data->file_name, &sbuf) == 0 && S_ISREG(sbuf.st_mode)){
+		size = sbuf.st_size;
+	}
+	job.parsed = stats_now();
+	job.due = server_now() + (uint64_t)size * 1000000 / server_config.sjf_aging;
+	pthread_mutex_lock(sv->lock);
+	server_push_job(sv, &job);
+	pthread_cond_broadcast(sv->empty);
+	pthread_mutex_unlock(sv->lock);
+}
+
 void
 server_request(struct server *sv, int connfd)
 {
+	uint64_t accepted = stats_now();
+
 	if (sv->nr_threads == 0) { /* no worker threads */
-		do_server_request(sv, connfd);
+		do_server_request(sv, NULL, connfd, accepted);
+	} else if (sv->uthreads) {
+		/*  Run the connection in a user-level thread of its own, once
+		 *  fewer than max_requests connections are running. */
+		struct conn * conn;
+
+		pthread_mutex_lock(sv->lock);
+		while (sv->active >= sv->max_requests - 1) {
+			pthread_cond_wait(sv->full, sv->lock);
+		} //full
+		sv->active++;
+		pthread_mutex_unlock(sv->lock);
+		fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+		conn = Malloc(sizeof(struct conn));
+		conn->connfd = connfd;
+		conn->accepted = accepted;
+		conn->trace = tracer_current();
+		conn->sv = sv;
+		uthread_spawn(sv->uthreads, server_uthread, conn);
+		tracer_record(TRACE_ENQUEUE, stats_now() - accepted);
 	} else {
 		/*  Save the relevant info in a buffer and have one of the
 		 *  worker threads do the work. */
 		pthread_mutex_lock(sv->lock);
-		while ((sv->in - sv->out + sv->max_requests) % sv->max_requests == (sv->max_requests - 1)) {
+		while (server_nr_queued(sv) >= sv->max_requests - 1) {
 			pthread_cond_wait(sv->full, sv->lock);
 		} //full
-		sv->buffer[sv->in] = connfd;
+		sv->buffer[sv->in].connfd = connfd;
+		sv->buffer[sv->in].accepted = accepted;
+		sv->buffer[sv->in].trace = tracer_current();
 		pthread_cond_broadcast(sv->empty);
 		sv->in = (sv->in + 1) % sv->max_requests;
 		pthread_mutex_unlock(sv->lock);
+		tracer_record(TRACE_ENQUEUE, stats_now() - accepted);
 	}
 }
 
 void server_response(struct server * sv){
+	struct cache_l1 * l1 = NULL;	//hottest files of this thread
+
+	if (sv->cache && server_config.l1_slots > 0){
+		l1 = cache_l1_init(sv->cache, server_config.l1_slots);
+	}
 	while (1){
+		uint64_t start = stats_now();	//of the wait for a request
+
 		pthread_mutex_lock(sv->lock);
-		while (sv->in == sv->out) {
+		while (sv->in == sv->out && sv->nr_jobs == 0) {
 			if (sv->exiting){
 				pthread_mutex_unlock(sv->lock);
+				if (l1 != NULL){	//before the cache is destroyed
+					cache_l1_destroy(l1);
+				}
 				return;
 			}
 			pthread_cond_wait(sv->empty, sv->lock);
 		} //empty
-		int connfd = sv->buffer[sv->out];
-		pthread_cond_broadcast(sv->full);
+		if (sv->in == sv->out){	//only parsed requests are left, serve the one due first
+			struct job job = server_pop_job(sv);
+			pthread_cond_broadcast(sv->full);
+			pthread_mutex_unlock(sv->lock);
+			tracer_switch(job.trace);
+			tracer_record(TRACE_DEQUEUE, stats_now() - start);
+			stats_record(PHASE_QUEUE, job.queued + stats_now() - job.parsed);
+			server_serve(sv, l1, job.rq, job.data, job.accepted);
+			continue;
+		}
+		struct conn conn = sv->buffer[sv->out];
+		if (!sv->jobs){	//otherwise the connection stays queued until its request is served
+			pthread_cond_broadcast(sv->full);
+		}
 		sv->out = (sv->out + 1) % sv->max_requests;
 		pthread_mutex_unlock(sv->lock);
-		do_server_request(sv, connfd);
+		tracer_switch(conn.trace);
+		tracer_record(TRACE_DEQUEUE, stats_now() - start);
+		if (sv->jobs){
+			server_parse_job(sv, &conn);
+			continue;
+		}
+		stats_record(PHASE_QUEUE, stats_now() - conn.accepted);
+		do_server_request(sv, l1, conn.connfd, conn.accepted);
 	}
 }
 
+static void
+server_uthread(void *arg)
+{
+	struct conn * conn = arg;
+	struct server * sv = conn->sv;
+
+	tracer_switch(conn->trace);
+	stats_record(PHASE_QUEUE, stats_now() - conn->accepted);
+	//the L1 caches are per kernel thread, and would be shared by its threads
+	do_server_request(sv, NULL, conn->connfd, conn->accepted);
+	free(conn);
+	pthread_mutex_lock(sv->lock);
+	sv->active--;
+	pthread_cond_signal(sv->full);
+	pthread_mutex_unlock(sv->lock);
+}
+
 void
 server_exit(struct server *sv)
 {
@@ -235,16 +815,52 @@ server_exit(struct server *sv)
 	pthread_cond_broadcast(sv->full);
 	pthread_cond_broadcast(sv->empty);
 
-	for (int i = 0; i < sv->nr_threads; i++){
-		pthread_join(sv->tid[i], NULL);
+	if (sv->uthreads){	//waits for the connections that are still running
+		uthreads_join(sv->uthreads);
+	} else {
+		for (int i = 0; i < sv->nr_threads; i++){
+			pthread_join(sv->tid[i], NULL);
+		}
 	}
 
-	if (sv->max_cache_size > 0){
-		go_bankrupt();
-		burn_cash_trace();
+	logger_exit();	//the dump follows the log
+	if (sv->access_fd >= 0){
+		close(sv->access_fd);
+	}
+	if (!server_config.quiet) {
+		server_dump(sv);
+	} else if (server_config.chrome_trace) {	//the trace is written anyway
+		tracer_dump(server_config.chrome_trace);
+	}
+	if (sv->watch){
+		request_stat = stat;
+		request_csum_lookup = NULL;
+		request_csum_store = NULL;
+		watch_destroy(sv->watch);
+	}
+	if (sv->negative){
+		cache_destroy(sv->negative);
+	}
+	if (sv->prefetch){	//it inserts into the cache
+		prefetch_destroy(sv->prefetch);
+	}
+	if (sv->rtrace){
+		rtrace_close(sv->rtrace);
+	}
+	if (sv->cache){
+		cache_destroy(sv->cache);
+	}
+	if (sv->spill){
+		spill_destroy(sv->spill);
+	}
+	if (sv->uthreads){
+		uthreads_destroy(sv->uthreads);
 	}
+	stats_exit();
+	tracer_exit();
 	/* make sure to free any allocated resources */
 	free(sv->tid);
+	free(sv->jobs);
 	free(sv->full);
 	free(sv->empty);
 	free(sv->lock);
@@ -252,176 +868,48 @@ server_exit(struct server *sv)
 	
 }
 
-unsigned long hash(char *str)
+void
+server_dump(struct server *sv)
 {
-	unsigned long hash = 5381;
-	int c;
-
-	while ((c = *str++))
-		hash = hash * 33 ^ c;
-
-	return hash % Cash->size;
-}
-
-Node * lookup_cash(struct file_data * file){
-	long index = hash(file->file_name);
-	if (Cash->cashTable[index] == NULL){
-		return NULL;
+	stats_dump(stdout);
+	if (sv->uthreads) {
+		uthreads_dump(sv->uthreads, stdout);
 	}
-	Node * ptr = Cash->cashTable[index];
-	while (ptr != NULL){
-		if (strcmp(ptr->file->file_name, file->file_name) == 0){
-			return ptr;
-		}
-		ptr = ptr->nextNode;
+	if (sv->cache) {
+		cache_dump(sv->cache, stdout);
 	}
-	return NULL;
-}
-
-void insert_cash_table(struct file_data * file){
-	long index = hash(file->file_name);
-	Node * newNode = Malloc(sizeof(Node));
-	newNode->file = file;
-	newNode->nextNode = NULL;
-	newNode->users = 0;
-	if (Cash->cashTable[index] == NULL){	//if nothing there
-		Cash->cashTable[index] = newNode;
-	}
-	else {	//if there is an item, linked list stuff here
-		Node * ptr = Cash->cashTable[index];
-		while (ptr->nextNode != NULL){
-			ptr = ptr->nextNode;
-		}
-		ptr->nextNode = newNode;
+	if (sv->spill) {
+		spill_dump(sv->spill, stdout);
 	}
-	Cash->cashAvailable -= file->file_size;	//decrement the available cache since file was added
-}
-
-void insert_cash(struct file_data *file){
-	if (Cash->cashAvailable < file->file_size){ //if file is too big to fit the cache
-		evict_cash(file->file_size);	//remove some usless stuff from the cache (lru)
+	if (sv->prefetch) {
+		prefetch_dump(sv->prefetch, stdout);
 	}
-	insert_cash_table(file);	
-}
-
-void evict_cash(int amount_to_evict){
-	Node * remove = Cash->counterfeitCash;
-	Node * prev = Cash->counterfeitCash;
-	while (Cash->cashAvailable < amount_to_evict){
-		Node * cash = lookup_cash(remove->file);	//lookup to see if there are any users (this is required since users arent updated within the lru)
-		if (cash->users == 0){	//checks if anyone is reading through a file in the cache 
-			if(remove == Cash->counterfeitCash){	//if at head
-				Cash->counterfeitCash = remove->nextNode;	//do linked list stuff
-				prev = Cash->counterfeitCash;
-				spend_cash(remove->file);	//remove it from cache
-				Cash->cashAvailable += remove->file->file_size;	//increase available cache now the file is removed
-				free(remove);	//free it
-				remove = prev;	//reset the pointers so that more can be freed at next loop
-				continue;	//this continue is here to recheck the head now that the new head is different
-			}
-			else {
-				prev->nextNode = remove->nextNode;
-				spend_cash(remove->file);
-				Cash->cashAvailable += remove->file->file_size;
-				free(remove);
-				remove = prev;	//same as above but no need to use continue since the next one will be checked by going to the next pointer (below)
-			}
-		}
-		prev = remove;
-		remove = remove->nextNode;
+	if (sv->rtrace) {
+		printf("trace: %ld requests recorded in %s\n",
+		       rtrace_records(sv->rtrace), server_config.rtrace);
 	}
-}
-
-void spend_cash(struct file_data *file){
-	long index = hash(file->file_name);
-	if (Cash->cashTable[index] == NULL){
-		return;
-	}
-	Node * ptr = Cash->cashTable[index];
-	Node * prev = Cash->cashTable[index];
-	while (strcmp(ptr->file->file_name, file->file_name) != 0){ //find the node with same file
-		prev = ptr;
-		ptr = ptr->nextNode;
+	if (sv->negative) {
+		cache_dump(sv->negative, stdout);
 	}
-	if (ptr != NULL){	//if it exists, delete by doing linked list nonsense
-		if (ptr == Cash->cashTable[index]){
-			Cash->cashTable[index] = ptr->nextNode;
-			free(ptr);
-			return;
-		}
-		prev->nextNode = ptr->nextNode;
-		free(ptr);
-		return;
+	if (sv->watch) {
+		watch_dump(sv->watch, stdout);
 	}
-}
-
-void insert_latest_cash_use(struct file_data * file){	//insert lru to tail
-	if (Cash->counterfeitCash == NULL){	//if LRU is empty, insert into LRU
-		Node * newNode = Malloc(sizeof(Node));
-		newNode->file = file;
-		newNode->users = 0;
-		newNode->nextNode = NULL;
-		Cash->counterfeitCash = newNode;
-		return;
+	if (logger_dropped(LOGGER_MESSAGES) > 0) {
+		printf("log: %ld messages dropped\n",
+		       logger_dropped(LOGGER_MESSAGES));
 	}
-	else {	//if multiple in LRU
-		Node * ptr = Cash->counterfeitCash;
-		while (ptr->nextNode != NULL){
-			if (strcmp(ptr->file->file_name, file->file_name) == 0){	//if same item exists, exit
-				return;
-			}
-			ptr = ptr->nextNode;
+	if (server_config.chrome_trace) {
+		long nr_spans = tracer_dump(server_config.chrome_trace);
+
+		if (nr_spans < 0) {
+			perror(server_config.chrome_trace);
+		} else {
+			printf("chrome trace: %ld spans written to %s\n",
+			       nr_spans, server_config.chrome_trace);
 		}
-		if (strcmp(ptr->file->file_name, file->file_name) == 0){	//makes sure to theck the list item since while loop exits before checking last item
-			return;
-		}
-		Node * newNode = Malloc(sizeof(Node));
-		newNode->file = file;
-		newNode->users = 0;
-		newNode->nextNode = NULL;
-		ptr->nextNode = newNode;
 	}
-}
-
-void go_bankrupt(){
-	for (int i = 0; i < Cash->size; i++){
-		Node * ptr = Cash->cashTable[i];
-		Node * ptrNext = Cash->cashTable[i];
-		while(ptr != NULL){
-			ptrNext = ptr->nextNode;
-			free(ptr);
-			ptr = ptrNext;
-		}
+	if (logger_dropped(LOGGER_ACCESS) > 0) {
+		printf("log: %ld access log lines dropped\n",
+		       logger_dropped(LOGGER_ACCESS));
 	}
-	free(Cash->cashTable);
-	free(Cash->safe);
-	free(Cash);
 }
-
-void burn_cash_trace(){
-	Node * ptr = Cash->counterfeitCash;
-	Node * ptrNext = Cash->counterfeitCash;
-	while(ptr != NULL){
-		ptrNext = ptr->nextNode;
-		free(ptr);
-		ptr = ptrNext;
-	}
-}
-
-void printcash(){
-	for (int i = 0; i<Cash->size; i++){
-		Node * ptr = Cash->cashTable[i];
-		while (ptr != NULL){
-			printf("%s ->", ptr->file->file_name);
-			ptr=ptr->nextNode;
-		}
-	}
-	printf("\n");
-
-	Node * ptr = Cash->counterfeitCash;
-	while (ptr != NULL){
-		printf("%s ->", ptr->file->file_name);
-		ptr=ptr->nextNode;
-	}
-	printf("\n");
-}
\ No newline at end of file
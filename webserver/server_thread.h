@@ -3,9 +3,69 @@
 
 struct server;
 
+/* optional server settings. they must be set before server_init. */
+struct server_config {
+	int quiet;	/* don't print statistics in server_exit */
+	long max_rss;	/* stop caching above this RSS in bytes, if > 0 */
+	double gzip_ratio;	/* see struct cache_config, 0 disables gzip */
+	/* see struct cache_config, a high watermark of 0 evicts files in the
+	 * workers instead of a reclaimer thread */
+	double high_watermark;
+	double low_watermark;
+	/* ranges of files larger than the cache are cached in chunks of this
+	 * many bytes. 0 disables chunks. */
+	long chunk_size;
+	/* files larger than this many bytes are sent while they are read
+	 * instead of being read into memory first. 0 disables streaming. */
+	long stream_size;
+	/* bytes of the spill tier beneath the cache, in a file in $TMPDIR or
+	 * /tmp (see spill.h). 0 disables it. */
+	long spill_size;
+	/* files each worker thread keeps pinned in an L1 cache in front of the
+	 * cache (see cache.h). 0 disables it. */
+	int l1_slots;
+	/* likely successors of each requested file to prefetch into the
+	 * cache, as learned from the requests (see prefetch.h). 0 disables
+	 * prefetching, unless there are hints. */
+	int prefetch_depth;
+	/* file of the files to prefetch after each file, or NULL */
+	const char *prefetch_hints;
+	/* record the requests for files in this binary trace, which cache_sim
+	 * replays (see rtrace.h), or NULL */
+	const char *rtrace;
+	/* watch the current directory, which holds the files, for changes
+	 * (see watch.h) */
+	int watch;
+	/* the cache shared by the worker processes of the prefork mode (see
+	 * shcache.h), which the process uses instead of a cache of its own,
+	 * or NULL */
+	struct shcache *shared;
+	/* serve each connection in a user-level thread of its own, on
+	 * nr_threads kernel threads (see uthread.h), instead of queueing the
+	 * connections for nr_threads worker threads */
+	int uthreads;
+	/* serve the requests for the smallest files first, once the workers
+	 * have parsed them. a request is due when it was parsed, plus a
+	 * millisecond for every sjf_aging bytes of its file, and the one due
+	 * first is served first, so large files still get their turn. 0
+	 * serves the connections in the order they were accepted. */
+	long sjf_aging;
+	/* append a line for every response to this file, or NULL (see
+	 * logger.h) */
+	const char *access_log;
+	/* trace one in every trace_sample requests, and write the trace to
+	 * this file in the Chrome trace format on every dump (see tracer.h),
+	 * or NULL */
+	const char *chrome_trace;
+	int trace_sample;
+};
+extern struct server_config server_config;
+
 struct server *server_init(int nr_threads, int max_requests, 
 			   int max_cache_size);
 void server_request(struct server *sv, int connfd);
 void server_exit(struct server *sv);
+/* print the server statistics collected so far */
+void server_dump(struct server *sv);
 
 #endif /* __SERVER_THREAD_H__ */
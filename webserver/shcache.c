@@ -0,0 +1,786 @@
+/*
+ * shcache.c: a file cache in shared memory (see shcache.h).
+ *
+ * The segment is a memfd, which the parent maps before it forks the workers,
+ * so the workers inherit the mapping, and it starts with struct segment,
+ * followed by the slots of the workers, the hash table, and the heap.
+ *
+ * The heap is a list of blocks that covers it from end to end. Every block
+ * starts with its size, and ends with it, so that a block that is freed can
+ * be merged with the free blocks on either side of it. Free blocks are kept
+ * in lists by the power of two of their size, and an allocation takes the
+ * first block that is large enough, from the smallest list that can have
+ * one, and splits off the rest of it. Each entry of the cache is a block,
+ * with its name and the file after its header.
+ *
+ * Since the blocks cover the heap, the heap can be walked from its start,
+ * which is how the cache is rebuilt after a worker died holding the lock:
+ * the hash table, the LRU list and the free lists are all recomputed from
+ * the blocks. The order of the LRU list is lost.
+ *
+ * An entry is filled in after it is allocated, without the lock, and is
+ * only linked into the cache once it is full. Until then it is held by the
+ * worker that fills it, so that it is freed if the worker dies.
+ */
+
+#define _GNU_SOURCE	/* for memfd_create */
+#include <stddef.h>
+#include "common.h"
+#include "shcache.h"
+
+#define SHCACHE_MIN_BUCKETS 64
+#define SHCACHE_BUCKET_SIZE 4096	/* bytes of the heap per bucket */
+#define SHCACHE_MAX_HELD 256	/* entries a worker can hold at once */
+#define SHCACHE_ALIGN 16	/* of the blocks of the heap */
+#define NR_CLASSES 64		/* free lists, one per power of two */
+#define SHCACHE_GENERATIONS 1024	/* see cache_generation */
+
+#define ALIGN(n, a) (((n) + (a) - 1) & ~((long)(a) - 1))
+
+enum {
+	ENTRY_FILLING = 1,	/* allocated, and held by its worker */
+	ENTRY_CACHED,		/* in the hash table and the LRU list */
+	ENTRY_EVICTED,		/* out of the cache, and still in use */
+};
+
+/* the header of a block of the heap. size, which includes the header and
+ * the footer, is repeated in the footer, the last long of the block. */
+struct block {
+	long size;		/* a multiple of SHCACHE_ALIGN */
+	long used;
+};
+
+/* a free block, in the free list of its class */
+struct free_block {
+	struct block b;
+	long next;
+	long prev;
+};
+
+#define MIN_BLOCK ALIGN((long)sizeof(struct free_block) + \
+			(long)sizeof(long), SHCACHE_ALIGN)
+
+/* a cached file. offsets are from the start of the segment, and 0 is
+ * NULL. */
+struct shcache_entry {
+	struct block b;
+	long hash_next;		/* in its bucket */
+	long lru_prev;		/* toward the most recently used */
+	long lru_next;
+	unsigned long hash;
+	long data;		/* offset of the contents of the file */
+	long file_size;
+	time_t file_mtime;
+	unsigned int file_csum;
+	int state;
+	int users;
+	char name[];
+};
+
+/* the entries a worker holds */
+struct slot {
+	int nr_held;
+	long held[SHCACHE_MAX_HELD];
+};
+
+struct shcache_stats {
+	long lookups;
+	long hits;
+	long inserts;
+	long evictions;
+	long nr_entries;
+	long size;		/* bytes of the blocks in use */
+	long data_size;		/* bytes of file contents in the cache */
+	long max_size;
+	long invalidations;
+	long stale_rejects;
+	long space_rejects;
+	long held_rejects;	/* a worker held SHCACHE_MAX_HELD entries */
+	long reaped;		/* entries released for workers that exited */
+	long repairs;		/* times the cache was rebuilt */
+};
+
+/* the start of the segment */
+struct segment {
+	pthread_mutex_t lock;	/* robust, protects everything below */
+	long heap;		/* offset of the heap */
+	long heap_end;
+	long slots;		/* offset of nr_slots struct slot */
+	int nr_slots;
+	int broken;		/* the heap was corrupted, and is not used */
+	long table;		/* offset of the hash table */
+	unsigned long nr_buckets;	/* a power of two */
+	long lru_first;		/* the most recently used entry */
+	long lru_last;
+	long free_lists[NR_CLASSES];
+	/* bumped by the invalidations of the paths in each group, and of
+	 * directories, see shcache_generation */
+	unsigned long generations[SHCACHE_GENERATIONS];
+	unsigned long dir_generation;
+	struct shcache_stats stats;
+};
+
+/* the cache, as mapped by one process */
+struct shcache {
+	char *base;		/* of the segment */
+	struct segment *s;
+	long size;		/* of the segment */
+	int slot;		/* of the process, -1 in the parent */
+};
+
+static unsigned long
+shcache_hash(const char *str)
+{
+	unsigned long hash = 5381;
+	int c;
+
+	while ((c = *str++))
+		hash = hash * 33 ^ c;
+	return hash;
+}
+
+/* the generation of the file whose path has the hash. the lock must be
+ * held. */
+static unsigned long
+shcache_path_generation(struct shcache *c, unsigned long hash)
+{
+	return c->s->dir_generation +
+		c->s->generations[hash % SHCACHE_GENERATIONS];
+}
+
+static void *
+shcache_at(struct shcache *c, long off)
+{
+	return off ? c->base + off : NULL;
+}
+
+static long
+shcache_offset(struct shcache *c, void *p)
+{
+	return p ? (char *)p - c->base : 0;
+}
+
+static long *
+shcache_bucket(struct shcache *c, unsigned long hash)
+{
+	long *table = shcache_at(c, c->s->table);
+
+	return &table[hash & (c->s->nr_buckets - 1)];
+}
+
+static struct slot *
+shcache_slot(struct shcache *c, int slot)
+{
+	struct slot *slots = shcache_at(c, c->s->slots);
+
+	return &slots[slot];
+}
+
+/* the free list of blocks of size */
+static int
+heap_class(long size)
+{
+	return 63 - __builtin_clzl(size);
+}
+
+static long *
+heap_footer(struct shcache *c, long off, long size)
+{
+	return (long *)(c->base + off + size - sizeof(long));
+}
+
+static void
+heap_list_remove(struct shcache *c, struct free_block *f)
+{
+	struct free_block *next = shcache_at(c, f->next);
+	struct free_block *prev = shcache_at(c, f->prev);
+
+	if (prev)
+		prev->next = f->next;
+	else
+		c->s->free_lists[heap_class(f->b.size)] = f->next;
+	if (next)
+		next->prev = f->prev;
+}
+
+/* make the size bytes at off a free block, in its free list */
+static void
+heap_make_free(struct shcache *c, long off, long size)
+{
+	struct free_block *f = shcache_at(c, off);
+	long *list = &c->s->free_lists[heap_class(size)];
+	struct free_block *next = shcache_at(c, *list);
+
+	f->b.size = size;
+	f->b.used = 0;
+	*heap_footer(c, off, size) = size;
+	f->prev = 0;
+	f->next = *list;
+	if (next)
+		next->prev = off;
+	*list = off;
+}
+
+/* allocate a block of size bytes, a multiple of SHCACHE_ALIGN. returns its
+ * offset, or 0 if no free block is large enough. */
+static long
+heap_alloc(struct shcache *c, long size)
+{
+	struct free_block *f;
+	long off, rest;
+	int k;
+
+	for (k = heap_class(size); k < NR_CLASSES; k++) {
+		for (off = c->s->free_lists[k]; off; off = f->next) {
+			f = shcache_at(c, off);
+			if (f->b.size >= size)
+				goto found;
+		}
+	}
+	return 0;
+found:
+	heap_list_remove(c, f);
+	/* the block after a free block is never free, so the rest of the
+	 * block needs no merging */
+	rest = f->b.size - size;
+	if (rest >= MIN_BLOCK) {
+		heap_make_free(c, off + size, rest);
+	} else {
+		size = f->b.size;
+	}
+	f->b.size = size;
+	/* the block may still have the state of the entry it last held,
+	 * which shcache_repair must not find if this process dies before the
+	 * new entry is filling */
+	((struct shcache_entry *)f)->state = 0;
+	f->b.used = 1;
+	*heap_footer(c, off, size) = size;
+	c->s->stats.size += size;
+	return off;
+}
+
+/* free the block at off, merging it with the free blocks next to it */
+static void
+heap_free(struct shcache *c, long off)
+{
+	struct block *b = shcache_at(c, off), *next, *prev;
+	long size = b->size;
+
+	c->s->stats.size -= size;
+	if (off + size < c->s->heap_end) {
+		next = shcache_at(c, off + size);
+		if (!next->used) {
+			heap_list_remove(c, (struct free_block *)next);
+			size += next->size;
+		}
+	}
+	if (off > c->s->heap) {
+		/* the footer of the block before */
+		prev = shcache_at(c, off - *(long *)(c->base + off -
+						     sizeof(long)));
+		if (!prev->used) {
+			heap_list_remove(c, (struct free_block *)prev);
+			off = shcache_offset(c, prev);
+			size += prev->size;
+		}
+	}
+	heap_make_free(c, off, size);
+}
+
+static void
+lru_remove(struct shcache *c, struct shcache_entry *e)
+{
+	struct shcache_entry *prev = shcache_at(c, e->lru_prev);
+	struct shcache_entry *next = shcache_at(c, e->lru_next);
+
+	if (prev)
+		prev->lru_next = e->lru_next;
+	else
+		c->s->lru_first = e->lru_next;
+	if (next)
+		next->lru_prev = e->lru_prev;
+	else
+		c->s->lru_last = e->lru_prev;
+}
+
+/* make e the most recently used entry, or the least if last is set */
+static void
+lru_add(struct shcache *c, struct shcache_entry *e, int last)
+{
+	long off = shcache_offset(c, e);
+	struct shcache_entry *other;
+
+	if (last) {
+		e->lru_next = 0;
+		e->lru_prev = c->s->lru_last;
+		other = shcache_at(c, c->s->lru_last);
+		if (other)
+			other->lru_next = off;
+		else
+			c->s->lru_first = off;
+		c->s->lru_last = off;
+	} else {
+		e->lru_prev = 0;
+		e->lru_next = c->s->lru_first;
+		other = shcache_at(c, c->s->lru_first);
+		if (other)
+			other->lru_prev = off;
+		else
+			c->s->lru_last = off;
+		c->s->lru_first = off;
+	}
+}
+
+/* link e into the hash table and the LRU list */
+static void
+shcache_link(struct shcache *c, struct shcache_entry *e, int last)
+{
+	long *bucket = shcache_bucket(c, e->hash);
+
+	e->state = ENTRY_CACHED;
+	e->hash_next = *bucket;
+	*bucket = shcache_offset(c, e);
+	lru_add(c, e, last);
+	c->s->stats.nr_entries++;
+	c->s->stats.data_size += e->file_size;
+}
+
+static struct shcache_entry *
+shcache_find(struct shcache *c, const char *name, unsigned long hash)
+{
+	struct shcache_entry *e;
+
+	for (e = shcache_at(c, *shcache_bucket(c, hash)); e;
+	     e = shcache_at(c, e->hash_next)) {
+		if (e->hash == hash && strcmp(e->name, name) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+/* take e out of the cache. it is freed now if no one uses it, and when it is
+ * released otherwise. */
+static void
+shcache_evict(struct shcache *c, struct shcache_entry *e)
+{
+	long off = shcache_offset(c, e);
+	long *p = shcache_bucket(c, e->hash);
+
+	while (*p != off) {
+		p = &((struct shcache_entry *)shcache_at(c, *p))->hash_next;
+	}
+	*p = e->hash_next;
+	lru_remove(c, e);
+	c->s->stats.nr_entries--;
+	c->s->stats.data_size -= e->file_size;
+	if (e->users == 0) {
+		heap_free(c, off);
+	} else {
+		e->state = ENTRY_EVICTED;
+	}
+}
+
+/* remember that the calling worker holds e. returns -1 if it holds too many
+ * entries already. */
+static int
+shcache_hold(struct shcache *c, struct shcache_entry *e)
+{
+	struct slot *slot;
+
+	if (c->slot < 0)
+		return 0;
+	slot = shcache_slot(c, c->slot);
+	if (slot->nr_held == SHCACHE_MAX_HELD) {
+		c->s->stats.held_rejects++;
+		return -1;
+	}
+	slot->held[slot->nr_held++] = shcache_offset(c, e);
+	return 0;
+}
+
+static void
+shcache_unhold(struct shcache *c, struct shcache_entry *e)
+{
+	long off = shcache_offset(c, e);
+	struct slot *slot;
+	int i;
+
+	if (c->slot < 0)
+		return;
+	slot = shcache_slot(c, c->slot);
+	for (i = slot->nr_held - 1; i >= 0; i--) {
+		if (slot->held[i] == off) {
+			slot->held[i] = slot->held[--slot->nr_held];
+			return;
+		}
+	}
+	assert(0);
+}
+
+/* e is no longer used by the worker that held it */
+static void
+shcache_put(struct shcache *c, struct shcache_entry *e)
+{
+	if (c->s->broken)
+		return;
+	if (e->state == ENTRY_FILLING) {
+		heap_free(c, shcache_offset(c, e));
+	} else if (--e->users == 0 && e->state == ENTRY_EVICTED) {
+		heap_free(c, shcache_offset(c, e));
+	}
+}
+
+/* rebuild the cache from the blocks of the heap, after a process died
+ * holding the lock. the blocks themselves are only changed by a few stores
+ * each, so they are checked, and if they don't cover the heap, the cache is
+ * disabled. */
+static void
+shcache_repair(struct shcache *c)
+{
+	struct segment *s = c->s;
+	struct shcache_entry *e;
+	struct block *b;
+	long off, run = 0;
+	unsigned long i;
+
+	s->stats.repairs++;
+	for (off = s->heap; off < s->heap_end; off += b->size) {
+		b = shcache_at(c, off);
+		if (b->size < MIN_BLOCK || b->size % SHCACHE_ALIGN != 0 ||
+		    b->size > s->heap_end - off || (b->used & ~1L) != 0 ||
+		    *heap_footer(c, off, b->size) != b->size) {
+			s->broken = 1;
+			return;
+		}
+	}
+	for (i = 0; i < s->nr_buckets; i++) {
+		*shcache_bucket(c, i) = 0;
+	}
+	memset(s->free_lists, 0, sizeof(s->free_lists));
+	s->lru_first = s->lru_last = 0;
+	s->stats.nr_entries = 0;
+	s->stats.size = 0;
+	s->stats.data_size = 0;
+	for (off = s->heap; off <= s->heap_end; off += b->size) {
+		b = shcache_at(c, off);
+		if (off < s->heap_end && !b->used) {
+			/* a free block next to it may not have been merged
+			 * yet */
+			if (run == 0)
+				run = off;
+			continue;
+		}
+		if (run) {
+			heap_make_free(c, run, off - run);
+			run = 0;
+		}
+		if (off == s->heap_end)
+			break;
+		s->stats.size += b->size;
+		e = (struct shcache_entry *)b;
+		if (e->state == ENTRY_CACHED)
+			shcache_link(c, e, 1);
+	}
+}
+
+/* lock the cache, repairing it if the last process to lock it died */
+static void
+shcache_lock(struct shcache *c)
+{
+	int ret = pthread_mutex_lock(&c->s->lock);
+
+	if (ret == EOWNERDEAD) {
+		pthread_mutex_consistent(&c->s->lock);
+		if (!c->s->broken)
+			shcache_repair(c);
+	} else {
+		assert(ret == 0);
+	}
+}
+
+static void
+shcache_unlock(struct shcache *c)
+{
+	pthread_mutex_unlock(&c->s->lock);
+}
+
+struct shcache *
+shcache_init(long max_size, int nr_slots)
+{
+	struct shcache *c;
+	struct segment *s;
+	pthread_mutexattr_t attr;
+	unsigned long nr_buckets = SHCACHE_MIN_BUCKETS;
+	long table, slots, heap, size;
+	void *base;
+	int fd;
+
+	while (nr_buckets < (unsigned long)max_size / SHCACHE_BUCKET_SIZE) {
+		nr_buckets *= 2;
+	}
+	slots = ALIGN((long)sizeof(struct segment), SHCACHE_ALIGN);
+	table = ALIGN(slots + (long)sizeof(struct slot) * nr_slots,
+		      SHCACHE_ALIGN);
+	heap = ALIGN(table + (long)sizeof(long) * nr_buckets, SHCACHE_ALIGN);
+	size = heap + (max_size & ~((long)SHCACHE_ALIGN - 1));
+	if ((fd = memfd_create("shcache", MFD_CLOEXEC)) < 0)
+		return NULL;
+	/* the pages of a memfd start out zeroed */
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+		return NULL;
+	}
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	c = Malloc(sizeof(struct shcache));
+	c->base = base;
+	c->s = s = base;
+	c->size = size;
+	c->slot = -1;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&s->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	s->slots = slots;
+	s->nr_slots = nr_slots;
+	s->table = table;
+	s->nr_buckets = nr_buckets;
+	s->heap = heap;
+	s->heap_end = size;
+	s->stats.max_size = size - heap;
+	if (size - heap >= MIN_BLOCK)
+		heap_make_free(c, heap, size - heap);
+	else
+		s->heap_end = heap;
+	return c;
+}
+
+void
+shcache_destroy(struct shcache *c)
+{
+	munmap(c->base, c->size);
+	free(c);
+}
+
+void
+shcache_attach(struct shcache *c, int slot)
+{
+	assert(slot >= 0 && slot < c->s->nr_slots);
+	c->slot = slot;
+}
+
+void
+shcache_reap(struct shcache *c, int slot)
+{
+	struct slot *sl = shcache_slot(c, slot);
+	int i;
+
+	shcache_lock(c);
+	for (i = 0; i < sl->nr_held; i++) {
+		shcache_put(c, shcache_at(c, sl->held[i]));
+		c->s->stats.reaped++;
+	}
+	sl->nr_held = 0;
+	shcache_unlock(c);
+}
+
+struct shcache_entry *
+shcache_lookup(struct shcache *c, const char *name, struct file_data *data)
+{
+	unsigned long hash = shcache_hash(name);
+	struct shcache_entry *e = NULL;
+
+	shcache_lock(c);
+	c->s->stats.lookups++;
+	if (!c->s->broken)
+		e = shcache_find(c, name, hash);
+	if (e && shcache_hold(c, e) < 0)
+		e = NULL;
+	if (e) {
+		e->users++;
+		lru_remove(c, e);
+		lru_add(c, e, 0);
+		c->s->stats.hits++;
+	}
+	shcache_unlock(c);
+	if (!e)
+		return NULL;
+	data->file_name = e->name;
+	data->file_buf = c->base + e->data;
+	data->file_size = e->file_size;
+	data->file_csum = e->file_csum;
+	data->file_mtime = e->file_mtime;
+	data->gzip_buf = NULL;
+	data->gzip_size = 0;
+	return e;
+}
+
+void
+shcache_release(struct shcache *c, struct shcache_entry *e)
+{
+	shcache_lock(c);
+	shcache_unhold(c, e);
+	shcache_put(c, e);
+	shcache_unlock(c);
+}
+
+int
+shcache_insert(struct shcache *c, struct file_data *data)
+{
+	struct segment *s = c->s;
+	long name_len = strlen(data->file_name) + 1;
+	long data_off = ALIGN((long)offsetof(struct shcache_entry, name) +
+			      name_len, sizeof(long));
+	long size = ALIGN(data_off + data->file_size + (long)sizeof(long),
+			  SHCACHE_ALIGN);
+	unsigned long hash = shcache_hash(data->file_name);
+	struct shcache_entry *e;
+	long off = 0;
+
+	if (!data->file_buf)
+		return -1;
+	shcache_lock(c);
+	if (s->broken || shcache_find(c, data->file_name, hash)) {
+		shcache_unlock(c);
+		return -1;
+	}
+	if (data->file_generation != shcache_path_generation(c, hash)) {
+		s->stats.stale_rejects++;
+		shcache_unlock(c);
+		return -1;
+	}
+	if (size <= s->heap_end - s->heap) {
+		while (!(off = heap_alloc(c, size)) && s->lru_last) {
+			shcache_evict(c, shcache_at(c, s->lru_last));
+			s->stats.evictions++;
+		}
+	}
+	if (!off) {
+		s->stats.space_rejects++;
+		shcache_unlock(c);
+		return -1;
+	}
+	e = shcache_at(c, off);
+	e->state = ENTRY_FILLING;
+	e->users = 0;
+	if (shcache_hold(c, e) < 0) {
+		heap_free(c, off);
+		shcache_unlock(c);
+		return -1;
+	}
+	shcache_unlock(c);
+
+	/* fill the entry in without the lock */
+	e->hash = hash;
+	e->data = off + data_off;
+	e->file_size = data->file_size;
+	e->file_mtime = data->file_mtime;
+	e->file_csum = data->file_csum;
+	memcpy(e->name, data->file_name, name_len);
+	memcpy(c->base + e->data, data->file_buf, data->file_size);
+
+	shcache_lock(c);
+	shcache_unhold(c, e);
+	if (s->broken) {
+		shcache_unlock(c);
+		return -1;
+	}
+	/* another worker may have inserted the file, or it may have changed,
+	 * while it was copied */
+	if (data->file_generation != shcache_path_generation(c, hash) ||
+	    shcache_find(c, data->file_name, hash)) {
+		if (data->file_generation != shcache_path_generation(c, hash))
+			s->stats.stale_rejects++;
+		heap_free(c, off);
+		shcache_unlock(c);
+		return -1;
+	}
+	shcache_link(c, e, 0);
+	s->stats.inserts++;
+	shcache_unlock(c);
+	return 0;
+}
+
+void
+shcache_invalidate(struct shcache *c, const char *path, int is_dir)
+{
+	size_t len = strlen(path);
+	struct shcache_entry *e, *next;
+
+	shcache_lock(c);
+	if (is_dir)
+		c->s->dir_generation++;
+	else
+		c->s->generations[shcache_hash(path) % SHCACHE_GENERATIONS]++;
+	if (c->s->broken) {
+		shcache_unlock(c);
+		return;
+	}
+	if (!is_dir) {
+		e = shcache_find(c, path, shcache_hash(path));
+		if (e) {
+			shcache_evict(c, e);
+			c->s->stats.invalidations++;
+		}
+	} else {
+		for (e = shcache_at(c, c->s->lru_first); e; e = next) {
+			next = shcache_at(c, e->lru_next);
+			if (strncmp(e->name, path, len) == 0 &&
+			    (e->name[len] == 0 || e->name[len] == '/')) {
+				shcache_evict(c, e);
+				c->s->stats.invalidations++;
+			}
+		}
+	}
+	shcache_unlock(c);
+}
+
+unsigned long
+shcache_generation(struct shcache *c, const char *path)
+{
+	unsigned long generation;
+
+	shcache_lock(c);
+	generation = shcache_path_generation(c, shcache_hash(path));
+	shcache_unlock(c);
+	return generation;
+}
+
+void
+shcache_dump(struct shcache *c, FILE *out)
+{
+	struct shcache_stats s;
+	int broken;
+
+	shcache_lock(c);
+	s = c->s->stats;
+	broken = c->s->broken;
+	shcache_unlock(c);
+	fprintf(out, "shared cache: %ld lookups, %.1f%% hits, %ld inserts, "
+		"%ld evictions, %ld files\n", s.lookups,
+		s.lookups ? 100.0 * s.hits / s.lookups : 0, s.inserts,
+		s.evictions, s.nr_entries);
+	fprintf(out, "shared cache memory: %ld of %ld bytes charged, %ld of "
+		"them file data\n", s.size, s.max_size, s.data_size);
+	if (s.invalidations > 0 || s.stale_rejects > 0) {
+		fprintf(out, "shared cache invalidations: %ld files removed, "
+			"%ld inserts of stale files refused\n",
+			s.invalidations, s.stale_rejects);
+	}
+	if (s.space_rejects > 0 || s.held_rejects > 0) {
+		fprintf(out, "shared cache rejects: %ld inserts refused for "
+			"space, %ld lookups and inserts by workers that held "
+			"too many files\n", s.space_rejects, s.held_rejects);
+	}
+	if (s.reaped > 0 || s.repairs > 0) {
+		fprintf(out, "shared cache workers: %ld files released for "
+			"workers that exited, %ld rebuilds after a worker "
+			"died holding the lock%s\n", s.reaped, s.repairs,
+			broken ? ", the heap was corrupted" : "");
+	}
+	fflush(out);
+}
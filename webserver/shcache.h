@@ -0,0 +1,68 @@
+#ifndef __SHCACHE_H__
+#define __SHCACHE_H__
+
+#include <stdio.h>
+#include "request.h"
+
+/*
+ * A file cache shared by the worker processes of the prefork mode of the
+ * server. It lives in a segment of shared memory that the parent process
+ * creates before it forks the workers, so that a file cached by one worker
+ * is a hit for all of them, and the cache outlives any worker that dies and
+ * is restarted.
+ *
+ * The segment holds the whole cache, its hash table, its LRU list and a heap
+ * with an allocator of its own, and everything in it refers to everything
+ * else by offsets from the start of the segment, never by pointers, so it
+ * works wherever a process maps it. One robust, process-shared mutex protects
+ * the cache. As with struct cache, the size of the cache counts the names and
+ * the headers of the files, the least recently used files are evicted when
+ * the heap is full, and an entry that is evicted while it is in use is freed
+ * when its last user releases it.
+ *
+ * Each worker process has a slot, which remembers the entries that the
+ * process holds. When a worker exits, the parent passes its slot to
+ * shcache_reap, which releases whatever the worker did not release itself.
+ * If a worker dies while it holds the lock, the next process to take the
+ * lock rebuilds the cache from the blocks of the heap, or disables the cache
+ * if the heap itself was left inconsistent.
+ */
+
+struct shcache;
+struct shcache_entry;
+
+/* create a cache of max_size bytes, for nr_slots worker processes. returns
+ * NULL if the shared memory could not be created. */
+struct shcache *shcache_init(long max_size, int nr_slots);
+/* unmap the cache. it is freed once no process maps it. */
+void shcache_destroy(struct shcache *c);
+
+/* the calling process, which was forked after shcache_init, is the worker of
+ * slot, and holds entries there */
+void shcache_attach(struct shcache *c, int slot);
+/* release the entries that the worker of slot still held when it exited */
+void shcache_reap(struct shcache *c, int slot);
+
+/* look up the file called name. on a hit, fills in data, whose name and
+ * contents point into the cache until the entry is released, and returns the
+ * entry. returns NULL on a miss. */
+struct shcache_entry *shcache_lookup(struct shcache *c, const char *name,
+				     struct file_data *data);
+void shcache_release(struct shcache *c, struct shcache_entry *e);
+/* copy the file of data into the cache, evicting other files to make space
+ * for it. returns 0 if it was added, and -1 if it was not, because it is
+ * cached already, it does not fit, or it changed since
+ * data->file_generation. the caller keeps data either way. */
+int shcache_insert(struct shcache *c, struct file_data *data);
+
+/* remove the file path from the cache, or every file under the directory
+ * path if is_dir is set */
+void shcache_invalidate(struct shcache *c, const char *path, int is_dir);
+/* the number of shcache_invalidate calls so far that may have covered the
+ * file path, see cache_generation */
+unsigned long shcache_generation(struct shcache *c, const char *path);
+
+/* print the statistics of the cache */
+void shcache_dump(struct shcache *c, FILE *out);
+
+#endif /* __SHCACHE_H__ */
@@ -0,0 +1,349 @@
+/*
+ * spill.c: a log-structured cache tier on local disk (see spill.h).
+ *
+ * Positions in the log count the bytes ever appended to it, so the byte at
+ * position pos is at offset pos % max_size of the file, and it is still there
+ * as long as pos >= head - max_size. A file is never split across the end of
+ * the file, the rest of the file is skipped instead.
+ *
+ * The lock is not held while files are written or read. A writer reserves
+ * its place in the log under the lock, and drops the records it is about to
+ * overwrite first. A reader looks up the place of its file, reads it, and
+ * then checks that no writer reserved that place in the meantime, so it
+ * never returns a file that was partly overwritten.
+ */
+
+#include "common.h"
+#include "spill.h"
+
+#define SPILL_MIN_BUCKETS 64
+
+/* a file in the log */
+struct record {
+	unsigned long hash;
+	long pos;		/* position in the log */
+	long size;
+	unsigned int csum;
+	time_t mtime;
+	struct record *next;	/* in its bucket */
+	struct record *log_prev;	/* in the order of the log */
+	struct record *log_next;
+	char name[];
+};
+
+struct spill {
+	int fd;
+	long max_size;		/* bytes of the log */
+	pthread_mutex_t lock;	/* protects everything below */
+	struct record **table;
+	unsigned long nr_buckets;	/* a power of two */
+	long nr_records;
+	/* log.log_next is the oldest record, and log.log_prev the newest */
+	struct record log;
+	long head;		/* position of the next file */
+	long used;		/* bytes of the records in the log */
+	unsigned long generation;	/* see spill_generation */
+	long lookups;
+	long hits;
+	long writes;		/* files written */
+	long bytes_written;
+	long skipped;		/* files that were in the log already */
+	long overwritten;	/* records dropped by later writes */
+	long invalidations;	/* records dropped by spill_invalidate */
+};
+
+static unsigned long
+spill_hash(const char *str)
+{
+	unsigned long hash = 5381;
+	int c;
+
+	while ((c = *str++))
+		hash = hash * 33 ^ c;
+	return hash;
+}
+
+/* the record of the file called name, or NULL. the lock must be held. */
+static struct record *
+spill_find(struct spill *s, const char *name, unsigned long hash)
+{
+	struct record *r;
+
+	for (r = s->table[hash & (s->nr_buckets - 1)]; r; r = r->next) {
+		if (r->hash == hash && strcmp(r->name, name) == 0)
+			return r;
+	}
+	return NULL;
+}
+
+static void
+spill_resize(struct spill *s, unsigned long nr_buckets)
+{
+	struct record **table, *r, *next;
+	unsigned long i;
+
+	table = Malloc(sizeof(struct record *) * nr_buckets);
+	for (i = 0; i < nr_buckets; i++) {
+		table[i] = NULL;
+	}
+	for (i = 0; i < s->nr_buckets; i++) {
+		for (r = s->table[i]; r; r = next) {
+			next = r->next;
+			r->next = table[r->hash & (nr_buckets - 1)];
+			table[r->hash & (nr_buckets - 1)] = r;
+		}
+	}
+	free(s->table);
+	s->table = table;
+	s->nr_buckets = nr_buckets;
+}
+
+/* remove r from the index, and free it. the lock must be held. */
+static void
+spill_drop(struct spill *s, struct record *r)
+{
+	struct record **p;
+
+	p = &s->table[r->hash & (s->nr_buckets - 1)];
+	while (*p != r) {
+		p = &(*p)->next;
+	}
+	*p = r->next;
+	r->log_prev->log_next = r->log_next;
+	r->log_next->log_prev = r->log_prev;
+	s->nr_records--;
+	s->used -= r->size;
+	free(r);
+}
+
+/* has the log overwritten the bytes at pos? the lock must be held. */
+static int
+spill_overwritten(struct spill *s, long pos)
+{
+	return pos < s->head - s->max_size;
+}
+
+struct spill *
+spill_init(const char *dir, long max_size)
+{
+	char path[MAXLINE];
+	struct spill *s;
+	int fd;
+
+	snprintf(path, MAXLINE, "%s/spill-XXXXXX", dir);
+	if ((fd = mkstemp(path)) < 0)
+		return NULL;
+	/* nobody else needs the file, and it goes away with the server */
+	SYS(unlink(path));
+	s = Malloc(sizeof(struct spill));
+	s->fd = fd;
+	s->max_size = max_size;
+	pthread_mutex_init(&s->lock, NULL);
+	s->table = NULL;
+	s->nr_buckets = 0;
+	spill_resize(s, SPILL_MIN_BUCKETS);
+	s->nr_records = 0;
+	s->log.log_next = &s->log;
+	s->log.log_prev = &s->log;
+	s->head = 0;
+	s->used = 0;
+	s->generation = 0;
+	s->lookups = 0;
+	s->hits = 0;
+	s->writes = 0;
+	s->bytes_written = 0;
+	s->skipped = 0;
+	s->overwritten = 0;
+	s->invalidations = 0;
+	return s;
+}
+
+void
+spill_destroy(struct spill *s)
+{
+	while (s->log.log_next != &s->log) {
+		spill_drop(s, s->log.log_next);
+	}
+	SYS(close(s->fd));
+	pthread_mutex_destroy(&s->lock);
+	free(s->table);
+	free(s);
+}
+
+unsigned long
+spill_generation(struct spill *s)
+{
+	unsigned long generation;
+
+	pthread_mutex_lock(&s->lock);
+	generation = s->generation;
+	pthread_mutex_unlock(&s->lock);
+	return generation;
+}
+
+void
+spill_put(struct spill *s, struct file_data *data, unsigned long generation)
+{
+	unsigned long hash = spill_hash(data->file_name);
+	size_t len = strlen(data->file_name);
+	long size = data->file_size, pos, done;
+	struct record *r, *p;
+	ssize_t n;
+
+	if (size > s->max_size || (!data->file_buf && size > 0))
+		return;
+	pthread_mutex_lock(&s->lock);
+	if (generation != s->generation) {
+		/* the file may have changed since it was read */
+		pthread_mutex_unlock(&s->lock);
+		return;
+	}
+	r = spill_find(s, data->file_name, hash);
+	if (r && r->size == size && r->csum == data->file_csum &&
+	    r->mtime == data->file_mtime) {
+		/* it was read back from the log, and is still there */
+		s->skipped++;
+		pthread_mutex_unlock(&s->lock);
+		return;
+	}
+	/* reserve the place of the file, and drop what was there */
+	pos = s->head;
+	if (pos % s->max_size + size > s->max_size)
+		pos += s->max_size - pos % s->max_size;
+	s->head = pos + size;
+	while (s->log.log_next != &s->log &&
+	       spill_overwritten(s, s->log.log_next->pos)) {
+		spill_drop(s, s->log.log_next);
+		s->overwritten++;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	for (done = 0; done < size; done += n) {
+		SYS(n = pwrite(s->fd, data->file_buf + done, size - done,
+			       pos % s->max_size + done));
+	}
+	/* as request_readfile, keep the file out of the page cache, so that it
+	 * is read back from the disk */
+	SYS(posix_fadvise(s->fd, pos % s->max_size, size,
+			  POSIX_FADV_DONTNEED));
+
+	r = Malloc(sizeof(struct record) + len + 1);
+	r->hash = hash;
+	r->pos = pos;
+	r->size = size;
+	r->csum = data->file_csum;
+	r->mtime = data->file_mtime;
+	memcpy(r->name, data->file_name, len + 1);
+	pthread_mutex_lock(&s->lock);
+	if (generation != s->generation || spill_overwritten(s, pos)) {
+		/* invalidated, or overwritten, while it was written */
+		pthread_mutex_unlock(&s->lock);
+		free(r);
+		return;
+	}
+	if ((p = spill_find(s, r->name, hash)) != NULL)
+		spill_drop(s, p);
+	r->next = s->table[hash & (s->nr_buckets - 1)];
+	s->table[hash & (s->nr_buckets - 1)] = r;
+	/* concurrent writers may finish out of order */
+	for (p = s->log.log_prev; p != &s->log && p->pos > pos; p = p->log_prev)
+		;
+	r->log_prev = p;
+	r->log_next = p->log_next;
+	p->log_next->log_prev = r;
+	p->log_next = r;
+	s->nr_records++;
+	s->used += size;
+	s->writes++;
+	s->bytes_written += size;
+	if (s->nr_records > s->nr_buckets)
+		spill_resize(s, s->nr_buckets * 2);
+	pthread_mutex_unlock(&s->lock);
+}
+
+struct file_data *
+spill_get(struct spill *s, const char *name)
+{
+	struct file_data *data;
+	struct record *r;
+	long pos, done;
+	ssize_t n;
+
+	pthread_mutex_lock(&s->lock);
+	s->lookups++;
+	if ((r = spill_find(s, name, spill_hash(name))) == NULL) {
+		pthread_mutex_unlock(&s->lock);
+		return NULL;
+	}
+	data = file_data_init();
+	data->file_name = strdup(name);
+	data->file_size = r->size;
+	data->file_csum = r->csum;
+	data->file_mtime = r->mtime;
+	pos = r->pos;
+	pthread_mutex_unlock(&s->lock);
+
+	if (data->file_size > 0) {
+		data->file_buf = Malloc(data->file_size);
+	}
+	for (done = 0; done < data->file_size; done += n) {
+		SYS(n = pread(s->fd, data->file_buf + done,
+			      data->file_size - done,
+			      pos % s->max_size + done));
+		if (n == 0)
+			break;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	if (done < data->file_size || spill_overwritten(s, pos)) {
+		/* a writer took the place of the file while it was read */
+		pthread_mutex_unlock(&s->lock);
+		file_data_free(data);
+		return NULL;
+	}
+	s->hits++;
+	pthread_mutex_unlock(&s->lock);
+	return data;
+}
+
+void
+spill_invalidate(struct spill *s, const char *path, int is_dir)
+{
+	size_t len = strlen(path);
+	struct record *r, *next;
+
+	pthread_mutex_lock(&s->lock);
+	s->generation++;
+	if (!is_dir) {
+		if ((r = spill_find(s, path, spill_hash(path))) != NULL) {
+			spill_drop(s, r);
+			s->invalidations++;
+		}
+	} else {
+		for (r = s->log.log_next; r != &s->log; r = next) {
+			next = r->log_next;
+			if (strncmp(r->name, path, len) == 0 &&
+			    (r->name[len] == 0 || r->name[len] == '/')) {
+				spill_drop(s, r);
+				s->invalidations++;
+			}
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+void
+spill_dump(struct spill *s, FILE *out)
+{
+	pthread_mutex_lock(&s->lock);
+	fprintf(out, "spill: %ld lookups, %.1f%% hits, %ld files in %ld of "
+		"%ld bytes\n", s->lookups,
+		s->lookups ? 100.0 * s->hits / s->lookups : 0, s->nr_records,
+		s->used, s->max_size);
+	fprintf(out, "spill writes: %ld files, %ld bytes, %ld files in the "
+		"log already, %ld overwritten, %ld invalidated\n", s->writes,
+		s->bytes_written, s->skipped, s->overwritten,
+		s->invalidations);
+	pthread_mutex_unlock(&s->lock);
+	fflush(out);
+}
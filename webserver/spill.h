@@ -0,0 +1,46 @@
+#ifndef __SPILL_H__
+#define __SPILL_H__
+
+#include <stdio.h>
+#include "request.h"
+
+/*
+ * A second cache tier, on local disk, beneath the file cache. Files that the
+ * file cache evicts for space are written to a spill file, and a miss in the
+ * file cache reads the file back from there, which is much faster than the
+ * slow path of request_readfile.
+ *
+ * The spill file is a log of max_size bytes that is written in a circle, so
+ * files are appended at the head of the log, and the oldest files are
+ * dropped when the head comes around to them. An index in memory maps file
+ * names to their place in the log.
+ *
+ * The tier has no metadata of its own to check against the files, so it must
+ * be told about changes with spill_invalidate, which the file cache does for
+ * the spill tier it was given (see struct cache_config).
+ */
+
+struct spill;
+
+/* create a spill file of max_size bytes in dir. returns NULL if the file
+ * could not be created. */
+struct spill *spill_init(const char *dir, long max_size);
+void spill_destroy(struct spill *s);
+
+/* the number of spill_invalidate calls so far, which spill_put checks */
+unsigned long spill_generation(struct spill *s);
+/* write the contents of data to the log, unless spill_invalidate was called
+ * since spill_generation returned generation. data is not kept. */
+void spill_put(struct spill *s, struct file_data *data,
+	       unsigned long generation);
+/* read the file called name back from the log. returns a new file_data, which
+ * the caller frees, or NULL if the file is not in the log. */
+struct file_data *spill_get(struct spill *s, const char *name);
+/* drop the file path, or every file under the directory path if is_dir is
+ * set, from the log */
+void spill_invalidate(struct spill *s, const char *path, int is_dir);
+
+/* print the statistics of the spill tier */
+void spill_dump(struct spill *s, FILE *out);
+
+#endif /* __SPILL_H__ */
@@ -0,0 +1,116 @@
+/*
+ * stats.c: per-thread phase histograms for the server (see stats.h).
+ */
+
+#include "common.h"
+#include "histogram.h"
+#include "stats.h"
+#include "tracer.h"
+
+#ifdef STATS
+
+static const char *phase_names[NR_PHASES] = {
+	[PHASE_QUEUE] = "queue",
+	[PHASE_PARSE] = "parse",
+	[PHASE_LOCK] = "lock",
+	[PHASE_LOOKUP] = "lookup",
+	[PHASE_READ] = "read",
+	[PHASE_PROCESS] = "process",
+	[PHASE_WRITE] = "write",
+	[PHASE_TOTAL] = "total",
+};
+
+struct thread_stats {
+	struct histogram phases[NR_PHASES];
+	struct thread_stats *next;	/* list of all threads' stats */
+};
+
+/* allocated on the first call to stats_record from a thread */
+static __thread struct thread_stats *my_stats;
+
+static struct thread_stats *all_stats;
+static pthread_mutex_t all_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct thread_stats *
+thread_stats_init(void)
+{
+	struct thread_stats *ts;
+	int i;
+
+	ts = Malloc(sizeof(struct thread_stats));
+	for (i = 0; i < NR_PHASES; i++) {
+		histogram_init(&ts->phases[i]);
+	}
+	pthread_mutex_lock(&all_stats_lock);
+	ts->next = all_stats;
+	all_stats = ts;
+	pthread_mutex_unlock(&all_stats_lock);
+	return ts;
+}
+
+void
+stats_record(enum stats_phase phase, uint64_t ns)
+{
+	if (!my_stats)
+		my_stats = thread_stats_init();
+	histogram_record(&my_stats->phases[phase], ns);
+	tracer_record(phase, ns);
+}
+
+void
+stats_dump(FILE *out)
+{
+	struct histogram *merged;
+	struct thread_stats *ts;
+	int i;
+
+	merged = Malloc(sizeof(struct histogram) * NR_PHASES);
+	for (i = 0; i < NR_PHASES; i++) {
+		histogram_init(&merged[i]);
+	}
+	/* the workers keep recording while we merge. the snapshot may be
+	 * slightly inconsistent, which is fine for statistics. */
+	pthread_mutex_lock(&all_stats_lock);
+	for (ts = all_stats; ts; ts = ts->next) {
+		for (i = 0; i < NR_PHASES; i++) {
+			histogram_merge(&merged[i], &ts->phases[i]);
+		}
+	}
+	pthread_mutex_unlock(&all_stats_lock);
+
+	fprintf(out, "%-8s %10s %10s %10s %10s %10s %10s %10s  (usec)\n",
+		"phase", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+	for (i = 0; i < NR_PHASES; i++) {
+		struct histogram *h = &merged[i];
+
+		if (h->count == 0)
+			continue;
+		fprintf(out, "%-8s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f "
+			"%10.1f\n", phase_names[i], h->count,
+			histogram_mean(h) / 1000,
+			histogram_percentile(h, 50) / 1000.0,
+			histogram_percentile(h, 90) / 1000.0,
+			histogram_percentile(h, 99) / 1000.0,
+			histogram_percentile(h, 99.9) / 1000.0,
+			h->max / 1000.0);
+	}
+	fflush(out);
+	free(merged);
+}
+
+void
+stats_exit(void)
+{
+	struct thread_stats *ts;
+
+	pthread_mutex_lock(&all_stats_lock);
+	while ((ts = all_stats) != NULL) {
+		all_stats = ts->next;
+		free(ts);
+	}
+	pthread_mutex_unlock(&all_stats_lock);
+	/* only the calling thread's pointer can be reset here */
+	my_stats = NULL;
+}
+
+#endif /* STATS */
@@ -0,0 +1,61 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Per-request phase timing for the server. Each thread records the time spent
+ * in every phase of a request into its own set of histograms, so recording
+ * never takes a lock. stats_dump() merges the per-thread histograms and prints
+ * them.
+ *
+ * All of this is compiled out unless STATS is defined (see the Makefile), in
+ * which case the functions below are empty and the timestamps are constants,
+ * so the compiler removes the instrumentation entirely.
+ */
+
+enum stats_phase {
+	PHASE_QUEUE,	/* waiting in sv->buffer for a worker */
+	PHASE_PARSE,	/* reading the request line and headers */
+	PHASE_LOCK,	/* waiting for the cache lock */
+	PHASE_LOOKUP,	/* looking up the file in the cache */
+	PHASE_READ,	/* reading the file from disk */
+	PHASE_PROCESS,	/* checksum and request_processfile */
+	PHASE_WRITE,	/* writing the response to the socket */
+	PHASE_TOTAL,	/* from accept to closing the connection */
+	NR_PHASES
+};
+
+#ifdef STATS
+
+/* we use CLOCK_MONOTONIC rather than CLOCK_MONOTONIC_COARSE, because the
+ * coarse clock ticks every few milliseconds, which is longer than most phases
+ * take. both are read through the vDSO without a system call. */
+static inline uint64_t
+stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* record that the calling thread spent ns nanoseconds in phase */
+void stats_record(enum stats_phase phase, uint64_t ns);
+/* print the merged histograms of all threads */
+void stats_dump(FILE *out);
+/* free the per-thread histograms. no thread may record after this call. */
+void stats_exit(void);
+
+#else /* STATS */
+
+static inline uint64_t stats_now(void) { return 0; }
+static inline void stats_record(enum stats_phase phase, uint64_t ns) {}
+static inline void stats_dump(FILE *out) {}
+static inline void stats_exit(void) {}
+
+#endif /* STATS */
+
+#endif /* __STATS_H__ */
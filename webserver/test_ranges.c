@@ -0,0 +1,283 @@
+/*
+ * test_ranges.c: checks the Range requests of request.c, how the headers are
+ * parsed and resolved against the size of the file, and the 206, multipart
+ * and 416 responses that request_sendfile sends for them.
+ *
+ * The requests are written to one end of a socketpair and read by
+ * request_init from the other, as server_bench does, and the responses are
+ * read back from the first end.
+ */
+
+#include "common.h"
+#include "request.h"
+
+#define FILE_SIZE 1000
+#define BOUNDARY "OS_WEB_SERVER_BYTERANGES"
+
+static int failures;
+
+#define CHECK(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: %s failed\n", __FILE__,	\
+			__LINE__, #cond);				\
+		failures++;						\
+	}								\
+} while (0)
+
+#define NR_RANGE_CASES (sizeof(range_cases) / sizeof(range_cases[0]))
+
+static char file[FILE_SIZE];
+static unsigned int file_csum;
+
+/* a Range header, and the ranges that it resolves to for a file of size */
+struct range_case {
+	char *range;
+	long size;
+	int nr_ranges;		/* as request_nr_ranges returns it */
+	long ranges[3][2];	/* start and length of the first ranges */
+};
+
+static struct range_case range_cases[] = {
+	{ "bytes=0-99", FILE_SIZE, 1, { { 0, 100 } } },
+	{ "bytes=999-999", FILE_SIZE, 1, { { 999, 1 } } },
+	{ "bytes=900-", FILE_SIZE, 1, { { 900, 100 } } },
+	{ "bytes=-100", FILE_SIZE, 1, { { 900, 100 } } },
+	/* clamped to the file */
+	{ "bytes=500-2000", FILE_SIZE, 1, { { 500, 500 } } },
+	{ "bytes=-2000", FILE_SIZE, 1, { { 0, 1000 } } },
+	/* the ranges outside the file are dropped */
+	{ "bytes=2000-3000,0-0", FILE_SIZE, 1, { { 0, 1 } } },
+	{ "bytes=0-1,-0,5-", FILE_SIZE, 2, { { 0, 2 }, { 5, 995 } } },
+	{ "bytes=1000-", FILE_SIZE, -1 },
+	{ "bytes=1000-1999", FILE_SIZE, -1 },
+	{ "bytes=-0", FILE_SIZE, -1 },
+	{ "bytes=0-", 0, -1 },
+	{ "bytes=-5", 0, -1 },
+	/* spaces and case */
+	{ " bytes= 0-1 , 4-5 ", FILE_SIZE, 2, { { 0, 2 }, { 4, 2 } } },
+	{ "BYTES=10-19", FILE_SIZE, 1, { { 10, 10 } } },
+	/* overlapping ranges are sent as asked */
+	{ "bytes=0-9,5-14,-3", FILE_SIZE, 3,
+	  { { 0, 10 }, { 5, 10 }, { 997, 3 } } },
+	/* not valid, so the whole file is sent */
+	{ "items=0-5", FILE_SIZE, 0 },
+	{ "bytes=", FILE_SIZE, 0 },
+	{ "bytes=-", FILE_SIZE, 0 },
+	{ "bytes=5-3", FILE_SIZE, 0 },
+	{ "bytes=0-1,abc", FILE_SIZE, 0 },
+	{ "bytes=0-1x", FILE_SIZE, 0 },
+	{ "bytes=1-2-3", FILE_SIZE, 0 },
+	{ "bytes=+1-2", FILE_SIZE, 0 },
+	/* MAX_RANGES ranges, and one too many */
+	{ "bytes=0-0,1-1,2-2,3-3,4-4,5-5,6-6,7-7,8-8,9-9,10-10,11-11,"
+	  "12-12,13-13,14-14,15-15", FILE_SIZE, 16,
+	  { { 0, 1 }, { 1, 1 }, { 2, 1 } } },
+	{ "bytes=0-0,1-1,2-2,3-3,4-4,5-5,6-6,7-7,8-8,9-9,10-10,11-11,"
+	  "12-12,13-13,14-14,15-15,16-16", FILE_SIZE, 0 },
+};
+
+/* start a request for the file with the Range header range, or none if
+ * range is NULL. the response can be read from *client. */
+static struct request *
+request_start(char *range, struct file_data *data, int *client)
+{
+	char buf[MAXLINE];
+	struct request *rq;
+	int sv[2];
+
+	SYS(socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+	if (range) {
+		snprintf(buf, MAXLINE, "GET /file.txt HTTP/1.0\r\n"
+			 "Range: %s\r\n\r\n", range);
+	} else {
+		snprintf(buf, MAXLINE, "GET /file.txt HTTP/1.0\r\n\r\n");
+	}
+	Rio_write(sv[0], buf, strlen(buf));
+	memset(data, 0, sizeof(*data));
+	rq = request_init(sv[1], data);
+	assert(rq);
+	data->file_buf = file;
+	data->file_size = FILE_SIZE;
+	data->file_csum = file_csum;
+	*client = sv[0];
+	return rq;
+}
+
+static void
+test_range_cases(void)
+{
+	struct range_case *t;
+	struct file_data data;
+	struct request *rq;
+	long start, len;
+	int i, j, fd, nr;
+
+	for (i = 0; i < NR_RANGE_CASES; i++) {
+		t = &range_cases[i];
+		rq = request_start(t->range, &data, &fd);
+		data.file_size = t->size;
+		CHECK(request_has_ranges(rq) == (t->nr_ranges != 0));
+		nr = request_nr_ranges(rq);
+		if (nr != t->nr_ranges) {
+			fprintf(stderr, "\"%s\": %d ranges, not %d\n",
+				t->range, nr, t->nr_ranges);
+			failures++;
+			goto next;
+		}
+		/* the ranges are only resolved once */
+		CHECK(request_nr_ranges(rq) == nr);
+		for (j = 0; j < nr && j < 3; j++) {
+			request_range(rq, j, &start, &len);
+			if (start == t->ranges[j][0] && len == t->ranges[j][1])
+				continue;
+			fprintf(stderr, "\"%s\": range %d is %ld+%ld, not "
+				"%ld+%ld\n", t->range, j, start, len,
+				t->ranges[j][0], t->ranges[j][1]);
+			failures++;
+		}
+	next:
+		free(data.file_name);
+		request_destroy(rq);
+		SYS(close(fd));
+	}
+}
+
+/* a response, split into its headers and its body */
+struct response {
+	char buf[MAXBUF];
+	char *body;
+	long body_size;
+};
+
+/* send the response to a request with the Range header range, and read it */
+static void
+response_get(char *range, struct response *r)
+{
+	struct file_data data;
+	struct request *rq;
+	long size = 0;
+	char *end;
+	int fd, n;
+
+	rq = request_start(range, &data, &fd);
+	request_sendfile(rq);
+	free(data.file_name);
+	request_destroy(rq);
+	while ((n = read(fd, r->buf + size, MAXBUF - 1 - size)) > 0)
+		size += n;
+	SYS(n);
+	SYS(close(fd));
+	r->buf[size] = 0;
+	end = strstr(r->buf, "\r\n\r\n");
+	assert(end);
+	*end = 0;
+	r->body = end + 4;
+	r->body_size = r->buf + size - r->body;
+}
+
+/* the value of the header name of the response, or NULL */
+static char *
+response_header(struct response *r, char *name)
+{
+	static char value[MAXLINE];
+	size_t len = strlen(name);
+	char *p;
+
+	for (p = strstr(r->buf, "\r\n"); p; p = strstr(p + 2, "\r\n")) {
+		if (strncasecmp(p + 2, name, len) == 0 && p[len + 2] == ':') {
+			sscanf(p + len + 3, " %[^\r]", value);
+			return value;
+		}
+	}
+	return NULL;
+}
+
+/* check that the response has the status, and that the body has the length
+ * and the checksum of its headers */
+static void
+response_check(struct response *r, char *status)
+{
+	unsigned int csum = 0;
+	char *value;
+	long i;
+
+	CHECK(strncmp(r->buf, status, strlen(status)) == 0);
+	for (i = 0; i < r->body_size; i++) {
+		csum += (unsigned char)r->body[i];
+	}
+	value = response_header(r, "Content-Length");
+	CHECK(value && atol(value) == r->body_size);
+	value = response_header(r, "Content-Csum");
+	CHECK(value && strtoul(value, NULL, 10) == csum);
+}
+
+static void
+test_responses(void)
+{
+	static struct response r;
+	char part[MAXBUF], *p;
+	size_t n = 0;
+
+	response_get(NULL, &r);
+	response_check(&r, "HTTP/1.0 200 ");
+	CHECK(!response_header(&r, "Content-Range"));
+	CHECK(r.body_size == FILE_SIZE &&
+	      memcmp(r.body, file, FILE_SIZE) == 0);
+
+	/* a header that is not valid gets the whole file */
+	response_get("bytes=5-3", &r);
+	response_check(&r, "HTTP/1.0 200 ");
+	CHECK(r.body_size == FILE_SIZE);
+
+	response_get("bytes=-100", &r);
+	response_check(&r, "HTTP/1.0 206 ");
+	p = response_header(&r, "Content-Range");
+	CHECK(p && strcmp(p, "bytes 900-999/1000") == 0);
+	p = response_header(&r, "Content-Type");
+	CHECK(p && strcmp(p, "text/plain") == 0);
+	CHECK(r.body_size == 100 && memcmp(r.body, file + 900, 100) == 0);
+
+	response_get("bytes=0-9,-10", &r);
+	response_check(&r, "HTTP/1.0 206 ");
+	CHECK(!response_header(&r, "Content-Range"));
+	p = response_header(&r, "Content-Type");
+	CHECK(p && strcmp(p, "multipart/byteranges; boundary=" BOUNDARY) ==
+	      0);
+	n += sprintf(part + n, "\r\n--" BOUNDARY "\r\nContent-Type: "
+		     "text/plain\r\nContent-Range: bytes 0-9/1000\r\n\r\n");
+	memcpy(part + n, file, 10);
+	n += 10;
+	n += sprintf(part + n, "\r\n--" BOUNDARY "\r\nContent-Type: "
+		     "text/plain\r\nContent-Range: bytes 990-999/1000\r\n"
+		     "\r\n");
+	memcpy(part + n, file + 990, 10);
+	n += 10;
+	n += sprintf(part + n, "\r\n--" BOUNDARY "--\r\n");
+	CHECK(r.body_size == n && memcmp(r.body, part, n) == 0);
+
+	response_get("bytes=1000-,-0", &r);
+	response_check(&r, "HTTP/1.0 416 ");
+	p = response_header(&r, "Content-Range");
+	CHECK(p && strcmp(p, "bytes */1000") == 0);
+	CHECK(r.body_size == 0);
+}
+
+int
+main(int argc, char **argv)
+{
+	int i;
+
+	for (i = 0; i < FILE_SIZE; i++) {
+		file[i] = 'a' + i % 26;
+		file_csum += (unsigned char)file[i];
+	}
+	request_disk_delay = 0;
+	test_range_cases();
+	test_responses();
+	if (failures) {
+		fprintf(stderr, "test_ranges: %d checks failed\n", failures);
+		return 1;
+	}
+	printf("test_ranges: ok\n");
+	return 0;
+}
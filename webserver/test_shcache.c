@@ -0,0 +1,298 @@
+/*
+ * test_shcache.c: kills workers of the shared cache of the prefork mode in
+ * the middle of their inserts, and checks that shcache_repair and
+ * shcache_reap leave a cache that still works (see shcache.h).
+ *
+ * It includes shcache.c to look at the heap and the slots, which are private
+ * to it. The workers are children that attach to slot 1, and the test plays
+ * the parent of the server, which reaps the slot of every worker that exits.
+ */
+
+#include "shcache.c"
+#include <sys/resource.h>
+
+#define NR_FILES 300
+#define MAX_FILE 5000
+static int failures;
+static long lost_size;	/* of the block that die_locked allocates */
+
+#define CHECK(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: %s failed\n", __FILE__,	\
+			__LINE__, #cond);				\
+		failures++;						\
+	}								\
+} while (0)
+
+static char *
+file_name(int i)
+{
+	static char name[32];
+
+	snprintf(name, sizeof(name), "./dir%d/f%d", i % 4, i);
+	return name;
+}
+
+static long
+file_size(int i)
+{
+	return 100 + i * 16 % (MAX_FILE - 100);
+}
+
+/* the contents of file i, which tell it apart from the other files */
+static void
+file_fill(char *buf, int i, long size)
+{
+	long j;
+
+	for (j = 0; j < size; j++) {
+		buf[j] = i + j;
+	}
+}
+
+static int
+file_insert(struct shcache *c, int i)
+{
+	static char buf[MAX_FILE];
+	struct file_data data;
+
+	memset(&data, 0, sizeof(data));
+	data.file_name = file_name(i);
+	data.file_size = file_size(i);
+	data.file_generation = shcache_generation(c, data.file_name);
+	file_fill(buf, i, data.file_size);
+	data.file_buf = buf;
+	return shcache_insert(c, &data);
+}
+
+/* look file i up, and check that its contents are those it was inserted
+ * with. returns whether it is cached. */
+static int
+file_check(struct shcache *c, int i)
+{
+	static char buf[MAX_FILE];
+	struct shcache_entry *e;
+	struct file_data data;
+
+	if (!(e = shcache_lookup(c, file_name(i), &data)))
+		return 0;
+	file_fill(buf, i, file_size(i));
+	CHECK(data.file_size == file_size(i) &&
+	      memcmp(data.file_buf, buf, data.file_size) == 0);
+	shcache_release(c, e);
+	return 1;
+}
+
+/* check that the blocks cover the heap, and that the cache counts the ones in
+ * use, once no worker holds an entry */
+static void
+heap_check(struct shcache *c)
+{
+	struct segment *s = c->s;
+	struct block *b;
+	long off, used = 0;
+
+	for (off = s->heap; off < s->heap_end; off += b->size) {
+		b = shcache_at(c, off);
+		if (b->size < MIN_BLOCK || b->size > s->heap_end - off ||
+		    *heap_footer(c, off, b->size) != b->size)
+			break;
+		if (b->used)
+			used += b->size;
+	}
+	CHECK(off == s->heap_end);
+	CHECK(used == s->stats.size);
+	CHECK(shcache_slot(c, 1)->nr_held == 0);
+}
+
+/* fork a worker of slot 1, which runs fn, and never core dumps */
+static pid_t
+worker_start(struct shcache *c, void (*fn)(struct shcache *c))
+{
+	struct rlimit no_core = { 0, 0 };
+	pid_t pid;
+
+	SYS(pid = fork());
+	if (pid == 0) {
+		setrlimit(RLIMIT_CORE, &no_core);
+		shcache_attach(c, 1);
+		fn(c);
+		_exit(0);
+	}
+	return pid;
+}
+
+/* the worker exited, and the parent cleans up after it */
+static int
+worker_wait(struct shcache *c, pid_t pid)
+{
+	int status;
+
+	SYS(waitpid(pid, &status, 0));
+	shcache_reap(c, 1);
+	return status;
+}
+
+static void
+die_locked(struct shcache *c)
+{
+	struct file_data data;
+
+	/* hold an entry, and die in shcache_insert, with the lock held and a
+	 * block allocated, which held file 1 until it was invalidated */
+	shcache_lookup(c, file_name(0), &data);
+	shcache_lock(c);
+	heap_alloc(c, lost_size);
+}
+
+/* a worker that dies holding the lock leaves the cache to be repaired by the
+ * next process that takes the lock */
+static void
+test_die_locked(void)
+{
+	struct shcache *c = shcache_init(4 << 20, 2);
+	int i, cached = 0;
+
+	for (i = 0; i < NR_FILES; i++) {
+		CHECK(file_insert(c, i) == 0);
+	}
+	lost_size = c->s->stats.size;
+	shcache_invalidate(c, file_name(1), 0);
+	lost_size -= c->s->stats.size;
+	worker_wait(c, worker_start(c, die_locked));
+	CHECK(c->s->stats.repairs == 1);
+	CHECK(!c->s->broken);
+	CHECK(c->s->stats.reaped == 1);
+	for (i = 0; i < NR_FILES; i++) {
+		cached += file_check(c, i);
+	}
+	CHECK(cached == NR_FILES - 1 && !file_check(c, 1));
+	heap_check(c);
+	/* the block that the worker allocated was lost, the rest works */
+	shcache_invalidate(c, ".", 1);
+	CHECK(c->s->stats.size == lost_size);
+	for (i = 0; i < NR_FILES; i++) {
+		CHECK(file_insert(c, i) == 0);
+		CHECK(file_check(c, i));
+	}
+	shcache_destroy(c);
+}
+
+static void
+die_filling(struct shcache *c)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	struct file_data data;
+	char *buf;
+
+	/* the copy of the file faults on its second page */
+	buf = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert(buf != MAP_FAILED);
+	SYS(mprotect(buf + page, page, PROT_NONE));
+	memset(&data, 0, sizeof(data));
+	data.file_name = "./filling";
+	data.file_size = 2 * page;
+	data.file_generation = shcache_generation(c, data.file_name);
+	data.file_buf = buf;
+	shcache_insert(c, &data);
+}
+
+/* a worker that dies while it copies a file in leaves an entry in its slot,
+ * which only shcache_reap frees */
+static void
+test_die_filling(void)
+{
+	struct shcache *c = shcache_init(1 << 20, 2);
+	long size;
+	int i, status;
+
+	for (i = 0; i < 10; i++) {
+		CHECK(file_insert(c, i) == 0);
+	}
+	size = c->s->stats.size;
+	SYS(waitpid(worker_start(c, die_filling), &status, 0));
+	CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+	CHECK(shcache_slot(c, 1)->nr_held == 1);
+	CHECK(c->s->stats.size > size);
+	shcache_reap(c, 1);
+	CHECK(c->s->stats.reaped == 1);
+	CHECK(c->s->stats.repairs == 0);
+	CHECK(c->s->stats.size == size);
+	CHECK(!shcache_lookup(c, "./filling", &(struct file_data){ 0 }));
+	for (i = 0; i < 10; i++) {
+		CHECK(file_check(c, i));
+	}
+	heap_check(c);
+	shcache_destroy(c);
+}
+
+static void
+churn(struct shcache *c)
+{
+	struct file_data data;
+	struct shcache_entry *e;
+	unsigned int seed = getpid();
+	int i;
+
+	while (1) {
+		i = rand_r(&seed) % NR_FILES;
+		e = shcache_lookup(c, file_name(i), &data);
+		if (!e)
+			file_insert(c, i);
+		else if (rand_r(&seed) % 2)
+			shcache_release(c, e);	/* else, keep it until killed */
+		if (rand_r(&seed) % 64 == 0)
+			shcache_invalidate(c, file_name(i), 0);
+	}
+}
+
+/* workers that are killed anywhere, often with the lock held */
+static void
+test_kill_random(void)
+{
+	struct shcache *c = shcache_init(256 << 10, 2);
+	unsigned int seed = 1;
+	int i, status;
+	pid_t pid;
+
+	for (i = 0; i < 200; i++) {
+		pid = worker_start(c, churn);
+		usleep(rand_r(&seed) % 2000);
+		kill(pid, SIGKILL);
+		status = worker_wait(c, pid);
+		CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL);
+		if (c->s->broken)
+			break;
+		heap_check(c);
+	}
+	for (i = 0; i < NR_FILES; i++) {
+		file_check(c, i);
+	}
+	printf("test_shcache: %ld repairs, %ld entries reaped%s\n",
+	       c->s->stats.repairs, c->s->stats.reaped,
+	       c->s->broken ? ", cache disabled" : "");
+	if (!c->s->broken) {
+		shcache_invalidate(c, ".", 1);
+		CHECK(c->s->stats.nr_entries == 0);
+		for (i = 0; i < 20; i++) {
+			CHECK(file_insert(c, i) == 0);
+			CHECK(file_check(c, i));
+		}
+	}
+	shcache_destroy(c);
+}
+
+int
+main(int argc, char **argv)
+{
+	test_die_locked();
+	test_die_filling();
+	test_kill_random();
+	if (failures) {
+		fprintf(stderr, "test_shcache: %d checks failed\n", failures);
+		return 1;
+	}
+	printf("test_shcache: ok\n");
+	return 0;
+}
@@ -0,0 +1,213 @@
+/*
+ * tracer.c: a sampling tracer in the Chrome trace format (see tracer.h).
+ *
+ * Each thread allocates a ring of TRACER_SPANS spans the first time it
+ * records a span, and overwrites its oldest spans once the ring is full, so
+ * the trace always has the latest spans of every thread. Only the thread
+ * writes to its ring, and tracer_dump reads the rings while the threads keep
+ * recording, so a span that is overwritten during the dump may come out
+ * garbled, which is fine for a trace.
+ *
+ * The queue and the whole of a request are not spent in one thread, so they
+ * are written as async events, which the viewers show on a track of their
+ * own, by request. All the other spans are complete events of their thread.
+ */
+
+#include "common.h"
+#include "tracer.h"
+
+#ifdef STATS
+
+#include <sys/syscall.h>
+
+#define TRACER_SPANS 16384	/* spans kept by each thread */
+
+static const char *event_names[NR_TRACE_EVENTS] = {
+	[PHASE_QUEUE] = "queue",
+	[PHASE_PARSE] = "parse",
+	[PHASE_LOCK] = "lock wait",
+	[PHASE_LOOKUP] = "cache lookup",
+	[PHASE_READ] = "disk read",
+	[PHASE_PROCESS] = "process",
+	[PHASE_WRITE] = "send",
+	[PHASE_TOTAL] = "request",
+	[TRACE_ACCEPT] = "accept",
+	[TRACE_ENQUEUE] = "enqueue",
+	[TRACE_DEQUEUE] = "dequeue",
+};
+
+struct span {
+	uint64_t start;		/* stats_now() */
+	uint64_t ns;
+	uint64_t id;		/* of the request */
+	int event;
+};
+
+struct tracer_ring {
+	struct span spans[TRACER_SPANS];
+	unsigned long head;	/* spans ever recorded */
+	pid_t tid;
+	struct tracer_ring *next;	/* list of all threads' rings */
+};
+
+static struct {
+	pthread_mutex_t lock;	/* protects the list of rings */
+	struct tracer_ring *rings;
+	int sample;		/* 0 when not tracing */
+	unsigned long generation;	/* of tracer_init calls */
+	uint64_t requests;	/* started so far */
+} tracer = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* the request that the calling thread works on, 0 if it is not traced */
+static __thread uint64_t my_request;
+/* the ring of the calling thread, valid while my_generation is the
+ * generation of the tracer */
+static __thread struct tracer_ring *my_ring;
+static __thread unsigned long my_generation;
+
+void
+tracer_init(int sample)
+{
+	pthread_mutex_lock(&tracer.lock);
+	tracer.generation++;
+	tracer.requests = 0;
+	__atomic_store_n(&tracer.sample, sample, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&tracer.lock);
+}
+
+uint64_t
+tracer_start(void)
+{
+	int sample = __atomic_load_n(&tracer.sample, __ATOMIC_ACQUIRE);
+	uint64_t n;
+
+	if (sample <= 0)
+		return my_request = 0;
+	n = __atomic_fetch_add(&tracer.requests, 1, __ATOMIC_RELAXED);
+	return my_request = n % sample == 0 ? n + 1 : 0;
+}
+
+void
+tracer_switch(uint64_t id)
+{
+	my_request = id;
+}
+
+uint64_t
+tracer_current(void)
+{
+	return my_request;
+}
+
+static struct tracer_ring *
+tracer_ring(void)
+{
+	struct tracer_ring *r;
+
+	if (my_ring && my_generation == tracer.generation)
+		return my_ring;
+	r = Malloc(sizeof(struct tracer_ring));
+	r->head = 0;
+	r->tid = syscall(SYS_gettid);
+	pthread_mutex_lock(&tracer.lock);
+	r->next = tracer.rings;
+	tracer.rings = r;
+	my_generation = tracer.generation;
+	pthread_mutex_unlock(&tracer.lock);
+	return my_ring = r;
+}
+
+void
+tracer_record(int event, uint64_t ns)
+{
+	struct tracer_ring *r;
+	struct span *s;
+
+	if (!my_request || !__atomic_load_n(&tracer.sample, __ATOMIC_ACQUIRE))
+		return;
+	r = tracer_ring();
+	s = &r->spans[r->head % TRACER_SPANS];
+	s->ns = ns;
+	s->start = stats_now() - ns;
+	s->id = my_request;
+	s->event = event;
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/* write span s of thread tid as Chrome trace events, after others */
+static void
+tracer_dump_span(FILE *out, struct span *s, pid_t tid)
+{
+	const char *name;
+	pid_t pid = getpid();
+
+	if (s->event < 0 || s->event >= NR_TRACE_EVENTS)
+		return;
+	name = event_names[s->event];
+	if (s->event == PHASE_QUEUE || s->event == PHASE_TOTAL) {
+		fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"request\","
+			"\"ph\":\"b\",\"id\":%lu,\"ts\":%.3f,\"pid\":%d,"
+			"\"tid\":%d}", name, (unsigned long)s->id,
+			s->start / 1000.0, pid, tid);
+		fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"request\","
+			"\"ph\":\"e\",\"id\":%lu,\"ts\":%.3f,\"pid\":%d,"
+			"\"tid\":%d}", name, (unsigned long)s->id,
+			(s->start + s->ns) / 1000.0, pid, tid);
+		return;
+	}
+	fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\","
+		"\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+		"\"args\":{\"request\":%lu}}", name,
+		s->start / 1000.0, s->ns / 1000.0, pid, tid,
+		(unsigned long)s->id);
+}
+
+long
+tracer_dump(const char *path)
+{
+	struct tracer_ring *r;
+	unsigned long head, i;
+	long nr_spans = 0;
+	FILE *out;
+
+	if (!(out = fopen(path, "w")))
+		return -1;
+	fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+		"\"args\":{\"name\":\"server\"}}", getpid());
+	pthread_mutex_lock(&tracer.lock);
+	for (r = tracer.rings; r; r = r->next) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		for (i = head > TRACER_SPANS ? head - TRACER_SPANS : 0;
+		     i < head; i++, nr_spans++) {
+			tracer_dump_span(out, &r->spans[i % TRACER_SPANS],
+					 r->tid);
+		}
+	}
+	pthread_mutex_unlock(&tracer.lock);
+	fprintf(out, "\n]}\n");
+	if (fclose(out) != 0)
+		return -1;
+	return nr_spans;
+}
+
+void
+tracer_exit(void)
+{
+	struct tracer_ring *r;
+
+	pthread_mutex_lock(&tracer.lock);
+	__atomic_store_n(&tracer.sample, 0, __ATOMIC_RELEASE);
+	while ((r = tracer.rings) != NULL) {
+		tracer.rings = r->next;
+		free(r);
+	}
+	/* the other threads allocate new rings on the next tracer_init */
+	tracer.generation++;
+	my_ring = NULL;
+	pthread_mutex_unlock(&tracer.lock);
+}
+
+#endif /* STATS */
@@ -0,0 +1,62 @@
+#ifndef __TRACER_H__
+#define __TRACER_H__
+
+#include <stdint.h>
+#include "stats.h"
+
+/*
+ * A sampling tracer, which records what the threads of the server do for one
+ * in every few requests, as spans with a start and a duration, and writes
+ * them out in the Chrome trace format, which chrome://tracing and Perfetto
+ * show on a timeline per thread.
+ *
+ * The spans are those of the phases of stats.h, which stats_record passes on
+ * to the tracer, and the events below. Each thread keeps the latest spans
+ * that it recorded in a ring of its own, without a lock. A thread records the
+ * spans of the request that it works on, which it starts with tracer_start
+ * or takes over from another thread with tracer_switch.
+ *
+ * Like the statistics, the tracer is compiled out unless STATS is defined.
+ */
+
+enum tracer_event {
+	TRACE_ACCEPT = NR_PHASES,	/* accept(2) of the connection */
+	TRACE_ENQUEUE,	/* putting it in sv->buffer, waiting while it is full */
+	TRACE_DEQUEUE,	/* a worker waiting for sv->lock and a connection */
+	NR_TRACE_EVENTS
+};
+
+#ifdef STATS
+
+/* trace one in every sample requests from now on */
+void tracer_init(int sample);
+/* start a new request on the calling thread. returns its id if it is traced,
+ * and 0 if it is not. */
+uint64_t tracer_start(void);
+/* the calling thread now works on the request id that tracer_start
+ * returned, in another thread */
+void tracer_switch(uint64_t id);
+/* the id of the request of the calling thread, 0 if it is not traced */
+uint64_t tracer_current(void);
+/* record that the request of the calling thread spent the last ns
+ * nanoseconds in event, a phase or a tracer_event */
+void tracer_record(int event, uint64_t ns);
+/* write the spans of all the threads to the file path. returns the number
+ * of spans, or -1 on errors. */
+long tracer_dump(const char *path);
+/* stop tracing, and free the spans. no thread may record after this. */
+void tracer_exit(void);
+
+#else /* STATS */
+
+static inline void tracer_init(int sample) {}
+static inline uint64_t tracer_start(void) { return 0; }
+static inline void tracer_switch(uint64_t id) {}
+static inline uint64_t tracer_current(void) { return 0; }
+static inline void tracer_record(int event, uint64_t ns) {}
+static inline long tracer_dump(const char *path) { return 0; }
+static inline void tracer_exit(void) {}
+
+#endif /* STATS */
+
+#endif /* __TRACER_H__ */
@@ -0,0 +1,514 @@
+/*
+ * uthread.c: user-level threads on a few kernel threads (see uthread.h).
+ *
+ * Each kernel thread runs a scheduler of its own, with its own ready queue,
+ * epoll instance and timers, and a user-level thread stays on the scheduler
+ * that started it. Schedulers only share their inboxes, the threads spawned
+ * for them but not yet started, which are protected by a lock, and an
+ * eventfd wakes a scheduler up when its inbox gets a thread.
+ *
+ * A thread that parks on a socket registers the socket with the epoll
+ * instance of its scheduler, as a one-shot event that points back to the
+ * thread, and switches to the scheduler. Later waits on the same socket
+ * re-arm the event. The socket is closed before the thread finishes, which
+ * takes it out of the epoll instance. Sleeping threads are kept in a heap
+ * by deadline, and a timerfd wakes the scheduler up at the first one.
+ *
+ * Stacks are mapped without reserving memory, with a guard page beneath
+ * them, so a thread only uses the pages that it touches, and each scheduler
+ * keeps a few of the stacks of finished threads for the next threads.
+ */
+
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <ucontext.h>
+#include "common.h"
+#include "tracer.h"
+#include "uthread.h"
+
+/* request.c keeps a few buffers of MAXLINE bytes on the stack */
+#define UTHREAD_STACK_SIZE (16 * MAXLINE)
+#define UTHREAD_FREE_STACKS 64	/* stacks kept by each scheduler */
+#define UTHREAD_MAX_EVENTS 64	/* per epoll_wait */
+
+struct uthread {
+	ucontext_t context;
+	void (*fn)(void *);
+	void *arg;
+	char *stack;		/* with the guard page */
+	int fd;			/* registered with the epoll instance, or -1 */
+	int done;		/* fn returned */
+	uint64_t deadline;	/* of uthread_usleep, in ns */
+	struct uthread *next;	/* in the ready queue, or the inbox */
+};
+
+struct uthread_stats {
+	long spawned;
+	long switches;		/* to user-level threads */
+	long parks;		/* on sockets */
+	long sleeps;
+	long nr_threads;	/* started and not finished */
+	long max_threads;
+};
+
+/* the scheduler of a kernel thread */
+struct sched {
+	struct uthreads *u;
+	pthread_t thread;
+	ucontext_t context;	/* of the scheduler loop */
+	struct uthread *current;
+	struct uthread *ready;	/* a FIFO queue */
+	struct uthread *ready_tail;
+	int epfd;
+	int eventfd;		/* the inbox has threads */
+	int timerfd;		/* the first sleeping thread is due */
+	struct uthread **timers;	/* a min-heap by deadline */
+	int nr_timers;
+	int max_timers;
+	char *stacks[UTHREAD_FREE_STACKS];	/* of finished threads */
+	int nr_stacks;
+	struct uthread_stats stats;	/* only updated by the scheduler */
+	pthread_mutex_t lock;	/* protects everything below */
+	struct uthread *inbox;
+	struct uthread *inbox_tail;
+	int exiting;
+	struct uthread_stats shared;	/* a copy of stats, for the dump */
+};
+
+struct uthreads {
+	struct sched *scheds;
+	int nr_scheds;
+	unsigned int next;	/* scheduler of the next thread */
+	long page_size;
+};
+
+/* the scheduler of the calling kernel thread, or NULL */
+static __thread struct sched *uthread_sched;
+
+static uint64_t
+uthread_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+sched_ready(struct sched *s, struct uthread *t)
+{
+	t->next = NULL;
+	if (s->ready_tail)
+		s->ready_tail->next = t;
+	else
+		s->ready = t;
+	s->ready_tail = t;
+}
+
+static struct uthread *
+sched_pop_ready(struct sched *s)
+{
+	struct uthread *t = s->ready;
+
+	if (t && !(s->ready = t->next))
+		s->ready_tail = NULL;
+	return t;
+}
+
+static void
+timer_swap(struct sched *s, int i, int j)
+{
+	struct uthread *t = s->timers[i];
+
+	s->timers[i] = s->timers[j];
+	s->timers[j] = t;
+}
+
+static void
+timer_push(struct sched *s, struct uthread *t)
+{
+	int i;
+
+	if (s->nr_timers == s->max_timers) {
+		s->max_timers = s->max_timers ? 2 * s->max_timers : 64;
+		s->timers = realloc(s->timers, sizeof(struct uthread *) *
+				    s->max_timers);
+		assert(s->timers);
+	}
+	i = s->nr_timers++;
+	s->timers[i] = t;
+	while (i > 0 && s->timers[i]->deadline <
+	       s->timers[(i - 1) / 2]->deadline) {
+		timer_swap(s, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static struct uthread *
+timer_pop(struct sched *s)
+{
+	struct uthread *t = s->timers[0];
+	int i = 0, child;
+
+	s->timers[0] = s->timers[--s->nr_timers];
+	while ((child = 2 * i + 1) < s->nr_timers) {
+		if (child + 1 < s->nr_timers && s->timers[child + 1]->deadline <
+		    s->timers[child]->deadline)
+			child++;
+		if (s->timers[i]->deadline <= s->timers[child]->deadline)
+			break;
+		timer_swap(s, i, child);
+		i = child;
+	}
+	return t;
+}
+
+/* make the threads that are due ready, and arm the timerfd for the next
+ * one */
+static void
+sched_expire(struct sched *s)
+{
+	struct itimerspec its;
+	uint64_t now = uthread_now();
+
+	while (s->nr_timers > 0 && s->timers[0]->deadline <= now) {
+		sched_ready(s, timer_pop(s));
+	}
+	if (s->nr_timers == 0)
+		return;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = s->timers[0]->deadline / 1000000000;
+	its.it_value.tv_nsec = s->timers[0]->deadline % 1000000000;
+	SYS(timerfd_settime(s->timerfd, TFD_TIMER_ABSTIME, &its, NULL));
+}
+
+/* the first function of every thread */
+static void
+uthread_start(void)
+{
+	struct sched *s = uthread_sched;
+	struct uthread *t = s->current;
+
+	t->fn(t->arg);
+	t->done = 1;
+	/* the scheduler frees the stack, once it is off it */
+	swapcontext(&t->context, &s->context);
+}
+
+/* give t a stack, and a context that starts it */
+static void
+sched_start(struct sched *s, struct uthread *t)
+{
+	long page_size = s->u->page_size;
+
+	if (s->nr_stacks > 0) {
+		t->stack = s->stacks[--s->nr_stacks];
+	} else {
+		t->stack = mmap(NULL, page_size + UTHREAD_STACK_SIZE,
+				PROT_READ | PROT_WRITE, MAP_PRIVATE |
+				MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+				-1, 0);
+		if (t->stack == MAP_FAILED) {
+			perror("mmap");
+			exit(1);
+		}
+		/* overflows fault, rather than overwrite another stack */
+		SYS(mprotect(t->stack, page_size, PROT_NONE));
+	}
+	getcontext(&t->context);
+	t->context.uc_stack.ss_sp = t->stack + page_size;
+	t->context.uc_stack.ss_size = UTHREAD_STACK_SIZE;
+	t->context.uc_link = NULL;
+	makecontext(&t->context, uthread_start, 0);
+	s->stats.nr_threads++;
+	if (s->stats.nr_threads > s->stats.max_threads)
+		s->stats.max_threads = s->stats.nr_threads;
+	sched_ready(s, t);
+}
+
+static void
+sched_finish(struct sched *s, struct uthread *t)
+{
+	if (s->nr_stacks < UTHREAD_FREE_STACKS) {
+		s->stacks[s->nr_stacks++] = t->stack;
+	} else {
+		munmap(t->stack, s->u->page_size + UTHREAD_STACK_SIZE);
+	}
+	free(t);
+	s->stats.nr_threads--;
+}
+
+/* start the threads in the inbox. returns 1 if the scheduler should exit,
+ * because it is exiting and has no threads left. */
+static int
+sched_inbox(struct sched *s)
+{
+	struct uthread *t, *next;
+	int exit;
+
+	pthread_mutex_lock(&s->lock);
+	t = s->inbox;
+	s->inbox = s->inbox_tail = NULL;
+	s->shared = s->stats;
+	exit = s->exiting && !t && s->stats.nr_threads == 0;
+	pthread_mutex_unlock(&s->lock);
+	for (; t; t = next) {
+		next = t->next;
+		sched_start(s, t);
+	}
+	return exit;
+}
+
+/* run the threads that are ready now. the threads that they make ready run
+ * in the next pass, after the sockets were polled. */
+static void
+sched_run(struct sched *s)
+{
+	struct uthread *t, *last = s->ready_tail;
+
+	while (last && (t = sched_pop_ready(s))) {
+		s->current = t;
+		s->stats.switches++;
+		swapcontext(&s->context, &t->context);
+		s->current = NULL;
+		if (t->done)
+			sched_finish(s, t);
+		if (t == last)
+			break;
+	}
+}
+
+static void *
+sched_main(void *arg)
+{
+	struct sched *s = arg;
+	struct epoll_event events[UTHREAD_MAX_EVENTS];
+	uint64_t count;
+	int n, i;
+
+	uthread_sched = s;
+	while (!sched_inbox(s)) {
+		sched_run(s);
+		sched_expire(s);	/* for the threads that just slept */
+		n = epoll_wait(s->epfd, events, UTHREAD_MAX_EVENTS,
+			       s->ready ? 0 : -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		SYS(n);
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == &s->eventfd) {
+				SYS(read(s->eventfd, &count, sizeof(count)));
+			} else if (events[i].data.ptr == &s->timerfd) {
+				SYS(read(s->timerfd, &count, sizeof(count)));
+			} else {
+				sched_ready(s, events[i].data.ptr);
+			}
+		}
+		sched_expire(s);
+	}
+	return NULL;
+}
+
+/* park the current thread t until something makes it ready. the request
+ * that the tracer follows is per kernel thread, and the other threads that
+ * run meanwhile change it, so t takes its own back when it resumes. */
+static void
+sched_park(struct sched *s, struct uthread *t)
+{
+	uint64_t trace = tracer_current();
+
+	swapcontext(&t->context, &s->context);
+	tracer_switch(trace);
+}
+
+struct uthreads *
+uthreads_init(int nr_kthreads)
+{
+	struct uthreads *u;
+	struct epoll_event ev;
+	struct sched *s;
+	int i;
+
+	u = Malloc(sizeof(struct uthreads));
+	u->nr_scheds = nr_kthreads;
+	u->scheds = Malloc(sizeof(struct sched) * nr_kthreads);
+	u->next = 0;
+	u->page_size = sysconf(_SC_PAGESIZE);
+	memset(u->scheds, 0, sizeof(struct sched) * nr_kthreads);
+	for (i = 0; i < nr_kthreads; i++) {
+		s = &u->scheds[i];
+		s->u = u;
+		pthread_mutex_init(&s->lock, NULL);
+		SYS(s->epfd = epoll_create1(EPOLL_CLOEXEC));
+		SYS(s->eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+		SYS(s->timerfd = timerfd_create(CLOCK_MONOTONIC,
+						TFD_CLOEXEC | TFD_NONBLOCK));
+		ev.events = EPOLLIN;
+		ev.data.ptr = &s->eventfd;
+		SYS(epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->eventfd, &ev));
+		ev.data.ptr = &s->timerfd;
+		SYS(epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->timerfd, &ev));
+		pthread_create(&s->thread, NULL, sched_main, s);
+	}
+	return u;
+}
+
+/* wake the scheduler s up */
+static void
+sched_wake(struct sched *s)
+{
+	uint64_t one = 1;
+
+	SYS(write(s->eventfd, &one, sizeof(one)));
+}
+
+void
+uthreads_join(struct uthreads *u)
+{
+	struct sched *s;
+	int i;
+
+	for (i = 0; i < u->nr_scheds; i++) {
+		s = &u->scheds[i];
+		pthread_mutex_lock(&s->lock);
+		s->exiting = 1;
+		pthread_mutex_unlock(&s->lock);
+		sched_wake(s);
+	}
+	for (i = 0; i < u->nr_scheds; i++) {
+		s = &u->scheds[i];
+		pthread_join(s->thread, NULL);
+		s->shared = s->stats;
+	}
+}
+
+void
+uthreads_destroy(struct uthreads *u)
+{
+	struct sched *s;
+	int i;
+
+	for (i = 0; i < u->nr_scheds; i++) {
+		s = &u->scheds[i];
+		while (s->nr_stacks > 0) {
+			munmap(s->stacks[--s->nr_stacks],
+			       u->page_size + UTHREAD_STACK_SIZE);
+		}
+		free(s->timers);
+		close(s->timerfd);
+		close(s->eventfd);
+		close(s->epfd);
+		pthread_mutex_destroy(&s->lock);
+	}
+	free(u->scheds);
+	free(u);
+}
+
+void
+uthread_spawn(struct uthreads *u, void (*fn)(void *), void *arg)
+{
+	struct uthread *t;
+	struct sched *s;
+	int wake;
+
+	t = Malloc(sizeof(struct uthread));
+	t->fn = fn;
+	t->arg = arg;
+	t->fd = -1;
+	t->done = 0;
+	t->next = NULL;
+	s = &u->scheds[__atomic_fetch_add(&u->next, 1, __ATOMIC_RELAXED) %
+		       u->nr_scheds];
+	pthread_mutex_lock(&s->lock);
+	/* the scheduler is only woken up for the first thread it hasn't
+	 * seen */
+	wake = s->inbox == NULL;
+	if (s->inbox_tail)
+		s->inbox_tail->next = t;
+	else
+		s->inbox = t;
+	s->inbox_tail = t;
+	s->stats.spawned++;
+	pthread_mutex_unlock(&s->lock);
+	if (wake)
+		sched_wake(s);
+}
+
+void
+uthread_wait_fd(int fd, int events)
+{
+	struct sched *s = uthread_sched;
+	struct uthread *t = s ? s->current : NULL;
+	struct epoll_event ev;
+	struct pollfd pfd = { fd, events, 0 };
+
+	if (!t) {
+		poll(&pfd, 1, -1);
+		return;
+	}
+	ev.events = EPOLLONESHOT | (events & POLLIN ? EPOLLIN : 0) |
+		(events & POLLOUT ? EPOLLOUT : 0);
+	ev.data.ptr = t;
+	/* the fd may have been closed, and its number reused, since the
+	 * last wait */
+	if (t->fd != fd || epoll_ctl(s->epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+		SYS(epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev));
+		t->fd = fd;
+	}
+	s->stats.parks++;
+	sched_park(s, t);
+}
+
+int
+uthread_usleep(useconds_t usec)
+{
+	struct sched *s = uthread_sched;
+	struct uthread *t = s ? s->current : NULL;
+
+	if (!t)
+		return usleep(usec);
+	t->deadline = uthread_now() + (uint64_t)usec * 1000;
+	timer_push(s, t);
+	s->stats.sleeps++;
+	sched_park(s, t);
+	return 0;
+}
+
+void
+uthread_yield(void)
+{
+	struct sched *s = uthread_sched;
+	struct uthread *t = s ? s->current : NULL;
+
+	if (!t)
+		return;
+	sched_ready(s, t);
+	sched_park(s, t);
+}
+
+void
+uthreads_dump(struct uthreads *u, FILE *out)
+{
+	struct uthread_stats total, *st;
+	int i;
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < u->nr_scheds; i++) {
+		pthread_mutex_lock(&u->scheds[i].lock);
+		st = &u->scheds[i].shared;
+		total.spawned += u->scheds[i].stats.spawned;
+		total.switches += st->switches;
+		total.parks += st->parks;
+		total.sleeps += st->sleeps;
+		total.nr_threads += st->nr_threads;
+		total.max_threads += st->max_threads;
+		pthread_mutex_unlock(&u->scheds[i].lock);
+	}
+	fprintf(out, "uthreads: %ld threads on %d kernel threads, %ld "
+		"running, at most %ld, %ld switches, %ld parks on sockets, "
+		"%ld sleeps\n", total.spawned, u->nr_scheds, total.nr_threads,
+		total.max_threads, total.switches, total.parks, total.sleeps);
+	fflush(out);
+}
@@ -0,0 +1,52 @@
+#ifndef __UTHREAD_H__
+#define __UTHREAD_H__
+
+#include <stdio.h>
+#include <unistd.h>
+
+/*
+ * User-level threads, for serving each connection in a thread of its own
+ * without a kernel thread per connection.
+ *
+ * A few kernel threads each run a scheduler, which switches between its
+ * user-level threads with swapcontext, as the threads of threads/thread.c
+ * do. Unlike those, the threads are not preempted: a thread runs until it
+ * finishes, yields, or parks. A thread parks when a socket it reads or writes
+ * is not ready, in uthread_wait_fd, and the scheduler runs it again once
+ * epoll says that the socket is ready. So sockets are non-blocking, and a
+ * connection that waits for its client only costs the few pages of its
+ * stack that it touched.
+ *
+ * A thread must not park while it holds a pthread mutex, since other
+ * threads of its kernel thread may need it. Files are read with blocking
+ * calls, which block the whole kernel thread, because epoll can't wait for
+ * regular files.
+ */
+
+struct uthreads;
+
+/* start nr_kthreads kernel threads, which run the user-level threads */
+struct uthreads *uthreads_init(int nr_kthreads);
+/* wait for all the user-level threads to finish, and stop the kernel
+ * threads. no threads may be spawned after this. */
+void uthreads_join(struct uthreads *u);
+/* free u, after uthreads_join */
+void uthreads_destroy(struct uthreads *u);
+
+/* run fn(arg) in a new user-level thread. may be called by any thread. */
+void uthread_spawn(struct uthreads *u, void (*fn)(void *), void *arg);
+
+/* park the calling user-level thread until fd is ready for events (POLLIN
+ * or POLLOUT). off a user-level thread, this waits with poll(2). this is
+ * the rio_wait of the server (see common.h). */
+void uthread_wait_fd(int fd, int events);
+/* usleep(3), which parks the calling user-level thread instead of blocking
+ * its kernel thread */
+int uthread_usleep(useconds_t usec);
+/* let the other user-level threads of the kernel thread run */
+void uthread_yield(void);
+
+/* print the statistics of the threads */
+void uthreads_dump(struct uthreads *u, FILE *out);
+
+#endif /* __UTHREAD_H__ */
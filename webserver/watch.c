@@ -0,0 +1,471 @@
+/*
+ * watch.c: invalidates the file cache when files change (see watch.h).
+ *
+ * inotify does not watch directory trees, so every directory under the root
+ * gets its own watch, and dirs maps each watch descriptor back to the path of
+ * its directory. New directories are watched as they appear. Only the watcher
+ * thread uses dirs once watch_init returns.
+ *
+ * A stat that races with a change could put metadata that is already stale
+ * into the table, after the watcher dropped it. So every change bumps a
+ * generation number, and watch_stat only keeps what it found if no change to
+ * the file was seen while it called stat(2). Paths are hashed into groups
+ * that share a generation, and a change to a directory bumps the generation
+ * of all of them, so that a busy file, such as a log being written, does not
+ * keep the other files out of the table. The file cache does the same for
+ * file contents, with cache_generation.
+ */
+
+#include <dirent.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include "common.h"
+#include "shcache.h"
+#include "watch.h"
+
+#define WATCH_MIN_BUCKETS 64
+#define WATCH_GENERATIONS 1024	/* groups of paths, see watch_generation */
+#define WATCH_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | \
+		    IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | \
+		    IN_MOVE_SELF)
+
+/* what a stat(2) of a file found */
+struct meta {
+	unsigned long hash;
+	off_t size;
+	time_t mtime;
+	mode_t mode;
+	unsigned int csum;	/* of the contents, if has_csum is set */
+	int has_csum;
+	struct meta *next;
+	char name[];
+};
+
+struct watch {
+	int fd;			/* inotify instance */
+	int exitfd;		/* eventfd that tells the thread to exit */
+	pthread_t thread;
+	struct cache **caches;	/* invalidated along with the table */
+	int nr_caches;
+	struct shcache *shared;	/* also invalidated, or NULL */
+	char **dirs;		/* path of each watch descriptor, or NULL */
+	int nr_dirs;		/* size of dirs */
+	long nr_watched;	/* directories being watched */
+	pthread_mutex_t lock;	/* protects everything below */
+	struct meta **table;
+	unsigned long nr_buckets;	/* a power of two */
+	long nr_entries;
+	/* bumped by the changes to the paths in each group, and to
+	 * directories */
+	unsigned long generations[WATCH_GENERATIONS];
+	unsigned long dir_generation;
+	long hits;		/* watch_stat calls without a stat(2) */
+	long misses;
+	long events;
+	long invalidations;	/* paths dropped from the table */
+};
+
+static unsigned long
+watch_hash(const char *str)
+{
+	unsigned long hash = 5381;
+	int c;
+
+	while ((c = *str++))
+		hash = hash * 33 ^ c;
+	return hash;
+}
+
+/* the metadata of path, or NULL. the lock must be held. */
+static struct meta *
+watch_find(struct watch *w, const char *path, unsigned long hash)
+{
+	struct meta *m;
+
+	for (m = w->table[hash & (w->nr_buckets - 1)]; m; m = m->next) {
+		if (m->hash == hash && strcmp(m->name, path) == 0)
+			return m;
+	}
+	return NULL;
+}
+
+/* the generation of the file whose path has the hash. the lock must be
+ * held. */
+static unsigned long
+watch_generation(struct watch *w, unsigned long hash)
+{
+	return w->dir_generation + w->generations[hash % WATCH_GENERATIONS];
+}
+
+static void
+watch_resize(struct watch *w, unsigned long nr_buckets)
+{
+	struct meta **table, *m, *next;
+	unsigned long i;
+
+	table = Malloc(sizeof(struct meta *) * nr_buckets);
+	for (i = 0; i < nr_buckets; i++) {
+		table[i] = NULL;
+	}
+	for (i = 0; i < w->nr_buckets; i++) {
+		for (m = w->table[i]; m; m = next) {
+			next = m->next;
+			m->next = table[m->hash & (nr_buckets - 1)];
+			table[m->hash & (nr_buckets - 1)] = m;
+		}
+	}
+	free(w->table);
+	w->table = table;
+	w->nr_buckets = nr_buckets;
+}
+
+/* is path the directory dir, or under it? */
+static int
+watch_under(const char *path, const char *dir, size_t len)
+{
+	return strncmp(path, dir, len) == 0 &&
+		(path[len] == 0 || path[len] == '/');
+}
+
+/* forget the metadata of path, or of everything under it if it is a
+ * directory, and invalidate the caches in the same way */
+static void
+watch_invalidate(struct watch *w, const char *path, int is_dir)
+{
+	size_t len = strlen(path);
+	struct meta **p, *m;
+	unsigned long i, first, last;
+
+	pthread_mutex_lock(&w->lock);
+	if (is_dir)
+		w->dir_generation++;
+	else
+		w->generations[watch_hash(path) % WATCH_GENERATIONS]++;
+	/* a file is in one bucket, but a directory can have files in any */
+	first = 0;
+	last = w->nr_buckets - 1;
+	if (!is_dir)
+		first = last = watch_hash(path) & (w->nr_buckets - 1);
+	for (i = first; i <= last; i++) {
+		for (p = &w->table[i]; (m = *p) != NULL;) {
+			if (is_dir ? watch_under(m->name, path, len) :
+			    strcmp(m->name, path) == 0) {
+				*p = m->next;
+				free(m);
+				w->nr_entries--;
+				w->invalidations++;
+			} else {
+				p = &m->next;
+			}
+		}
+	}
+	pthread_mutex_unlock(&w->lock);
+	for (i = 0; i < w->nr_caches; i++) {
+		cache_invalidate(w->caches[i], path, is_dir);
+	}
+	if (w->shared)
+		shcache_invalidate(w->shared, path, is_dir);
+}
+
+/* watch the directory at path and all the directories under it. returns -1
+ * if inotify ran out of watches. */
+static int
+watch_add_tree(struct watch *w, const char *path)
+{
+	char child[MAXLINE];
+	struct dirent *d;
+	struct stat sbuf;
+	DIR *dir;
+	int wd, ret = 0;
+
+	if ((wd = inotify_add_watch(w->fd, path, WATCH_MASK | IN_ONLYDIR)) < 0)
+		return errno == ENOSPC ? -1 : 0;
+	if (wd >= w->nr_dirs) {
+		int n = w->nr_dirs ? w->nr_dirs : 64;
+
+		while (n <= wd)
+			n *= 2;
+		w->dirs = realloc(w->dirs, sizeof(char *) * n);
+		assert(w->dirs);
+		memset(w->dirs + w->nr_dirs, 0,
+		       sizeof(char *) * (n - w->nr_dirs));
+		w->nr_dirs = n;
+	}
+	if (!w->dirs[wd])
+		w->nr_watched++;
+	free(w->dirs[wd]);
+	w->dirs[wd] = strdup(path);
+	if ((dir = opendir(path)) == NULL)
+		return 0;
+	while (ret == 0 && (d = readdir(dir)) != NULL) {
+		if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+			continue;
+		snprintf(child, MAXLINE, "%s/%s", path, d->d_name);
+		if (d->d_type == DT_DIR || (d->d_type == DT_UNKNOWN &&
+		    lstat(child, &sbuf) == 0 && S_ISDIR(sbuf.st_mode))) {
+			ret = watch_add_tree(w, child);
+		}
+	}
+	closedir(dir);
+	return ret;
+}
+
+/* stop watching the directories at path and under it, e.g., because they
+ * were moved and their paths are no longer right */
+static void
+watch_remove_tree(struct watch *w, const char *path)
+{
+	size_t len = strlen(path);
+	int wd;
+
+	for (wd = 0; wd < w->nr_dirs; wd++) {
+		if (w->dirs[wd] && watch_under(w->dirs[wd], path, len)) {
+			inotify_rm_watch(w->fd, wd);
+			free(w->dirs[wd]);
+			w->dirs[wd] = NULL;
+			w->nr_watched--;
+		}
+	}
+}
+
+static void
+watch_event(struct watch *w, struct inotify_event *ev)
+{
+	char path[MAXLINE];
+	int is_dir = (ev->mask & IN_ISDIR) != 0;
+
+	pthread_mutex_lock(&w->lock);
+	w->events++;
+	pthread_mutex_unlock(&w->lock);
+	if (ev->mask & IN_Q_OVERFLOW) {
+		/* events were lost, so nothing can be trusted */
+		watch_invalidate(w, ".", 1);
+		return;
+	}
+	if (ev->wd < 0 || ev->wd >= w->nr_dirs || !w->dirs[ev->wd])
+		return;
+	if (ev->mask & IN_IGNORED) {
+		/* the directory is gone */
+		free(w->dirs[ev->wd]);
+		w->dirs[ev->wd] = NULL;
+		w->nr_watched--;
+		return;
+	}
+	if (ev->len == 0) {
+		/* the watched directory itself changed */
+		watch_invalidate(w, w->dirs[ev->wd], 1);
+		return;
+	}
+	snprintf(path, MAXLINE, "%s/%s", w->dirs[ev->wd], ev->name);
+	watch_invalidate(w, path, is_dir);
+	if (is_dir && (ev->mask & (IN_MOVED_FROM | IN_DELETE))) {
+		watch_remove_tree(w, path);
+	}
+	if (is_dir && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+		if (watch_add_tree(w, path) < 0) {
+			fprintf(stderr, "watch: out of inotify watches, %s is "
+				"not watched\n", path);
+		}
+	}
+}
+
+static void *
+watch_thread(void *arg)
+{
+	struct watch *w = (struct watch *)arg;
+	char buf[16384]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd fds[2];
+	struct inotify_event *ev;
+	ssize_t n;
+	char *p;
+
+	fds[0].fd = w->fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = w->exitfd;
+	fds[1].events = POLLIN;
+	while (1) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			SYS(-1);
+		}
+		if (fds[1].revents)
+			return NULL;
+		if ((n = read(w->fd, buf, sizeof(buf))) < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			SYS(n);
+		}
+		for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)p;
+			watch_event(w, ev);
+		}
+	}
+}
+
+struct watch *
+watch_init(const char *root, struct cache **caches, int nr_caches,
+	   struct shcache *shared)
+{
+	struct watch *w;
+	int i;
+
+	w = Malloc(sizeof(struct watch));
+	SYS(w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+	SYS(w->exitfd = eventfd(0, EFD_CLOEXEC));
+	w->caches = Malloc((nr_caches + 1) * sizeof(struct cache *));
+	w->nr_caches = 0;
+	for (i = 0; i < nr_caches; i++) {
+		if (caches[i])
+			w->caches[w->nr_caches++] = caches[i];
+	}
+	w->shared = shared;
+	w->dirs = NULL;
+	w->nr_dirs = 0;
+	w->nr_watched = 0;
+	pthread_mutex_init(&w->lock, NULL);
+	w->table = NULL;
+	w->nr_buckets = 0;
+	watch_resize(w, WATCH_MIN_BUCKETS);
+	w->nr_entries = 0;
+	memset(w->generations, 0, sizeof(w->generations));
+	w->dir_generation = 0;
+	w->hits = 0;
+	w->misses = 0;
+	w->events = 0;
+	w->invalidations = 0;
+	if (watch_add_tree(w, root) < 0 || w->nr_watched == 0) {
+		fprintf(stderr, "watch: can't watch all the directories under "
+			"%s, files are not watched\n", root);
+		w->thread = pthread_self();
+		watch_destroy(w);
+		return NULL;
+	}
+	SYS(pthread_create(&w->thread, NULL, watch_thread, w));
+	return w;
+}
+
+void
+watch_destroy(struct watch *w)
+{
+	uint64_t one = 1;
+	struct meta *m, *next;
+	unsigned long i;
+	int wd;
+
+	if (!pthread_equal(w->thread, pthread_self())) {
+		SYS(write(w->exitfd, &one, sizeof(one)));
+		pthread_join(w->thread, NULL);
+	}
+	for (i = 0; i < w->nr_buckets; i++) {
+		for (m = w->table[i]; m; m = next) {
+			next = m->next;
+			free(m);
+		}
+	}
+	for (wd = 0; wd < w->nr_dirs; wd++) {
+		free(w->dirs[wd]);
+	}
+	free(w->dirs);
+	free(w->table);
+	free(w->caches);
+	SYS(close(w->exitfd));
+	SYS(close(w->fd));
+	pthread_mutex_destroy(&w->lock);
+	free(w);
+}
+
+int
+watch_stat(struct watch *w, const char *path, struct stat *sbuf)
+{
+	unsigned long hash = watch_hash(path), generation;
+	size_t len = strlen(path);
+	struct meta *m;
+
+	pthread_mutex_lock(&w->lock);
+	if ((m = watch_find(w, path, hash)) != NULL) {
+		memset(sbuf, 0, sizeof(*sbuf));
+		sbuf->st_size = m->size;
+		sbuf->st_mtime = m->mtime;
+		sbuf->st_mode = m->mode;
+		w->hits++;
+		pthread_mutex_unlock(&w->lock);
+		return 0;
+	}
+	w->misses++;
+	generation = watch_generation(w, hash);
+	pthread_mutex_unlock(&w->lock);
+
+	if (stat(path, sbuf) < 0)
+		return -1;
+	m = Malloc(sizeof(struct meta) + len + 1);
+	m->hash = hash;
+	m->size = sbuf->st_size;
+	m->mtime = sbuf->st_mtime;
+	m->mode = sbuf->st_mode;
+	m->has_csum = 0;
+	memcpy(m->name, path, len + 1);
+	pthread_mutex_lock(&w->lock);
+	if (generation != watch_generation(w, hash) ||
+	    watch_find(w, path, hash)) {
+		/* the file may have changed after the stat */
+		pthread_mutex_unlock(&w->lock);
+		free(m);
+		return 0;
+	}
+	m->next = w->table[hash & (w->nr_buckets - 1)];
+	w->table[hash & (w->nr_buckets - 1)] = m;
+	w->nr_entries++;
+	if (w->nr_entries > w->nr_buckets)
+		watch_resize(w, w->nr_buckets * 2);
+	pthread_mutex_unlock(&w->lock);
+	return 0;
+}
+
+int
+watch_csum(struct watch *w, const char *path, long size, time_t mtime,
+	   unsigned int *csum)
+{
+	unsigned long hash = watch_hash(path);
+	struct meta *m;
+	int found = 0;
+
+	pthread_mutex_lock(&w->lock);
+	m = watch_find(w, path, hash);
+	if (m && m->has_csum && m->size == size && m->mtime == mtime) {
+		*csum = m->csum;
+		found = 1;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return found;
+}
+
+void
+watch_set_csum(struct watch *w, const char *path, long size, time_t mtime,
+	       unsigned int csum)
+{
+	unsigned long hash = watch_hash(path);
+	struct meta *m;
+
+	pthread_mutex_lock(&w->lock);
+	/* a change to the file while it was read dropped its metadata, and
+	 * the metadata of the new file has another size or mtime */
+	m = watch_find(w, path, hash);
+	if (m && m->size == size && m->mtime == mtime) {
+		m->csum = csum;
+		m->has_csum = 1;
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+void
+watch_dump(struct watch *w, FILE *out)
+{
+	pthread_mutex_lock(&w->lock);
+	fprintf(out, "watch: %ld files, %ld stat calls saved, %ld made, %ld "
+		"events, %ld files invalidated\n", w->nr_entries, w->hits,
+		w->misses, w->events, w->invalidations);
+	pthread_mutex_unlock(&w->lock);
+	fflush(out);
+}
@@ -0,0 +1,53 @@
+#ifndef __WATCH_H__
+#define __WATCH_H__
+
+#include <sys/stat.h>
+#include "cache.h"
+
+/*
+ * Keeps the server's view of the document root fresh. A thread watches every
+ * directory under the root with inotify, and when a file or a directory
+ * changes, it invalidates the cache entries under that path, and drops
+ * their metadata.
+ *
+ * The metadata of the files that were served (their size, mtime and mode) is
+ * kept in a table, so that a miss in the file cache does not need a stat(2)
+ * either. Since every change is seen by the watcher, the table and the cache
+ * never serve a file that changed since it was read. The table also keeps
+ * the checksums of the files that are too large to cache, which are only
+ * known once they were read.
+ *
+ * Paths are relative to the root, in the canonical form of the server, e.g.,
+ * "./dir/file" (see request.c).
+ */
+
+struct watch;
+struct shcache;
+
+/* watch the directory tree at root, invalidating the nr_caches caches, of
+ * which the NULL ones are skipped, and the shared cache, if it is not NULL.
+ * returns NULL if the tree could not be watched, e.g., because it has more
+ * directories than inotify allows. */
+struct watch *watch_init(const char *root, struct cache **caches,
+			 int nr_caches, struct shcache *shared);
+void watch_destroy(struct watch *w);
+
+/* stat(2) for a path under the root, answered from the table when
+ * possible */
+int watch_stat(struct watch *w, const char *path, struct stat *sbuf);
+
+/* the checksum of the contents of the file path, if watch_set_csum
+ * remembered it for the size and mtime that the file still has. returns 0
+ * if it is not known. */
+int watch_csum(struct watch *w, const char *path, long size, time_t mtime,
+	       unsigned int *csum);
+/* remember the checksum of the file path, which had size and mtime when it
+ * was read, along with its metadata. it is dropped with the metadata when
+ * the file changes. */
+void watch_set_csum(struct watch *w, const char *path, long size,
+		    time_t mtime, unsigned int csum);
+
+/* print the statistics of the watcher */
+void watch_dump(struct watch *w, FILE *out);
+
+#endif /* __WATCH_H__ */
@@ -0,0 +1,275 @@
+/*
+ * workload.c: file sets and request distributions for the load generators.
+ */
+
+#include "common.h"
+#include "workload.h"
+
+/* filename should have a list of files to be requested, one per line */
+struct fileinfo *
+fileset_load(char *filename, int *nr_files)
+{
+	int i, n;
+	int fd;
+	struct rio *rio;
+	char buf[MAXLINE];
+	struct fileinfo *fileset = NULL;
+
+	/* read the index file for the fileset */
+	*nr_files = 0;
+	SYS(fd = open(filename, O_RDONLY, 0));
+	rio = Rio_init(fd);
+	i = 0;
+	while (1) {
+		struct fileinfo *fi;
+		n = Rio_readlineb(rio, buf, MAXLINE);
+		if (n == 0) {
+			assert(*nr_files > 0);
+			assert(i == *nr_files);
+			break;
+		}
+		if (buf[n - 1] == '\n') {
+			n--;
+		}
+		if (*nr_files == 0) {
+			*nr_files = atoi(buf);
+			assert(*nr_files > 0);
+			fileset = Malloc(sizeof(struct fileinfo) * *nr_files);
+			continue;
+		}
+		assert(i < *nr_files);
+		fi = &fileset[i];
+		fi->name = Malloc(n + 1);
+		sscanf(buf, "%s %u %ld", fi->name, &fi->csum, &fi->len);
+		i++;
+	}
+	Rio_destroy(rio);
+	SYS(close(fd));
+	return fileset;
+}
+
+static int
+fileinfo_cmp(const void *a, const void *b)
+{
+	const struct fileinfo *fa = *(const struct fileinfo **)a;
+	const struct fileinfo *fb = *(const struct fileinfo **)b;
+
+	return strcmp(fa->name, fb->name);
+}
+
+/* read a trace, mapping its file names to indexes in the file set */
+static int
+workload_load_trace(struct workload *wl, char *filename,
+		    struct fileinfo *files, int nr_files)
+{
+	struct fileinfo **sorted, key, *keyp = &key, **found;
+	char buf[MAXLINE], name[MAXLINE];
+	unsigned long long usec, first = 0;
+	long size = 1024;
+	FILE *f;
+	int i;
+
+	f = fopen(filename, "r");
+	if (!f) {
+		fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	/* sort the file set by name, so that trace names can be found with a
+	 * binary search */
+	sorted = Malloc(sizeof(struct fileinfo *) * nr_files);
+	for (i = 0; i < nr_files; i++) {
+		sorted[i] = &files[i];
+	}
+	qsort(sorted, nr_files, sizeof(struct fileinfo *), fileinfo_cmp);
+
+	wl->trace = Malloc(sizeof(struct trace_entry) * size);
+	wl->nr_trace = 0;
+	while (fgets(buf, MAXLINE, f)) {
+		if (sscanf(buf, "%llu %s", &usec, name) != 2)
+			continue;
+		key.name = name;
+		found = bsearch(&keyp, sorted, nr_files,
+				sizeof(struct fileinfo *), fileinfo_cmp);
+		if (!found) {
+			fprintf(stderr, "%s: %s is not in the file set\n",
+				filename, name);
+			goto error;
+		}
+		if (wl->nr_trace == 0) {
+			first = usec;
+		}
+		if (usec < first || (wl->nr_trace > 0 &&
+		    (usec - first) * 1000 < wl->trace[wl->nr_trace - 1].time)) {
+			fprintf(stderr, "%s: times must not decrease\n",
+				filename);
+			goto error;
+		}
+		if (wl->nr_trace == size) {
+			size *= 2;
+			wl->trace = realloc(wl->trace,
+					    sizeof(struct trace_entry) * size);
+			assert(wl->trace);
+		}
+		wl->trace[wl->nr_trace].time = (usec - first) * 1000;
+		wl->trace[wl->nr_trace].file = *found - files;
+		wl->nr_trace++;
+	}
+	if (wl->nr_trace == 0) {
+		fprintf(stderr, "%s: empty trace\n", filename);
+		goto error;
+	}
+	wl->trace_duration = wl->trace[wl->nr_trace - 1].time;
+	free(sorted);
+	fclose(f);
+	return 0;
+error:
+	free(sorted);
+	free(wl->trace);
+	wl->trace = NULL;
+	fclose(f);
+	return -1;
+}
+
+int
+workload_init(struct workload *wl, char *spec, struct fileinfo *files,
+	      int nr_files)
+{
+	int i;
+	double sum;
+
+	wl->nr_files = nr_files;
+	wl->cdf = NULL;
+	wl->trace = NULL;
+	wl->next = 0;
+	if (strcmp(spec, "uniform") == 0) {
+		wl->type = WORKLOAD_UNIFORM;
+	} else if (sscanf(spec, "zipf:%lf", &wl->param) == 1) {
+		if (wl->param < 0)
+			goto bad;
+		wl->type = WORKLOAD_ZIPF;
+		/* sampled by a binary search of the cumulative probabilities */
+		wl->cdf = Malloc(sizeof(double) * nr_files);
+		sum = 0;
+		for (i = 0; i < nr_files; i++) {
+			sum += 1 / pow(i + 1, wl->param);
+			wl->cdf[i] = sum;
+		}
+		for (i = 0; i < nr_files; i++) {
+			wl->cdf[i] /= sum;
+		}
+	} else if (sscanf(spec, "selfsimilar:%lf", &wl->param) == 1) {
+		if (wl->param <= 0 || wl->param >= 1)
+			goto bad;
+		wl->type = WORKLOAD_SELF_SIMILAR;
+	} else if (sscanf(spec, "hotset:%lf:%lf", &wl->param,
+			  &wl->hot_prob) == 2) {
+		if (wl->param <= 0 || wl->param >= 1 || wl->hot_prob < 0 ||
+		    wl->hot_prob > 1)
+			goto bad;
+		wl->type = WORKLOAD_HOTSET;
+	} else if (strncmp(spec, "trace:", 6) == 0) {
+		wl->type = WORKLOAD_TRACE;
+		return workload_load_trace(wl, spec + 6, files, nr_files);
+	} else {
+		goto bad;
+	}
+	return 0;
+bad:
+	fprintf(stderr, "bad workload: %s\n", spec);
+	return -1;
+}
+
+void
+workload_destroy(struct workload *wl)
+{
+	free(wl->cdf);
+	free(wl->trace);
+}
+
+/* uniform in [low, high) */
+static int
+uniform(unsigned short xsubi[3], int low, int high)
+{
+	int ret = low + (int)(erand48(xsubi) * (high - low));
+
+	return ret < high ? ret : high - 1;
+}
+
+int
+workload_next(struct workload *wl, unsigned short xsubi[3])
+{
+	int n = wl->nr_files;
+	int hot, low, high, mid;
+	double r;
+
+	switch (wl->type) {
+	case WORKLOAD_UNIFORM:
+		return uniform(xsubi, 0, n);
+	case WORKLOAD_ZIPF:
+		/* first file whose cumulative probability is >= r */
+		r = erand48(xsubi);
+		low = 0;
+		high = n - 1;
+		while (low < high) {
+			mid = (low + high) / 2;
+			if (wl->cdf[mid] < r)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		return low;
+	case WORKLOAD_SELF_SIMILAR:
+		/* same as rand_self_similar_int in common.c */
+		do {
+			r = erand48(xsubi);
+		} while (r <= 0);
+		r = pow(r, log(wl->param) / log(1 - wl->param));
+		return (int)ceil(n * r) - 1;
+	case WORKLOAD_HOTSET:
+		hot = (int)ceil(n * wl->param);
+		if (hot >= n || erand48(xsubi) < wl->hot_prob)
+			return uniform(xsubi, 0, hot);
+		return uniform(xsubi, hot, n);
+	case WORKLOAD_TRACE:
+		return workload_trace(wl,
+				      __sync_fetch_and_add(&wl->next, 1)).file;
+	}
+	assert(0);
+	return 0;
+}
+
+struct trace_entry
+workload_trace(struct workload *wl, long i)
+{
+	struct trace_entry e = wl->trace[i % wl->nr_trace];
+
+	/* each replay of the trace starts one request gap after the last
+	 * one, approximated by the mean gap */
+	e.time += (i / wl->nr_trace) *
+		(wl->trace_duration + wl->trace_duration / wl->nr_trace);
+	return e;
+}
+
+/* the splitmix64 finalizer, which changes about half of the bits of the
+ * result for every bit of x that changes */
+static uint64_t
+splitmix64(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+void
+workload_seed(unsigned short xsubi[3], long seed, int index)
+{
+	/* erand48 draws its first numbers mostly from the high bits of its
+	 * state, so all 48 bits must depend on both the seed and the index
+	 * for the threads to start on different files */
+	uint64_t x = splitmix64(splitmix64(seed) ^ (uint32_t)index);
+
+	xsubi[0] = x & 0xffff;
+	xsubi[1] = (x >> 16) & 0xffff;
+	xsubi[2] = (x >> 32) & 0xffff;
+}
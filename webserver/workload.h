@@ -0,0 +1,74 @@
+#ifndef __WORKLOAD_H__
+#define __WORKLOAD_H__
+
+#include <stdint.h>
+
+/* a file of the file set, as listed in the index file written by fileset */
+struct fileinfo {
+	char *name;
+	unsigned int csum;
+	long len;
+};
+
+/* read the index file of a file set. returns the files, and their number in
+ * nr_files. */
+struct fileinfo *fileset_load(char *filename, int *nr_files);
+
+/*
+ * A workload decides which files are requested. Files are ranked by their
+ * position in the file set, and the popular ones have the lowest ranks:
+ *
+ *   uniform            every file is equally likely
+ *   zipf:s             file i is requested with probability ~ 1 / i^s
+ *   selfsimilar:a      a fraction (1 - a) of the requests go to a fraction a
+ *                      of the files, recursively (0 < a < 1)
+ *   hotset:f:p         a fraction p of the requests go, uniformly, to the
+ *                      first fraction f of the files, and the rest go
+ *                      uniformly to the other files
+ *   trace:file         replay a request log. each line of the log is
+ *                      "time_usec file_name", times are relative to the
+ *                      first line, and names must be in the file set
+ *
+ * Random choices use caller-provided erand48 state, so that each thread has
+ * its own deterministic sequence of requests for a given seed.
+ */
+enum workload_type {
+	WORKLOAD_UNIFORM,
+	WORKLOAD_ZIPF,
+	WORKLOAD_SELF_SIMILAR,
+	WORKLOAD_HOTSET,
+	WORKLOAD_TRACE,
+};
+
+struct trace_entry {
+	uint64_t time;	/* ns since the first request of the trace */
+	int file;	/* index in the file set */
+};
+
+struct workload {
+	enum workload_type type;
+	int nr_files;
+	double param;		/* zipf s, selfsimilar a, or hotset f */
+	double hot_prob;	/* hotset p */
+	double *cdf;		/* zipf cumulative probabilities */
+	struct trace_entry *trace;
+	long nr_trace;
+	uint64_t trace_duration;	/* time of the last entry of the trace */
+	long next;		/* next trace entry for workload_next */
+};
+
+/* parse spec, one of the forms above. returns 0 on success, and -1 after
+ * printing an error. */
+int workload_init(struct workload *wl, char *spec, struct fileinfo *files,
+		  int nr_files);
+void workload_destroy(struct workload *wl);
+/* index of the next file to request. trace workloads hand out the entries of
+ * the trace in order to all callers, starting over when they run out. */
+int workload_next(struct workload *wl, unsigned short xsubi[3]);
+/* file and time of the i'th request of a trace, replaying the trace again
+ * after the last entry */
+struct trace_entry workload_trace(struct workload *wl, long i);
+/* seed xsubi for thread number index of a run with the given seed */
+void workload_seed(unsigned short xsubi[3], long seed, int index);
+
+#endif /* __WORKLOAD_H__ */